@@ -60,6 +60,7 @@ LOCAL_SRC_FILES := \
 	sockets.c \
 	services.c \
 	file_sync_client.c \
+	lz4.c \
 	$(EXTRA_SRCS) \
 	$(USB_SRCS) \
 	usb_vendors.c
@@ -108,10 +109,12 @@ LOCAL_SRC_FILES := \
 	sockets.c \
 	services.c \
 	file_sync_service.c \
+	lz4.c \
 	jdwp_service.c \
 	framebuffer_service.c \
 	remount_service.c \
-	usb_linux_client.c
+	usb_linux_client.c \
+	usb_ffs_aio.c
 
 LOCAL_CFLAGS := -O2 -g -DADB_HOST=0 -Wall -Wno-unused-parameter -Werror
 LOCAL_CFLAGS += -D_XOPEN_SOURCE -D_GNU_SOURCE
@@ -147,6 +150,7 @@ LOCAL_SRC_FILES := \
 	sockets.c \
 	services.c \
 	file_sync_client.c \
+	lz4.c \
 	get_my_path_linux.c \
 	usb_linux.c \
 	usb_vendors.c \
@@ -200,17 +200,88 @@ void adb_qemu_trace(const char* fmt, ...)
 }
 #endif  /* !ADB_HOST */
 
+/* Packets are recycled rather than freed, in two pools: those with the
+** default MAX_PAYLOAD_V1 buffer, and those grown to MAX_PAYLOAD. The
+** pools are bounded so that a burst does not pin its memory for good.
+*/
+#define APACKET_POOL_SMALL  64
+#define APACKET_POOL_LARGE  8
+
+ADB_MUTEX_DEFINE( apacket_pool_lock );
+static apacket *apacket_pool[2];
+static unsigned apacket_pool_count[2];
+
+static apacket *apacket_pool_get(int large)
+{
+    apacket *p;
+
+    adb_mutex_lock(&apacket_pool_lock);
+    p = apacket_pool[large];
+    if(p) {
+        apacket_pool[large] = p->next;
+        apacket_pool_count[large]--;
+    }
+    adb_mutex_unlock(&apacket_pool_lock);
+    return p;
+}
+
 apacket *get_apacket(void)
 {
-    apacket *p = malloc(sizeof(apacket));
-    if(p == 0) fatal("failed to allocate an apacket");
-    memset(p, 0, sizeof(apacket) - MAX_PAYLOAD);
+    apacket *p = apacket_pool_get(0);
+    if(p == 0) {
+        p = malloc(sizeof(apacket));
+        if(p == 0) fatal("failed to allocate an apacket");
+        p->data = malloc(MAX_PAYLOAD_V1);
+        if(p->data == 0) fatal("failed to allocate an apacket");
+        p->capacity = MAX_PAYLOAD_V1;
+    }
+    memset(p, 0, offsetof(apacket, data));
     return p;
 }
 
+void apacket_reserve(apacket *p, unsigned size)
+{
+    apacket *q;
+    unsigned char *data;
+
+    if(size <= p->capacity) return;
+
+        /* trade buffers with a large packet from the pool if we can */
+    q = apacket_pool_get(1);
+    if(q) {
+        data = q->data;
+        memcpy(data, p->data, p->capacity);
+        q->data = p->data;
+        q->capacity = p->capacity;
+        put_apacket(q);
+    } else {
+        data = malloc(MAX_PAYLOAD);
+        if(data == 0) fatal("failed to allocate an apacket payload");
+        memcpy(data, p->data, p->capacity);
+        free(p->data);
+    }
+    p->data = data;
+    p->capacity = MAX_PAYLOAD;
+}
+
 void put_apacket(apacket *p)
 {
-    free(p);
+    int large = p->capacity > MAX_PAYLOAD_V1;
+
+    adb_mutex_lock(&apacket_pool_lock);
+    if(apacket_pool_count[large] <
+            (large ? APACKET_POOL_LARGE : APACKET_POOL_SMALL)) {
+        p->next = apacket_pool[large];
+        apacket_pool[large] = p;
+        apacket_pool_count[large]++;
+        p = 0;
+    }
+    adb_mutex_unlock(&apacket_pool_lock);
+
+    if(p) {
+        free(p->data);
+        free(p);
+    }
 }
 
 void handle_online(atransport *t)
@@ -268,14 +339,14 @@ void print_packet(const char *label, apacket *p)
 }
 #endif
 
-static void send_ready(unsigned local, unsigned remote, atransport *t)
+/* the window granted by a READY(local-id, remote-id, <credit>), see
+** A_VERSION_STREAM_WINDOW in protocol.txt
+*/
+static unsigned ready_credit(apacket *p)
 {
-    D("Calling send_ready \n");
-    apacket *p = get_apacket();
-    p->msg.command = A_OKAY;
-    p->msg.arg0 = local;
-    p->msg.arg1 = remote;
-    send_packet(p, t);
+    if(p->msg.data_length < 4) return 0;
+    return p->data[0] | (p->data[1] << 8) | (p->data[2] << 16) |
+           ((unsigned) p->data[3] << 24);
 }
 
 static void send_close(unsigned local, unsigned remote, atransport *t)
@@ -346,7 +417,7 @@ static void send_connect(atransport *t)
     cp->msg.arg0 = A_VERSION;
     cp->msg.arg1 = MAX_PAYLOAD;
     cp->msg.data_length = fill_connect_data((char *)cp->data,
-                                            sizeof(cp->data));
+                                            cp->capacity);
     send_packet(cp, t);
 }
 
@@ -395,7 +466,7 @@ static void send_auth_publickey(atransport *t)
     apacket *p = get_apacket();
     int ret;
 
-    ret = adb_auth_get_userkey(p->data, sizeof(p->data));
+    ret = adb_auth_get_userkey(p->data, p->capacity);
     if (!ret) {
         D("Failed to get user public key\n");
         put_apacket(p);
@@ -544,12 +615,21 @@ void handle_packet(apacket *p, atransport *t)
         return;
 
     case A_CNXN: /* CONNECT(version, maxdata, "system-id-string") */
-            /* XXX verify version, etc */
         if(t->connection_state != CS_OFFLINE) {
             t->connection_state = CS_OFFLINE;
             handle_offline(t);
         }
 
+            /* older peers advertise maxdata, but only take MAX_PAYLOAD_V1 */
+        t->protocol_version = p->msg.arg0 < A_VERSION ? p->msg.arg0 : A_VERSION;
+        t->max_payload = MAX_PAYLOAD_V1;
+        if(t->protocol_version >= A_VERSION_LARGE_PAYLOAD &&
+                p->msg.arg1 > MAX_PAYLOAD_V1) {
+            t->max_payload = p->msg.arg1 < MAX_PAYLOAD ? p->msg.arg1 : MAX_PAYLOAD;
+        }
+        D("%s: protocol version %08x, max payload %u\n",
+          t->serial, t->protocol_version, t->max_payload);
+
         parse_banner((char*) p->data, t);
 
         if (HOST || !auth_enabled) {
@@ -594,7 +674,9 @@ void handle_packet(apacket *p, atransport *t)
             } else {
                 s->peer = create_remote_socket(p->msg.arg0, t);
                 s->peer->peer = s;
-                send_ready(s->id, s->peer->id, t);
+                    /* the OPEN implies a READY for one full packet */
+                remote_socket_credit(s->peer, t->max_payload);
+                s->peer->ready(s->peer);
                 s->ready(s);
             }
         }
@@ -607,10 +689,17 @@ void handle_packet(apacket *p, atransport *t)
                     /* On first READY message, create the connection. */
                     s->peer = create_remote_socket(p->msg.arg0, t);
                     s->peer->peer = s;
+                    remote_socket_credit(s->peer, ready_credit(p));
+                    if(t->protocol_version >= A_VERSION_STREAM_WINDOW) {
+                        /* grant our own window back */
+                        s->peer->ready(s->peer);
+                    }
                     s->ready(s);
                 } else if (s->peer->id == p->msg.arg0) {
                     /* Other READY messages must use the same local-id */
-                    s->ready(s);
+                    if(remote_socket_credit(s->peer, ready_credit(p))) {
+                        s->ready(s);
+                    }
                 } else {
                     D("Invalid A_OKAY(%d,%d), expected A_OKAY(%d,%d) on transport %s\n",
                       p->msg.arg0, p->msg.arg1, s->peer->id, p->msg.arg1, t->serial);
@@ -645,12 +734,12 @@ void handle_packet(apacket *p, atransport *t)
     case A_WRTE: /* WRITE(local-id, remote-id, <data>) */
         if (t->online && p->msg.arg0 != 0 && p->msg.arg1 != 0) {
             if((s = find_local_socket(p->msg.arg1, p->msg.arg0))) {
-                unsigned rid = p->msg.arg0;
                 p->len = p->msg.data_length;
+                remote_socket_received(s->peer, p->len);
 
                 if(s->enqueue(s, p) == 0) {
                     D("Enqueue the socket\n");
-                    send_ready(s->id, rid, t);
+                    s->peer->ready(s->peer);
                 }
                 return;
             }
@@ -22,7 +22,12 @@
 #include "adb_trace.h"
 #include "transport.h"  /* readx(), writex() */
 
-#define MAX_PAYLOAD 4096
+/* Peers older than A_VERSION_LARGE_PAYLOAD take no more than this */
+#define MAX_PAYLOAD_V1  (4 * 1024)
+/* and newer ones as much as both ends advertise in A_CNXN, up to this */
+#define MAX_PAYLOAD     (1024 * 1024)
+/* bytes a stream may have in flight towards us, with A_VERSION_STREAM_WINDOW */
+#define STREAM_WINDOW   (4 * MAX_PAYLOAD)
 
 #define A_SYNC 0x434e5953
 #define A_CNXN 0x4e584e43
@@ -32,7 +37,10 @@
 #define A_WRTE 0x45545257
 #define A_AUTH 0x48545541
 
-#define A_VERSION 0x01000000        // ADB protocol version
+#define A_VERSION_MIN 0x01000000    // ADB protocol version
+#define A_VERSION_LARGE_PAYLOAD 0x01000001 // maxdata beyond MAX_PAYLOAD_V1
+#define A_VERSION_STREAM_WINDOW 0x01000002 // A_OKAY grants a byte window
+#define A_VERSION A_VERSION_STREAM_WINDOW
 
 #define ADB_VERSION_MAJOR 1         // Used for help/version information
 #define ADB_VERSION_MINOR 0         // Used for help/version information
@@ -65,7 +73,12 @@ struct apacket
     unsigned char *ptr;
 
     amessage msg;
-    unsigned char data[MAX_PAYLOAD];
+
+        /* payload buffer, MAX_PAYLOAD_V1 bytes unless grown by
+        ** apacket_reserve()
+        */
+    unsigned char *data;
+    unsigned capacity;
 };
 
 /* An asocket represents one half of a connection between a local and
@@ -211,6 +224,12 @@ struct atransport
     unsigned char token[TOKEN_SIZE];
     fdevent auth_fde;
     unsigned failed_auth_attempts;
+
+        /* agreed in A_CNXN: the protocol version, and the largest
+        ** payload we may send
+        */
+    unsigned protocol_version;
+    unsigned max_payload;
 };
 
 
@@ -251,6 +270,8 @@ asocket *create_local_socket(int fd);
 asocket *create_local_service_socket(const char *destination);
 
 asocket *create_remote_socket(unsigned id, atransport *t);
+int remote_socket_credit(asocket *s, unsigned bytes);
+void remote_socket_received(asocket *s, unsigned bytes);
 void connect_to_remote(asocket *s, const char *destination);
 void connect_to_smartsocket(asocket *s);
 
@@ -334,6 +355,8 @@ void remount_service(int fd, void *cookie);
 /* packet allocator */
 apacket *get_apacket(void);
 void put_apacket(apacket *p);
+/* make room for a payload of size, keeping what the buffer holds */
+void apacket_reserve(apacket *p, unsigned size);
 
 int check_header(apacket *p);
 int check_data(apacket *p);
@@ -226,6 +226,10 @@ void help()
         "                                 1 or all, adb, sockets, packets, rwx, usb, sync, sysdeps, transport, jdwp\n"
         "  ANDROID_SERIAL               - The serial number to connect to. -s takes priority over this if given.\n"
         "  ANDROID_LOG_TAGS             - When used with the logcat option, only these debug tags are printed.\n"
+        "  ADB_SYNC_COMPRESS            - Set to 0 to send push and pull data uncompressed, which is faster\n"
+        "                                 over links quicker than USB 2.0, such as to an emulator.\n"
+        "                                 Directories are compressed by default; set to 1 to compress\n"
+        "                                 single files too, which costs older devices a reconnect.\n"
         );
 }
 
@@ -31,11 +31,20 @@
 #include "adb.h"
 #include "adb_client.h"
 #include "file_sync_service.h"
+#include "lz4.h"
 
 
+/* SENDs or RECVs a directory push or pull keeps in flight */
+#define SYNC_PIPELINE_DEPTH 32
+
 static unsigned long long total_bytes;
+static unsigned long long total_wire_bytes;
+static unsigned total_files;
 static long long start_time;
 
+/* set if the server takes and sends ID_LZ4D chunks (see sync_pipeline) */
+static int sync_lz4;
+
 static long long NOW()
 {
     struct timeval tv;
@@ -47,6 +56,8 @@ static long long NOW()
 static void BEGIN()
 {
     total_bytes = 0;
+    total_wire_bytes = 0;
+    total_files = 0;
     start_time = NOW();
 }
 
@@ -61,6 +72,15 @@ static void END()
     fprintf(stderr,"%lld KB/s (%lld bytes in %lld.%03llds)\n",
             ((total_bytes * 1000000LL) / t) / 1024LL,
             total_bytes, (t / 1000000LL), (t % 1000000LL) / 1000LL);
+    if(total_files > 1) {
+        fprintf(stderr,"%u files: %.1f files/s, %.2f MB/s\n", total_files,
+                total_files * 1000000.0 / t,
+                total_bytes * 1000000.0 / t / (1024 * 1024));
+    }
+    if(total_wire_bytes < total_bytes) {
+        fprintf(stderr,"compressed to %llu bytes (%llu%%)\n", total_wire_bytes,
+                total_wire_bytes * 100 / total_bytes);
+    }
 }
 
 static const char* transfer_progress_format = "\rTransferring: %llu/%llu (%d%%)";
@@ -89,6 +109,40 @@ void sync_quit(int fd)
     writex(fd, &msg.req, sizeof(msg.req));
 }
 
+static int sync_connect(void)
+{
+    int fd = adb_connect("sync:");
+
+    if(fd < 0) {
+        fprintf(stderr,"error: %s\n", adb_error());
+        return -1;
+    }
+        /* requests are small, and each may be the last before we wait
+        ** for a reply: send them right away
+        */
+    disable_tcp_nagle(fd);
+    return fd;
+}
+
+/* Writes a request and its name in one go, so that the name is not held
+** back waiting for the peer to acknowledge the header.
+*/
+static int sync_request(int fd, unsigned id, const char *name, int len)
+{
+    struct {
+        unsigned id;
+        unsigned namelen;
+        char name[1024 + 64];
+    } req;
+
+    if(len > (int) sizeof(req.name)) return -1;
+
+    req.id = id;
+    req.namelen = htoll(len);
+    memcpy(req.name, name, len);
+    return writex(fd, &req, sizeof(unsigned) * 2 + len);
+}
+
 typedef void (*sync_ls_cb)(unsigned mode, unsigned size, unsigned time, const char *name, void *cookie);
 
 int sync_ls(int fd, const char *path, sync_ls_cb func, void *cookie)
@@ -100,11 +154,7 @@ int sync_ls(int fd, const char *path, sync_ls_cb func, void *cookie)
     len = strlen(path);
     if(len > 1024) goto fail;
 
-    msg.req.id = ID_LIST;
-    msg.req.namelen = htoll(len);
-
-    if(writex(fd, &msg.req, sizeof(msg.req)) ||
-       writex(fd, path, len)) {
+    if(sync_request(fd, ID_LIST, path, len)) {
         goto fail;
     }
 
@@ -139,6 +189,7 @@ struct syncsendbuf {
 };
 
 static syncsendbuf send_buffer;
+static syncsendbuf lz4_buffer;
 
 int sync_readtime(int fd, const char *path, unsigned int *timestamp,
                   unsigned int *mode)
@@ -146,11 +197,7 @@ int sync_readtime(int fd, const char *path, unsigned int *timestamp,
     syncmsg msg;
     int len = strlen(path);
 
-    msg.req.id = ID_STAT;
-    msg.req.namelen = htoll(len);
-
-    if(writex(fd, &msg.req, sizeof(msg.req)) ||
-       writex(fd, path, len)) {
+    if(sync_request(fd, ID_STAT, path, len)) {
         return -1;
     }
 
@@ -169,18 +216,7 @@ int sync_readtime(int fd, const char *path, unsigned int *timestamp,
 
 static int sync_start_readtime(int fd, const char *path)
 {
-    syncmsg msg;
-    int len = strlen(path);
-
-    msg.req.id = ID_STAT;
-    msg.req.namelen = htoll(len);
-
-    if(writex(fd, &msg.req, sizeof(msg.req)) ||
-       writex(fd, path, len)) {
-        return -1;
-    }
-
-    return 0;
+    return sync_request(fd, ID_STAT, path, strlen(path));
 }
 
 static int sync_finish_readtime(int fd, unsigned int *timestamp,
@@ -206,11 +242,7 @@ int sync_readmode(int fd, const char *path, unsigned *mode)
     syncmsg msg;
     int len = strlen(path);
 
-    msg.req.id = ID_STAT;
-    msg.req.namelen = htoll(len);
-
-    if(writex(fd, &msg.req, sizeof(msg.req)) ||
-       writex(fd, path, len)) {
+    if(sync_request(fd, ID_STAT, path, len)) {
         return -1;
     }
 
@@ -248,9 +280,9 @@ static int write_data_file(int fd, const char *path, syncsendbuf *sbuf, int show
         size = st.st_size;
     }
 
-    sbuf->id = ID_DATA;
     for(;;) {
-        int ret;
+        syncsendbuf *buf = sbuf;
+        int ret, n = 0;
 
         ret = adb_read(lfd, sbuf->data, SYNC_DATA_MAX);
         if(!ret)
@@ -263,12 +295,25 @@ static int write_data_file(int fd, const char *path, syncsendbuf *sbuf, int show
             break;
         }
 
-        sbuf->size = htoll(ret);
-        if(writex(fd, sbuf, sizeof(unsigned) * 2 + ret)){
+            /* send a chunk compressed only if it saves a sixteenth */
+        if(sync_lz4 && lz4_worthwhile(sbuf->data, ret)) {
+            n = lz4_compress(sbuf->data, ret, lz4_buffer.data, ret - ret / 16);
+        }
+        if(n > 0) {
+            buf = &lz4_buffer;
+            buf->id = ID_LZ4D;
+        } else {
+            buf->id = ID_DATA;
+            n = ret;
+        }
+
+        buf->size = htoll(n);
+        if(writex(fd, buf, sizeof(unsigned) * 2 + n)){
             err = -1;
             break;
         }
         total_bytes += ret;
+        total_wire_bytes += n;
 
         if (show_progress) {
             print_transfer_progress(total_bytes, size);
@@ -300,6 +345,7 @@ static int write_data_buffer(int fd, char* file_buffer, int size, syncsendbuf *s
         }
         total += count;
         total_bytes += count;
+        total_wire_bytes += count;
 
         if (show_progress) {
             print_transfer_progress(total, size);
@@ -329,32 +375,29 @@ static int write_data_link(int fd, const char *path, syncsendbuf *sbuf)
         return -1;
 
     total_bytes += len + 1;
+    total_wire_bytes += len + 1;
 
     return 0;
 }
 #endif
 
-static int sync_send(int fd, const char *lpath, const char *rpath,
-                     unsigned mtime, mode_t mode, int show_progress)
+/* Sends a whole SEND request, without waiting for its status. */
+static int sync_send_request(int fd, const char *lpath, const char *rpath,
+                             unsigned mtime, mode_t mode, int show_progress)
 {
     syncmsg msg;
     int len, r;
     syncsendbuf *sbuf = &send_buffer;
     char* file_buffer = NULL;
     int size = 0;
-    char tmp[64];
+    char tmp[1024 + 64];
 
     len = strlen(rpath);
     if(len > 1024) goto fail;
 
-    snprintf(tmp, sizeof(tmp), ",%d", mode);
-    r = strlen(tmp);
+    r = snprintf(tmp, sizeof(tmp), "%s,%d", rpath, mode);
 
-    msg.req.id = ID_SEND;
-    msg.req.namelen = htoll(len + r);
-
-    if(writex(fd, &msg.req, sizeof(msg.req)) ||
-       writex(fd, rpath, len) || writex(fd, tmp, r)) {
+    if(sync_request(fd, ID_SEND, tmp, r)) {
         free(file_buffer);
         goto fail;
     }
@@ -376,6 +419,21 @@ static int sync_send(int fd, const char *lpath, const char *rpath,
     if(writex(fd, &msg.data, sizeof(msg.data)))
         goto fail;
 
+    return 0;
+
+fail:
+    fprintf(stderr,"protocol failure\n");
+    adb_close(fd);
+    return -1;
+}
+
+/* Reads the status of the oldest SEND in flight. */
+static int sync_send_status(int fd, const char *lpath, const char *rpath)
+{
+    syncmsg msg;
+    int len;
+    syncsendbuf *sbuf = &send_buffer;
+
     if(readx(fd, &msg.status, sizeof(msg.status)))
         return -1;
 
@@ -395,11 +453,57 @@ static int sync_send(int fd, const char *lpath, const char *rpath,
     }
 
     return 0;
+}
 
-fail:
-    fprintf(stderr,"protocol failure\n");
-    adb_close(fd);
-    return -1;
+static int sync_send(int fd, const char *lpath, const char *rpath,
+                     unsigned mtime, mode_t mode, int show_progress)
+{
+    if(sync_send_request(fd, lpath, rpath, mtime, mode, show_progress))
+        return -1;
+    return sync_send_status(fd, lpath, rpath);
+}
+
+/* Asks the server to take pipelined SENDs, and offers it our optional
+** features; it answers with those it agrees to. Servers that predate
+** ID_PIPE answer FAIL and hang up, so reconnect to them and send one file
+** at a time. Returns how many SENDs may be in flight, and the connection
+** to use in *fd, or -1 there if we could not reconnect.
+*/
+static int sync_pipeline(int *fd)
+{
+    syncmsg msg;
+    const char *offer = SYNC_FEATURE_LZ4;
+    const char *env = getenv("ADB_SYNC_COMPRESS");
+    char features[257];
+    unsigned len;
+
+        /* compressing costs more than it saves on fast links */
+    if(env && !strcmp(env, "0")) offer = "";
+
+    sync_lz4 = 0;
+    if(!sync_request(*fd, ID_PIPE, offer, strlen(offer)) &&
+       !readx(*fd, &msg.status, sizeof(msg.status)) &&
+       msg.status.id == ID_OKAY &&
+       (len = ltohl(msg.status.msglen)) < sizeof(features) &&
+       !readx(*fd, features, len)) {
+        features[len] = 0;
+        sync_lz4 = sync_has_feature(features, SYNC_FEATURE_LZ4);
+        return SYNC_PIPELINE_DEPTH;
+    }
+
+    adb_close(*fd);
+    *fd = sync_connect();
+    return 1;
+}
+
+/* Whether to negotiate for a single file too, which gains nothing from
+** pipelining. Against a server that predates ID_PIPE, asking costs a
+** FAIL and a second connection, so only compress those on request.
+*/
+static int sync_pipeline_single(void)
+{
+    const char *env = getenv("ADB_SYNC_COMPRESS");
+    return env && !strcmp(env, "1");
 }
 
 static int mkdirs(const char *name)
@@ -421,51 +525,30 @@ static int mkdirs(const char *name)
     return 0;
 }
 
-int sync_recv(int fd, const char *rpath, const char *lpath, int show_progress)
+static int sync_recv_request(int fd, const char *rpath)
+{
+    int len = strlen(rpath);
+
+    if(len > 1024) return -1;
+    return sync_request(fd, ID_RECV, rpath, len);
+}
+
+/* Reads the reply to the oldest RECV in flight into lpath. */
+static int sync_recv_data(int fd, const char *rpath, const char *lpath,
+                          int show_progress, unsigned long long size)
 {
     syncmsg msg;
     int len;
     int lfd = -1;
     char *buffer = send_buffer.data;
     unsigned id;
-    unsigned long long size = 0;
-
-    len = strlen(rpath);
-    if(len > 1024) return -1;
-
-    if (show_progress) {
-        // Determine remote file size.
-        syncmsg stat_msg;
-        stat_msg.req.id = ID_STAT;
-        stat_msg.req.namelen = htoll(len);
-
-        if (writex(fd, &stat_msg.req, sizeof(stat_msg.req)) ||
-            writex(fd, rpath, len)) {
-            return -1;
-        }
-
-        if (readx(fd, &stat_msg.stat, sizeof(stat_msg.stat))) {
-            return -1;
-        }
-
-        if (stat_msg.stat.id != ID_STAT) return -1;
-
-        size = ltohl(stat_msg.stat.size);
-    }
-
-    msg.req.id = ID_RECV;
-    msg.req.namelen = htoll(len);
-    if(writex(fd, &msg.req, sizeof(msg.req)) ||
-       writex(fd, rpath, len)) {
-        return -1;
-    }
 
     if(readx(fd, &msg.data, sizeof(msg.data))) {
         return -1;
     }
     id = msg.data.id;
 
-    if((id == ID_DATA) || (id == ID_DONE)) {
+    if((id == ID_DATA) || (id == ID_LZ4D) || (id == ID_DONE)) {
         adb_unlink(lpath);
         mkdirs(lpath);
         lfd = adb_creat(lpath, 0644);
@@ -487,14 +570,26 @@ int sync_recv(int fd, const char *rpath, const char *lpath, int show_progress)
     handle_data:
         len = ltohl(msg.data.size);
         if(id == ID_DONE) break;
-        if(id != ID_DATA) goto remote_error;
+        if(id != ID_DATA && id != ID_LZ4D) goto remote_error;
         if(len > SYNC_DATA_MAX) {
             fprintf(stderr,"data overrun\n");
             adb_close(lfd);
             return -1;
         }
+        total_wire_bytes += len;
 
-        if(readx(fd, buffer, len)) {
+        if(id == ID_LZ4D) {
+            if(readx(fd, lz4_buffer.data, len)) {
+                adb_close(lfd);
+                return -1;
+            }
+            len = lz4_decompress(lz4_buffer.data, len, buffer, SYNC_DATA_MAX);
+            if(len < 0) {
+                fprintf(stderr,"corrupt compressed data\n");
+                adb_close(lfd);
+                return -1;
+            }
+        } else if(readx(fd, buffer, len)) {
             adb_close(lfd);
             return -1;
         }
@@ -535,6 +630,36 @@ remote_error:
     return 0;
 }
 
+int sync_recv(int fd, const char *rpath, const char *lpath, int show_progress)
+{
+    int len;
+    unsigned long long size = 0;
+
+    len = strlen(rpath);
+    if(len > 1024) return -1;
+
+    if (show_progress) {
+        // Determine remote file size.
+        syncmsg stat_msg;
+
+        if (sync_request(fd, ID_STAT, rpath, len)) {
+            return -1;
+        }
+
+        if (readx(fd, &stat_msg.stat, sizeof(stat_msg.stat))) {
+            return -1;
+        }
+
+        if (stat_msg.stat.id != ID_STAT) return -1;
+
+        size = ltohl(stat_msg.stat.size);
+    }
+
+    if(sync_recv_request(fd, rpath))
+        return -1;
+    return sync_recv_data(fd, rpath, lpath, show_progress, size);
+}
+
 
 
 /* --- */
@@ -548,9 +673,8 @@ static void do_sync_ls_cb(unsigned mode, unsigned size, unsigned time,
 
 int do_sync_ls(const char *path)
 {
-    int fd = adb_connect("sync:");
+    int fd = sync_connect();
     if(fd < 0) {
-        fprintf(stderr,"error: %s\n", adb_error());
         return 1;
     }
 
@@ -682,12 +806,15 @@ static int local_build_list(copyinfo **filelist,
 }
 
 
-static int copy_local_dir_remote(int fd, const char *lpath, const char *rpath, int checktimestamps, int listonly)
+static int copy_local_dir_remote(int fd, const char *lpath, const char *rpath,
+                                 int checktimestamps, int listonly, int depth)
 {
     copyinfo *filelist = 0;
-    copyinfo *ci, *next;
+    copyinfo *ci, *next, *send;
     int pushed = 0;
     int skipped = 0;
+    int inflight = 0;
+    int failed = 0;
 
     if((lpath[0] == 0) || (rpath[0] == 0)) return -1;
     if(lpath[strlen(lpath) - 1] != '/') {
@@ -727,21 +854,48 @@ static int copy_local_dir_remote(int fd, const char *lpath, const char *rpath, i
             }
         }
     }
+        /* keep up to depth SENDs ahead of the status we wait for, and
+        ** once one fails, only let those already sent finish
+        */
+    send = filelist;
     for(ci = filelist; ci != 0; ci = next) {
+        while(!failed && send != 0 && inflight < depth) {
+            if(send->flag == 0) {
+                fprintf(stderr,"%spush: %s -> %s\n", listonly ? "would " : "", send->src, send->dst);
+                if(!listonly) {
+                    if(sync_send_request(fd, send->src, send->dst, send->time,
+                                         send->mode, 0 /* no show progress */)) {
+                        return 1;
+                    }
+                    inflight++;
+                }
+            }
+            send = send->next;
+        }
+        if(failed && inflight == 0) {
+            return 1;
+        }
+
         next = ci->next;
         if(ci->flag == 0) {
-            fprintf(stderr,"%spush: %s -> %s\n", listonly ? "would " : "", ci->src, ci->dst);
-            if(!listonly &&
-               sync_send(fd, ci->src, ci->dst, ci->time, ci->mode,
-                         0 /* no show progress */)) {
-                return 1;
+            if(!listonly) {
+                inflight--;
+                if(sync_send_status(fd, ci->src, ci->dst)) {
+                    failed = 1;
+                    free(ci);
+                    continue;
+                }
             }
             pushed++;
+            total_files++;
         } else {
             skipped++;
         }
         free(ci);
     }
+    if(failed) {
+        return 1;
+    }
 
     fprintf(stderr,"%d file%s pushed. %d file%s skipped.\n",
             pushed, (pushed == 1) ? "" : "s",
@@ -755,11 +909,10 @@ int do_sync_push(const char *lpath, const char *rpath, int show_progress)
 {
     struct stat st;
     unsigned mode;
-    int fd;
+    int fd, depth;
 
-    fd = adb_connect("sync:");
+    fd = sync_connect();
     if(fd < 0) {
-        fprintf(stderr,"error: %s\n", adb_error());
         return 1;
     }
 
@@ -769,9 +922,17 @@ int do_sync_push(const char *lpath, const char *rpath, int show_progress)
         return 1;
     }
 
+    depth = 1;
+    if(S_ISDIR(st.st_mode) || sync_pipeline_single()) {
+        depth = sync_pipeline(&fd);
+        if(fd < 0) {
+            return 1;
+        }
+    }
+
     if(S_ISDIR(st.st_mode)) {
         BEGIN();
-        if(copy_local_dir_remote(fd, lpath, rpath, 0, 0)) {
+        if(copy_local_dir_remote(fd, lpath, rpath, 0, 0, depth)) {
             return 1;
         } else {
             END();
@@ -897,9 +1058,10 @@ static int copy_remote_dir_local(int fd, const char *rpath, const char *lpath,
                                  int copy_attrs)
 {
     copyinfo *filelist = 0;
-    copyinfo *ci, *next;
+    copyinfo *ci, *next, *recv;
     int pulled = 0;
     int skipped = 0;
+    int inflight = 0;
 
     /* Make sure that both directory paths end in a slash. */
     if (rpath[0] == 0 || lpath[0] == 0) return -1;
@@ -924,11 +1086,25 @@ static int copy_remote_dir_local(int fd, const char *rpath, const char *lpath,
         return -1;
     }
 
+    /* Every server answers RECVs strictly in order, so keep a few ahead of
+     * the one being read. */
+    recv = filelist;
     for (ci = filelist; ci != 0; ci = next) {
+        while (recv != 0 && inflight < SYNC_PIPELINE_DEPTH) {
+            if (recv->flag == 0) {
+                if (sync_recv_request(fd, recv->src)) {
+                    return 1;
+                }
+                inflight++;
+            }
+            recv = recv->next;
+        }
+
         next = ci->next;
         if (ci->flag == 0) {
             fprintf(stderr, "pull: %s -> %s\n", ci->src, ci->dst);
-            if (sync_recv(fd, ci->src, ci->dst, 0 /* no show progress */)) {
+            inflight--;
+            if (sync_recv_data(fd, ci->src, ci->dst, 0 /* no show progress */, 0)) {
                 return 1;
             }
 
@@ -936,6 +1112,7 @@ static int copy_remote_dir_local(int fd, const char *rpath, const char *lpath,
                return 1;
             }
             pulled++;
+            total_files++;
         } else {
             skipped++;
         }
@@ -956,9 +1133,8 @@ int do_sync_pull(const char *rpath, const char *lpath, int show_progress, int co
 
     int fd;
 
-    fd = adb_connect("sync:");
+    fd = sync_connect();
     if(fd < 0) {
-        fprintf(stderr,"error: %s\n", adb_error());
         return 1;
     }
 
@@ -970,6 +1146,16 @@ int do_sync_pull(const char *rpath, const char *lpath, int show_progress, int co
         return 1;
     }
 
+        /* every server answers RECVs in order, so this is just to agree
+        ** on compression
+        */
+    if(S_ISDIR(mode) || sync_pipeline_single()) {
+        sync_pipeline(&fd);
+        if(fd < 0) {
+            return 1;
+        }
+    }
+
     if(S_ISREG(mode) || S_ISLNK(mode) || S_ISCHR(mode) || S_ISBLK(mode)) {
         if(stat(lpath, &st) == 0) {
             if(S_ISDIR(st.st_mode)) {
@@ -1018,14 +1204,18 @@ int do_sync_sync(const char *lpath, const char *rpath, int listonly)
 {
     fprintf(stderr,"syncing %s...\n",rpath);
 
-    int fd = adb_connect("sync:");
+    int fd = sync_connect();
+    if(fd < 0) {
+        return 1;
+    }
+
+    int depth = sync_pipeline(&fd);
     if(fd < 0) {
-        fprintf(stderr,"error: %s\n", adb_error());
         return 1;
     }
 
     BEGIN();
-    if(copy_local_dir_remote(fd, lpath, rpath, 1, listonly)){
+    if(copy_local_dir_remote(fd, lpath, rpath, 1, listonly, depth)){
         return 1;
     } else {
         END();
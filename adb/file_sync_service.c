@@ -32,6 +32,7 @@
 #define TRACE_TAG  TRACE_SYNC
 #include "adb.h"
 #include "file_sync_service.h"
+#include "lz4.h"
 
 /* TODO: use fs_config to configure permissions on /data */
 static bool is_on_system(const char *name) {
@@ -181,15 +182,15 @@ static int handle_send_file(int s, char *path, uid_t uid,
 {
     syncmsg msg;
     unsigned int timestamp = 0;
+    int chown_errno = 0;
     int fd;
 
+        /* a SEND gets exactly one status back, FAIL or OKAY, so that
+        ** clients can have several in flight (see ID_PIPE)
+        */
     fd = adb_open_mode(path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, mode);
     if(fd < 0 && errno == ENOENT) {
-        if(mkdirs(path) != 0) {
-            if(fail_errno(s))
-                return -1;
-            fd = -1;
-        } else {
+        if(mkdirs(path) == 0) {
             fd = adb_open_mode(path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, mode);
         }
     }
@@ -202,8 +203,7 @@ static int handle_send_file(int s, char *path, uid_t uid,
         fd = -1;
     } else {
         if(fchown(fd, uid, gid) != 0) {
-            fail_errno(s);
-            errno = 0;
+            chown_errno = errno;
         }
 
         /*
@@ -216,11 +216,12 @@ static int handle_send_file(int s, char *path, uid_t uid,
 
     for(;;) {
         unsigned int len;
+        char *data = buffer;
 
         if(readx(s, &msg.data, sizeof(msg.data)))
             goto fail;
 
-        if(msg.data.id != ID_DATA) {
+        if(msg.data.id != ID_DATA && msg.data.id != ID_LZ4D) {
             if(msg.data.id == ID_DONE) {
                 timestamp = ltohl(msg.data.size);
                 break;
@@ -236,9 +237,20 @@ static int handle_send_file(int s, char *path, uid_t uid,
         if(readx(s, buffer, len))
             goto fail;
 
+        if(msg.data.id == ID_LZ4D) {
+            int r = lz4_decompress(buffer, len, buffer + SYNC_DATA_MAX,
+                                   SYNC_DATA_MAX);
+            if(r < 0) {
+                fail_message(s, "corrupt compressed data");
+                goto fail;
+            }
+            data = buffer + SYNC_DATA_MAX;
+            len = r;
+        }
+
         if(fd < 0)
             continue;
-        if(writex(fd, buffer, len)) {
+        if(writex(fd, data, len)) {
             int saved_errno = errno;
             adb_close(fd);
             if (do_unlink) adb_unlink(path);
@@ -256,6 +268,10 @@ static int handle_send_file(int s, char *path, uid_t uid,
         u.modtime = timestamp;
         utime(path, &u);
 
+        if(chown_errno) {
+            errno = chown_errno;
+            return fail_errno(s);
+        }
         msg.status.id = ID_OKAY;
         msg.status.msglen = 0;
         if(writex(s, &msg.status, sizeof(msg.status)))
@@ -275,7 +291,7 @@ static int handle_send_link(int s, char *path, char *buffer)
 {
     syncmsg msg;
     unsigned int len;
-    int ret;
+    int ret, saved_errno;
 
     if(readx(s, &msg.data, sizeof(msg.data)))
         return -1;
@@ -295,30 +311,33 @@ static int handle_send_link(int s, char *path, char *buffer)
 
     ret = symlink(buffer, path);
     if(ret && errno == ENOENT) {
-        if(mkdirs(path) != 0) {
-            fail_errno(s);
-            return -1;
+        if(mkdirs(path) == 0) {
+            ret = symlink(buffer, path);
         }
-        ret = symlink(buffer, path);
-    }
-    if(ret) {
-        fail_errno(s);
-        return -1;
     }
+    saved_errno = errno;
 
     if(readx(s, &msg.data, sizeof(msg.data)))
         return -1;
 
-    if(msg.data.id == ID_DONE) {
-        msg.status.id = ID_OKAY;
-        msg.status.msglen = 0;
-        if(writex(s, &msg.status, sizeof(msg.status)))
-            return -1;
-    } else {
+    if(msg.data.id != ID_DONE) {
         fail_message(s, "invalid data message: expected ID_DONE");
         return -1;
     }
 
+        /* report a failed link once the whole request is in, and carry
+        ** on with the next one
+        */
+    if(ret) {
+        errno = saved_errno;
+        return fail_errno(s);
+    }
+
+    msg.status.id = ID_OKAY;
+    msg.status.msglen = 0;
+    if(writex(s, &msg.status, sizeof(msg.status)))
+        return -1;
+
     return 0;
 }
 #endif /* HAVE_SYMLINKS */
@@ -383,10 +402,33 @@ static int do_send(int s, char *path, char *buffer)
     return ret;
 }
 
-static int do_recv(int s, const char *path, char *buffer)
+/* Agrees to the features in the client's list that we support, and
+** tells it which they are.
+*/
+static int do_pipe(int s, const char *features, int *lz4)
+{
+    syncmsg msg;
+    const char *accepted = "";
+    int len;
+
+    *lz4 = sync_has_feature(features, SYNC_FEATURE_LZ4);
+    if(*lz4) accepted = SYNC_FEATURE_LZ4;
+
+    len = strlen(accepted);
+    msg.status.id = ID_OKAY;
+    msg.status.msglen = htoll(len);
+    if(writex(s, &msg.status, sizeof(msg.status)) ||
+       writex(s, accepted, len)) {
+        return -1;
+    }
+    return 0;
+}
+
+static int do_recv(int s, const char *path, char *buffer, int lz4)
 {
     syncmsg msg;
-    int fd, r;
+    int fd, r, n;
+    char *data;
 
     fd = adb_open(path, O_RDONLY | O_CLOEXEC);
     if(fd < 0) {
@@ -394,7 +436,6 @@ static int do_recv(int s, const char *path, char *buffer)
         return 0;
     }
 
-    msg.data.id = ID_DATA;
     for(;;) {
         r = adb_read(fd, buffer, SYNC_DATA_MAX);
         if(r <= 0) {
@@ -404,9 +445,23 @@ static int do_recv(int s, const char *path, char *buffer)
             adb_close(fd);
             return r;
         }
-        msg.data.size = htoll(r);
+
+            /* send a chunk compressed only if it saves a sixteenth */
+        n = 0;
+        if(lz4 && lz4_worthwhile(buffer, r)) {
+            n = lz4_compress(buffer, r, buffer + SYNC_DATA_MAX, r - r / 16);
+        }
+        if(n > 0) {
+            msg.data.id = ID_LZ4D;
+            data = buffer + SYNC_DATA_MAX;
+        } else {
+            msg.data.id = ID_DATA;
+            data = buffer;
+            n = r;
+        }
+        msg.data.size = htoll(n);
         if(writex(s, &msg.data, sizeof(msg.data)) ||
-           writex(s, buffer, r)) {
+           writex(s, data, n)) {
             adb_close(fd);
             return -1;
         }
@@ -428,8 +483,10 @@ void file_sync_service(int fd, void *cookie)
     syncmsg msg;
     char name[1025];
     unsigned namelen;
+    int lz4 = 0;
 
-    char *buffer = malloc(SYNC_DATA_MAX);
+        /* the second half holds data on its way through lz4 */
+    char *buffer = malloc(SYNC_DATA_MAX * 2);
     if(buffer == 0) goto fail;
 
     for(;;) {
@@ -464,7 +521,13 @@ void file_sync_service(int fd, void *cookie)
             if(do_send(fd, name, buffer)) goto fail;
             break;
         case ID_RECV:
-            if(do_recv(fd, name, buffer)) goto fail;
+            if(do_recv(fd, name, buffer, lz4)) goto fail;
+            break;
+        case ID_PIPE:
+                /* each SEND already gets a single status; just settle
+                ** on the optional features
+                */
+            if(do_pipe(fd, name, &lz4)) goto fail;
             break;
         case ID_QUIT:
             goto fail;
@@ -45,6 +45,11 @@ static inline unsigned __swap_uint32(unsigned x)
 #define ID_OKAY MKID('O','K','A','Y')
 #define ID_FAIL MKID('F','A','I','L')
 #define ID_QUIT MKID('Q','U','I','T')
+#define ID_PIPE MKID('P','I','P','E')
+#define ID_LZ4D MKID('L','Z','4','D')
+
+/* optional features, offered by the client in the name of its PIPE */
+#define SYNC_FEATURE_LZ4 "lz4"
 
 typedef union {
     unsigned id;
@@ -84,4 +89,21 @@ int do_sync_pull(const char *rpath, const char *lpath, int show_progress, int pu
 
 #define SYNC_DATA_MAX (64*1024)
 
+/* returns whether the comma separated list has the feature */
+static inline int sync_has_feature(const char *list, const char *feature)
+{
+    size_t len = strlen(feature);
+
+    while(*list) {
+        if(!strncmp(list, feature, len) &&
+           (list[len] == ',' || list[len] == 0)) {
+            return 1;
+        }
+        list = strchr(list, ',');
+        if(list == 0) break;
+        list++;
+    }
+    return 0;
+}
+
 #endif
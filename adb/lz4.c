@@ -0,0 +1,230 @@
+/*
+ * Copyright (C) 2014 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <string.h>
+
+#include "lz4.h"
+
+/* A block is a series of sequences, each a token byte holding a literal
+** length and a match length in its two nibbles, with 15 meaning that
+** more length bytes follow; then the literals, then a little-endian
+** 16-bit match offset. The last sequence has literals only.
+*/
+#define MINMATCH        4
+#define LASTLITERALS    5   /* the last 5 bytes are always literals */
+#define MFLIMIT         12  /* and no match starts in the last 12 */
+#define HASH_BITS       12
+
+static unsigned read32(const unsigned char *p)
+{
+    unsigned v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static unsigned hash32(unsigned v)
+{
+    return (v * 2654435761U) >> (32 - HASH_BITS);
+}
+
+static unsigned char *put_length(unsigned char *op, unsigned len)
+{
+    while(len >= 255) {
+        *op++ = 255;
+        len -= 255;
+    }
+    *op++ = len;
+    return op;
+}
+
+/* emits the literals from anchor to ip, and a match at offset off of
+** matchlen bytes unless off is 0; returns NULL if that would pass oend
+*/
+static unsigned char *put_sequence(unsigned char *op, unsigned char *oend,
+        const unsigned char *anchor, const unsigned char *ip,
+        unsigned off, unsigned matchlen)
+{
+    unsigned litlen = ip - anchor;
+    unsigned char *token;
+
+    if(litlen + litlen / 255 + matchlen / 255 + 5 > (unsigned) (oend - op))
+        return NULL;
+
+    token = op++;
+    if(litlen >= 15) {
+        *token = 15 << 4;
+        op = put_length(op, litlen - 15);
+    } else {
+        *token = litlen << 4;
+    }
+    memcpy(op, anchor, litlen);
+    op += litlen;
+
+    if(off) {
+        *op++ = off;
+        *op++ = off >> 8;
+        matchlen -= MINMATCH;
+        if(matchlen >= 15) {
+            *token |= 15;
+            op = put_length(op, matchlen - 15);
+        } else {
+            *token |= matchlen;
+        }
+    }
+    return op;
+}
+
+int lz4_compress(const void *src, int srclen, void *dst, int dstcap)
+{
+    const unsigned char *base = src;
+    const unsigned char *ip = base;
+    const unsigned char *anchor = base;
+    const unsigned char *iend = base + srclen;
+    const unsigned char *mflimit = iend - MFLIMIT;
+    const unsigned char *matchlimit = iend - LASTLITERALS;
+    unsigned char *op = dst;
+    unsigned char *oend = op + dstcap;
+    unsigned short table[1 << HASH_BITS];
+    unsigned misses = 0;
+
+    if(srclen < 0 || srclen > LZ4_MAX_INPUT) return 0;
+
+    if(srclen > MFLIMIT) {
+        memset(table, 0, sizeof(table));
+        ip++;
+        while(ip < mflimit) {
+            unsigned h = hash32(read32(ip));
+            const unsigned char *ref = base + table[h];
+            const unsigned char *p, *r;
+
+            table[h] = ip - base;
+            if(ref >= ip || read32(ref) != read32(ip)) {
+                    /* skip faster through data that doesn't match */
+                ip += 1 + (misses++ >> 6);
+                continue;
+            }
+            misses = 0;
+
+            while(ip > anchor && ref > base && ip[-1] == ref[-1]) {
+                ip--;
+                ref--;
+            }
+            p = ip + MINMATCH;
+            r = ref + MINMATCH;
+            while(p < matchlimit && *p == *r) {
+                p++;
+                r++;
+            }
+
+            op = put_sequence(op, oend, anchor, ip, ip - ref, p - ip);
+            if(op == NULL) return 0;
+
+            ip = anchor = p;
+            if(ip < mflimit) {
+                table[hash32(read32(ip - 2))] = ip - 2 - base;
+            }
+        }
+    }
+
+    op = put_sequence(op, oend, anchor, iend, 0, 0);
+    if(op == NULL) return 0;
+    return op - (unsigned char*) dst;
+}
+
+static int get_length(const unsigned char **ip, const unsigned char *iend,
+        unsigned *len)
+{
+    unsigned b;
+
+    do {
+        if(*ip >= iend) return -1;
+        b = *(*ip)++;
+        *len += b;
+    } while(b == 255);
+    return 0;
+}
+
+int lz4_decompress(const void *src, int srclen, void *dst, int dstcap)
+{
+    const unsigned char *ip = src;
+    const unsigned char *iend = ip + srclen;
+    unsigned char *op = dst;
+    unsigned char *oend = op + dstcap;
+
+    for(;;) {
+        unsigned token, len, off;
+        const unsigned char *ref;
+
+        if(ip >= iend) return -1;
+        token = *ip++;
+
+        len = token >> 4;
+        if(len == 15 && get_length(&ip, iend, &len)) return -1;
+        if(len > (unsigned) (iend - ip) || len > (unsigned) (oend - op))
+            return -1;
+        memcpy(op, ip, len);
+        op += len;
+        ip += len;
+
+            /* only the last sequence ends without a match */
+        if(ip == iend) break;
+
+        if(iend - ip < 2) return -1;
+        off = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if(off == 0 || off > (unsigned) (op - (unsigned char*) dst))
+            return -1;
+
+        len = token & 15;
+        if(len == 15 && get_length(&ip, iend, &len)) return -1;
+        len += MINMATCH;
+        if(len > (unsigned) (oend - op)) return -1;
+
+        ref = op - off;
+        if(off >= len) {
+            memcpy(op, ref, len);
+            op += len;
+        } else {
+                /* overlapping: the match repeats its own output */
+            while(len--) *op++ = *ref++;
+        }
+    }
+    return op - (unsigned char*) dst;
+}
+
+int lz4_worthwhile(const void *src, int len)
+{
+    const unsigned char *p = src;
+    unsigned counts[256];
+    unsigned long long sum = 0;
+    int i;
+
+    if(len <= 0) return 0;
+
+    memset(counts, 0, sizeof(counts));
+    for(i = 0; i < len; i++) {
+        counts[p[i]]++;
+    }
+    for(i = 0; i < 256; i++) {
+        sum += (unsigned long long) counts[i] * counts[i];
+    }
+
+        /* the collision entropy -log2(sum / len^2) of the byte values
+        ** is 8 bits for random data, and compressed data comes close;
+        ** try anything under 7.5 bits, as 2^7.5 is about 181
+        */
+    return sum * 181 > (unsigned long long) len * len;
+}
@@ -0,0 +1,40 @@
+/*
+ * Copyright (C) 2014 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _ADB_LZ4_H_
+#define _ADB_LZ4_H_
+
+/* A small codec for the LZ4 block format, used to compress sync data.
+** Blocks are at most LZ4_MAX_INPUT bytes, which covers SYNC_DATA_MAX.
+*/
+#define LZ4_MAX_INPUT (64 * 1024)
+
+/* Compresses srclen bytes of src into dst. Returns the compressed size,
+** or 0 if it would not fit in dstcap bytes.
+*/
+int lz4_compress(const void *src, int srclen, void *dst, int dstcap);
+
+/* Decompresses srclen bytes of src into dst. Returns the decompressed
+** size, or -1 if src is malformed or would not fit in dstcap bytes.
+*/
+int lz4_decompress(const void *src, int srclen, void *dst, int dstcap);
+
+/* A quick entropy check: returns 0 if len bytes of src look like they
+** are compressed already, or random, and not worth trying to compress.
+*/
+int lz4_worthwhile(const void *src, int len);
+
+#endif
@@ -7,6 +7,7 @@
 #error ADB_MUTEX not defined when including this file
 #endif
 ADB_MUTEX(socket_list_lock)
+ADB_MUTEX(apacket_pool_lock)
 ADB_MUTEX(transport_lock)
 #if ADB_HOST
 ADB_MUTEX(local_transports_lock)
@@ -33,6 +33,8 @@
 ADB_MUTEX_DEFINE( socket_list_lock );
 
 static void local_socket_close_locked(asocket *s);
+static int remote_socket_enqueue(asocket *s, apacket *p);
+static size_t remote_socket_avail(asocket *s);
 
 int sendfailmsg(int fd, const char *reason)
 {
@@ -339,17 +341,43 @@ static void local_socket_event_func(int fd, unsigned ev, void *_s)
 
     if(ev & FDE_READ){
         apacket *p = get_apacket();
-        unsigned char *x = p->data;
-        size_t avail = MAX_PAYLOAD;
+        unsigned char *x;
+        size_t max_payload = MAX_PAYLOAD_V1;
+        size_t limit;
+        size_t avail;
         int r;
         int is_eof = 0;
 
+            /* fill packets as large as the transport will carry, and
+            ** the far side has room for
+            */
+        if(s->peer && s->peer->enqueue == remote_socket_enqueue) {
+            max_payload = remote_socket_avail(s->peer);
+            if(max_payload == 0) {
+                put_apacket(p);
+                fdevent_del(&s->fde, FDE_READ);
+                return;
+            }
+        }
+            /* start in the packet's own small buffer, so that a keystroke
+            ** does not take up a large one; grow only once it fills
+            */
+        limit = max_payload < p->capacity ? max_payload : p->capacity;
+        x = p->data;
+        avail = limit;
+
         while(avail > 0) {
             r = adb_read(fd, x, avail);
             D("LS(%d): post adb_read(fd=%d,...) r=%d (errno=%d) avail=%zu\n", s->id, s->fd, r, r<0?errno:0, avail);
             if(r > 0) {
                 avail -= r;
                 x += r;
+                if(avail == 0 && limit < max_payload) {
+                    apacket_reserve(p, max_payload);
+                    x = p->data + limit;
+                    avail = max_payload - limit;
+                    limit = max_payload;
+                }
                 continue;
             }
             if(r < 0) {
@@ -363,10 +391,10 @@ static void local_socket_event_func(int fd, unsigned ev, void *_s)
         }
         D("LS(%d): fd=%d post avail loop. r=%d is_eof=%d forced_eof=%d\n",
           s->id, s->fd, r, is_eof, s->fde.force_eof);
-        if((avail == MAX_PAYLOAD) || (s->peer == 0)) {
+        if((avail == limit) || (s->peer == 0)) {
             put_apacket(p);
         } else {
-            p->len = MAX_PAYLOAD - avail;
+            p->len = limit - avail;
 
             r = s->peer->enqueue(s->peer, p);
             D("LS(%d): fd=%d post peer->enqueue(). r=%d\n", s->id, s->fd, r);
@@ -488,31 +516,105 @@ static asocket *create_host_service_socket(const char *name, const char* serial)
 typedef struct aremotesocket {
     asocket      socket;
     adisconnect  disconnect;
+
+        /* with A_VERSION_STREAM_WINDOW: bytes the far side has granted
+        ** us but we have yet to send, and bytes we have taken from it
+        ** (or our initial grant) but have yet to grant back
+        */
+    unsigned     window;
+    unsigned     unacked;
 } aremotesocket;
 
+static int remote_socket_windowed(asocket *s)
+{
+    return s->enqueue == remote_socket_enqueue &&
+           s->transport->protocol_version >= A_VERSION_STREAM_WINDOW;
+}
+
+/* how much our local peer may send in the next packet */
+static size_t remote_socket_avail(asocket *s)
+{
+    size_t avail = s->transport->max_payload;
+
+    if(remote_socket_windowed(s) && ((aremotesocket*)s)->window < avail) {
+        avail = ((aremotesocket*)s)->window;
+    }
+    return avail;
+}
+
 static int remote_socket_enqueue(asocket *s, apacket *p)
 {
+    aremotesocket *rs = (aremotesocket*)s;
+    unsigned len = p->len;
+
     D("entered remote_socket_enqueue RS(%d) WRITE fd=%d peer.fd=%d\n",
       s->id, s->fd, s->peer->fd);
     p->msg.command = A_WRTE;
     p->msg.arg0 = s->peer->id;
     p->msg.arg1 = s->id;
-    p->msg.data_length = p->len;
+    p->msg.data_length = len;
     send_packet(p, s->transport);
-    return 1;
+
+        /* stop-and-wait, unless the far side granted us more room */
+    if(!remote_socket_windowed(s)) {
+        return 1;
+    }
+    rs->window -= len < rs->window ? len : rs->window;
+    return rs->window == 0;
 }
 
 static void remote_socket_ready(asocket *s)
 {
+    aremotesocket *rs = (aremotesocket*)s;
+
     D("entered remote_socket_ready RS(%d) OKAY fd=%d peer.fd=%d\n",
       s->id, s->fd, s->peer->fd);
+    if(remote_socket_windowed(s) && rs->unacked == 0) {
+        return;
+    }
     apacket *p = get_apacket();
     p->msg.command = A_OKAY;
     p->msg.arg0 = s->peer->id;
     p->msg.arg1 = s->id;
+    if(remote_socket_windowed(s)) {
+            /* grant back everything our local peer has consumed */
+        p->data[0] = rs->unacked;
+        p->data[1] = rs->unacked >> 8;
+        p->data[2] = rs->unacked >> 16;
+        p->data[3] = rs->unacked >> 24;
+        p->msg.data_length = 4;
+        rs->unacked = 0;
+    }
     send_packet(p, s->transport);
 }
 
+/* The far side granted us |bytes| more of window, in an A_OKAY or implied
+** by its A_OPEN. Returns nonzero if our local peer may resume reading.
+*/
+int remote_socket_credit(asocket *s, unsigned bytes)
+{
+    aremotesocket *rs = (aremotesocket*)s;
+    unsigned old;
+
+    if(!remote_socket_windowed(s)) {
+        return 1;
+    }
+    old = rs->window;
+    rs->window = (bytes < UINT_MAX - old) ? old + bytes : UINT_MAX;
+    D("RS(%d): window %u -> %u\n", s->id, old, rs->window);
+    return old == 0 && rs->window > 0;
+}
+
+/* We took |bytes| of an A_WRTE for our local peer. They are granted back
+** in the next remote_socket_ready(), once the local peer has consumed them.
+*/
+void remote_socket_received(asocket *s, unsigned bytes)
+{
+    if(remote_socket_windowed(s)) {
+        ((aremotesocket*)s)->unacked += bytes;
+    }
+}
+
 static void remote_socket_shutdown(asocket *s)
 {
     D("entered remote_socket_shutdown RS(%d) CLOSE fd=%d peer->fd=%d\n",
@@ -575,6 +677,9 @@ asocket *create_remote_socket(unsigned id, atransport *t)
     s->shutdown = remote_socket_shutdown;
     s->close = remote_socket_close;
     s->transport = t;
+    if(remote_socket_windowed(s)) {
+        ((aremotesocket*)s)->unacked = STREAM_WINDOW;
+    }
 
     dis->func   = remote_socket_disconnect;
     dis->opaque = s;
@@ -589,7 +694,7 @@ void connect_to_remote(asocket *s, const char *destination)
     apacket *p = get_apacket();
     int len = strlen(destination) + 1;
 
-    if(len > (MAX_PAYLOAD-1)) {
+    if(len > (MAX_PAYLOAD_V1-1)) {
         fatal("destination oversized");
     }
 
@@ -714,7 +819,7 @@ static int smart_socket_enqueue(asocket *s, apacket *p)
         s->pkt_first = p;
         s->pkt_last = p;
     } else {
-        if((s->pkt_first->len + p->len) > MAX_PAYLOAD) {
+        if((s->pkt_first->len + p->len) > s->pkt_first->capacity) {
             D("SS(%d): overflow\n", s->id);
             put_apacket(p);
             goto fail;
@@ -0,0 +1,205 @@
+/* a simple test program for lz4.c, the sync data codec. adbd decodes
+** whatever the host sends it, so besides round trips this feeds the
+** decoder truncated and corrupted blocks, which it must reject without
+** writing outside its buffer. build and run it from this directory with:
+**
+**    cc -o test_lz4 test_lz4.c lz4.c
+**    ./test_lz4
+**
+** adding -fsanitize=address also catches reads past the input.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lz4.h"
+
+#define GUARD       64
+#define BOUND(n)    ((n) + (n) / 255 + 16)
+
+static int  failures;
+
+static void
+check( int  ok, const char*  what )
+{
+    printf("%s: %s\n", ok ? "PASS" : "FAIL", what);
+    if (!ok)
+        failures++;
+}
+
+static unsigned char  src[LZ4_MAX_INPUT];
+static unsigned char  comp[BOUND(LZ4_MAX_INPUT)];
+/* decoded output, with a guard band on each side */
+static unsigned char  out[GUARD + LZ4_MAX_INPUT + GUARD];
+
+enum { TEXT, RANDOM, ZEROS };
+
+static void
+fill( int  kind, int  len, unsigned  seed )
+{
+    static const char  words[] = "adb sync push pull lz4 block literal match ";
+    int                i;
+
+    for (i = 0; i < len; i++) {
+        if (kind == TEXT)
+            src[i] = words[(i + (rand_r(&seed) % 8 == 0)) % (sizeof(words) - 1)];
+        else if (kind == RANDOM)
+            src[i] = rand_r(&seed);
+        else
+            src[i] = 0;
+    }
+}
+
+static int
+guards_intact( void )
+{
+    int  i;
+    for (i = 0; i < GUARD; i++)
+        if (out[i] != 0xA5 || out[sizeof(out) - 1 - i] != 0xA5)
+            return 0;
+    return 1;
+}
+
+/* decodes into the middle of out, with room for cap bytes */
+static int
+decode( const unsigned char*  p, int  len, int  cap )
+{
+    memset(out, 0xA5, sizeof(out));
+    return lz4_decompress(p, len, out + GUARD, cap);
+}
+
+static void
+test_round_trip( void )
+{
+    static const int  sizes[] = { 0, 1, 12, 13, 14, 100, 4096, 65535, 65536 };
+    int               kind, i, ok = 1, tight = 1;
+
+    for (kind = TEXT; kind <= ZEROS; kind++) {
+        for (i = 0; i < (int)(sizeof(sizes) / sizeof(sizes[0])); i++) {
+            int  n = sizes[i], c, d;
+
+            fill(kind, n, i + 1);
+            c = lz4_compress(src, n, comp, BOUND(n));
+            d = decode(comp, c, n);
+            if (c <= 0 || d != n || memcmp(out + GUARD, src, n) ||
+                !guards_intact()) {
+                printf("  kind %d, %d bytes: compressed %d, got %d\n",
+                       kind, n, c, d);
+                ok = 0;
+            }
+                /* one byte short of the output fails cleanly */
+            if (n > 0 && (decode(comp, c, n - 1) != -1 || !guards_intact()))
+                tight = 0;
+        }
+    }
+    check(ok, "compressible, random and edge sizes round trip");
+    check(tight, "a block that does not fit the output is refused");
+
+    fill(TEXT, 65536, 9);
+    check(lz4_compress(src, 65536, comp, BOUND(65536)) < 65536 / 2,
+          "text compresses");
+    check(lz4_compress(src, LZ4_MAX_INPUT + 1, comp, sizeof(comp)) == 0,
+          "input over LZ4_MAX_INPUT is refused");
+}
+
+static void
+test_compress_bound( void )
+{
+    int  n = 4096, c, cap, ok = 1;
+
+    fill(RANDOM, n, 7);
+    c = lz4_compress(src, n, comp, BOUND(n));
+    for (cap = c - 8; cap < c && ok; cap++) {
+        memset(comp, 0xA5, sizeof(comp));
+        ok = lz4_compress(src, n, comp, cap) == 0 && comp[cap] == 0xA5;
+    }
+    check(ok, "compressing into too small a buffer fails within it");
+}
+
+static void
+test_truncated( void )
+{
+    int  kind, ok = 1;
+
+    for (kind = TEXT; kind <= RANDOM; kind++) {
+        int  n = 4096, c, len;
+
+        fill(kind, n, 11);
+        c = lz4_compress(src, n, comp, BOUND(n));
+        for (len = 0; len < c; len++) {
+            int  d = decode(comp, len, n);
+            if (d == n || !guards_intact())
+                ok = 0;
+        }
+    }
+    check(ok, "truncated blocks are refused");
+}
+
+static void
+test_corrupted( void )
+{
+    static unsigned char  bad[BOUND(LZ4_MAX_INPUT)];
+    unsigned              seed = 5;
+    int                   n = 65536, c, i, ok = 1;
+
+    fill(TEXT, n, 13);
+    c = lz4_compress(src, n, comp, BOUND(n));
+    for (i = 0; i < 20000 && ok; i++) {
+        int  flips = 1 + rand_r(&seed) % 4, d;
+
+        memcpy(bad, comp, c);
+        while (flips--)
+            bad[rand_r(&seed) % c] ^= 1 << (rand_r(&seed) % 8);
+        d = decode(bad, c, n);
+        ok = d >= -1 && d <= n && guards_intact();
+    }
+    check(ok, "corrupted blocks stay within the output");
+
+    for (i = 0; i < 20000 && ok; i++) {
+        int  len = rand_r(&seed) % 64, j, d;
+
+        for (j = 0; j < len; j++)
+            bad[j] = rand_r(&seed);
+        d = decode(bad, len, 256);
+        ok = d >= -1 && d <= 256 && guards_intact();
+    }
+    check(ok, "random blocks stay within the output");
+}
+
+static void
+test_crafted( void )
+{
+        /* literal 'a', then a match at offset 0 */
+    static const unsigned char  zero_off[] = { 0x10, 'a', 0x00, 0x00, 0x00 };
+        /* literal 'a', then a match reaching back before the output */
+    static const unsigned char  far_off[] = { 0x10, 'a', 0x02, 0x00, 0x00 };
+        /* a literal length run that never ends */
+    static const unsigned char  endless[] = { 0xF0, 0xFF, 0xFF, 0xFF };
+        /* a match of 4 + 15 + 255 + 10 bytes, repeating 'a' */
+    static const unsigned char  long_match[] = { 0x1F, 'a', 0x01, 0x00,
+                                                 0xFF, 0x0A, 0x00 };
+    int                         d;
+
+    check(decode(zero_off, sizeof(zero_off), 64) == -1 && guards_intact(),
+          "a match at offset 0 is refused");
+    check(decode(far_off, sizeof(far_off), 64) == -1 && guards_intact(),
+          "a match before the start of the output is refused");
+    check(decode(endless, sizeof(endless), 64) == -1 && guards_intact(),
+          "an unterminated length is refused");
+    check(decode(long_match, sizeof(long_match), 100) == -1 &&
+          guards_intact(), "an overlong match is refused");
+    d = decode(long_match, sizeof(long_match), 1 + 284);
+    check(d == 285 && out[GUARD + 284] == 'a' && guards_intact(),
+          "an overlapping match repeats its output");
+    check(decode(comp, 0, 64) == -1, "an empty block is refused");
+}
+
+int  main( int  argc, char**  argv )
+{
+    test_round_trip();
+    test_compress_bound();
+    test_truncated();
+    test_corrupted();
+    test_crafted();
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,878 @@
+/* a simple test program, measures stream throughput through the ADB server
+** to a stand-in device on a loopback TCP transport.
+**
+** start an adb server first, then run:
+**
+**    test_throughput [-p port] [-v version] [-l latency-ms] [-b MB/s]
+**                    [-s size-mb] [-f file]
+**
+** the program listens on 127.0.0.1:port as a minimal adbd, which offers
+** "source:<bytes>" and "sink:<bytes>" services, tells the server to connect
+** to it, and times one transfer in each direction. every packet the server
+** sends is held back for latency-ms before the stand-in looks at it, to
+** approximate a slower link, and -b caps the link's bandwidth both ways.
+** version is the protocol version the stand-in claims in A_CNXN, so that
+** older devices can be compared against newer ones.
+**
+** with -f, the stand-in offers a "sync:" service instead, and the program
+** pushes and pulls the file through it, first as plain ID_DATA and then
+** with lz4 compression, the way "adb push" and "adb pull" do. the stand-in
+** throws pushed data away, and serves pulls from the local file system.
+**
+** build it from this directory with:
+**
+**    cc -o test_throughput test_throughput.c lz4.c -lpthread
+*/
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+
+#include "file_sync_service.h"
+#include "lz4.h"
+
+#define A_CNXN 0x4e584e43
+#define A_OPEN 0x4e45504f
+#define A_OKAY 0x59414b4f
+#define A_CLSE 0x45534c43
+#define A_WRTE 0x45545257
+
+#define A_VERSION_LARGE_PAYLOAD 0x01000001
+#define A_VERSION_STREAM_WINDOW 0x01000002
+
+#define MAX_PAYLOAD_V1  (4 * 1024)
+#define MAX_PAYLOAD     (1024 * 1024)
+#define STREAM_WINDOW   (4 * MAX_PAYLOAD)
+
+#define ADB_PORT        5037
+
+typedef struct packet packet;
+
+struct packet {
+    packet*         next;
+    double          due;
+    unsigned        msg[6];
+    unsigned char*  data;
+};
+
+static unsigned         version = A_VERSION_STREAM_WINDOW;
+static double           latency;
+static double           bandwidth;  /* bytes per second, 0 for no limit */
+
+static int              dev_fd = -1;
+static unsigned         max_payload = MAX_PAYLOAD_V1;
+static int              windowed;
+
+static pthread_mutex_t  queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t   queue_cond = PTHREAD_COND_INITIALIZER;
+static packet*          queue_first;
+static packet*          queue_last;
+static int              online;
+
+static void
+panic( const char*  msg )
+{
+    fprintf(stderr, "PANIC: %s: %s\n", msg, strerror(errno));
+    exit(1);
+}
+
+static double
+now( void )
+{
+    struct timeval  tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static int
+unix_write( int  fd, const void*  _buf, int  len )
+{
+    const char*  buf = _buf;
+    int  result = 0;
+    while (len > 0) {
+        int  len2 = write(fd, buf, len);
+        if (len2 < 0) {
+            if (errno == EINTR || errno == EAGAIN)
+                continue;
+            return -1;
+        }
+        result += len2;
+        len -= len2;
+        buf += len2;
+    }
+    return  result;
+}
+
+static int
+unix_read( int  fd, void*  _buf, int  len )
+{
+    char*  buf = _buf;
+    int  result = 0;
+    while (len > 0) {
+        int  len2 = read(fd, buf, len);
+        if (len2 <= 0) {
+            if (len2 < 0 && (errno == EINTR || errno == EAGAIN))
+                continue;
+            return -1;
+        }
+        result += len2;
+        len -= len2;
+        buf += len2;
+    }
+    return  result;
+}
+
+/* the stand-in device */
+
+static void
+send_packet( unsigned  command, unsigned  arg0, unsigned  arg1,
+             const void*  data, unsigned  len )
+{
+    const unsigned char*  x = data;
+    unsigned  msg[6];
+    unsigned  sum = 0;
+    unsigned  n;
+
+    for (n = 0; n < len; n++)
+        sum += x[n];
+
+    msg[0] = command;
+    msg[1] = arg0;
+    msg[2] = arg1;
+    msg[3] = len;
+    msg[4] = sum;
+    msg[5] = command ^ 0xffffffff;
+
+        /* wait for the link to carry the previous packet */
+    if (bandwidth > 0) {
+        static double  busy;
+        double  t = now();
+
+        if (busy > t)
+            usleep((busy - t) * 1e6);
+        else
+            busy = t;
+        busy += (sizeof(msg) + len) / bandwidth;
+    }
+    if (unix_write(dev_fd, msg, sizeof(msg)) < 0 ||
+        (len > 0 && unix_write(dev_fd, data, len) < 0))
+        panic("device: write");
+}
+
+static void
+send_ready( unsigned  local, unsigned  remote, unsigned  credit )
+{
+    unsigned char  data[4];
+
+    if (!windowed) {
+        send_packet(A_OKAY, local, remote, NULL, 0);
+        return;
+    }
+    data[0] = credit;
+    data[1] = credit >> 8;
+    data[2] = credit >> 16;
+    data[3] = credit >> 24;
+    send_packet(A_OKAY, local, remote, data, 4);
+}
+
+/* reads packets from the server and queues them, due after the latency */
+static void*
+reader_thread( void*  arg )
+{
+    double  busy = 0;
+
+    for (;;) {
+        packet*  p = calloc(1, sizeof(*p));
+
+        if (p == NULL)
+            panic("device: calloc");
+        if (unix_read(dev_fd, p->msg, sizeof(p->msg)) < 0) {
+            free(p);
+            p = NULL;
+        } else if (p->msg[3] > 0) {
+            p->data = malloc(p->msg[3]);
+            if (p->data == NULL || unix_read(dev_fd, p->data, p->msg[3]) < 0)
+                panic("device: read");
+        }
+
+        pthread_mutex_lock(&queue_lock);
+        if (p == NULL) {
+            online = -1;
+        } else {
+            double  t = now();
+
+            if (busy < t)
+                busy = t;
+            if (bandwidth > 0)
+                busy += (sizeof(p->msg) + p->msg[3]) / bandwidth;
+            p->due = busy + latency;
+            if (queue_first)
+                queue_last->next = p;
+            else
+                queue_first = p;
+            queue_last = p;
+        }
+        pthread_cond_broadcast(&queue_cond);
+        pthread_mutex_unlock(&queue_lock);
+        if (p == NULL)
+            return NULL;
+    }
+}
+
+static packet*
+next_packet( void )
+{
+    packet*  p;
+    double   wait;
+
+    pthread_mutex_lock(&queue_lock);
+    while (queue_first == NULL && online >= 0)
+        pthread_cond_wait(&queue_cond, &queue_lock);
+    p = queue_first;
+    if (p) {
+        queue_first = p->next;
+    }
+    pthread_mutex_unlock(&queue_lock);
+
+    if (p && (wait = p->due - now()) > 0)
+        usleep(wait * 1e6);
+    return p;
+}
+
+static void
+free_packet( packet*  p )
+{
+    free(p->data);
+    free(p);
+}
+
+/* one stream at a time is plenty for measuring */
+static struct {
+    unsigned    local;
+    unsigned    remote;
+    int         is_source;
+    int         is_sync;
+    long long   remaining;
+    long long   credit;
+} stream;
+
+/* the stand-in's end of a "sync:" stream */
+static struct {
+    unsigned char   in[8 + SYNC_DATA_MAX];  /* the message coming in */
+    unsigned        in_len;
+    unsigned char*  out;                    /* replies not sent yet */
+    unsigned        out_pos;
+    unsigned        out_len;
+    int             sending;                /* inside a SEND */
+    int             recv_fd;                /* the file a RECV reads */
+    int             lz4;
+    unsigned char   data[SYNC_DATA_MAX];
+} sync_stream;
+
+#define SYNC_OUT_MAX  (MAX_PAYLOAD + 2 * (8 + SYNC_DATA_MAX))
+
+static void
+source_send( void )
+{
+    static unsigned char  buf[MAX_PAYLOAD];
+
+    while (stream.remaining > 0 && stream.credit > 0) {
+        unsigned  len = max_payload;
+        if (len > stream.remaining)
+            len = stream.remaining;
+        if (windowed && len > stream.credit)
+            len = stream.credit;
+        send_packet(A_WRTE, stream.local, stream.remote, buf, len);
+        stream.remaining -= len;
+        stream.credit = windowed ? stream.credit - len : 0;
+    }
+    if (stream.remaining == 0) {
+        send_packet(A_CLSE, stream.local, stream.remote, NULL, 0);
+        stream.remote = 0;
+    }
+}
+
+static void
+sync_reply( unsigned  id, const void*  data, unsigned  len )
+{
+    unsigned  msg[2];
+
+    if (sync_stream.out_len + sizeof(msg) + len > SYNC_OUT_MAX) {
+        fprintf(stderr, "stand-in: sync replies overflow\n");
+        exit(1);
+    }
+    msg[0] = id;
+    msg[1] = len;
+    memcpy(sync_stream.out + sync_stream.out_len, msg, sizeof(msg));
+    memcpy(sync_stream.out + sync_stream.out_len + sizeof(msg), data, len);
+    sync_stream.out_len += sizeof(msg) + len;
+}
+
+/* queues up to a packet's worth of the file a RECV is reading, chunk by
+** chunk, compressing those that shrink like adbd does */
+static void
+sync_refill( void )
+{
+    if (sync_stream.recv_fd < 0)
+        return;
+
+    memmove(sync_stream.out, sync_stream.out + sync_stream.out_pos,
+            sync_stream.out_len - sync_stream.out_pos);
+    sync_stream.out_len -= sync_stream.out_pos;
+    sync_stream.out_pos = 0;
+
+    while (sync_stream.recv_fd >= 0 && sync_stream.out_len < max_payload) {
+        unsigned char*  out = sync_stream.out + sync_stream.out_len;
+        int  r = read(sync_stream.recv_fd, sync_stream.data, SYNC_DATA_MAX);
+        int  n = 0;
+
+        if (r <= 0) {
+            close(sync_stream.recv_fd);
+            sync_stream.recv_fd = -1;
+            sync_reply(ID_DONE, NULL, 0);
+            break;
+        }
+        if (sync_stream.lz4 && lz4_worthwhile(sync_stream.data, r))
+            n = lz4_compress(sync_stream.data, r, out + 8, r - r / 16);
+        if (n > 0) {
+            unsigned  msg[2] = { ID_LZ4D, n };
+            memcpy(out, msg, sizeof(msg));
+            sync_stream.out_len += sizeof(msg) + n;
+        } else {
+            sync_reply(ID_DATA, sync_stream.data, r);
+        }
+    }
+}
+
+static void
+sync_flush( void )
+{
+    for (;;) {
+        unsigned  len;
+
+        sync_refill();
+        len = sync_stream.out_len - sync_stream.out_pos;
+        if (len == 0 || stream.credit <= 0)
+            break;
+        if (len > max_payload)
+            len = max_payload;
+        if (windowed && len > stream.credit)
+            len = stream.credit;
+        send_packet(A_WRTE, stream.local, stream.remote,
+                    sync_stream.out + sync_stream.out_pos, len);
+        sync_stream.out_pos += len;
+        stream.credit = windowed ? stream.credit - len : 0;
+        if (sync_stream.out_pos == sync_stream.out_len)
+            sync_stream.out_pos = sync_stream.out_len = 0;
+    }
+}
+
+/* handles the message at the start of sync_stream.in, and returns its size,
+** or 0 if it isn't all in yet */
+static unsigned
+sync_message( void )
+{
+    unsigned char*  body = sync_stream.in + 8;
+    char      name[1025];
+    unsigned  msg[2];
+
+    if (sync_stream.in_len < sizeof(msg))
+        return 0;
+    memcpy(msg, sync_stream.in, sizeof(msg));
+
+        /* a DONE's length is the file's time */
+    if (sync_stream.sending && msg[0] == ID_DONE) {
+        sync_stream.sending = 0;
+        sync_reply(ID_OKAY, NULL, 0);
+        return sizeof(msg);
+    }
+    if (msg[1] > SYNC_DATA_MAX) {
+        fprintf(stderr, "stand-in: oversize sync message\n");
+        exit(1);
+    }
+    if (sync_stream.in_len < sizeof(msg) + msg[1])
+        return 0;
+
+    if (sync_stream.sending) {
+        if (msg[0] == ID_LZ4D &&
+            lz4_decompress(body, msg[1], sync_stream.data, SYNC_DATA_MAX) < 0) {
+            fprintf(stderr, "stand-in: corrupt compressed data\n");
+            exit(1);
+        }
+        return sizeof(msg) + msg[1];
+    }
+
+    if (msg[1] >= sizeof(name)) {
+        fprintf(stderr, "stand-in: invalid namelen\n");
+        exit(1);
+    }
+    memcpy(name, body, msg[1]);
+    name[msg[1]] = 0;
+
+    switch (msg[0]) {
+    case ID_PIPE:
+        sync_stream.lz4 = sync_has_feature(name, SYNC_FEATURE_LZ4);
+        sync_reply(ID_OKAY, SYNC_FEATURE_LZ4,
+                   sync_stream.lz4 ? strlen(SYNC_FEATURE_LZ4) : 0);
+        break;
+    case ID_SEND:
+        sync_stream.sending = 1;
+        break;
+    case ID_RECV:
+        sync_stream.recv_fd = open(name, O_RDONLY);
+        if (sync_stream.recv_fd < 0) {
+            const char*  reason = strerror(errno);
+            sync_reply(ID_FAIL, reason, strlen(reason));
+        }
+        break;
+    default:
+        send_packet(A_CLSE, stream.local, stream.remote, NULL, 0);
+        stream.remote = 0;
+        break;
+    }
+    return sizeof(msg) + msg[1];
+}
+
+static void
+sync_input( const unsigned char*  data, unsigned  len )
+{
+    while (len > 0) {
+        unsigned  n = sizeof(sync_stream.in) - sync_stream.in_len;
+
+        if (n > len)
+            n = len;
+        memcpy(sync_stream.in + sync_stream.in_len, data, n);
+        sync_stream.in_len += n;
+        data += n;
+        len  -= n;
+
+        while (stream.remote != 0 && (n = sync_message()) > 0) {
+            sync_stream.in_len -= n;
+            memmove(sync_stream.in, sync_stream.in + n, sync_stream.in_len);
+        }
+    }
+    if (stream.remote != 0)
+        sync_flush();
+}
+
+static void
+handle_open( packet*  p )
+{
+    const char*  name = (const char*) p->data;
+
+    if (stream.remote != 0 || p->msg[3] == 0 || p->data[p->msg[3] - 1] != 0) {
+        send_packet(A_CLSE, 0, p->msg[1], NULL, 0);
+        return;
+    }
+    stream.is_source = 0;
+    stream.is_sync = 0;
+    if (!strncmp(name, "source:", 7)) {
+        stream.is_source = 1;
+        stream.remaining = atoll(name + 7);
+    } else if (!strncmp(name, "sink:", 5)) {
+        stream.remaining = atoll(name + 5);
+    } else if (!strcmp(name, "sync:")) {
+        stream.is_sync = 1;
+        sync_stream.in_len = 0;
+        sync_stream.out_pos = sync_stream.out_len = 0;
+        sync_stream.sending = 0;
+        sync_stream.recv_fd = -1;
+        sync_stream.lz4 = 0;
+    } else {
+        send_packet(A_CLSE, 0, p->msg[1], NULL, 0);
+        return;
+    }
+    stream.local++;
+    stream.remote = p->msg[1];
+        /* the OPEN implies a READY for one packet */
+    stream.credit = max_payload;
+    send_ready(stream.local, stream.remote, STREAM_WINDOW);
+    if (stream.is_source)
+        source_send();
+}
+
+static void*
+device_thread( void*  arg )
+{
+    static const char  banner[] = "device::ro.product.name=standin;";
+    packet*  p;
+
+    while ((p = next_packet()) != NULL) {
+        unsigned  arg0 = p->msg[1];
+        unsigned  len  = p->msg[3];
+
+        switch (p->msg[0]) {
+        case A_CNXN:
+            windowed = version >= A_VERSION_STREAM_WINDOW &&
+                       arg0 >= A_VERSION_STREAM_WINDOW;
+            max_payload = MAX_PAYLOAD_V1;
+            if (version >= A_VERSION_LARGE_PAYLOAD &&
+                arg0 >= A_VERSION_LARGE_PAYLOAD) {
+                max_payload = p->msg[2] < MAX_PAYLOAD ? p->msg[2] : MAX_PAYLOAD;
+            }
+            send_packet(A_CNXN, version,
+                        version >= A_VERSION_LARGE_PAYLOAD ? MAX_PAYLOAD : MAX_PAYLOAD_V1,
+                        banner, sizeof(banner));
+            pthread_mutex_lock(&queue_lock);
+            online = 1;
+            pthread_cond_broadcast(&queue_cond);
+            pthread_mutex_unlock(&queue_lock);
+            break;
+
+        case A_OPEN:
+            handle_open(p);
+            break;
+
+        case A_OKAY:
+            if (stream.remote == 0 || p->msg[2] != stream.local)
+                break;
+            if (!windowed)
+                stream.credit = max_payload;
+            else if (len >= 4)
+                stream.credit += p->data[0] | (p->data[1] << 8) |
+                                 (p->data[2] << 16) | ((unsigned) p->data[3] << 24);
+            if (stream.is_source)
+                source_send();
+            else if (stream.is_sync)
+                sync_flush();
+            break;
+
+        case A_WRTE:
+            if (stream.remote == 0 || p->msg[2] != stream.local)
+                break;
+            send_ready(stream.local, stream.remote, len);
+            if (stream.is_sync) {
+                sync_input(p->data, len);
+                break;
+            }
+            stream.remaining -= len;
+            if (stream.remaining <= 0) {
+                send_packet(A_CLSE, stream.local, stream.remote, NULL, 0);
+                stream.remote = 0;
+            }
+            break;
+
+        case A_CLSE:
+            if (p->msg[2] == stream.local)
+                stream.remote = 0;
+            break;
+        }
+        free_packet(p);
+    }
+    return NULL;
+}
+
+/* the server's side */
+
+static int
+server_request( int  s, const char*  request, int  want_reply )
+{
+    char  buffer[1024];
+    int   len = strlen(request);
+
+    snprintf(buffer, sizeof(buffer), "%04x%s", len, request);
+    if (unix_write(s, buffer, len + 4) < 0)
+        panic("could not send request");
+    if (unix_read(s, buffer, 4) < 0)
+        panic("could not read status");
+    if (memcmp(buffer, "OKAY", 4)) {
+        buffer[4] = 0;
+        fprintf(stderr, "request '%s' failed: %s\n", request, buffer);
+        return -1;
+    }
+    if (want_reply) {
+        if (unix_read(s, buffer, 4) < 0)
+            panic("could not read reply length");
+        buffer[4] = 0;
+        len = strtol(buffer, NULL, 16);
+        if (len >= (int) sizeof(buffer) || unix_read(s, buffer, len) < 0)
+            panic("could not read reply");
+        buffer[len] = 0;
+        printf("%s: %s\n", request, buffer);
+    }
+    return 0;
+}
+
+static int
+server_connect( void )
+{
+    struct sockaddr_in  server;
+    int  s;
+
+    memset(&server, 0, sizeof(server));
+    server.sin_family      = AF_INET;
+    server.sin_port        = htons(ADB_PORT);
+    server.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    s = socket(PF_INET, SOCK_STREAM, 0);
+    if (s < 0 || connect(s, (struct sockaddr*) &server, sizeof(server)) < 0)
+        panic("could not connect to the adb server");
+    return s;
+}
+
+static double
+transfer( const char*  serial, const char*  service, long long  size )
+{
+    static char  buf[64 * 1024];
+    char         request[256];
+    double       start;
+    long long    done = 0;
+    int          s = server_connect();
+
+    snprintf(request, sizeof(request), "host:transport:%s", serial);
+    if (server_request(s, request, 0) < 0)
+        exit(1);
+
+    start = now();
+    snprintf(request, sizeof(request), "%s:%lld", service, size);
+    if (server_request(s, request, 0) < 0)
+        exit(1);
+
+    if (!strcmp(service, "source")) {
+        int  len;
+        while ((len = read(s, buf, sizeof(buf))) > 0)
+            done += len;
+    } else {
+        while (done < size) {
+            int  len = size - done < (long long) sizeof(buf) ? size - done : sizeof(buf);
+            if (unix_write(s, buf, len) < 0)
+                break;
+            done += len;
+        }
+            /* the stand-in closes once it has everything */
+        while (read(s, buf, sizeof(buf)) > 0)
+            ;
+    }
+    close(s);
+
+    if (done != size) {
+        fprintf(stderr, "%s: moved %lld of %lld bytes\n", service, done, size);
+        exit(1);
+    }
+    return now() - start;
+}
+
+/* pushes or pulls a file through a "sync:" stream, with lz4 if asked for,
+** and returns how long that took; *wire gets the bytes that crossed */
+static double
+sync_transfer( const char*  serial, const char*  path, int  push,
+               int  lz4, long long*  wire )
+{
+    static unsigned char  buf[8 + SYNC_DATA_MAX];
+    static unsigned char  data[SYNC_DATA_MAX];
+    static unsigned char  local[SYNC_DATA_MAX];
+    const char*  offer = lz4 ? SYNC_FEATURE_LZ4 : "";
+    const char*  name = push ? "/data/local/tmp/test_throughput,33188" : path;
+    char         request[256];
+    unsigned     msg[2];
+    double       start;
+    int          s = server_connect();
+    int          fd = open(path, O_RDONLY);
+
+    if (fd < 0)
+        panic(path);
+
+    snprintf(request, sizeof(request), "host:transport:%s", serial);
+    if (server_request(s, request, 0) < 0 || server_request(s, "sync:", 0) < 0)
+        exit(1);
+
+    msg[0] = ID_PIPE;
+    msg[1] = strlen(offer);
+    if (unix_write(s, msg, sizeof(msg)) < 0 || unix_write(s, offer, msg[1]) < 0 ||
+        unix_read(s, msg, sizeof(msg)) < 0 || msg[0] != ID_OKAY ||
+        msg[1] >= sizeof(request) || unix_read(s, request, msg[1]) < 0)
+        panic("sync: no PIPE");
+    request[msg[1]] = 0;
+    lz4 = sync_has_feature(request, SYNC_FEATURE_LZ4);
+
+    *wire = 0;
+    start = now();
+
+    msg[0] = push ? ID_SEND : ID_RECV;
+    msg[1] = strlen(name);
+    if (unix_write(s, msg, sizeof(msg)) < 0 || unix_write(s, name, msg[1]) < 0)
+        panic("sync: write");
+
+    if (push) {
+        int  r;
+
+        while ((r = read(fd, data, sizeof(data))) > 0) {
+            int  n = 0;
+
+            if (lz4 && lz4_worthwhile(data, r))
+                n = lz4_compress(data, r, buf + 8, r - r / 16);
+            if (n > 0) {
+                msg[0] = ID_LZ4D;
+            } else {
+                msg[0] = ID_DATA;
+                memcpy(buf + 8, data, r);
+                n = r;
+            }
+            msg[1] = n;
+            memcpy(buf, msg, sizeof(msg));
+            if (unix_write(s, buf, 8 + n) < 0)
+                panic("sync: write");
+            *wire += n;
+        }
+        msg[0] = ID_DONE;
+        msg[1] = 0;
+        if (unix_write(s, msg, sizeof(msg)) < 0 ||
+            unix_read(s, msg, sizeof(msg)) < 0 || msg[0] != ID_OKAY)
+            panic("sync: push failed");
+    } else {
+        for (;;) {
+            int  n;
+
+            if (unix_read(s, msg, sizeof(msg)) < 0)
+                panic("sync: read");
+            if (msg[0] == ID_DONE)
+                break;
+            if ((msg[0] != ID_DATA && msg[0] != ID_LZ4D) || msg[1] > SYNC_DATA_MAX)
+                panic("sync: pull failed");
+            if (unix_read(s, buf, msg[1]) < 0)
+                panic("sync: read");
+            *wire += msg[1];
+
+            n = msg[1];
+            if (msg[0] == ID_LZ4D) {
+                n = lz4_decompress(buf, msg[1], data, SYNC_DATA_MAX);
+                if (n < 0)
+                    panic("sync: corrupt compressed data");
+            } else {
+                memcpy(data, buf, n);
+            }
+            if (unix_read(fd, local, n) < 0 || memcmp(data, local, n)) {
+                fprintf(stderr, "sync: pulled data differs from %s\n", path);
+                exit(1);
+            }
+        }
+    }
+
+    msg[0] = ID_QUIT;
+    msg[1] = 0;
+    unix_write(s, msg, sizeof(msg));
+    close(s);
+    close(fd);
+    return now() - start;
+}
+
+static void
+sync_benchmark( const char*  serial, const char*  path )
+{
+    static const char*  dirs[2] = { "pull", "push" };
+    long long  size, wire;
+    int        push, lz4;
+    int        fd = open(path, O_RDONLY);
+
+    if (fd < 0)
+        panic(path);
+    size = lseek(fd, 0, SEEK_END);
+    close(fd);
+
+    for (push = 0; push < 2; push++) {
+        for (lz4 = 0; lz4 < 2; lz4++) {
+            double  t = sync_transfer(serial, path, push, lz4, &wire);
+            printf("%s, %s: %8.2f MB/s", dirs[push], lz4 ? "lz4" : "raw",
+                   size / t / (1024 * 1024));
+            if (size > 0 && wire < size)
+                printf(", %lld%% on the wire", wire * 100 / size);
+            printf("\n");
+        }
+    }
+}
+
+int  main( int  argc, char**  argv )
+{
+    struct sockaddr_in  addr;
+    pthread_t  reader, device;
+    char       serial[64];
+    char       request[128];
+    long long  size = 64LL * 1024 * 1024;
+    const char*  file = NULL;
+    int        port = 6001;
+    int        s, c, opt;
+    double     t;
+
+    while ((opt = getopt(argc, argv, "p:v:l:b:s:f:")) != -1) {
+        switch (opt) {
+        case 'p': port = atoi(optarg); break;
+        case 'v': version = strtoul(optarg, NULL, 0); break;
+        case 'l': latency = atof(optarg) / 1000; break;
+        case 'b': bandwidth = atof(optarg) * 1024 * 1024; break;
+        case 's': size = atoll(optarg) * 1024 * 1024; break;
+        case 'f': file = optarg; break;
+        default:
+            fprintf(stderr, "usage: %s [-p port] [-v version] [-l latency-ms] [-b MB/s] [-s size-mb] [-f file]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family      = AF_INET;
+    addr.sin_port        = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    opt = 1;
+    s = socket(PF_INET, SOCK_STREAM, 0);
+    if (s < 0)
+        panic("socket");
+    setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    if (bind(s, (struct sockaddr*) &addr, sizeof(addr)) < 0 || listen(s, 1) < 0)
+        panic("could not listen");
+
+    snprintf(serial, sizeof(serial), "127.0.0.1:%d", port);
+    snprintf(request, sizeof(request), "host:connect:%s", serial);
+    c = server_connect();
+    server_request(c, request, 1);
+    close(c);
+
+    dev_fd = accept(s, NULL, NULL);
+    if (dev_fd < 0)
+        panic("accept");
+    setsockopt(dev_fd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+    pthread_create(&reader, NULL, reader_thread, NULL);
+    pthread_create(&device, NULL, device_thread, NULL);
+
+    pthread_mutex_lock(&queue_lock);
+    while (online == 0)
+        pthread_cond_wait(&queue_cond, &queue_lock);
+    pthread_mutex_unlock(&queue_lock);
+    if (online < 0) {
+        fprintf(stderr, "the adb server hung up\n");
+        return 1;
+    }
+        /* the server only marks us online after its own A_CNXN handling */
+    usleep(100 * 1000);
+
+    sync_stream.out = malloc(SYNC_OUT_MAX);
+    if (sync_stream.out == NULL)
+        panic("malloc");
+
+    printf("version %08x, latency %g ms", version, latency * 1000);
+    if (bandwidth > 0)
+        printf(", %g MB/s", bandwidth / (1024 * 1024));
+    if (file) {
+        printf(", %s\n", file);
+        sync_benchmark(serial, file);
+    } else {
+        printf(", %lld MB each way\n", size >> 20);
+        t = transfer(serial, "source", size);
+        printf("device to host: %8.2f MB/s\n", size / t / (1024 * 1024));
+        t = transfer(serial, "sink", size);
+        printf("host to device: %8.2f MB/s\n", size / t / (1024 * 1024));
+    }
+
+    snprintf(request, sizeof(request), "host:disconnect:%s", serial);
+    c = server_connect();
+    server_request(c, request, 0);
+    close(c);
+    return 0;
+}
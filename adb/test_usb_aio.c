@@ -0,0 +1,572 @@
+/* a simple test program for usb_ffs_aio.c, the queued FunctionFS I/O of
+** adbd, against a stand-in endpoint backed by a pipe. build and run it
+** from this directory with:
+**
+**    cc -o test_usb_aio test_usb_aio.c usb_ffs_aio.c -lpthread
+**    ./test_usb_aio
+**
+** the stand-in replaces the kernel's AIO calls. a thread per context
+** works through the submitted transfers in order with plain read() and
+** write(), the way the controller would on the endpoint. when it runs out
+** of transfers, the next one waits a turnaround time, as the host only
+** polls an idle endpoint again after a while. the host sends packets over
+** a SOCK_SEQPACKET socket, and like the controller, the stand-in only ends
+** a read on a full buffer or a short packet. the program checks that data
+** gets through intact both ways, that a message of whole packets is not
+** held back waiting for a zero length packet, that usb_aio_stop() wakes a
+** blocked reader, and that errors come back; then it compares throughput
+** with one transfer queued against several.
+*/
+#include <pthread.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "usb_ffs_aio.h"
+
+#define MAX_QUEUED  256
+#define MAX_PACKET  512     /* high speed bulk */
+
+typedef struct standin standin;
+
+struct standin {
+    pthread_mutex_t  lock;
+    pthread_cond_t   cond;
+    pthread_t        thread;
+    struct iocb*     queue[MAX_QUEUED];
+    unsigned         queue_head, queue_tail;
+    struct io_event  done[MAX_QUEUED];
+    unsigned         done_head, done_tail;
+    unsigned         max_queued;
+    int              dead;
+    int              wake[2];   /* interrupts a transfer when destroyed */
+};
+
+static unsigned  turnaround_us;
+static int       failures;
+
+static double
+now( void )
+{
+    struct timeval  tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static void
+check( int  ok, const char*  what )
+{
+    printf("%s: %s\n", ok ? "PASS" : "FAIL", what);
+    if (!ok)
+        failures++;
+}
+
+/* the stand-in endpoint */
+
+static long long
+standin_transfer( standin*  s, struct iocb*  iocb )
+{
+    struct pollfd  fds[2];
+    char*          buf = (char*)(uintptr_t) iocb->aio_buf;
+    unsigned       done = 0;
+    int            reading = iocb->aio_lio_opcode == IOCB_CMD_PREAD;
+
+    fds[0].fd = iocb->aio_fildes;
+    fds[0].events = reading ? POLLIN : POLLOUT;
+    fds[1].fd = s->wake[0];
+    fds[1].events = POLLIN;
+
+    do {
+        char  packet[MAX_PACKET];
+        int   r;
+
+        fds[0].revents = fds[1].revents = 0;
+        if (poll(fds, 2, -1) < 0)
+            return -errno;
+        if (fds[1].revents)
+            return -ECANCELED;
+
+        if (!reading) {
+            r = write(iocb->aio_fildes, buf + done, iocb->aio_nbytes - done);
+            if (r < 0)
+                return -errno;
+            done += r;
+            continue;
+        }
+
+            /* one packet at a time; a read ends on a full buffer or a
+            ** short packet, never on a pause in what the host sends */
+        r = read(iocb->aio_fildes, packet, sizeof(packet));
+        if (r < 0)
+            return -errno;
+            /* a closed socket ends like an unbound endpoint */
+        if (r == 0)
+            return -ESHUTDOWN;
+        if ((unsigned) r > iocb->aio_nbytes - done)
+            return -EOVERFLOW;
+        memcpy(buf + done, packet, r);
+        done += r;
+        if (r < MAX_PACKET)
+            break;
+    } while (done < iocb->aio_nbytes);
+    return done;
+}
+
+static void*
+standin_thread( void*  arg )
+{
+    standin*  s = arg;
+
+    pthread_mutex_lock(&s->lock);
+    for (;;) {
+        struct iocb*     iocb;
+        struct io_event  ev;
+        int              idle = 0;
+
+        while (s->queue_head == s->queue_tail && !s->dead) {
+            idle = 1;
+            pthread_cond_wait(&s->cond, &s->lock);
+        }
+        if (s->dead)
+            break;
+        iocb = s->queue[s->queue_head++ % MAX_QUEUED];
+        pthread_mutex_unlock(&s->lock);
+
+        if (idle && turnaround_us)
+            usleep(turnaround_us);
+        memset(&ev, 0, sizeof(ev));
+        ev.data = iocb->aio_data;
+        ev.obj = (uintptr_t) iocb;
+        ev.res = standin_transfer(s, iocb);
+
+        pthread_mutex_lock(&s->lock);
+        s->done[s->done_tail++ % MAX_QUEUED] = ev;
+        pthread_cond_broadcast(&s->cond);
+    }
+    pthread_mutex_unlock(&s->lock);
+    return NULL;
+}
+
+static int
+standin_setup( unsigned  nr, aio_context_t*  ctx )
+{
+    standin*  s = calloc(1, sizeof(*s));
+
+    if (s == NULL || nr > MAX_QUEUED || pipe(s->wake) < 0) {
+        free(s);
+        errno = EINVAL;
+        return -1;
+    }
+    pthread_mutex_init(&s->lock, NULL);
+    pthread_cond_init(&s->cond, NULL);
+    pthread_create(&s->thread, NULL, standin_thread, s);
+    *ctx = (uintptr_t) s;
+    return 0;
+}
+
+/* like io_destroy(), waits for the transfer in progress; the standin is
+** never freed, since callers may still be waking up in getevents */
+static int
+standin_destroy( aio_context_t  ctx )
+{
+    standin*  s = (standin*)(uintptr_t) ctx;
+
+    pthread_mutex_lock(&s->lock);
+    s->dead = 1;
+    pthread_cond_broadcast(&s->cond);
+    pthread_mutex_unlock(&s->lock);
+    write(s->wake[1], "", 1);
+    pthread_join(s->thread, NULL);
+    return 0;
+}
+
+static int
+standin_submit( aio_context_t  ctx, long  nr, struct iocb**  iocbs )
+{
+    standin*  s = (standin*)(uintptr_t) ctx;
+    long      i;
+
+    if (s == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+    pthread_mutex_lock(&s->lock);
+    if (s->dead || s->queue_tail - s->queue_head + nr > MAX_QUEUED) {
+        pthread_mutex_unlock(&s->lock);
+        errno = s->dead ? EINVAL : EAGAIN;
+        return -1;
+    }
+    for (i = 0; i < nr; i++)
+        s->queue[s->queue_tail++ % MAX_QUEUED] = iocbs[i];
+    if (s->queue_tail - s->queue_head > s->max_queued)
+        s->max_queued = s->queue_tail - s->queue_head;
+    pthread_cond_broadcast(&s->cond);
+    pthread_mutex_unlock(&s->lock);
+    return nr;
+}
+
+static int
+standin_getevents( aio_context_t  ctx, long  min_nr, long  nr,
+                   struct io_event*  events )
+{
+    standin*  s = (standin*)(uintptr_t) ctx;
+    long      n = 0;
+
+    if (s == NULL) {
+        errno = EINVAL;
+        return -1;
+    }
+    pthread_mutex_lock(&s->lock);
+    while ((long)(s->done_tail - s->done_head) < min_nr && !s->dead)
+        pthread_cond_wait(&s->cond, &s->lock);
+    if (s->dead) {
+        pthread_mutex_unlock(&s->lock);
+        errno = EINVAL;
+        return -1;
+    }
+    while (n < nr && s->done_head != s->done_tail)
+        events[n++] = s->done[s->done_head++ % MAX_QUEUED];
+    pthread_mutex_unlock(&s->lock);
+    return n;
+}
+
+static const struct usb_aio_ops  standin_ops = {
+    .setup     = standin_setup,
+    .destroy   = standin_destroy,
+    .submit    = standin_submit,
+    .getevents = standin_getevents,
+};
+
+/* the far side of the pipes */
+
+static unsigned char
+pattern( unsigned long long  offset )
+{
+    return (offset * 2654435761U) >> 13;
+}
+
+typedef struct {
+    int                 fd;
+    unsigned long long  total;
+    unsigned            chunk;      /* most bytes per read() or write() */
+    int                 ok;
+} peer;
+
+/* plays the host taking what the endpoint writes */
+static void*
+host_reader( void*  arg )
+{
+    static unsigned char  buf[64 * 1024];
+    peer*               p = arg;
+    unsigned long long  offset = 0;
+
+    p->ok = 1;
+    while (offset < p->total) {
+        int  n = read(p->fd, buf, p->chunk), i;
+        if (n <= 0)
+            break;
+        for (i = 0; i < n; i++)
+            if (buf[i] != pattern(offset + i))
+                p->ok = 0;
+        offset += n;
+    }
+    if (offset != p->total)
+        p->ok = 0;
+    return NULL;
+}
+
+/* sends one transfer the way the Linux host does, in packets, with no
+** zero length packet after a transfer of whole packets */
+static int
+host_transfer( int  fd, const unsigned char*  data, unsigned  len )
+{
+    do {
+        unsigned  n = len < MAX_PACKET ? len : MAX_PACKET;
+        if (write(fd, data, n) != (int) n)
+            return -1;
+        data += n;
+        len -= n;
+    } while (len > 0);
+    return 0;
+}
+
+/* plays the host sending adb messages to the endpoint, a header transfer
+** then a payload transfer each, the payload sizes taken from lens */
+static int*  host_lens;
+
+static void*
+host_writer( void*  arg )
+{
+    static unsigned char  buf[24 + 70000];
+    peer*               p = arg;
+    unsigned long long  offset = 0;
+    int                 i = 0;
+
+    p->ok = 1;
+    while (offset < p->total) {
+        unsigned  n = 24 + host_lens[i++], j;
+        for (j = 0; j < n; j++)
+            buf[j] = pattern(offset + j);
+        if (host_transfer(p->fd, buf, 24) ||
+            (n > 24 && host_transfer(p->fd, buf + 24, n - 24))) {
+            p->ok = 0;
+            break;
+        }
+        offset += n;
+    }
+    return NULL;
+}
+
+/* the tests */
+
+static void
+test_write( void )
+{
+    static unsigned char  buf[70000];
+    struct usb_aio        aio;
+    unsigned long long    offset = 0;
+    pthread_t             t;
+    peer                  p;
+    int                   fds[2], i, ok = 1;
+
+    pipe(fds);
+    p.fd = fds[0];
+    p.total = 0;
+    p.chunk = 4096;
+    srand(1);
+    for (i = 0; i < 2000; i++)
+        p.total += rand() % 70000;
+
+    usb_aio_init(&aio, &standin_ops, 8, 16384);
+    ok = usb_aio_start(&aio, fds[1], 0) == 0;
+    pthread_create(&t, NULL, host_reader, &p);
+
+    srand(1);
+    for (i = 0; i < 2000 && ok; i++) {
+        int  len = rand() % 70000, j;
+        for (j = 0; j < len; j++)
+            buf[j] = pattern(offset + j);
+        ok = usb_aio_write(&aio, buf, len) == 0;
+        offset += len;
+    }
+    pthread_join(t, NULL);
+    check(ok && p.ok, "writes arrive intact and in order");
+    check(((standin*)(uintptr_t) aio.ctx)->max_queued > 1,
+          "writes are queued several at a time");
+
+    close(fds[0]);
+    for (i = 0; i < 100 && ok; i++)
+        ok = usb_aio_write(&aio, buf, sizeof(buf)) == 0;
+    check(!ok && errno == EPIPE, "a failed write is reported");
+
+    usb_aio_stop(&aio);
+    close(fds[1]);
+}
+
+static void
+test_read( void )
+{
+    static unsigned char  buf[70000];
+    static int            lens[2000];
+    struct usb_aio        aio;
+    unsigned long long    offset = 0;
+    pthread_t             t;
+    peer                  p;
+    int                   fds[2], i, ok;
+
+    socketpair(AF_UNIX, SOCK_SEQPACKET, 0, fds);
+    p.fd = fds[1];
+    p.total = 0;
+    srand(2);
+    for (i = 0; i < 2000; i++) {
+            /* many of them whole packets, a 4096 byte WRTE among them */
+        lens[i] = rand() % 70000;
+        if (i % 3 == 0)
+            lens[i] &= ~(MAX_PACKET - 1);
+        if (i % 7 == 0)
+            lens[i] = 4096;
+        p.total += 24 + lens[i];
+    }
+    host_lens = lens;
+
+    usb_aio_init(&aio, &standin_ops, 8, 16384);
+    ok = usb_aio_start(&aio, fds[0], 1) == 0 &&
+         usb_aio_prime(&aio, 24) == 0;
+    pthread_create(&t, NULL, host_writer, &p);
+
+        /* read it back the way adbd does, header then payload */
+    for (i = 0; i < 2000 && ok; i++) {
+        int  len = lens[i], j;
+        ok = usb_aio_read(&aio, buf, 24) == 0 &&
+             usb_aio_read(&aio, buf + 24, len) == 0;
+        for (j = 0; ok && j < 24 + len; j++)
+            ok = buf[j] == pattern(offset + j);
+        offset += 24 + len;
+    }
+    pthread_join(t, NULL);
+    check(ok && p.ok, "reads come back intact and in order");
+    check(((standin*)(uintptr_t) aio.ctx)->max_queued > 1,
+          "a large read is queued several transfers at a time");
+
+    close(fds[1]);
+    check(usb_aio_read(&aio, buf, 1) < 0, "a failed read is reported");
+
+    usb_aio_stop(&aio);
+    close(fds[0]);
+}
+
+typedef struct {
+    struct usb_aio*  aio;
+    int              len;
+    volatile int     done;
+    int              ok;
+} exchange;
+
+/* reads one message, as adbd does before it answers with an OKAY */
+static void*
+message_reader( void*  arg )
+{
+    static unsigned char  buf[24 + 65536];
+    exchange*           x = arg;
+
+    x->ok = usb_aio_read(x->aio, buf, 24) == 0 &&
+            usb_aio_read(x->aio, buf + 24, x->len) == 0;
+    x->done = 1;
+    return NULL;
+}
+
+static void
+test_stop_and_wait( void )
+{
+    static const int      lens[] = { 4096, 512, 16384, 65536, 1000, 4096 };
+    static unsigned char  buf[24 + 65536];
+    struct usb_aio        aio;
+    exchange              x;
+    pthread_t             t;
+    int                   fds[2], i, ok = 1;
+
+    socketpair(AF_UNIX, SOCK_SEQPACKET, 0, fds);
+    usb_aio_init(&aio, &standin_ops, 8, 16384);
+    usb_aio_start(&aio, fds[0], 1);
+    usb_aio_prime(&aio, 24);
+    x.aio = &aio;
+
+        /* the host sends one message, then waits for the answer */
+    for (i = 0; i < (int)(sizeof(lens) / sizeof(lens[0])) && ok; i++) {
+        int  ms;
+
+        x.len = lens[i];
+        x.done = 0;
+        pthread_create(&t, NULL, message_reader, &x);
+        host_transfer(fds[1], buf, 24);
+        host_transfer(fds[1], buf + 24, lens[i]);
+        for (ms = 0; ms < 2000 && !x.done; ms++)
+            usleep(1000);
+        if (!x.done)
+            usb_aio_stop(&aio);
+        pthread_join(t, NULL);
+        ok = x.done && x.ok;
+    }
+    check(ok, "a message of whole packets is read without a zero length packet");
+
+    usb_aio_stop(&aio);
+    close(fds[0]);
+    close(fds[1]);
+}
+
+static void*
+blocked_reader( void*  arg )
+{
+    char  c;
+    return (void*)(intptr_t) usb_aio_read(arg, &c, 1);
+}
+
+static void
+test_stop( void )
+{
+    struct usb_aio  aio;
+    pthread_t       t;
+    void*           ret;
+    char            c = 0;
+    int             fds[2];
+
+    socketpair(AF_UNIX, SOCK_SEQPACKET, 0, fds);
+    usb_aio_init(&aio, &standin_ops, 4, 512);
+    usb_aio_start(&aio, fds[0], 1);
+    pthread_create(&t, NULL, blocked_reader, &aio);
+    usleep(100 * 1000);
+    usb_aio_stop(&aio);
+    pthread_join(t, &ret);
+    check((intptr_t) ret < 0, "stopping wakes a blocked read");
+    check(usb_aio_read(&aio, &c, 1) < 0, "reads fail until restarted");
+    close(fds[0]);
+    close(fds[1]);
+
+        /* the pool is reused for the next connection */
+    socketpair(AF_UNIX, SOCK_SEQPACKET, 0, fds);
+    write(fds[1], "x", 1);
+    check(usb_aio_start(&aio, fds[0], 1) == 0 &&
+          usb_aio_read(&aio, &c, 1) == 0 && c == 'x',
+          "reads work again after a restart");
+    usb_aio_stop(&aio);
+    close(fds[0]);
+    close(fds[1]);
+}
+
+static double
+measure_write( unsigned  count, unsigned  size, long long  total )
+{
+    static unsigned char  buf[64 * 1024];
+    struct usb_aio        aio;
+    pthread_t             t;
+    peer                  p;
+    long long             i;
+    double                start;
+    int                   fds[2];
+
+    pipe(fds);
+    p.fd = fds[0];
+    p.total = total;
+    p.chunk = sizeof(buf);
+    for (i = 0; i < (long long) sizeof(buf); i++)
+        buf[i] = pattern(i);
+
+    usb_aio_init(&aio, &standin_ops, count, size);
+    usb_aio_start(&aio, fds[1], 0);
+    pthread_create(&t, NULL, host_reader, &p);
+
+    start = now();
+    for (i = 0; i < total; i += sizeof(buf))
+        usb_aio_write(&aio, buf, sizeof(buf));
+    pthread_join(t, NULL);
+
+    usb_aio_stop(&aio);
+    close(fds[0]);
+    close(fds[1]);
+    return total / (now() - start) / (1024 * 1024);
+}
+
+int  main( int  argc, char**  argv )
+{
+    signal(SIGPIPE, SIG_IGN);
+
+    test_write();
+    test_read();
+    test_stop_and_wait();
+    test_stop();
+
+    turnaround_us = 125;
+    printf("writes of 16 KB, %u us to come back to an idle endpoint:\n", turnaround_us);
+    printf(" 1 queued: %8.2f MB/s\n", measure_write(1, 16384, 64 << 20));
+    printf(" 4 queued: %8.2f MB/s\n", measure_write(4, 16384, 64 << 20));
+    printf("16 queued: %8.2f MB/s\n", measure_write(16, 16384, 64 << 20));
+
+    return failures ? 1 : 0;
+}
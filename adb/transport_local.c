@@ -72,6 +72,7 @@ static int remote_read(apacket *p, atransport *t)
         D("bad header: terminated (data)\n");
         return -1;
     }
+    apacket_reserve(p, p->msg.data_length);
 
     if(readx(t->sfd, p->data, p->msg.data_length)){
         D("remote local: terminated (data)\n");
@@ -89,6 +90,7 @@ static int remote_read(apacket *p, atransport *t)
 static int remote_write(apacket *p, atransport *t)
 {
     int   length = p->msg.data_length;
+    char  buf[sizeof(amessage) + MAX_PAYLOAD_V1];
 
     fix_endians(p);
 
@@ -96,7 +98,19 @@ static int remote_write(apacket *p, atransport *t)
     D("write remote packet: %04x arg0=%0x arg1=%0x data_length=%0x data_check=%0x magic=%0x\n",
       p->msg.command, p->msg.arg0, p->msg.arg1, p->msg.data_length, p->msg.data_check, p->msg.magic);
 #endif
-    if(writex(t->sfd, &p->msg, sizeof(amessage) + length)) {
+        /* keep small packets to one segment, the copy is cheaper */
+    if(length <= MAX_PAYLOAD_V1) {
+        memcpy(buf, &p->msg, sizeof(amessage));
+        memcpy(buf + sizeof(amessage), p->data, length);
+        if(writex(t->sfd, buf, sizeof(amessage) + length)) {
+            D("remote local: write terminated\n");
+            return -1;
+        }
+        return 0;
+    }
+
+    if(writex(t->sfd, &p->msg, sizeof(amessage)) ||
+       writex(t->sfd, p->data, length)) {
         D("remote local: write terminated\n");
         return -1;
     }
@@ -409,6 +423,8 @@ int init_socket_transport(atransport *t, int s, int adb_port, int local)
     t->kick = remote_kick;
     t->close = remote_close;
     t->read_from_remote = remote_read;
+    t->protocol_version = A_VERSION_MIN;
+    t->max_payload = MAX_PAYLOAD_V1;
     t->write_to_remote = remote_write;
     t->sfd = s;
     t->sync_token = 1;
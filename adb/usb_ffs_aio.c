@@ -0,0 +1,288 @@
+/*
+ * Copyright (C) 2014 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/syscall.h>
+
+#include "usb_ffs_aio.h"
+
+/* the C library has no wrappers for these */
+
+static int linux_setup(unsigned nr, aio_context_t *ctx)
+{
+    return syscall(__NR_io_setup, nr, ctx);
+}
+
+static int linux_destroy(aio_context_t ctx)
+{
+    return syscall(__NR_io_destroy, ctx);
+}
+
+static int linux_submit(aio_context_t ctx, long nr, struct iocb **iocbs)
+{
+    return syscall(__NR_io_submit, ctx, nr, iocbs);
+}
+
+static int linux_getevents(aio_context_t ctx, long min_nr, long nr,
+                           struct io_event *events)
+{
+    return syscall(__NR_io_getevents, ctx, min_nr, nr, events, NULL);
+}
+
+const struct usb_aio_ops usb_aio_linux = {
+    .setup = linux_setup,
+    .destroy = linux_destroy,
+    .submit = linux_submit,
+    .getevents = linux_getevents,
+};
+
+int usb_aio_init(struct usb_aio *aio, const struct usb_aio_ops *ops,
+                 unsigned count, unsigned size)
+{
+    unsigned i;
+
+    memset(aio, 0, sizeof(*aio));
+    aio->ops = ops;
+    aio->fd = -1;
+    aio->count = count;
+    aio->size = size;
+    pthread_mutex_init(&aio->lock, NULL);
+
+    aio->pool = malloc((size_t) count * size);
+    aio->slots = calloc(count, sizeof(*aio->slots));
+    aio->events = calloc(count, sizeof(*aio->events));
+    if (aio->pool == NULL || aio->slots == NULL || aio->events == NULL) {
+        free(aio->pool);
+        free(aio->slots);
+        free(aio->events);
+        return -1;
+    }
+
+    for (i = 0; i < count; i++) {
+        aio->slots[i].buf = aio->pool + (size_t) i * size;
+    }
+    return 0;
+}
+
+static int submit(struct usb_aio *aio, unsigned i, unsigned len)
+{
+    struct usb_aio_slot *s = &aio->slots[i];
+    struct iocb *iocb = &s->iocb;
+
+    memset(iocb, 0, sizeof(*iocb));
+    iocb->aio_data = i;
+    iocb->aio_lio_opcode = aio->reading ? IOCB_CMD_PREAD : IOCB_CMD_PWRITE;
+    iocb->aio_fildes = aio->fd;
+    iocb->aio_buf = (uintptr_t) s->buf;
+    iocb->aio_nbytes = len;
+
+    if (aio->ops->submit(aio->ctx, 1, &iocb) != 1) {
+        return -1;
+    }
+    s->busy = 1;
+    return 0;
+}
+
+/* waits for at least one transfer to complete */
+static int reap(struct usb_aio *aio)
+{
+    int n, i;
+
+    do {
+        n = aio->ops->getevents(aio->ctx, 1, aio->count, aio->events);
+    } while (n < 0 && errno == EINTR);
+    if (n < 0) {
+        return -1;
+    }
+
+    for (i = 0; i < n; i++) {
+        struct usb_aio_slot *s = &aio->slots[aio->events[i].data];
+
+        s->busy = 0;
+        s->res = aio->events[i].res;
+        if (aio->reading) {
+                /* ended early on a short packet */
+            aio->ahead -= s->iocb.aio_nbytes - (s->res < 0 ? 0 : s->res);
+        } else if (s->res != (long long) s->iocb.aio_nbytes) {
+            aio->error = s->res < 0 ? -s->res : EIO;
+        }
+    }
+    return 0;
+}
+
+int usb_aio_start(struct usb_aio *aio, int fd, int reading)
+{
+    aio_context_t ctx = 0;
+    unsigned i;
+
+    pthread_mutex_lock(&aio->lock);
+
+    if (aio->ops->setup(aio->count, &ctx)) {
+        pthread_mutex_unlock(&aio->lock);
+        return -1;
+    }
+    aio->ctx = ctx;
+    aio->fd = fd;
+    aio->reading = reading;
+    aio->next = 0;
+    aio->pos = 0;
+    aio->queued = 0;
+    aio->ahead = 0;
+    aio->error = 0;
+    for (i = 0; i < aio->count; i++) {
+        aio->slots[i].busy = 0;
+        aio->slots[i].res = 0;
+    }
+
+    pthread_mutex_unlock(&aio->lock);
+    return 0;
+}
+
+int usb_aio_prime(struct usb_aio *aio, int len)
+{
+    int ret = -1;
+
+    pthread_mutex_lock(&aio->lock);
+    if (aio->ctx == 0 || !aio->reading || aio->queued ||
+            len <= 0 || len > (int) aio->size) {
+        errno = EINVAL;
+    } else if (submit(aio, aio->next, len) == 0) {
+        aio->queued = 1;
+        aio->ahead = len;
+        ret = 0;
+    }
+    pthread_mutex_unlock(&aio->lock);
+    return ret;
+}
+
+void usb_aio_stop(struct usb_aio *aio)
+{
+    aio_context_t ctx = aio->ctx;
+
+        /* not under the lock, which a blocked reader or writer holds;
+        ** destroying the context cancels what is in flight and wakes
+        ** them, and it fails all later calls until the next start
+        */
+    aio->ctx = 0;
+    if (ctx) {
+        aio->ops->destroy(ctx);
+    }
+}
+
+int usb_aio_read(struct usb_aio *aio, void *data, int len)
+{
+    char *p = data;
+
+    pthread_mutex_lock(&aio->lock);
+    while (len > 0) {
+        struct usb_aio_slot *s = &aio->slots[aio->next];
+        unsigned xfer;
+
+        if (aio->ctx == 0) {
+            errno = EIO;
+            goto fail;
+        }
+            /* queue what is still missing, and no more */
+        while (aio->ahead < (unsigned) len && aio->queued < aio->count) {
+            unsigned want = len - aio->ahead;
+            if (want > aio->size) {
+                want = aio->size;
+            }
+            if (submit(aio, (aio->next + aio->queued) % aio->count, want)) {
+                goto fail;
+            }
+            aio->queued++;
+            aio->ahead += want;
+        }
+        if (s->busy) {
+            if (reap(aio)) goto fail;
+            continue;
+        }
+        if (s->res < 0) {
+            errno = -s->res;
+            goto fail;
+        }
+
+        xfer = s->res - aio->pos;
+        if (xfer > (unsigned) len) {
+            xfer = len;
+        }
+        memcpy(p, s->buf + aio->pos, xfer);
+        aio->pos += xfer;
+        aio->ahead -= xfer;
+        p += xfer;
+        len -= xfer;
+
+            /* a drained buffer, or a zero length packet, frees the slot */
+        if (aio->pos == s->res) {
+            aio->next = (aio->next + 1) % aio->count;
+            aio->pos = 0;
+            aio->queued--;
+        }
+    }
+    pthread_mutex_unlock(&aio->lock);
+    return 0;
+
+fail:
+    pthread_mutex_unlock(&aio->lock);
+    return -1;
+}
+
+int usb_aio_write(struct usb_aio *aio, const void *data, int len)
+{
+    const char *p = data;
+
+    pthread_mutex_lock(&aio->lock);
+    while (len > 0) {
+        struct usb_aio_slot *s = &aio->slots[aio->next];
+        unsigned xfer;
+
+        if (aio->ctx == 0) {
+            errno = EIO;
+            goto fail;
+        }
+            /* completions come in order, so the next slot is the oldest */
+        if (s->busy) {
+            if (reap(aio)) goto fail;
+            continue;
+        }
+        if (aio->error) {
+            errno = aio->error;
+            goto fail;
+        }
+
+        xfer = len > (int) aio->size ? aio->size : (unsigned) len;
+        memcpy(s->buf, p, xfer);
+        if (submit(aio, aio->next, xfer)) goto fail;
+        aio->next = (aio->next + 1) % aio->count;
+        p += xfer;
+        len -= xfer;
+    }
+    if (aio->error) {
+        errno = aio->error;
+        goto fail;
+    }
+    pthread_mutex_unlock(&aio->lock);
+    return 0;
+
+fail:
+    pthread_mutex_unlock(&aio->lock);
+    return -1;
+}
@@ -0,0 +1,104 @@
+/*
+ * Copyright (C) 2014 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef __USB_FFS_AIO_H
+#define __USB_FFS_AIO_H
+
+#include <pthread.h>
+#include <linux/aio_abi.h>
+
+/* Keeps several transfers queued on a FunctionFS bulk endpoint with Linux
+** AIO, so that the controller always has the next one at hand. Each
+** direction of an endpoint pair gets its own usb_aio.
+**
+** Reads are only submitted for what the caller asks for, split over
+** buffers from the pool. A bulk out transfer ends when its buffer fills
+** or on a short packet, and the host sends no zero length packets, so a
+** read queued past the end of a message could wait for the next one.
+** Writes are copied into the pool and queued, and usb_aio_write() only
+** waits when all of them are in flight. A failed write is reported by
+** the next call.
+*/
+
+/* the kernel calls, so that a test can stand in for an endpoint;
+** they return -1 and set errno on failure, like the system calls
+*/
+struct usb_aio_ops {
+    int (*setup)(unsigned nr, aio_context_t *ctx);
+    int (*destroy)(aio_context_t ctx);
+    int (*submit)(aio_context_t ctx, long nr, struct iocb **iocbs);
+    int (*getevents)(aio_context_t ctx, long min_nr, long nr,
+                     struct io_event *events);
+};
+
+extern const struct usb_aio_ops usb_aio_linux;
+
+struct usb_aio_slot {
+    struct iocb iocb;
+    char *buf;
+    int busy;
+    long long res;
+};
+
+struct usb_aio {
+    const struct usb_aio_ops *ops;
+    pthread_mutex_t lock;
+    aio_context_t ctx;
+    int fd;
+    int reading;
+
+    unsigned count;     /* transfers kept in flight */
+    unsigned size;      /* bytes per transfer */
+    char *pool;         /* count buffers of size bytes, reused throughout */
+    struct usb_aio_slot *slots;
+    struct io_event *events;
+
+    unsigned next;      /* the slot to fill (writes) or drain (reads) next */
+    unsigned pos;       /* bytes of a read slot already handed out */
+    unsigned queued;    /* read slots submitted and not yet drained */
+    unsigned ahead;     /* bytes those may still hand out */
+    int error;          /* errno of a failed write, not yet reported */
+};
+
+/* Sets up the buffer pool, once for the life of the endpoint pair.
+** Returns -1 if it cannot be allocated.
+*/
+int usb_aio_init(struct usb_aio *aio, const struct usb_aio_ops *ops,
+                 unsigned count, unsigned size);
+
+/* Starts I/O on a freshly opened endpoint; reading is set for bulk-out.
+** Returns -1, with errno set, if the endpoint can't do AIO.
+*/
+int usb_aio_start(struct usb_aio *aio, int fd, int reading);
+
+/* Queues a read of the len bytes the caller will ask for first, so that
+** an endpoint that can't do AIO fails here rather than in usb_aio_read().
+** Returns -1, with errno set, on failure.
+*/
+int usb_aio_prime(struct usb_aio *aio, int len);
+
+/* Cancels everything in flight. Callers blocked in usb_aio_read() or
+** usb_aio_write() return -1, as do any later calls until the next start.
+*/
+void usb_aio_stop(struct usb_aio *aio);
+
+/* Both return 0 once len bytes are read, or queued to be written, and -1
+** on failure.
+*/
+int usb_aio_read(struct usb_aio *aio, void *data, int len);
+int usb_aio_write(struct usb_aio *aio, const void *data, int len);
+
+#endif
@@ -37,6 +37,9 @@
 #define   TRACE_TAG  TRACE_USB
 #include "adb.h"
 
+/* the largest bulk urb usbfs takes on older kernels */
+#define MAX_USBFS_BULK_SIZE (16 * 1024)
+
 static adb_mutex_t usb_lock = ADB_MUTEX_INITIALIZER;
 static libusb_context *ctx = NULL;
 
@@ -148,7 +151,7 @@ usb_write(struct usb_handle *uh, const void *_data, int len)
     D("usb_write(): %p:%d -> transport %p\n", _data, len, uh);
     
     while (len > 0) {
-        int xfer = (len > 4096) ? 4096 : len;
+        int xfer = (len > MAX_USBFS_BULK_SIZE) ? MAX_USBFS_BULK_SIZE : len;
 
         n = usb_bulk_write(uh, data, xfer);
         
@@ -182,7 +185,7 @@ usb_read(struct usb_handle *uh, void *_data, int len)
     D("usb_read(): %p:%d <- transport %p\n", _data, len, uh);
     
     while (len > 0) {
-        int xfer = (len > 4096) ? 4096 : len;
+        int xfer = (len > MAX_USBFS_BULK_SIZE) ? MAX_USBFS_BULK_SIZE : len;
 
         n = usb_bulk_read(uh, data, xfer);
         
@@ -26,14 +26,24 @@
 #include <dirent.h>
 #include <errno.h>
 
+#include <cutils/properties.h>
+
 #include "sysdeps.h"
 
 #define   TRACE_TAG  TRACE_USB
 #include "adb.h"
+#include "usb_ffs_aio.h"
 
 #define MAX_PACKET_SIZE_FS	64
 #define MAX_PACKET_SIZE_HS	512
 
+/* transfers FunctionFS keeps queued in each direction, and their size;
+** persist.adb.ffs.aio_count and persist.adb.ffs.aio_size override these,
+** and a count of 0 means blocking reads and writes
+*/
+#define FFS_AIO_COUNT   16
+#define FFS_AIO_SIZE    (16 * 1024)
+
 #define cpu_to_le16(x)  htole16(x)
 #define cpu_to_le32(x)  htole32(x)
 
@@ -53,6 +63,11 @@ struct usb_handle
     int control;
     int bulk_out; /* "out" from the host's perspective => source for adbd */
     int bulk_in;  /* "in" from the host's perspective => sink for adbd */
+
+    // FunctionFS with AIO
+    int use_aio;
+    struct usb_aio bulk_out_aio;
+    struct usb_aio bulk_in_aio;
 };
 
 static const struct {
@@ -200,14 +215,21 @@ static int usb_adb_write(usb_handle *h, const void *data, int len)
 
 static int usb_adb_read(usb_handle *h, void *data, int len)
 {
-    int n;
+    char *buf = data;
+    int n, xfer;
 
     D("about to read (fd=%d, len=%d)\n", h->fd, len);
-    n = adb_read(h->fd, data, len);
-    if(n != len) {
-        D("ERROR: fd = %d, n = %d, errno = %d (%s)\n",
-            h->fd, n, errno, strerror(errno));
-        return -1;
+        /* the f_adb driver takes reads of no more than 4096 bytes */
+    while(len > 0) {
+        xfer = (len > 4096) ? 4096 : len;
+        n = adb_read(h->fd, buf, xfer);
+        if(n != xfer) {
+            D("ERROR: fd = %d, n = %d, errno = %d (%s)\n",
+                h->fd, n, errno, strerror(errno));
+            return -1;
+        }
+        buf += xfer;
+        len -= xfer;
     }
     D("[ done fd=%d ]\n", h->fd);
     return 0;
@@ -315,6 +337,9 @@ err:
     return;
 }
 
+static int usb_ffs_write(usb_handle *h, const void *data, int len);
+static int usb_ffs_read(usb_handle *h, void *data, int len);
+
 static void *usb_ffs_open_thread(void *x)
 {
     struct usb_handle *usb = (struct usb_handle *)x;
@@ -335,6 +360,20 @@ static void *usb_ffs_open_thread(void *x)
             adb_sleep_ms(1000);
         }
 
+        if (usb->use_aio) {
+                // the first thing read is a message header
+            if (usb_aio_start(&usb->bulk_out_aio, usb->bulk_out, 1) ||
+                usb_aio_prime(&usb->bulk_out_aio, sizeof(amessage)) ||
+                usb_aio_start(&usb->bulk_in_aio, usb->bulk_in, 0)) {
+                    // kernels before 3.15 have no AIO on FunctionFS
+                D("[ usb_thread - no AIO on FunctionFS (%d), using blocking I/O ]\n", errno);
+                usb_aio_stop(&usb->bulk_out_aio);
+                usb->use_aio = 0;
+                usb->write = usb_ffs_write;
+                usb->read = usb_ffs_read;
+            }
+        }
+
         D("[ usb_thread - registering device ]\n");
         register_usb_transport(usb, 0, 0, 1);
     }
@@ -413,6 +452,29 @@ static int usb_ffs_read(usb_handle *h, void *data, int len)
     return 0;
 }
 
+static int usb_ffs_aio_write(usb_handle *h, const void *data, int len)
+{
+    D("about to queue write (fd=%d, len=%d)\n", h->bulk_in, len);
+    if (usb_aio_write(&h->bulk_in_aio, data, len)) {
+        D("ERROR: fd = %d, errno = %d (%s)\n",
+            h->bulk_in, errno, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+static int usb_ffs_aio_read(usb_handle *h, void *data, int len)
+{
+    D("about to read (fd=%d, len=%d)\n", h->bulk_out, len);
+    if (usb_aio_read(&h->bulk_out_aio, data, len)) {
+        D("ERROR: fd = %d, errno = %d (%s)\n",
+            h->bulk_out, errno, strerror(errno));
+        return -1;
+    }
+    D("[ done fd=%d ]\n", h->bulk_out);
+    return 0;
+}
+
 static void usb_ffs_kick(usb_handle *h)
 {
     int err;
@@ -425,6 +487,11 @@ static void usb_ffs_kick(usb_handle *h)
     if (err < 0)
         D("[ kick: sink (fd=%d) clear halt failed (%d) ]", h->bulk_out, errno);
 
+    if (h->use_aio) {
+        usb_aio_stop(&h->bulk_out_aio);
+        usb_aio_stop(&h->bulk_in_aio);
+    }
+
     adb_mutex_lock(&h->lock);
 
     // don't close ep0 here, since we may not need to reinitialize it with
@@ -443,6 +510,8 @@ static void usb_ffs_init()
 {
     usb_handle *h;
     adb_thread_t tid;
+    char value[PROPERTY_VALUE_MAX];
+    unsigned count, size;
 
     D("[ usb_init - using FunctionFS ]\n");
 
@@ -454,7 +523,26 @@ static void usb_ffs_init()
 
     h->control  = -1;
     h->bulk_out = -1;
-    h->bulk_out = -1;
+    h->bulk_in  = -1;
+
+    property_get("persist.adb.ffs.aio_count", value, "");
+    count = value[0] ? strtoul(value, NULL, 0) : FFS_AIO_COUNT;
+    property_get("persist.adb.ffs.aio_size", value, "");
+    size = value[0] ? strtoul(value, NULL, 0) : FFS_AIO_SIZE;
+
+        // a read that fills its buffer must end on a packet boundary
+    size = (size + MAX_PACKET_SIZE_HS - 1) & ~(MAX_PACKET_SIZE_HS - 1);
+    if (size == 0 || size > MAX_PAYLOAD)
+        size = FFS_AIO_SIZE;
+
+    if (count > 0 &&
+        usb_aio_init(&h->bulk_out_aio, &usb_aio_linux, count, size) == 0 &&
+        usb_aio_init(&h->bulk_in_aio, &usb_aio_linux, count, size) == 0) {
+        D("[ usb_init - %u transfers of %u bytes queued each way ]\n", count, size);
+        h->use_aio = 1;
+        h->write = usb_ffs_aio_write;
+        h->read = usb_ffs_aio_read;
+    }
 
     adb_cond_init(&h->notify, 0);
     adb_mutex_init(&h->lock, 0);
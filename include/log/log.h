@@ -567,6 +567,27 @@ int __android_log_buf_print(int bufID, int prio, const char *tag, const char *fm
 #endif
     ;
 
+/*
+ * Opt in to batched writes for this process. Messages are queued without
+ * a lock or a syscall, and a background thread sends them to logd in
+ * batches at most max_delay_ms later. LOG_ID_CRASH and fatal messages,
+ * fatal signals and exit() flush the queue first. Messages that find the
+ * queue full are dropped, and the number dropped is logged by the next
+ * batch. A max_delay_ms of 0 turns batching off again. Returns 0, or a
+ * negative errno, -ENOSYS where there is no logd.
+ */
+int __android_log_set_batching(unsigned int max_delay_ms);
+
+/*
+ * Send any batched messages to logd now. Returns 0, or a negative errno.
+ */
+int __android_log_flush(void);
+
+/*
+ * Messages dropped so far because the batching queue was full.
+ */
+unsigned long __android_log_dropped(void);
+
 #ifdef __cplusplus
 }
 #endif
@@ -8,6 +8,8 @@
 #include <sys/types.h>
 #include <sys/uio.h>
 
+struct mmsghdr;
+
 class SocketClient {
     int             mSocket;
     bool            mSocketOwned;
@@ -62,6 +64,9 @@ public:
     int sendData(const void *data, int len);
     // iovec contents not preserved through call
     int sendDatav(struct iovec *iov, int iovcnt);
+    // Send vlen messages as separate packets with as few sendmmsg() calls
+    // as possible, for SOCK_SEQPACKET and SOCK_DGRAM sockets.
+    int sendDatamv(struct mmsghdr *msgs, unsigned int vlen);
 
     // Optional reference counting.  Reference count starts at 1.  If
     // it's decremented to 0, it deletes itself.
@@ -20,6 +20,7 @@
 #ifndef LIBZIPARCHIVE_ZIPARCHIVE_H_
 #define LIBZIPARCHIVE_ZIPARCHIVE_H_
 
+#include <stdbool.h>
 #include <stdint.h>
 #include <sys/types.h>
 #include <utils/Compat.h>
@@ -102,6 +103,19 @@ int32_t OpenArchive(const char* fileName, ZipArchiveHandle* handle);
 int32_t OpenArchiveFd(const int fd, const char* debugFileName,
                       ZipArchiveHandle *handle);
 
+/*
+ * Like OpenArchive, but keeps an index of the archive in |indexFileName|,
+ * typically next to it or in a cache directory. If the file holds the index
+ * of the archive as it is, it stands in for parsing the central directory,
+ * which saves most of the time taken to open an archive with many entries.
+ * Otherwise, the archive is opened as usual and its index written to the
+ * file for next time; failing to write it is not an error.
+ *
+ * Returns 0 on success, and negative values on failure.
+ */
+int32_t OpenArchiveWithIndex(const char* fileName, const char* indexFileName,
+                             ZipArchiveHandle* handle);
+
 /*
  * Close archive, releasing resources associated with it. This will
  * unmap the central directory of the zipfile and free all internal
@@ -136,7 +150,8 @@ int32_t FindEntry(const ZipArchiveHandle handle, const char* entryName,
  * Next.
  *
  * This method also accepts an optional prefix to restrict iteration to
- * entry names that start with |prefix|.
+ * entry names that start with |prefix|. Those are then visited in order of
+ * their names, without looking at any of the other entries.
  *
  * Returns 0 on success and negative values on failure.
  */
@@ -172,6 +187,129 @@ int32_t ExtractEntryToFile(ZipArchiveHandle handle, ZipEntry* entry, int fd);
 int32_t ExtractToMemory(ZipArchiveHandle handle, ZipEntry* entry,
                         uint8_t* begin, uint32_t size);
 
+/*
+ * A read-only view of the data of a stored entry, straight from the
+ * archive, as set up by MapStoredEntry.
+ */
+struct ZipEntryMapping {
+  const uint8_t* data;
+  uint32_t length;
+
+  // The underlying android::FileMap, NULL for an empty entry.
+  void* map;
+};
+
+/*
+ * Map the data of |entry|, which must be stored rather than compressed,
+ * read-only into memory. |entry| must come from FindEntry or Next, which
+ * check it against the local file header, and the data is checked to lie
+ * within the archive before the central directory.
+ *
+ * The data is not copied or checked against the crc32 of the entry. The
+ * mapping must be released with UnmapStoredEntry, and may outlive the
+ * handle.
+ *
+ * Returns 0 on success and negative values on failure.
+ */
+int32_t MapStoredEntry(ZipArchiveHandle handle, const ZipEntry* entry,
+                       ZipEntryMapping* mapping);
+
+void UnmapStoredEntry(ZipEntryMapping* mapping);
+
+/*
+ * Called by ProcessZipEntryContents with each chunk of the uncompressed
+ * data in turn. Returns false to stop early.
+ */
+typedef bool (*ProcessZipEntryFunction)(const uint8_t* buf, size_t buf_size,
+                                        void* cookie);
+
+/*
+ * Stream the uncompressed data of |entry| through |func|, a chunk at a time,
+ * without ever holding all of it in memory. The data is checked against the
+ * crc32 and uncompressed length of the entry once all of it has been
+ * handed over.
+ *
+ * Returns 0 on success and negative values on failure.
+ */
+int32_t ProcessZipEntryContents(ZipArchiveHandle handle, ZipEntry* entry,
+                                ProcessZipEntryFunction func, void* cookie);
+
+/*
+ * One entry to extract with ExtractEntriesToFiles.
+ */
+struct ZipExtractRequest {
+  // The entry, as returned by FindEntry or Next.
+  ZipEntry entry;
+
+  // The file to extract it to, as with ExtractEntryToFile.
+  int fd;
+
+  // Set to 0 if the entry was extracted, or a negative value on failure.
+  int32_t result;
+};
+
+/*
+ * Totals over one call to ExtractEntriesToFiles or ExtractPrefixToFiles.
+ */
+struct ZipExtractStats {
+  // Number of entries extracted, and that failed.
+  uint32_t extracted;
+  uint32_t failed;
+
+  // Bytes read from the archive and written out for the entries extracted.
+  uint64_t compressed_bytes;
+  uint64_t uncompressed_bytes;
+
+  // Wall clock time taken, in nanoseconds, and the number of threads used.
+  int64_t elapsed_ns;
+  uint32_t num_threads;
+};
+
+/*
+ * Extract |count| entries, each to its own file as ExtractEntryToFile does,
+ * on up to |num_threads| threads reading the archive concurrently. Pass 0
+ * for |num_threads| to use one per CPU. The calling thread takes part, and
+ * returns once all are done.
+ *
+ * The result of each entry is left in |requests[i].result|, and |stats|,
+ * if not NULL, is filled in with the totals.
+ *
+ * Returns 0 if every entry was extracted, otherwise the result of the first
+ * request that failed.
+ */
+int32_t ExtractEntriesToFiles(ZipArchiveHandle handle,
+                              ZipExtractRequest* requests, uint32_t count,
+                              uint32_t num_threads, ZipExtractStats* stats);
+
+/*
+ * Called by ExtractPrefixToFiles on the calling thread for each entry whose
+ * name starts with the prefix, before any is extracted. Returns a file
+ * descriptor to extract the entry to, or a negative value to skip it.
+ */
+typedef int (*ZipExtractOpenCallback)(const ZipEntryName* name,
+                                      const ZipEntry* entry, void* cookie);
+
+/*
+ * Called by ExtractPrefixToFiles on the calling thread, once all entries
+ * are done, for each entry it was given a file descriptor for, with the
+ * result of extracting it. Typically closes |fd|.
+ */
+typedef void (*ZipExtractDoneCallback)(const ZipEntryName* name, int fd,
+                                       int32_t result, void* cookie);
+
+/*
+ * Extract all entries whose names start with |prefix|, say "lib/arm64-v8a/",
+ * as ExtractEntriesToFiles does, to the files |open_callback| returns.
+ * |done_callback| may be NULL.
+ *
+ * Returns 0 if every entry was extracted, otherwise the first failure.
+ */
+int32_t ExtractPrefixToFiles(ZipArchiveHandle handle, const char* prefix,
+                             ZipExtractOpenCallback open_callback,
+                             ZipExtractDoneCallback done_callback,
+                             void* cookie, uint32_t num_threads,
+                             ZipExtractStats* stats);
+
 int GetFileDescriptor(const ZipArchiveHandle handle);
 
 const char* ErrorCodeString(int32_t error_code);
@@ -25,7 +25,12 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 #if (FAKE_LOG_DEVICE == 0)
+#include <limits.h>
+#include <poll.h>
+#include <sched.h>
+#include <signal.h>
 #include <sys/socket.h>
+#include <sys/syscall.h>
 #include <sys/un.h>
 #endif
 #include <time.h>
@@ -137,6 +142,24 @@ static int __write_to_log_initialize()
     return ret;
 }
 
+#if !FAKE_LOG_DEVICE
+/*
+ * Ignore log messages we send to ourself (logd). Such log messages are
+ * often generated by libraries we depend on which use standard Android
+ * logging.
+ */
+static int __log_to_self()
+{
+    static uid_t last_uid = AID_ROOT; /* logd *always* starts up as AID_ROOT */
+
+    if (last_uid == AID_ROOT) { /* have we called to get the UID yet? */
+        last_uid = getuid();
+    }
+    /* logd, after initialization and priv drop */
+    return last_uid == AID_LOGD;
+}
+#endif
+
 static int __write_to_log_kernel(log_id_t log_id, struct iovec *vec, size_t nr)
 {
     ssize_t ret;
@@ -162,17 +185,8 @@ static int __write_to_log_kernel(log_id_t log_id, struct iovec *vec, size_t nr)
     struct timespec ts;
     log_time realtime_ts;
     size_t i, payload_size;
-    static uid_t last_uid = AID_ROOT; /* logd *always* starts up as AID_ROOT */
 
-    if (last_uid == AID_ROOT) { /* have we called to get the UID yet? */
-        last_uid = getuid();
-    }
-    if (last_uid == AID_LOGD) { /* logd, after initialization and priv drop */
-        /*
-         * ignore log messages we send to ourself (logd).
-         * Such log messages are often generated by libraries we depend on
-         * which use standard Android logging.
-         */
+    if (__log_to_self()) {
         return 0;
     }
 
@@ -264,6 +278,482 @@ static int __write_to_log_kernel(log_id_t log_id, struct iovec *vec, size_t nr)
     return ret;
 }
 
+#if !FAKE_LOG_DEVICE && defined(HAVE_PTHREADS)
+/*
+ * Opt-in batching. A writer claims the next slot of a process wide ring
+ * with a compare and swap and copies the whole datagram, header and all,
+ * into it, so that logging takes no lock and makes no syscall. A flusher
+ * thread sends what the ring holds to logd with sendmmsg() every
+ * batch_delay_ms, or as soon as the ring is half full. Messages that find
+ * the ring full are dropped, counted, and reported by the next flush.
+ */
+#define BATCH_SLOTS 256 /* a power of two */
+/* longer messages flush the ring and are written directly */
+#define BATCH_PAYLOAD 1024
+#define BATCH_SEND_MAX 64
+/* how long the flusher waits for logd to make room before dropping */
+#define BATCH_SEND_TIMEOUT_MS 100
+#define BATCH_HEADER_LEN (sizeof_log_id_t + sizeof(uint16_t) + sizeof(log_time))
+
+struct batch_slot {
+    /* Free for the writer of message n when seq == n, and holding message
+     * n for the flusher when seq == n + 1 */
+    volatile uint32_t seq;
+    uint16_t len;
+    unsigned char msg[BATCH_HEADER_LEN + BATCH_PAYLOAD];
+};
+
+static struct batch_slot *batch_ring;
+static volatile uint32_t batch_head; /* next message to be written */
+static volatile uint32_t batch_tail; /* next message to be sent */
+static volatile unsigned long batch_dropped;
+static unsigned long batch_dropped_reported;
+static volatile unsigned int batch_delay_ms;
+/* Held while draining the ring. A flag rather than a mutex, so that the
+ * fatal signal handler can try for it. */
+static volatile int batch_draining;
+static volatile int batch_thread_started;
+static pthread_mutex_t batch_wake_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t batch_wake = PTHREAD_COND_INITIALIZER;
+
+static const int batch_fatal_signals[] = {
+    SIGABRT, SIGBUS, SIGFPE, SIGILL, SIGSEGV, SIGTRAP
+};
+static struct sigaction batch_old_actions[sizeof(batch_fatal_signals) /
+                                          sizeof(batch_fatal_signals[0])];
+
+static void batch_reset_ring(void)
+{
+    uint32_t i;
+
+    for (i = 0; i < BATCH_SLOTS; i++) {
+        batch_ring[i].seq = i;
+    }
+    batch_head = 0;
+    batch_tail = 0;
+}
+
+/* Try for batch_draining up to tries times, yielding in between */
+static int batch_lock(int tries)
+{
+    while (__sync_lock_test_and_set(&batch_draining, 1)) {
+        if (--tries <= 0) {
+            return -EBUSY;
+        }
+        sched_yield();
+    }
+    return 0;
+}
+
+static void batch_unlock(void)
+{
+    __sync_lock_release(&batch_draining);
+}
+
+/* Send msgs, waiting for room in the socket unless in a signal handler */
+static void batch_send(struct mmsghdr *msgs, unsigned int n, int in_signal)
+{
+    unsigned int sent = 0;
+    int ret, reconnected = 0;
+    struct pollfd pfd;
+
+    while (sent < n) {
+        ret = sendmmsg(logd_fd, msgs + sent, n - sent, 0);
+        if (ret > 0) {
+            sent += ret;
+            continue;
+        }
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        }
+        if (ret < 0 && !in_signal) {
+            if (errno == EAGAIN) {
+                /* logd is behind, wait while it catches up */
+                pfd.fd = logd_fd;
+                pfd.events = POLLOUT;
+                pfd.revents = 0;
+                if (poll(&pfd, 1, BATCH_SEND_TIMEOUT_MS) > 0) {
+                    continue;
+                }
+            } else if (!reconnected && (errno == ENOTCONN || errno == EBADF)) {
+                reconnected = 1;
+                pthread_mutex_lock(&log_init_lock);
+                ret = __write_to_log_initialize();
+                pthread_mutex_unlock(&log_init_lock);
+                if (ret >= 0) {
+                    continue;
+                }
+            }
+        }
+        __sync_fetch_and_add(&batch_dropped, n - sent);
+        break;
+    }
+}
+
+/* "<count> messages dropped" into buf, which must hold 40 bytes. Done by
+ * hand, as snprintf() is not async-signal-safe. Returns the length. */
+static int batch_format_dropped(char *buf, unsigned long count)
+{
+    static const char suffix[] = " messages dropped";
+    char digits[24];
+    int n = 0, len = 0;
+
+    do {
+        digits[n++] = '0' + count % 10;
+        count /= 10;
+    } while (count);
+    while (n) {
+        buf[len++] = digits[--n];
+    }
+    memcpy(buf + len, suffix, sizeof(suffix));
+    return len + sizeof(suffix) - 1;
+}
+
+/* Log how many messages have been dropped since the last report */
+static void batch_report_dropped(int in_signal)
+{
+    unsigned char buf[BATCH_HEADER_LEN + 64];
+    unsigned long dropped = batch_dropped;
+    struct timespec ts;
+    log_time realtime_ts;
+    uint16_t tid;
+    struct iovec iov;
+    struct mmsghdr msg;
+    int len;
+
+    if (dropped == batch_dropped_reported) {
+        return;
+    }
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    realtime_ts.tv_sec = ts.tv_sec;
+    realtime_ts.tv_nsec = ts.tv_nsec;
+    tid = gettid();
+
+    buf[0] = LOG_ID_MAIN;
+    memcpy(buf + sizeof_log_id_t, &tid, sizeof(tid));
+    memcpy(buf + sizeof_log_id_t + sizeof(tid), &realtime_ts, sizeof(log_time));
+    buf[BATCH_HEADER_LEN] = ANDROID_LOG_WARN;
+    memcpy(buf + BATCH_HEADER_LEN + 1, "liblog", sizeof("liblog"));
+    len = batch_format_dropped((char *)buf + BATCH_HEADER_LEN + 1 + sizeof("liblog"),
+                               dropped - batch_dropped_reported);
+    batch_dropped_reported = dropped;
+
+    iov.iov_base = buf;
+    iov.iov_len = BATCH_HEADER_LEN + 1 + sizeof("liblog") + len + 1;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_hdr.msg_iov = &iov;
+    msg.msg_hdr.msg_iovlen = 1;
+    batch_send(&msg, 1, in_signal);
+}
+
+/* batch_draining assumed */
+static void batch_drain_locked(int in_signal)
+{
+    struct mmsghdr msgs[BATCH_SEND_MAX];
+    struct iovec iov[BATCH_SEND_MAX];
+    struct batch_slot *slot;
+    uint32_t tail = batch_tail;
+    unsigned int i, n;
+
+    if (!batch_ring) {
+        return;
+    }
+
+    memset(msgs, 0, sizeof(msgs));
+    for (;;) {
+        for (n = 0; n < BATCH_SEND_MAX; n++) {
+            slot = &batch_ring[(tail + n) & (BATCH_SLOTS - 1)];
+            if (slot->seq != tail + n + 1) {
+                break;
+            }
+            __sync_synchronize(); /* read the message after its seq */
+            iov[n].iov_base = slot->msg;
+            iov[n].iov_len = slot->len;
+            msgs[n].msg_hdr.msg_iov = &iov[n];
+            msgs[n].msg_hdr.msg_iovlen = 1;
+        }
+        if (n == 0) {
+            break;
+        }
+
+        batch_send(msgs, n, in_signal);
+
+        __sync_synchronize(); /* done with the messages before reuse */
+        for (i = 0; i < n; i++) {
+            batch_ring[(tail + i) & (BATCH_SLOTS - 1)].seq = tail + i + BATCH_SLOTS;
+        }
+        tail += n;
+        batch_tail = tail;
+    }
+
+    batch_report_dropped(in_signal);
+}
+
+int __android_log_flush(void)
+{
+    int ret = batch_lock(INT_MAX);
+    if (ret < 0) {
+        return ret;
+    }
+    batch_drain_locked(0);
+    batch_unlock();
+    return 0;
+}
+
+static void *batch_flusher(void *arg __unused)
+{
+    struct timespec ts;
+    unsigned int delay_ms;
+
+    for (;;) {
+        delay_ms = batch_delay_ms;
+        if (!delay_ms) {
+            delay_ms = 1000; /* switched off, only stragglers left */
+        }
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec += delay_ms / 1000;
+        ts.tv_nsec += (delay_ms % 1000) * 1000000;
+        if (ts.tv_nsec >= 1000000000) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000;
+        }
+
+        pthread_mutex_lock(&batch_wake_lock);
+        pthread_cond_timedwait(&batch_wake, &batch_wake_lock, &ts);
+        pthread_mutex_unlock(&batch_wake_lock);
+
+        if (batch_head != batch_tail || batch_dropped != batch_dropped_reported) {
+            __android_log_flush();
+        }
+    }
+
+    return NULL;
+}
+
+static void batch_fatal_signal(int sig, siginfo_t *info, void *uc __unused)
+{
+    size_t i;
+
+    /* The flusher may be the thread that faulted, so do not wait long */
+    if (batch_lock(100) == 0) {
+        batch_drain_locked(1);
+        batch_unlock();
+    }
+
+    /* Hand the signal on to whoever had it before us, e.g. debuggerd */
+    for (i = 0; i < sizeof(batch_fatal_signals) / sizeof(batch_fatal_signals[0]); i++) {
+        if (batch_fatal_signals[i] == sig) {
+            sigaction(sig, &batch_old_actions[i], NULL);
+            break;
+        }
+    }
+    /* A fault is raised again when we return, but a sent signal is not */
+    if (info->si_code <= 0) {
+        syscall(__NR_tgkill, getpid(), gettid(), sig);
+    }
+}
+
+static void batch_at_exit(void)
+{
+    __android_log_flush();
+}
+
+static void batch_before_fork(void)
+{
+    batch_lock(INT_MAX);
+}
+
+static void batch_after_fork_parent(void)
+{
+    batch_unlock();
+}
+
+static void batch_after_fork_child(void)
+{
+    /* The parent sends what is queued, and the flusher did not come along */
+    if (batch_ring) {
+        batch_reset_ring();
+    }
+    batch_thread_started = 0;
+    /* A fork while the flusher held batch_wake_lock leaves it locked for
+     * good, with no thread here to release it */
+    pthread_mutex_init(&batch_wake_lock, NULL);
+    pthread_cond_init(&batch_wake, NULL);
+    batch_unlock();
+}
+
+/* log_init_lock assumed */
+static int batch_start_locked(void)
+{
+    static int registered;
+    struct sigaction sa;
+    pthread_attr_t attr;
+    pthread_t thread;
+    size_t i;
+    int ret;
+
+    if (!batch_ring) {
+        batch_ring = calloc(BATCH_SLOTS, sizeof(struct batch_slot));
+        if (!batch_ring) {
+            return -ENOMEM;
+        }
+        batch_reset_ring();
+    }
+
+    if (!registered) {
+        registered = 1;
+        atexit(batch_at_exit);
+        pthread_atfork(batch_before_fork, batch_after_fork_parent,
+                       batch_after_fork_child);
+
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_sigaction = batch_fatal_signal;
+        sa.sa_flags = SA_SIGINFO | SA_ONSTACK;
+        sigemptyset(&sa.sa_mask);
+        for (i = 0; i < sizeof(batch_fatal_signals) / sizeof(batch_fatal_signals[0]); i++) {
+            sigaction(batch_fatal_signals[i], &sa, &batch_old_actions[i]);
+        }
+    }
+
+    if (!batch_thread_started) {
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        ret = pthread_create(&thread, &attr, batch_flusher, NULL);
+        pthread_attr_destroy(&attr);
+        if (ret) {
+            return -ret;
+        }
+        batch_thread_started = 1;
+    }
+
+    return 0;
+}
+
+static int __write_to_log_batch(log_id_t log_id, struct iovec *vec, size_t nr)
+{
+    struct batch_slot *slot;
+    struct timespec ts;
+    log_time realtime_ts;
+    typeof_log_id_t log_id_buf;
+    uint16_t tid;
+    uint32_t pos;
+    size_t i, payload_size;
+    unsigned char *p;
+    int ret;
+
+    if (__log_to_self()) {
+        return 0;
+    }
+
+    for (payload_size = 0, i = 0; i < nr; i++) {
+        payload_size += vec[i].iov_len;
+    }
+
+    /* Crashes and fatal messages go out at once, after what is queued */
+    if (log_id == LOG_ID_CRASH || payload_size > BATCH_PAYLOAD ||
+            (log_id != LOG_ID_EVENTS && nr && vec[0].iov_len &&
+             *(unsigned char *)vec[0].iov_base == ANDROID_LOG_FATAL)) {
+        __android_log_flush();
+        return __write_to_log_kernel(log_id, vec, nr);
+    }
+
+    if (!batch_thread_started) {
+        /* first message in a child after fork() */
+        pthread_mutex_lock(&log_init_lock);
+        ret = batch_start_locked();
+        pthread_mutex_unlock(&log_init_lock);
+        if (ret < 0) {
+            return __write_to_log_kernel(log_id, vec, nr);
+        }
+    }
+
+    do {
+        pos = batch_head;
+        slot = &batch_ring[pos & (BATCH_SLOTS - 1)];
+        if (slot->seq != pos) {
+            if ((int32_t)(slot->seq - pos) < 0) {
+                /* the ring is full */
+                __sync_fetch_and_add(&batch_dropped, 1);
+                return -EAGAIN;
+            }
+            continue; /* another writer got there first */
+        }
+    } while (!__sync_bool_compare_and_swap(&batch_head, pos, pos + 1));
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    realtime_ts.tv_sec = ts.tv_sec;
+    realtime_ts.tv_nsec = ts.tv_nsec;
+    log_id_buf = log_id;
+    tid = gettid();
+
+    p = slot->msg;
+    memcpy(p, &log_id_buf, sizeof_log_id_t);
+    p += sizeof_log_id_t;
+    memcpy(p, &tid, sizeof(tid));
+    p += sizeof(tid);
+    memcpy(p, &realtime_ts, sizeof(log_time));
+    p += sizeof(log_time);
+    for (i = 0; i < nr; i++) {
+        memcpy(p, vec[i].iov_base, vec[i].iov_len);
+        p += vec[i].iov_len;
+    }
+    slot->len = p - slot->msg;
+
+    __sync_synchronize(); /* the message before its seq */
+    slot->seq = pos + 1;
+
+    if (pos - batch_tail == BATCH_SLOTS / 2) {
+        pthread_cond_signal(&batch_wake);
+    }
+
+    return payload_size;
+}
+
+int __android_log_set_batching(unsigned int max_delay_ms)
+{
+    int ret = 0;
+
+    pthread_mutex_lock(&log_init_lock);
+    batch_delay_ms = max_delay_ms;
+    if (max_delay_ms) {
+        ret = batch_start_locked();
+        if (ret == 0 && write_to_log == __write_to_log_kernel) {
+            write_to_log = __write_to_log_batch;
+        }
+    } else if (write_to_log == __write_to_log_batch) {
+        write_to_log = __write_to_log_kernel;
+    }
+    pthread_mutex_unlock(&log_init_lock);
+
+    if (!max_delay_ms) {
+        __android_log_flush();
+    }
+
+    return ret;
+}
+
+unsigned long __android_log_dropped(void)
+{
+    return batch_dropped;
+}
+#else
+int __android_log_set_batching(unsigned int max_delay_ms __unused)
+{
+    return -ENOSYS;
+}
+
+int __android_log_flush(void)
+{
+    return 0;
+}
+
+unsigned long __android_log_dropped(void)
+{
+    return 0;
+}
+#endif
+
 #if FAKE_LOG_DEVICE
 static const char *LOG_NAME[LOG_ID_MAX] = {
     [LOG_ID_MAIN] = "main",
@@ -300,6 +790,11 @@ static int __write_to_log_init(log_id_t log_id, struct iovec *vec, size_t nr)
         }
 
         write_to_log = __write_to_log_kernel;
+#if !FAKE_LOG_DEVICE && defined(HAVE_PTHREADS)
+        if (batch_delay_ms) {
+            write_to_log = __write_to_log_batch;
+        }
+#endif
     }
 
 #ifdef HAVE_PTHREADS
@@ -342,3 +342,19 @@ int __android_log_bswrite(int32_t tag, const char *payload)
 
     return write_to_log(LOG_ID_EVENTS, vec, 4);
 }
+
+/* Batching needs logd */
+int __android_log_set_batching(unsigned int max_delay_ms __unused)
+{
+    return -ENOSYS;
+}
+
+int __android_log_flush(void)
+{
+    return 0;
+}
+
+unsigned long __android_log_dropped(void)
+{
+    return 0;
+}
@@ -21,6 +21,9 @@
 #include <assert.h>
 #include <ctype.h>
 #include <errno.h>
+#ifdef HAVE_PTHREADS
+#include <pthread.h>
+#endif
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -33,14 +36,77 @@ typedef struct FilterInfo_t {
     char *mTag;
     android_LogPriority mPri;
     struct FilterInfo_t *p_next;
+    /* next in the same hash bucket */
+    struct FilterInfo_t *p_hashNext;
+    uint32_t mHash;
 } FilterInfo;
 
 struct AndroidLogFormat_t {
     android_LogPriority global_pri;
     FilterInfo *filters;
     AndroidLogPrintFormat format;
+    /* filters hashed on tag, one entry per tag, a power of two buckets */
+    FilterInfo **buckets;
+    size_t numBuckets;
+    size_t numFilters;
 };
 
+/*
+ * "%m-%d %H:%M:%S" for sec, strftime() is far from cheap. Kept per thread
+ * rather than in the AndroidLogFormat, which threads may share.
+ */
+typedef struct {
+    time_t sec;
+    char buf[32];
+} TimeCache;
+
+#ifdef HAVE_PTHREADS
+static pthread_once_t timeCacheOnce = PTHREAD_ONCE_INIT;
+static pthread_key_t timeCacheKey;
+static int timeCacheKeyValid;
+
+static void timeCacheInit(void)
+{
+    timeCacheKeyValid = !pthread_key_create(&timeCacheKey, free);
+}
+#endif
+
+/* This thread's cache, or fallback emptied when there is none */
+static TimeCache *getTimeCache(TimeCache *fallback)
+{
+#ifdef HAVE_PTHREADS
+    TimeCache *cache;
+
+    pthread_once(&timeCacheOnce, timeCacheInit);
+    if (timeCacheKeyValid) {
+        cache = pthread_getspecific(timeCacheKey);
+        if (cache) {
+            return cache;
+        }
+        cache = malloc(sizeof(*cache));
+        if (cache && !pthread_setspecific(timeCacheKey, cache)) {
+            cache->sec = (time_t)-1;
+            return cache;
+        }
+        free(cache);
+    }
+#endif
+    fallback->sec = (time_t)-1;
+    return fallback;
+}
+
+/* FNV-1a, tags are short */
+static uint32_t filterHash(const char *tag)
+{
+    uint32_t hash = 2166136261U;
+
+    while (*tag) {
+        hash ^= (unsigned char)*tag++;
+        hash *= 16777619U;
+    }
+    return hash;
+}
+
 static FilterInfo * filterinfo_new(const char * tag, android_LogPriority pri)
 {
     FilterInfo *p_ret;
@@ -48,11 +114,61 @@ static FilterInfo * filterinfo_new(const char * tag, android_LogPriority pri)
     p_ret = (FilterInfo *)calloc(1, sizeof(FilterInfo));
     p_ret->mTag = strdup(tag);
     p_ret->mPri = pri;
+    p_ret->mHash = filterHash(tag);
 
     return p_ret;
 }
 
-/* balance to above, filterinfo_free left unimplemented */
+static FilterInfo *filterLookup(
+        AndroidLogFormat *p_format, const char *tag, uint32_t hash)
+{
+    FilterInfo *p_curFilter;
+
+    for (p_curFilter = p_format->buckets[hash & (p_format->numBuckets - 1)]
+            ; p_curFilter != NULL
+            ; p_curFilter = p_curFilter->p_hashNext
+    ) {
+        if (p_curFilter->mHash == hash && 0 == strcmp(tag, p_curFilter->mTag)) {
+            return p_curFilter;
+        }
+    }
+
+    return NULL;
+}
+
+/* Double the buckets, keeping the chains at one filter per bucket or so */
+static int filterRehash(AndroidLogFormat *p_format)
+{
+    size_t numBuckets = p_format->numBuckets ? p_format->numBuckets * 2 : 16;
+    FilterInfo **buckets;
+    FilterInfo *p_curFilter;
+
+    buckets = (FilterInfo **)calloc(numBuckets, sizeof(FilterInfo *));
+    if (buckets == NULL) {
+        return -1;
+    }
+
+    for (p_curFilter = p_format->filters
+            ; p_curFilter != NULL
+            ; p_curFilter = p_curFilter->p_next
+    ) {
+        FilterInfo **p_bucket = &buckets[p_curFilter->mHash & (numBuckets - 1)];
+        p_curFilter->p_hashNext = *p_bucket;
+        *p_bucket = p_curFilter;
+    }
+
+    free(p_format->buckets);
+    p_format->buckets = buckets;
+    p_format->numBuckets = numBuckets;
+
+    return 0;
+}
+
+static void filterinfo_free(FilterInfo *p_info)
+{
+    free(p_info->mTag);
+    free(p_info);
+}
 
 /*
  * Note: also accepts 0-9 priorities
@@ -115,20 +231,16 @@ static android_LogPriority filterPriForTag(
 {
     FilterInfo *p_curFilter;
 
-    for (p_curFilter = p_format->filters
-            ; p_curFilter != NULL
-            ; p_curFilter = p_curFilter->p_next
-    ) {
-        if (0 == strcmp(tag, p_curFilter->mTag)) {
-            if (p_curFilter->mPri == ANDROID_LOG_DEFAULT) {
-                return p_format->global_pri;
-            } else {
-                return p_curFilter->mPri;
-            }
-        }
+    if (p_format->numFilters == 0) {
+        return p_format->global_pri;
+    }
+
+    p_curFilter = filterLookup(p_format, tag, filterHash(tag));
+    if (p_curFilter == NULL || p_curFilter->mPri == ANDROID_LOG_DEFAULT) {
+        return p_format->global_pri;
     }
 
-    return p_format->global_pri;
+    return p_curFilter->mPri;
 }
 
 /**
@@ -163,9 +275,10 @@ void android_log_format_free(AndroidLogFormat *p_format)
         p_info_old = p_info;
         p_info = p_info->p_next;
 
-        free(p_info_old);
+        filterinfo_free(p_info_old);
     }
 
+    free(p_format->buckets);
     free(p_format);
 }
 
@@ -254,11 +367,34 @@ int android_log_addFilterRule(AndroidLogFormat *p_format,
         tagName[tagNameLength] = '\0';
 #endif /*HAVE_STRNDUP*/
 
-        FilterInfo *p_fi = filterinfo_new(tagName, pri);
+        // the last rule for a tag wins
+        uint32_t hash = filterHash(tagName);
+        FilterInfo *p_fi = p_format->numFilters
+                ? filterLookup(p_format, tagName, hash) : NULL;
+
+        if (p_fi != NULL) {
+            free(tagName);
+            p_fi->mPri = pri;
+            return 0;
+        }
+
+        if (p_format->numFilters >= p_format->numBuckets
+                && filterRehash(p_format) < 0) {
+            free(tagName);
+            goto error;
+        }
+
+        p_fi = filterinfo_new(tagName, pri);
         free(tagName);
 
         p_fi->p_next = p_format->filters;
         p_format->filters = p_fi;
+
+        FilterInfo **p_bucket =
+                &p_format->buckets[hash & (p_format->numBuckets - 1)];
+        p_fi->p_hashNext = *p_bucket;
+        *p_bucket = p_fi;
+        p_format->numFilters++;
     }
 
     return 0;
@@ -672,6 +808,73 @@ int android_log_processBinaryLogBuffer(struct logger_entry *buf,
     return 0;
 }
 
+/*
+ * Right-align value in width characters, like "%*d" for value >= 0
+ */
+static char *formatDecimal(char *p, uint32_t value, size_t width)
+{
+    char digits[10];
+    size_t len = 0;
+
+    do {
+        digits[len++] = '0' + value % 10;
+        value /= 10;
+    } while (value);
+
+    while (width > len) {
+        *p++ = ' ';
+        width--;
+    }
+    while (len) {
+        *p++ = digits[--len];
+    }
+    return p;
+}
+
+/*
+ * The threadtime prefix, "%s.%03ld %5d %5d %c %-8s: ", without snprintf(),
+ * as this is what logcat -v threadtime spends its time on. Returns its
+ * length, or 0 where snprintf() had better handle it.
+ */
+static size_t formatThreadtimePrefix(char *buf, size_t bufLen,
+        const char *timeBuf, const AndroidLogEntry *entry, char priChar)
+{
+    size_t timeLen = strlen(timeBuf);
+    size_t tagLen = strlen(entry->tag);
+    uint32_t msec = entry->tv_nsec / 1000000;
+    char *p = buf;
+
+    /* time, 3 + 2 * 10 numbers, 5 separators, 8 tag, 3 trailer and NUL */
+    if (entry->pid < 0 || entry->tid < 0 || entry->tv_nsec < 0 || msec > 999
+            || timeLen + 3 + 20 + 5 + (tagLen < 8 ? 8 : tagLen) + 3 >= bufLen) {
+        return 0;
+    }
+
+    memcpy(p, timeBuf, timeLen);
+    p += timeLen;
+    *p++ = '.';
+    *p++ = '0' + msec / 100;
+    *p++ = '0' + msec / 10 % 10;
+    *p++ = '0' + msec % 10;
+    *p++ = ' ';
+    p = formatDecimal(p, entry->pid, 5);
+    *p++ = ' ';
+    p = formatDecimal(p, entry->tid, 5);
+    *p++ = ' ';
+    *p++ = priChar;
+    *p++ = ' ';
+    memcpy(p, entry->tag, tagLen);
+    p += tagLen;
+    while (tagLen++ < 8) {
+        *p++ = ' ';
+    }
+    *p++ = ':';
+    *p++ = ' ';
+    *p = '\0';
+
+    return p - buf;
+}
+
 /**
  * Formats a log message into a buffer
  *
@@ -691,7 +894,9 @@ char *android_log_formatLogLine (
     struct tm tmBuf;
 #endif
     struct tm* ptm;
-    char timeBuf[32];
+    TimeCache timeCacheBuf;
+    TimeCache *timeCache;
+    const char *timeBuf;
     char prefixBuf[128], suffixBuf[128];
     char priChar;
     int prefixSuffixIsHeaderFooter = 0;
@@ -708,13 +913,19 @@ char *android_log_formatLogLine (
      * in the time stamp.  Don't use forward slashes, parenthesis,
      * brackets, asterisks, or other special chars here.
      */
+    timeCache = getTimeCache(&timeCacheBuf);
+    if (entry->tv_sec != timeCache->sec) {
 #if defined(HAVE_LOCALTIME_R)
-    ptm = localtime_r(&(entry->tv_sec), &tmBuf);
+        ptm = localtime_r(&(entry->tv_sec), &tmBuf);
 #else
-    ptm = localtime(&(entry->tv_sec));
+        ptm = localtime(&(entry->tv_sec));
 #endif
-    //strftime(timeBuf, sizeof(timeBuf), "%Y-%m-%d %H:%M:%S", ptm);
-    strftime(timeBuf, sizeof(timeBuf), "%m-%d %H:%M:%S", ptm);
+        //strftime(timeBuf, sizeof(timeBuf), "%Y-%m-%d %H:%M:%S", ptm);
+        strftime(timeCache->buf, sizeof(timeCache->buf),
+                 "%m-%d %H:%M:%S", ptm);
+        timeCache->sec = entry->tv_sec;
+    }
+    timeBuf = timeCache->buf;
 
     /*
      * Construct a buffer containing the log header and log message.
@@ -753,9 +964,14 @@ char *android_log_formatLogLine (
             suffixLen = 1;
             break;
         case FORMAT_THREADTIME:
-            prefixLen = snprintf(prefixBuf, sizeof(prefixBuf),
-                "%s.%03ld %5d %5d %c %-8s: ", timeBuf, entry->tv_nsec / 1000000,
-                entry->pid, entry->tid, priChar, entry->tag);
+            prefixLen = formatThreadtimePrefix(prefixBuf, sizeof(prefixBuf),
+                timeBuf, entry, priChar);
+            if (prefixLen == 0) {
+                prefixLen = snprintf(prefixBuf, sizeof(prefixBuf),
+                    "%s.%03ld %5d %5d %c %-8s: ", timeBuf,
+                    entry->tv_nsec / 1000000, entry->pid, entry->tid,
+                    priChar, entry->tag);
+            }
             strcpy(suffixBuf, "\n");
             suffixLen = 1;
             break;
@@ -792,6 +1008,7 @@ char *android_log_formatLogLine (
     size_t numLines;
     char *p;
     size_t bufferSize;
+    size_t lineLen;
     const char *pm;
 
     if (prefixSuffixIsHeaderFooter) {
@@ -824,39 +1041,39 @@ char *android_log_formatLogLine (
         }
     }
 
-    ret[0] = '\0';       /* to start strcat off */
-
     p = ret;
     pm = entry->message;
 
     if (prefixSuffixIsHeaderFooter) {
-        strcat(p, prefixBuf);
+        memcpy(p, prefixBuf, prefixLen);
         p += prefixLen;
-        strncat(p, entry->message, entry->messageLen);
-        p += entry->messageLen;
-        strcat(p, suffixBuf);
+        lineLen = strnlen(entry->message, entry->messageLen);
+        memcpy(p, entry->message, lineLen);
+        p += lineLen;
+        memcpy(p, suffixBuf, suffixLen);
         p += suffixLen;
     } else {
         while(pm < (entry->message + entry->messageLen)) {
-            const char *lineStart;
-            size_t lineLen;
+            const char *lineStart, *lineEnd;
             lineStart = pm;
 
             // Find the next end-of-line in message
-            while (pm < (entry->message + entry->messageLen)
-                    && *pm != '\n') pm++;
-            lineLen = pm - lineStart;
+            lineEnd = memchr(pm, '\n', entry->message + entry->messageLen - pm);
+            pm = lineEnd ? lineEnd : entry->message + entry->messageLen;
+            // and stop short at a NUL, as strncat() did
+            lineLen = strnlen(lineStart, pm - lineStart);
 
-            strcat(p, prefixBuf);
+            memcpy(p, prefixBuf, prefixLen);
             p += prefixLen;
-            strncat(p, lineStart, lineLen);
+            memcpy(p, lineStart, lineLen);
             p += lineLen;
-            strcat(p, suffixBuf);
+            memcpy(p, suffixBuf, suffixLen);
             p += suffixLen;
 
-            if (*pm == '\n') pm++;
+            if (pm < (entry->message + entry->messageLen)) pm++;
         }
     }
+    *p = '\0';
 
     if (p_outLength != NULL) {
         *p_outLength = p - ret;
@@ -71,6 +71,26 @@ static void BM_log_maximum(int iters) {
 }
 BENCHMARK(BM_log_maximum);
 
+/*
+ *	Measure the fastest rate we can stuff print messages into the log
+ * at high pressure with batching on. Messages that do not fit are dropped.
+ * Expect this to be a fraction of a syscall period (<1us).
+ */
+static void BM_log_maximum_batched(int iters) {
+    __android_log_set_batching(10);
+
+    StartBenchmarkTiming();
+
+    for (int i = 0; i < iters; ++i) {
+        __android_log_print(ANDROID_LOG_INFO, "BM_log_maximum_batched", "%d", i);
+    }
+
+    StopBenchmarkTiming();
+
+    __android_log_set_batching(0);
+}
+BENCHMARK(BM_log_maximum_batched);
+
 /*
  *	Measure the time it takes to submit the android logging call using
  * discrete acquisition under light load. Expect this to be a pair of
@@ -161,6 +161,65 @@ TEST(liblog, __android_log_btwrite__android_logger_list_read) {
     android_logger_list_close(logger_list);
 }
 
+TEST(liblog, __android_log_set_batching__android_logger_list_read) {
+    struct logger_list *logger_list;
+
+    pid_t pid = getpid();
+
+    ASSERT_TRUE(NULL != (logger_list = android_logger_list_open(
+        LOG_ID_EVENTS, O_RDONLY | O_NDELAY, 1000, pid)));
+
+    unsigned long dropped = __android_log_dropped();
+    ASSERT_EQ(0, __android_log_set_batching(100));
+
+    static const int num_messages = 32;
+    log_time ts(CLOCK_MONOTONIC);
+
+    for (int i = 0; i < num_messages; ++i) {
+        log_time tx(ts);
+        tx.tv_nsec = i;
+        ASSERT_LT(0, __android_log_btwrite(0, EVENT_TYPE_LONG, &tx, sizeof(tx)));
+    }
+    // Sent by the flusher within max_delay_ms, without an explicit flush;
+    // read back while still batching, as turning it off would flush them
+    usleep(1000000);
+
+    int count = 0;
+
+    for (;;) {
+        log_msg log_msg;
+        if (android_logger_list_read(logger_list, &log_msg) <= 0) {
+            break;
+        }
+
+        ASSERT_EQ(log_msg.entry.pid, pid);
+
+        if ((log_msg.entry.len != (4 + 1 + 8))
+         || (log_msg.id() != LOG_ID_EVENTS)) {
+            continue;
+        }
+
+        char *eventData = log_msg.msg();
+
+        if (eventData[4] != EVENT_TYPE_LONG) {
+            continue;
+        }
+
+        log_time tx(eventData + 4 + 1);
+        if ((ts.tv_sec == tx.tv_sec) && (tx.tv_nsec == (unsigned)count)) {
+            ++count;
+        }
+    }
+
+    // All of them, in order
+    EXPECT_EQ(num_messages, count);
+
+    EXPECT_EQ(0, __android_log_set_batching(0));
+    EXPECT_EQ(dropped, __android_log_dropped());
+
+    android_logger_list_close(logger_list);
+}
+
 static unsigned signaled;
 log_time signal_time;
 
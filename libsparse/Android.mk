@@ -108,3 +108,5 @@ LOCAL_MODULE_CLASS := EXECUTABLES
 LOCAL_IS_HOST_MODULE := true
 LOCAL_CFLAGS := -Werror
 include $(BUILD_PREBUILT)
+
+include $(call first-makefiles-under,$(LOCAL_PATH))
@@ -44,17 +44,116 @@ struct backed_block {
 		} fill;
 	};
 	struct backed_block *next;
+	/* Blocks are kept in a skip list ordered by block. Every block is on
+	 * the level 0 list through next; one in four is also on level 1, one
+	 * in sixteen on level 2 and so on, through up[level - 1]. */
+	unsigned int height;
+	struct backed_block *up[];
 };
 
+#define MAX_HEIGHT 16
+
 struct backed_block_list {
-	struct backed_block *data_blocks;
-	struct backed_block *last_used;
+	/* data_blocks[level] is the first block on that level */
+	struct backed_block *data_blocks[MAX_HEIGHT];
+	/* levels in use, none above have ever had a block */
+	unsigned int height;
+	uint32_t seed;
 	unsigned int block_size;
 };
 
+/* The link to the block after bb on a level */
+static struct backed_block **bb_link(struct backed_block *bb,
+		unsigned int level)
+{
+	return level == 0 ? &bb->next : &bb->up[level - 1];
+}
+
+/* Allocate a zeroed block with a random height */
+static struct backed_block *backed_block_new(struct backed_block_list *bbl)
+{
+	struct backed_block *bb;
+	unsigned int height = 1;
+	uint32_t r;
+
+	bbl->seed ^= bbl->seed << 13;
+	bbl->seed ^= bbl->seed >> 17;
+	bbl->seed ^= bbl->seed << 5;
+	for (r = bbl->seed; height < MAX_HEIGHT && (r & 3) == 0; r >>= 2) {
+		height++;
+	}
+
+	bb = calloc(1, sizeof(struct backed_block) +
+			(height - 1) * sizeof(struct backed_block *));
+	if (bb) {
+		bb->height = height;
+	}
+	return bb;
+}
+
+/* Find, on every level, the link that leads to the first block at or after
+ * block. Returns the block before that on level 0, or NULL if none. */
+static struct backed_block *find_links(struct backed_block_list *bbl,
+		unsigned int block, struct backed_block **links[MAX_HEIGHT])
+{
+	struct backed_block **link;
+	struct backed_block *prev = NULL;
+	int level;
+
+	for (level = MAX_HEIGHT - 1; level >= (int)bbl->height; level--) {
+		links[level] = &bbl->data_blocks[level];
+	}
+	for (; level >= 0; level--) {
+		link = prev ? bb_link(prev, level) : &bbl->data_blocks[level];
+		while (*link && (*link)->block < block) {
+			prev = *link;
+			link = bb_link(prev, level);
+		}
+		links[level] = link;
+	}
+
+	return prev;
+}
+
+/* Link bb in before any block at or after it. Returns the block before
+ * it, or NULL if it is first. */
+static struct backed_block *link_bb(struct backed_block_list *bbl,
+		struct backed_block *bb)
+{
+	struct backed_block **links[MAX_HEIGHT];
+	struct backed_block *prev;
+	unsigned int level;
+
+	prev = find_links(bbl, bb->block, links);
+	if (bb->height > bbl->height) {
+		bbl->height = bb->height;
+	}
+	for (level = 0; level < bb->height; level++) {
+		*bb_link(bb, level) = *links[level];
+		*links[level] = bb;
+	}
+
+	return prev;
+}
+
+static void unlink_bb(struct backed_block_list *bbl, struct backed_block *bb)
+{
+	struct backed_block **links[MAX_HEIGHT];
+	unsigned int level;
+
+	find_links(bbl, bb->block, links);
+	for (level = 0; level < bb->height; level++) {
+		/* step over any other block queued at the same block */
+		while (*links[level] != bb) {
+			links[level] = bb_link(*links[level], level);
+		}
+		*links[level] = *bb_link(bb, level);
+	}
+}
+
 struct backed_block *backed_block_iter_new(struct backed_block_list *bbl)
 {
-	return bbl->data_blocks;
+	return bbl->data_blocks[0];
 }
 
 struct backed_block *backed_block_iter_next(struct backed_block *bb)
@@ -123,14 +222,17 @@ void backed_block_destroy(struct backed_block *bb)
 struct backed_block_list *backed_block_list_new(unsigned int block_size)
 {
 	struct backed_block_list *b = calloc(sizeof(struct backed_block_list), 1);
-	b->block_size = block_size;
+	if (b) {
+		b->block_size = block_size;
+		b->seed = 2463534242U;
+	}
 	return b;
 }
 
 void backed_block_list_destroy(struct backed_block_list *bbl)
 {
-	if (bbl->data_blocks) {
-		struct backed_block *bb = bbl->data_blocks;
+	if (bbl->data_blocks[0]) {
+		struct backed_block *bb = bbl->data_blocks[0];
 		while (bb) {
 			struct backed_block *next = bb->next;
 			backed_block_destroy(bb);
@@ -146,44 +248,21 @@ void backed_block_list_move(struct backed_block_list *from,
 		struct backed_block *end)
 {
 	struct backed_block *bb;
+	struct backed_block *next;
 
 	if (start == NULL) {
-		start = from->data_blocks;
+		start = from->data_blocks[0];
 	}
 
-	if (!end) {
-		for (end = start; end && end->next; end = end->next)
-			;
-	}
-
-	if (start == NULL || end == NULL) {
+	if (start == NULL) {
 		return;
 	}
 
-	from->last_used = NULL;
-	to->last_used = NULL;
-	if (from->data_blocks == start) {
-		from->data_blocks = end->next;
-	} else {
-		for (bb = from->data_blocks; bb; bb = bb->next) {
-			if (bb->next == start) {
-				bb->next = end->next;
-				break;
-			}
-		}
-	}
-
-	if (!to->data_blocks) {
-		to->data_blocks = start;
-		end->next = NULL;
-	} else {
-		for (bb = to->data_blocks; bb; bb = bb->next) {
-			if (!bb->next || bb->next->block > start->block) {
-				end->next = bb->next;
-				bb->next = start;
-				break;
-			}
-		}
+	/* Move the blocks one at a time, each taking O(log n) */
+	for (bb = start; bb; bb = next) {
+		next = (bb == end) ? NULL : bb->next;
+		unlink_bb(from, bb);
+		link_bb(to, bb);
 	}
 }
 
@@ -237,7 +316,7 @@ static int merge_bb(struct backed_block_list *bbl,
 	/* Blocks are compatible and adjacent, with a before b.  Merge b into a,
 	 * and free b */
 	a->len += b->len;
-	a->next = b->next;
+	unlink_bb(bbl, b);
 
 	backed_block_destroy(b);
 
@@ -246,40 +325,12 @@ static int merge_bb(struct backed_block_list *bbl,
 
 static int queue_bb(struct backed_block_list *bbl, struct backed_block *new_bb)
 {
-	struct backed_block *bb;
-
-	if (bbl->data_blocks == NULL) {
-		bbl->data_blocks = new_bb;
-		return 0;
-	}
-
-	if (bbl->data_blocks->block > new_bb->block) {
-		new_bb->next = bbl->data_blocks;
-		bbl->data_blocks = new_bb;
-		return 0;
-	}
+	struct backed_block *prev;
 
-	/* Optimization: blocks are mostly queued in sequence, so save the
-	   pointer to the last bb that was added, and start searching from
-	   there if the next block number is higher */
-	if (bbl->last_used && new_bb->block > bbl->last_used->block)
-		bb = bbl->last_used;
-	else
-		bb = bbl->data_blocks;
-	bbl->last_used = new_bb;
-
-	for (; bb->next && bb->next->block < new_bb->block; bb = bb->next)
-		;
-
-	if (bb->next == NULL) {
-		bb->next = new_bb;
-	} else {
-		new_bb->next = bb->next;
-		bb->next = new_bb;
-	}
+	prev = link_bb(bbl, new_bb);
 
 	merge_bb(bbl, new_bb, new_bb->next);
-	merge_bb(bbl, bb, new_bb);
+	merge_bb(bbl, prev, new_bb);
 
 	return 0;
 }
@@ -288,7 +339,7 @@ static int queue_bb(struct backed_block_list *bbl, struct backed_block *new_bb)
 int backed_block_add_fill(struct backed_block_list *bbl, unsigned int fill_val,
 		unsigned int len, unsigned int block)
 {
-	struct backed_block *bb = calloc(1, sizeof(struct backed_block));
+	struct backed_block *bb = backed_block_new(bbl);
 	if (bb == NULL) {
 		return -ENOMEM;
 	}
@@ -306,7 +357,7 @@ int backed_block_add_fill(struct backed_block_list *bbl, unsigned int fill_val,
 int backed_block_add_data(struct backed_block_list *bbl, void *data,
 		unsigned int len, unsigned int block)
 {
-	struct backed_block *bb = calloc(1, sizeof(struct backed_block));
+	struct backed_block *bb = backed_block_new(bbl);
 	if (bb == NULL) {
 		return -ENOMEM;
 	}
@@ -324,7 +375,7 @@ int backed_block_add_data(struct backed_block_list *bbl, void *data,
 int backed_block_add_file(struct backed_block_list *bbl, const char *filename,
 		int64_t offset, unsigned int len, unsigned int block)
 {
-	struct backed_block *bb = calloc(1, sizeof(struct backed_block));
+	struct backed_block *bb = backed_block_new(bbl);
 	if (bb == NULL) {
 		return -ENOMEM;
 	}
@@ -343,7 +394,7 @@ int backed_block_add_file(struct backed_block_list *bbl, const char *filename,
 int backed_block_add_fd(struct backed_block_list *bbl, int fd, int64_t offset,
 		unsigned int len, unsigned int block)
 {
-	struct backed_block *bb = calloc(1, sizeof(struct backed_block));
+	struct backed_block *bb = backed_block_new(bbl);
 	if (bb == NULL) {
 		return -ENOMEM;
 	}
@@ -362,6 +413,7 @@ int backed_block_split(struct backed_block_list *bbl, struct backed_block *bb,
 		unsigned int max_len)
 {
 	struct backed_block *new_bb;
+	unsigned int height;
 
 	max_len = ALIGN_DOWN(max_len, bbl->block_size);
 
@@ -369,18 +421,19 @@ int backed_block_split(struct backed_block_list *bbl, struct backed_block *bb,
 		return 0;
 	}
 
-	new_bb = malloc(sizeof(struct backed_block));
+	new_bb = backed_block_new(bbl);
 	if (new_bb == NULL) {
 		return -ENOMEM;
 	}
 
+	height = new_bb->height;
 	*new_bb = *bb;
+	new_bb->height = height;
 
 	new_bb->len = bb->len - max_len;
 	new_bb->block = bb->block + max_len / bbl->block_size;
-	new_bb->next = bb->next;
-	bb->next = new_bb;
 	bb->len = max_len;
+	link_bb(bbl, new_bb);
 
 	switch (bb->type) {
 	case BACKED_BLOCK_DATA:
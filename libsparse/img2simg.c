@@ -40,7 +40,9 @@
 
 void usage()
 {
-    fprintf(stderr, "Usage: img2simg <raw_image_file> <sparse_image_file> [<block_size>]\n");
+    fprintf(stderr, "Usage: img2simg [-s] [-j <threads>] <raw_image_file> <sparse_image_file> [<block_size>]\n");
+    fprintf(stderr, "  -s  store blocks of zeros as don't care instead of as fill\n");
+    fprintf(stderr, "  -j  threads to scan the image on, default one per CPU\n");
 }
 
 int main(int argc, char *argv[])
@@ -51,6 +53,25 @@ int main(int argc, char *argv[])
 	struct sparse_file *s;
 	unsigned int block_size = 4096;
 	off64_t len;
+	bool skip_zero = false;
+	int num_threads = 0;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "sj:")) != -1) {
+		switch (opt) {
+		case 's':
+			skip_zero = true;
+			break;
+		case 'j':
+			num_threads = atoi(optarg);
+			break;
+		default:
+			usage();
+			exit(-1);
+		}
+	}
+	argc -= optind - 1;
+	argv += optind - 1;
 
 	if (argc < 3 || argc > 4) {
 		usage();
@@ -96,7 +117,7 @@ int main(int argc, char *argv[])
 	}
 
 	sparse_file_verbose(s);
-	ret = sparse_file_read(s, in, false, false);
+	ret = sparse_file_read_raw(s, in, skip_zero, num_threads);
 	if (ret) {
 		fprintf(stderr, "Failed to read file\n");
 		exit(-1);
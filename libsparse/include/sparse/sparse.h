@@ -214,6 +214,26 @@ int sparse_file_callback(struct sparse_file *s, bool sparse, bool crc,
  */
 int sparse_file_read(struct sparse_file *s, int fd, bool sparse, bool crc);
 
+/**
+ * sparse_file_read_raw - read a raw image into a sparse file cookie
+ *
+ * @s - sparse file cookie
+ * @fd - file descriptor to read from
+ * @skip_zero - leave blocks of all zeros out of the sparse file
+ * @num_threads - threads to scan the image on, or 0 for one per CPU
+ *
+ * Reads a raw image into a sparse file cookie, sparsing it by looking for
+ * block aligned chunks of all zeros or another 32 bit value, which become
+ * fill chunks.  If skip_zero is true, blocks of all zeros become don't care
+ * chunks instead, which are smaller to store and faster to flash but leave
+ * whatever was on the device before in place of the zeros.  Same as
+ * sparse_file_read with sparse false when skip_zero is false.
+ *
+ * Returns 0 on success, negative errno on error.
+ */
+int sparse_file_read_raw(struct sparse_file *s, int fd, bool skip_zero,
+		int num_threads);
+
 /**
  * sparse_file_import - import an existing sparse file
  *
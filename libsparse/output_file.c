@@ -35,6 +35,7 @@
 #include "sparse_format.h"
 
 #ifndef USE_MINGW
+#include <pthread.h>
 #include <sys/mman.h>
 #define O_BINARY 0
 #else
@@ -64,7 +65,7 @@ struct output_file_ops {
 	int (*skip)(struct output_file *, int64_t);
 	int (*pad)(struct output_file *, int64_t);
 	int (*write)(struct output_file *, void *, int);
-	void (*close)(struct output_file *);
+	int (*close)(struct output_file *);
 };
 
 struct sparse_file_ops {
@@ -88,6 +89,7 @@ struct output_file {
 	char *zero_buf;
 	uint32_t *fill_buf;
 	char *buf;
+	struct output_pipe *pipe;
 };
 
 struct output_file_gz {
@@ -166,11 +168,12 @@ static int file_write(struct output_file *out, void *data, int len)
 	return 0;
 }
 
-static void file_close(struct output_file *out)
+static int file_close(struct output_file *out)
 {
 	struct output_file_normal *outn = to_output_file_normal(out);
 
 	free(outn);
+	return 0;
 }
 
 static struct output_file_ops file_ops = {
@@ -249,12 +252,19 @@ static int gz_file_write(struct output_file *out, void *data, int len)
 	return 0;
 }
 
-static void gz_file_close(struct output_file *out)
+static int gz_file_close(struct output_file *out)
 {
 	struct output_file_gz *outgz = to_output_file_gz(out);
+	int ret;
 
-	gzclose(outgz->gz_fd);
+	/* flushes what zlib still holds */
+	ret = gzclose(outgz->gz_fd);
 	free(outgz);
+	if (ret != Z_OK) {
+		error("gzclose failed");
+		return -1;
+	}
+	return 0;
 }
 
 static struct output_file_ops gz_file_ops = {
@@ -288,9 +298,11 @@ static int callback_file_skip(struct output_file *out, int64_t off)
 	return 0;
 }
 
+/* write_all_blocks() has already skipped up to the full length, and the
+ * callback was told about that, so there is nothing left to pad */
 static int callback_file_pad(struct output_file *out __unused, int64_t len __unused)
 {
-	return -1;
+	return 0;
 }
 
 static int callback_file_write(struct output_file *out, void *data, int len)
@@ -300,11 +312,12 @@ static int callback_file_write(struct output_file *out, void *data, int len)
 	return outc->write(outc->priv, data, len);
 }
 
-static void callback_file_close(struct output_file *out)
+static int callback_file_close(struct output_file *out)
 {
 	struct output_file_callback *outc = to_output_file_callback(out);
 
 	free(outc);
+	return 0;
 }
 
 static struct output_file_ops callback_file_ops = {
@@ -315,6 +328,433 @@ static struct output_file_ops callback_file_ops = {
 	.close = callback_file_close,
 };
 
+#ifndef USE_MINGW
+/*
+ * The pipelined writer. Files written with a crc or through gzip spend
+ * most of their time on those rather than on reading the backing data, so
+ * the three run on separate threads: the caller copies each write into a
+ * queued piece, a crc thread checksums the pieces in order, and a write
+ * thread hands them to the ops of the file being written. Skips, pads and
+ * the crc of fill and don't care chunks travel through the same queue so
+ * that everything stays in order.
+ */
+
+/* Writes are copied into pieces of up to this */
+#define PIPE_BUF_SIZE (1024U*1024U)
+/* Pieces in flight between the caller and the write thread */
+#define PIPE_DEPTH 8
+
+enum pipe_op {
+	PIPE_WRITE,
+	PIPE_SKIP,
+	PIPE_PAD,
+	PIPE_CRC_FILL,
+};
+
+struct pipe_piece {
+	enum pipe_op op;
+	char *buf;
+	/* PIPE_WRITE: bytes of buf to write, and whether they count towards
+	 * the crc */
+	unsigned int len;
+	bool crc;
+	/* PIPE_SKIP, PIPE_PAD, PIPE_CRC_FILL: the length to skip, pad to or
+	 * checksum fill_val over */
+	int64_t arg;
+	uint32_t fill_val;
+};
+
+struct output_pipe {
+	/* ops of the file written to, out->ops being pipe_file_ops */
+	struct output_file_ops *ops;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	pthread_t crc_thread;
+	pthread_t write_thread;
+	bool crc_started;
+	bool write_started;
+	struct pipe_piece pieces[PIPE_DEPTH];
+	/* Pieces queued, checksummed and written so far. Piece n lives in
+	 * pieces[n % PIPE_DEPTH]. */
+	unsigned int queued;
+	unsigned int summed;
+	unsigned int written;
+	/* pieces[queued % PIPE_DEPTH] is a PIPE_WRITE being filled */
+	bool filling;
+	bool stopping;
+	int error;
+};
+
+static void *pipe_crc_thread(void *arg)
+{
+	struct output_file *out = arg;
+	struct output_pipe *pipe = out->pipe;
+	struct pipe_piece *piece;
+	uint32_t *fill;
+	int64_t len;
+	unsigned int i;
+
+	pthread_mutex_lock(&pipe->lock);
+	for (;;) {
+		while (pipe->summed == pipe->queued && !pipe->stopping) {
+			pthread_cond_wait(&pipe->cond, &pipe->lock);
+		}
+		if (pipe->summed == pipe->queued) {
+			break;
+		}
+		piece = &pipe->pieces[pipe->summed % PIPE_DEPTH];
+		pthread_mutex_unlock(&pipe->lock);
+
+		if (piece->op == PIPE_WRITE && piece->crc) {
+			out->crc32 = sparse_crc32(out->crc32, piece->buf, piece->len);
+		} else if (piece->op == PIPE_CRC_FILL) {
+			fill = (uint32_t *)piece->buf;
+			len = min(piece->arg, (int64_t)PIPE_BUF_SIZE);
+			for (i = 0; i < len / sizeof(uint32_t); i++) {
+				fill[i] = piece->fill_val;
+			}
+			for (len = piece->arg; len > 0; len -= PIPE_BUF_SIZE) {
+				out->crc32 = sparse_crc32(out->crc32, piece->buf,
+						min(len, (int64_t)PIPE_BUF_SIZE));
+			}
+		}
+
+		pthread_mutex_lock(&pipe->lock);
+		pipe->summed++;
+		pthread_cond_broadcast(&pipe->cond);
+	}
+	pthread_mutex_unlock(&pipe->lock);
+
+	return NULL;
+}
+
+static void *pipe_write_thread(void *arg)
+{
+	struct output_file *out = arg;
+	struct output_pipe *pipe = out->pipe;
+	struct pipe_piece *piece;
+	int failed;
+	int ret;
+
+	pthread_mutex_lock(&pipe->lock);
+	for (;;) {
+		while (pipe->written == pipe->summed &&
+				!(pipe->stopping && pipe->written == pipe->queued)) {
+			pthread_cond_wait(&pipe->cond, &pipe->lock);
+		}
+		if (pipe->written == pipe->summed) {
+			break;
+		}
+		piece = &pipe->pieces[pipe->written % PIPE_DEPTH];
+		failed = pipe->error;
+		pthread_mutex_unlock(&pipe->lock);
+
+		ret = 0;
+		if (!failed) {
+			switch (piece->op) {
+			case PIPE_WRITE:
+				ret = pipe->ops->write(out, piece->buf, piece->len);
+				break;
+			case PIPE_SKIP:
+				ret = pipe->ops->skip(out, piece->arg);
+				break;
+			case PIPE_PAD:
+				ret = pipe->ops->pad(out, piece->arg);
+				break;
+			case PIPE_CRC_FILL:
+				break;
+			}
+		}
+
+		pthread_mutex_lock(&pipe->lock);
+		if (ret < 0 && !pipe->error) {
+			pipe->error = ret;
+		}
+		pipe->written++;
+		pthread_cond_broadcast(&pipe->cond);
+	}
+	pthread_mutex_unlock(&pipe->lock);
+
+	return NULL;
+}
+
+/* Called with the lock held */
+static void pipe_submit_locked(struct output_pipe *pipe)
+{
+	pipe->filling = false;
+	pipe->queued++;
+	if (!pipe->crc_started) {
+		/* without a crc thread, pieces go straight to the write thread */
+		pipe->summed = pipe->queued;
+	}
+	pthread_cond_broadcast(&pipe->cond);
+}
+
+/* Returns a piece to fill in at the end of the queue, first submitting
+ * the PIPE_WRITE being filled unless it can take more with crc. Returns
+ * NULL once a write has failed. */
+static struct pipe_piece *pipe_get_piece(struct output_pipe *pipe,
+		enum pipe_op op, bool crc)
+{
+	struct pipe_piece *piece = &pipe->pieces[pipe->queued % PIPE_DEPTH];
+
+	if (pipe->filling && op == PIPE_WRITE && piece->crc == crc &&
+			piece->len < PIPE_BUF_SIZE) {
+		return piece;
+	}
+
+	pthread_mutex_lock(&pipe->lock);
+	if (pipe->filling) {
+		pipe_submit_locked(pipe);
+	}
+	while (pipe->queued - pipe->written == PIPE_DEPTH && !pipe->error) {
+		pthread_cond_wait(&pipe->cond, &pipe->lock);
+	}
+	if (pipe->error) {
+		pthread_mutex_unlock(&pipe->lock);
+		return NULL;
+	}
+	pthread_mutex_unlock(&pipe->lock);
+
+	piece = &pipe->pieces[pipe->queued % PIPE_DEPTH];
+	piece->op = op;
+	piece->len = 0;
+	piece->crc = crc;
+	if (op == PIPE_WRITE) {
+		pipe->filling = true;
+	}
+	return piece;
+}
+
+static int pipe_queue_write(struct output_file *out, void *data, int len,
+		bool crc)
+{
+	struct output_pipe *pipe = out->pipe;
+	struct pipe_piece *piece;
+	unsigned int copy;
+
+	while (len > 0) {
+		piece = pipe_get_piece(pipe, PIPE_WRITE, crc);
+		if (!piece) {
+			return -1;
+		}
+		copy = min((unsigned int)len, PIPE_BUF_SIZE - piece->len);
+		memcpy(piece->buf + piece->len, data, copy);
+		piece->len += copy;
+		data = (char *)data + copy;
+		len -= copy;
+	}
+
+	return 0;
+}
+
+static int pipe_queue_op(struct output_file *out, enum pipe_op op,
+		int64_t arg, uint32_t fill_val)
+{
+	struct output_pipe *pipe = out->pipe;
+	struct pipe_piece *piece;
+
+	piece = pipe_get_piece(pipe, op, false);
+	if (!piece) {
+		return -1;
+	}
+	piece->arg = arg;
+	piece->fill_val = fill_val;
+
+	pthread_mutex_lock(&pipe->lock);
+	pipe_submit_locked(pipe);
+	pthread_mutex_unlock(&pipe->lock);
+
+	return 0;
+}
+
+/* Wait until everything queued has been checksummed, so that out->crc32
+ * is up to date */
+static int pipe_sync_crc(struct output_file *out)
+{
+	struct output_pipe *pipe = out->pipe;
+	int ret;
+
+	pthread_mutex_lock(&pipe->lock);
+	if (pipe->filling) {
+		pipe_submit_locked(pipe);
+	}
+	while (pipe->summed != pipe->queued) {
+		pthread_cond_wait(&pipe->cond, &pipe->lock);
+	}
+	ret = pipe->error;
+	pthread_mutex_unlock(&pipe->lock);
+
+	return ret;
+}
+
+static int pipe_file_skip(struct output_file *out, int64_t cnt)
+{
+	return pipe_queue_op(out, PIPE_SKIP, cnt, 0);
+}
+
+static int pipe_file_pad(struct output_file *out, int64_t len)
+{
+	return pipe_queue_op(out, PIPE_PAD, len, 0);
+}
+
+static int pipe_file_write(struct output_file *out, void *data, int len)
+{
+	return pipe_queue_write(out, data, len, false);
+}
+
+/* Drain the queue and stop the threads, leaving out to its own ops again.
+ * Returns the first error writing, if any. */
+static int output_pipe_stop(struct output_file *out)
+{
+	struct output_pipe *pipe = out->pipe;
+	int ret;
+	int i;
+
+	pthread_mutex_lock(&pipe->lock);
+	if (pipe->filling) {
+		pipe_submit_locked(pipe);
+	}
+	pipe->stopping = true;
+	pthread_cond_broadcast(&pipe->cond);
+	pthread_mutex_unlock(&pipe->lock);
+
+	if (pipe->crc_started) {
+		pthread_join(pipe->crc_thread, NULL);
+	}
+	if (pipe->write_started) {
+		pthread_join(pipe->write_thread, NULL);
+	}
+
+	ret = pipe->error;
+	out->ops = pipe->ops;
+	out->pipe = NULL;
+
+	for (i = 0; i < PIPE_DEPTH; i++) {
+		free(pipe->pieces[i].buf);
+	}
+	pthread_cond_destroy(&pipe->cond);
+	pthread_mutex_destroy(&pipe->lock);
+	free(pipe);
+
+	return ret;
+}
+
+/* Returns the first error writing, the last buffers included */
+static int pipe_file_close(struct output_file *out)
+{
+	int ret;
+	int close_ret;
+
+	ret = output_pipe_stop(out);
+	close_ret = out->ops->close(out);
+
+	return ret < 0 ? ret : close_ret;
+}
+
+static struct output_file_ops pipe_file_ops = {
+	.skip = pipe_file_skip,
+	.pad = pipe_file_pad,
+	.write = pipe_file_write,
+	.close = pipe_file_close,
+};
+
+/* Put a pipeline in front of out's own ops. If that is not possible, out
+ * is left to write synchronously. */
+static void output_pipe_start(struct output_file *out)
+{
+	struct output_pipe *pipe;
+	int i;
+
+	pipe = calloc(1, sizeof(struct output_pipe));
+	if (!pipe) {
+		return;
+	}
+	for (i = 0; i < PIPE_DEPTH; i++) {
+		pipe->pieces[i].buf = malloc(PIPE_BUF_SIZE);
+		if (!pipe->pieces[i].buf) {
+			goto err_buf;
+		}
+	}
+	pthread_mutex_init(&pipe->lock, NULL);
+	pthread_cond_init(&pipe->cond, NULL);
+	pipe->ops = out->ops;
+	out->pipe = pipe;
+	out->ops = &pipe_file_ops;
+
+	if (pthread_create(&pipe->write_thread, NULL, pipe_write_thread, out)) {
+		output_pipe_stop(out);
+		return;
+	}
+	pipe->write_started = true;
+
+	if (out->use_crc) {
+		pipe->crc_started = pthread_create(&pipe->crc_thread, NULL,
+				pipe_crc_thread, out) == 0;
+		if (!pipe->crc_started) {
+			output_pipe_stop(out);
+		}
+	}
+	return;
+
+err_buf:
+	for (i = 0; i < PIPE_DEPTH; i++) {
+		free(pipe->pieces[i].buf);
+	}
+	free(pipe);
+}
+#endif
+
+/* Write data that counts towards the crc of the expanded image */
+static int write_checksummed(struct output_file *out, void *data, int len)
+{
+	int ret;
+
+#ifndef USE_MINGW
+	if (out->pipe) {
+		return pipe_queue_write(out, data, len, out->use_crc);
+	}
+#endif
+
+	ret = out->ops->write(out, data, len);
+	if (ret < 0) {
+		return ret;
+	}
+	if (out->use_crc) {
+		out->crc32 = sparse_crc32(out->crc32, data, len);
+	}
+
+	return 0;
+}
+
+/* Add len bytes of fill_val to the crc of the expanded image */
+static int checksum_fill(struct output_file *out, uint32_t fill_val,
+		int64_t len)
+{
+	unsigned int i;
+
+	if (!out->use_crc) {
+		return 0;
+	}
+
+#ifndef USE_MINGW
+	if (out->pipe) {
+		return pipe_queue_op(out, PIPE_CRC_FILL, len, fill_val);
+	}
+#endif
+
+	for (i = 0; i < out->block_size / sizeof(uint32_t); i++) {
+		out->fill_buf[i] = fill_val;
+	}
+	while (len > 0) {
+		out->crc32 = sparse_crc32(out->crc32, out->fill_buf,
+				min(len, (int64_t)out->block_size));
+		len -= out->block_size;
+	}
+
+	return 0;
+}
+
 int read_all(int fd, void *buf, size_t len)
 {
 	size_t total = 0;
@@ -357,6 +797,11 @@ static int write_sparse_skip_chunk(struct output_file *out, int64_t skip_len)
 	if (ret < 0)
 		return -1;
 
+	/* The crc covers what the chunk expands to, which is zeros */
+	ret = checksum_fill(out, 0, skip_len);
+	if (ret < 0)
+		return -1;
+
 	out->cur_out_ptr += skip_len;
 	out->chunk_cnt++;
 
@@ -367,7 +812,7 @@ static int write_sparse_fill_chunk(struct output_file *out, unsigned int len,
 		uint32_t fill_val)
 {
 	chunk_header_t chunk_header;
-	int rnd_up_len, count;
+	int rnd_up_len;
 	int ret;
 
 	/* Round up the fill length to a multiple of the block size */
@@ -386,11 +831,9 @@ static int write_sparse_fill_chunk(struct output_file *out, unsigned int len,
 	if (ret < 0)
 		return -1;
 
-	if (out->use_crc) {
-		count = out->block_size / sizeof(uint32_t);
-		while (count--)
-			out->crc32 = sparse_crc32(out->crc32, &fill_val, sizeof(uint32_t));
-	}
+	ret = checksum_fill(out, fill_val, rnd_up_len);
+	if (ret < 0)
+		return -1;
 
 	out->cur_out_ptr += rnd_up_len;
 	out->chunk_cnt++;
@@ -418,21 +861,15 @@ static int write_sparse_data_chunk(struct output_file *out, unsigned int len,
 
 	if (ret < 0)
 		return -1;
-	ret = out->ops->write(out, data, len);
+	ret = write_checksummed(out, data, len);
 	if (ret < 0)
 		return -1;
 	if (zero_len) {
-		ret = out->ops->write(out, out->zero_buf, zero_len);
+		ret = write_checksummed(out, out->zero_buf, zero_len);
 		if (ret < 0)
 			return -1;
 	}
 
-	if (out->use_crc) {
-		out->crc32 = sparse_crc32(out->crc32, data, len);
-		if (zero_len)
-			out->crc32 = sparse_crc32(out->crc32, out->zero_buf, zero_len);
-	}
-
 	out->cur_out_ptr += rnd_up_len;
 	out->chunk_cnt++;
 
@@ -445,6 +882,14 @@ int write_sparse_end_chunk(struct output_file *out)
 	int ret;
 
 	if (out->use_crc) {
+#ifndef USE_MINGW
+		if (out->pipe) {
+			ret = pipe_sync_crc(out);
+			if (ret < 0) {
+				return ret;
+			}
+		}
+#endif
 		chunk_header.chunk_type = CHUNK_TYPE_CRC32;
 		chunk_header.reserved1 = 0;
 		chunk_header.chunk_sz = 0;
@@ -454,7 +899,7 @@ int write_sparse_end_chunk(struct output_file *out)
 		if (ret < 0) {
 			return ret;
 		}
-		out->ops->write(out, &out->crc32, 4);
+		ret = out->ops->write(out, &out->crc32, 4);
 		if (ret < 0) {
 			return ret;
 		}
@@ -532,10 +977,15 @@ static struct sparse_file_ops normal_file_ops = {
 		.write_end_chunk = write_normal_end_chunk,
 };
 
-void output_file_close(struct output_file *out)
+int output_file_close(struct output_file *out)
 {
-	out->sparse_ops->write_end_chunk(out);
-	out->ops->close(out);
+	int ret;
+	int close_ret;
+
+	ret = out->sparse_ops->write_end_chunk(out);
+	close_ret = out->ops->close(out);
+
+	return ret < 0 ? ret : close_ret;
 }
 
 static int output_file_init(struct output_file *out, int block_size,
@@ -670,8 +1120,21 @@ struct output_file *output_file_open_fd(int fd, unsigned int block_size, int64_t
 
 	out->ops->open(out, fd);
 
+#ifndef USE_MINGW
+	/* Overlap checksumming and compression with reading the data */
+	out->use_crc = crc;
+	if (gz || (sparse && crc)) {
+		output_pipe_start(out);
+	}
+#endif
+
 	ret = output_file_init(out, block_size, len, sparse, chunks, crc);
 	if (ret < 0) {
+#ifndef USE_MINGW
+		if (out->pipe) {
+			output_pipe_stop(out);
+		}
+#endif
 		free(out);
 		return NULL;
 	}
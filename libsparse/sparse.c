@@ -153,6 +153,7 @@ int sparse_file_write(struct sparse_file *s, int fd, bool gz, bool sparse,
 		bool crc)
 {
 	int ret;
+	int close_ret;
 	int chunks;
 	struct output_file *out;
 
@@ -164,15 +165,17 @@ int sparse_file_write(struct sparse_file *s, int fd, bool gz, bool sparse,
 
 	ret = write_all_blocks(s, out);
 
-	output_file_close(out);
+	/* the last of the output may only be written, or fail, on close */
+	close_ret = output_file_close(out);
 
-	return ret;
+	return ret < 0 ? ret : close_ret;
 }
 
 int sparse_file_callback(struct sparse_file *s, bool sparse, bool crc,
 		int (*write)(void *priv, const void *data, int len), void *priv)
 {
 	int ret;
+	int close_ret;
 	int chunks;
 	struct output_file *out;
 
@@ -185,9 +188,10 @@ int sparse_file_callback(struct sparse_file *s, bool sparse, bool crc,
 
 	ret = write_all_blocks(s, out);
 
-	output_file_close(out);
+	/* the last of the output may only be written, or fail, on close */
+	close_ret = output_file_close(out);
 
-	return ret;
+	return ret < 0 ? ret : close_ret;
 }
 
 static int out_counter_write(void *priv, const void *data __unused, int len)
@@ -212,9 +216,7 @@ int64_t sparse_file_len(struct sparse_file *s, bool sparse, bool crc)
 
 	ret = write_all_blocks(s, out);
 
-	output_file_close(out);
-
-	if (ret < 0) {
+	if (output_file_close(out) < 0 || ret < 0) {
 		return -1;
 	}
 
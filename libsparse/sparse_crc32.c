@@ -43,8 +43,11 @@
  */
 
 /* Code taken from FreeBSD 8 */
+#include <stddef.h>
 #include <stdint.h>
 
+#include "sparse_crc32.h"
+
 static uint32_t crc32_tab[] = {
         0x00000000, 0x77073096, 0xee0e612c, 0x990951ba, 0x076dc419, 0x706af48f,
         0xe963a535, 0x9e6495a3, 0x0edb8832, 0x79dcb8a4, 0xe0d5e91e, 0x97d2d988,
@@ -92,20 +95,218 @@ static uint32_t crc32_tab[] = {
 };
 
 /*
- * A function that calculates the CRC-32 based on the table above is
- * given below for documentation purposes. An equivalent implementation
- * of this function that's actually used in the kernel can be found
- * in sys/libkern.h, where it can be inlined.
+ * The table above takes a byte at a time. crc32_slice_tab extends it to
+ * take eight bytes at a time ("slicing-by-8"): entry k of it gives the
+ * effect of a byte followed by k zero bytes, so the eight lookups of a
+ * step are independent of each other. It is filled in from crc32_tab on
+ * first use.
+ */
+static uint32_t crc32_slice_tab[8][256];
+
+static void crc32_init_slice_tab(void)
+{
+	unsigned int i, k;
+
+	for (i = 0; i < 256; i++) {
+		crc32_slice_tab[0][i] = crc32_tab[i];
+	}
+	for (k = 1; k < 8; k++) {
+		for (i = 0; i < 256; i++) {
+			uint32_t c = crc32_slice_tab[k - 1][i];
+			crc32_slice_tab[k][i] = crc32_tab[c & 0xFF] ^ (c >> 8);
+		}
+	}
+}
+
+static inline uint32_t load_le32(const uint8_t *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+/* Operates on the inverted crc, as sparse_crc32() passes it in */
+static uint32_t crc32_slice8(uint32_t crc, const uint8_t *p, size_t size)
+{
+	const uint32_t (*t)[256] = crc32_slice_tab;
+
+	while (size >= 8) {
+		uint32_t lo = crc ^ load_le32(p);
+		uint32_t hi = load_le32(p + 4);
+		crc = t[7][lo & 0xFF] ^ t[6][(lo >> 8) & 0xFF] ^
+				t[5][(lo >> 16) & 0xFF] ^ t[4][lo >> 24] ^
+				t[3][hi & 0xFF] ^ t[2][(hi >> 8) & 0xFF] ^
+				t[1][(hi >> 16) & 0xFF] ^ t[0][hi >> 24];
+		p += 8;
+		size -= 8;
+	}
+	while (size--) {
+		crc = crc32_tab[(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+	}
+	return crc;
+}
+
+/*
+ * The intrinsics are only usable in a function built for sse4.1 and
+ * pclmul, without those flags for the whole file, from GCC 4.9 and
+ * clang 3.8 (Apple clang 8) on.
+ */
+#if defined(__PCLMUL__) && defined(__SSE4_1__)
+#define CRC32_CLMUL_TARGET_OK 1
+#elif defined(__apple_build_version__)
+#define CRC32_CLMUL_TARGET_OK (__clang_major__ >= 8)
+#elif defined(__clang__)
+#define CRC32_CLMUL_TARGET_OK \
+		(__clang_major__ > 3 || (__clang_major__ == 3 && __clang_minor__ >= 8))
+#elif defined(__GNUC__)
+#define CRC32_CLMUL_TARGET_OK \
+		(__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+#else
+#define CRC32_CLMUL_TARGET_OK 0
+#endif
+
+#if (defined(__x86_64__) || defined(__i386__)) && CRC32_CLMUL_TARGET_OK
+#include <cpuid.h>
+#include <immintrin.h>
+
+#define HAVE_CRC32_CLMUL 1
+
+/*
+ * Carry-less multiplication, after "Fast CRC Computation for Generic
+ * Polynomials Using PCLMULQDQ Instruction" (Intel, 2009). Four 128 bit
+ * lanes are folded forward 64 bytes at a time, then folded into one, and
+ * Barrett reduced to 32 bits. The constants are those of the paper for
+ * the bit reflected polynomial 0xedb88320. size must be at least 64 and
+ * a multiple of 16. Operates on the inverted crc.
  */
+__attribute__((target("sse4.1,pclmul")))
+static uint32_t crc32_clmul(uint32_t crc, const uint8_t *p, size_t size)
+{
+	static const uint64_t k1k2[2] __attribute__((aligned(16))) =
+			{ 0x0154442bd4ULL, 0x01c6e41596ULL };
+	static const uint64_t k3k4[2] __attribute__((aligned(16))) =
+			{ 0x01751997d0ULL, 0x00ccaa009eULL };
+	static const uint64_t k5k0[2] __attribute__((aligned(16))) =
+			{ 0x0163cd6124ULL, 0x0000000000ULL };
+	static const uint64_t poly[2] __attribute__((aligned(16))) =
+			{ 0x01db710641ULL, 0x01f7011641ULL };
+	__m128i x0, x1, x2, x3, x4, x5, x6, x7, x8;
+
+	x1 = _mm_loadu_si128((const __m128i *)(p + 0x00));
+	x2 = _mm_loadu_si128((const __m128i *)(p + 0x10));
+	x3 = _mm_loadu_si128((const __m128i *)(p + 0x20));
+	x4 = _mm_loadu_si128((const __m128i *)(p + 0x30));
+	x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(crc));
+	x0 = _mm_load_si128((const __m128i *)k1k2);
+	p += 64;
+	size -= 64;
+
+	while (size >= 64) {
+		x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+		x6 = _mm_clmulepi64_si128(x2, x0, 0x00);
+		x7 = _mm_clmulepi64_si128(x3, x0, 0x00);
+		x8 = _mm_clmulepi64_si128(x4, x0, 0x00);
+		x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+		x2 = _mm_clmulepi64_si128(x2, x0, 0x11);
+		x3 = _mm_clmulepi64_si128(x3, x0, 0x11);
+		x4 = _mm_clmulepi64_si128(x4, x0, 0x11);
+		x1 = _mm_xor_si128(_mm_xor_si128(x1, x5),
+				_mm_loadu_si128((const __m128i *)(p + 0x00)));
+		x2 = _mm_xor_si128(_mm_xor_si128(x2, x6),
+				_mm_loadu_si128((const __m128i *)(p + 0x10)));
+		x3 = _mm_xor_si128(_mm_xor_si128(x3, x7),
+				_mm_loadu_si128((const __m128i *)(p + 0x20)));
+		x4 = _mm_xor_si128(_mm_xor_si128(x4, x8),
+				_mm_loadu_si128((const __m128i *)(p + 0x30)));
+		p += 64;
+		size -= 64;
+	}
+
+	/* Fold the four lanes into one */
+	x0 = _mm_load_si128((const __m128i *)k3k4);
+	x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x2), x5);
+	x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x3), x5);
+	x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+	x1 = _mm_xor_si128(_mm_xor_si128(x1, x4), x5);
+
+	while (size >= 16) {
+		x5 = _mm_clmulepi64_si128(x1, x0, 0x00);
+		x1 = _mm_clmulepi64_si128(x1, x0, 0x11);
+		x1 = _mm_xor_si128(_mm_xor_si128(x1, x5),
+				_mm_loadu_si128((const __m128i *)p));
+		p += 16;
+		size -= 16;
+	}
+
+	/* Fold 128 bits to 64 */
+	x2 = _mm_clmulepi64_si128(x1, x0, 0x10);
+	x3 = _mm_setr_epi32(~0, 0, ~0, 0);
+	x1 = _mm_srli_si128(x1, 8);
+	x1 = _mm_xor_si128(x1, x2);
+	x0 = _mm_loadl_epi64((const __m128i *)k5k0);
+	x2 = _mm_srli_si128(x1, 4);
+	x1 = _mm_and_si128(x1, x3);
+	x1 = _mm_clmulepi64_si128(x1, x0, 0x00);
+	x1 = _mm_xor_si128(x1, x2);
+
+	/* Barrett reduce to 32 bits */
+	x0 = _mm_load_si128((const __m128i *)poly);
+	x2 = _mm_and_si128(x1, x3);
+	x2 = _mm_clmulepi64_si128(x2, x0, 0x10);
+	x2 = _mm_and_si128(x2, x3);
+	x2 = _mm_clmulepi64_si128(x2, x0, 0x00);
+	x1 = _mm_xor_si128(x1, x2);
+
+	return _mm_extract_epi32(x1, 1);
+}
 
-uint32_t sparse_crc32(uint32_t crc_in, const void *buf, int size)
+static int crc32_have_clmul(void)
 {
-        const uint8_t *p = buf;
-        uint32_t crc;
+	unsigned int eax, ebx, ecx, edx;
 
-        crc = crc_in ^ ~0U;
-        while (size--)
-                crc = crc32_tab[(crc ^ *p++) & 0xFF] ^ (crc >> 8);
-        return crc ^ ~0U;
+	if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx)) {
+		return 0;
+	}
+	return (ecx & bit_PCLMUL) && (ecx & bit_SSE4_1);
 }
+#endif
 
+/* -1 until the first call has set up the tables and looked at the cpu */
+static volatile int crc32_use_clmul = -1;
+
+static void crc32_init(void)
+{
+	int use_clmul = 0;
+
+	crc32_init_slice_tab();
+#ifdef HAVE_CRC32_CLMUL
+	use_clmul = crc32_have_clmul();
+#endif
+	__sync_synchronize();
+	crc32_use_clmul = use_clmul;
+}
+
+uint32_t sparse_crc32(uint32_t crc_in, const void *buf, size_t size)
+{
+	const uint8_t *p = buf;
+	uint32_t crc;
+
+	if (crc32_use_clmul < 0) {
+		crc32_init();
+	}
+
+	crc = crc_in ^ ~0U;
+#ifdef HAVE_CRC32_CLMUL
+	if (crc32_use_clmul && size >= 64) {
+		size_t bulk = size & ~(size_t)15;
+		crc = crc32_clmul(crc, p, bulk);
+		p += bulk;
+		size -= bulk;
+	}
+#endif
+	crc = crc32_slice8(crc, p, size);
+	return crc ^ ~0U;
+}
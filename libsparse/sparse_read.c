@@ -27,6 +27,11 @@
 #include <string.h>
 #include <unistd.h>
 
+#ifndef USE_MINGW
+#include <pthread.h>
+#include <sys/mman.h>
+#endif
+
 #include <sparse/sparse.h>
 
 #include "defs.h"
@@ -37,6 +42,7 @@
 
 #if defined(__APPLE__) && defined(__MACH__)
 #define lseek64 lseek
+#define mmap64 mmap
 #define off64_t off_t
 #endif
 
@@ -47,6 +53,12 @@
 #define COPY_BUF_SIZE (1024U*1024U)
 static char *copybuf;
 
+/* Raw images are mapped, or read, and scanned this much at a time */
+#define READ_BATCH_SIZE (16U*1024U*1024U)
+/* Blocks a scanning thread claims at a time */
+#define SCAN_SLICE_BLOCKS 256U
+#define MAX_SCAN_THREADS 8
+
 #define min(a, b) \
 	({ typeof(a) _a = (a); typeof(b) _b = (b); (_a < _b) ? _a : _b; })
 
@@ -353,54 +365,242 @@ static int sparse_file_read_sparse(struct sparse_file *s, int fd, bool crc)
 	return 0;
 }
 
-static int sparse_file_read_normal(struct sparse_file *s, int fd)
+/* A block is a fill block if every 32 bit word in it matches the first.
+ * Comparing the block against itself one word along leaves the work to
+ * memcmp(), which uses whatever vector instructions the C library has,
+ * and stops at the first mismatch, which for a data block is nearly
+ * always within the first few words. */
+static bool block_is_fill(const char *block, unsigned int block_size,
+		uint32_t *fill_val)
 {
-	int ret;
-	uint32_t *buf = malloc(s->block_size);
-	unsigned int block = 0;
-	int64_t remain = s->len;
-	int64_t offset = 0;
-	unsigned int to_read;
+	const uint32_t *words = (const uint32_t *)block;
+
+	if (words[0] != words[1]) {
+		return false;
+	}
+	if (memcmp(block, block + sizeof(uint32_t),
+			block_size - sizeof(uint32_t)) != 0) {
+		return false;
+	}
+	*fill_val = words[0];
+	return true;
+}
+
+struct scan_job {
+	const char *data;
+	unsigned int block_size;
+	unsigned int blocks;
+	unsigned int slices;
+	/* next slice to claim, shared by the scanning threads */
+	unsigned int next_slice;
+	bool *is_fill;
+	uint32_t *fill_val;
+};
+
+static void *scan_slices(void *arg)
+{
+	struct scan_job *job = arg;
+	unsigned int slice;
 	unsigned int i;
-	bool sparse_block;
+	unsigned int end;
+
+	while ((slice = __sync_fetch_and_add(&job->next_slice, 1)) < job->slices) {
+		i = slice * SCAN_SLICE_BLOCKS;
+		end = min(i + SCAN_SLICE_BLOCKS, job->blocks);
+		for (; i < end; i++) {
+			job->is_fill[i] = block_is_fill(
+					job->data + (size_t)i * job->block_size,
+					job->block_size, &job->fill_val[i]);
+		}
+	}
 
-	if (!buf) {
-		return -ENOMEM;
+	return NULL;
+}
+
+/* Classify every whole block of a batch, on up to num_threads threads
+ * including the caller's own */
+static void scan_batch(struct scan_job *job, int num_threads)
+{
+#ifndef USE_MINGW
+	pthread_t threads[MAX_SCAN_THREADS];
+	int started = 0;
+#endif
+
+	job->slices = DIV_ROUND_UP(job->blocks, SCAN_SLICE_BLOCKS);
+	job->next_slice = 0;
+
+#ifndef USE_MINGW
+	num_threads = min(num_threads, (int)job->slices);
+	while (started < num_threads - 1 &&
+			pthread_create(&threads[started], NULL, scan_slices, job) == 0) {
+		started++;
 	}
+#endif
 
-	while (remain > 0) {
-		to_read = min(remain, s->block_size);
-		ret = read_all(fd, buf, to_read);
+	scan_slices(job);
+
+#ifndef USE_MINGW
+	while (started > 0) {
+		pthread_join(threads[--started], NULL);
+	}
+#endif
+}
+
+/* Add the blocks of a scanned batch to the sparse file in order, one call
+ * per run of data blocks or of blocks with the same fill value. A partial
+ * block at the end of the file is always data. */
+static int add_batch(struct sparse_file *s, int fd, struct scan_job *job,
+		unsigned int len, int64_t offset, unsigned int block, bool skip_zero)
+{
+	unsigned int blocks = DIV_ROUND_UP(len, s->block_size);
+	unsigned int start = 0;
+	unsigned int run_len;
+	unsigned int i;
+	int ret = 0;
+
+	if (job->blocks < blocks) {
+		job->is_fill[job->blocks] = false;
+	}
+
+	for (i = 1; i <= blocks; i++) {
+		if (i < blocks && job->is_fill[i] == job->is_fill[start] &&
+				(!job->is_fill[i] ||
+				 job->fill_val[i] == job->fill_val[start])) {
+			continue;
+		}
+
+		run_len = min(len, i * s->block_size) - start * s->block_size;
+		if (!job->is_fill[start]) {
+			ret = sparse_file_add_fd(s, fd,
+					offset + (int64_t)start * s->block_size, run_len,
+					block + start);
+		} else if (!skip_zero || job->fill_val[start] != 0) {
+			ret = sparse_file_add_fill(s, job->fill_val[start], run_len,
+					block + start);
+		}
 		if (ret < 0) {
-			error("failed to read sparse file");
 			return ret;
 		}
+		start = i;
+	}
+
+	return 0;
+}
+
+static int default_scan_threads(void)
+{
+#ifndef USE_MINGW
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	if (cpus > 0) {
+		return min(cpus, (long)MAX_SCAN_THREADS);
+	}
+#endif
+	return 1;
+}
+
+int sparse_file_read_raw(struct sparse_file *s, int fd, bool skip_zero,
+		int num_threads)
+{
+	int ret = 0;
+	unsigned int batch_blocks = READ_BATCH_SIZE / s->block_size;
+	unsigned int batch_size;
+	unsigned int block = 0;
+	int64_t remain = s->len;
+	int64_t offset = 0;
+	unsigned int len;
+	char *buf = NULL;
+	bool use_mmap = true;
+	struct scan_job job;
+#ifndef USE_MINGW
+	int64_t aligned_offset;
+	size_t aligned_diff;
+	char *map;
+#endif
+
+	/* at least one block per batch, however large the blocks */
+	if (batch_blocks == 0) {
+		batch_blocks = 1;
+	}
+	batch_size = batch_blocks * s->block_size;
+
+	if (num_threads <= 0) {
+		num_threads = default_scan_threads();
+	}
+	num_threads = min(num_threads, MAX_SCAN_THREADS);
+
+	memset(&job, 0, sizeof(job));
+	job.block_size = s->block_size;
+	/* one extra entry for a partial block at the end */
+	job.is_fill = malloc(batch_blocks + 1);
+	job.fill_val = malloc(batch_blocks * sizeof(uint32_t));
+	if (!job.is_fill || !job.fill_val) {
+		ret = -ENOMEM;
+		goto out;
+	}
 
-		if (to_read == s->block_size) {
-			sparse_block = true;
-			for (i = 1; i < s->block_size / sizeof(uint32_t); i++) {
-				if (buf[0] != buf[i]) {
-					sparse_block = false;
-					break;
+	while (remain > 0) {
+		len = min(remain, (int64_t)batch_size);
+#ifndef USE_MINGW
+		/* Map the batch rather than copy it in, unless fd cannot be
+		 * mapped, in which case it is read sequentially from the start */
+		aligned_offset = offset & ~(4096 - 1);
+		aligned_diff = offset - aligned_offset;
+		map = MAP_FAILED;
+		if (use_mmap) {
+			map = mmap64(NULL, len + aligned_diff, PROT_READ, MAP_SHARED, fd,
+					aligned_offset);
+			if (map == MAP_FAILED) {
+				if (offset > 0) {
+					ret = -errno;
+					goto out;
 				}
+				use_mmap = false;
 			}
-		} else {
-			sparse_block = false;
+		}
+		if (map != MAP_FAILED) {
+			job.data = map + aligned_diff;
+		} else
+#endif
+		{
+			use_mmap = false;
+			if (!buf) {
+				buf = malloc(batch_size);
+				if (!buf) {
+					ret = -ENOMEM;
+					goto out;
+				}
+			}
+			ret = read_all(fd, buf, len);
+			if (ret < 0) {
+				error("failed to read sparse file");
+				goto out;
+			}
+			job.data = buf;
 		}
 
-		if (sparse_block) {
-			/* TODO: add flag to use skip instead of fill for buf[0] == 0 */
-			sparse_file_add_fill(s, buf[0], to_read, block);
-		} else {
-			sparse_file_add_fd(s, fd, offset, to_read, block);
+		job.blocks = len / s->block_size;
+		scan_batch(&job, num_threads);
+		ret = add_batch(s, fd, &job, len, offset, block, skip_zero);
+
+#ifndef USE_MINGW
+		if (map != MAP_FAILED) {
+			munmap(map, len + aligned_diff);
+		}
+#endif
+		if (ret < 0) {
+			goto out;
 		}
 
-		remain -= to_read;
-		offset += to_read;
-		block++;
+		remain -= len;
+		offset += len;
+		block += batch_blocks;
 	}
 
-	return 0;
+out:
+	free(buf);
+	free(job.is_fill);
+	free(job.fill_val);
+	return ret;
 }
 
 int sparse_file_read(struct sparse_file *s, int fd, bool sparse, bool crc)
@@ -412,7 +612,7 @@ int sparse_file_read(struct sparse_file *s, int fd, bool sparse, bool crc)
 	if (sparse) {
 		return sparse_file_read_sparse(s, fd, crc);
 	} else {
-		return sparse_file_read_normal(s, fd);
+		return sparse_file_read_raw(s, fd, false, 0);
 	}
 }
 
@@ -495,7 +695,7 @@ struct sparse_file *sparse_file_import_auto(int fd, bool crc)
 		return NULL;
 	}
 
-	ret = sparse_file_read_normal(s, fd);
+	ret = sparse_file_read_raw(s, fd, false, 0);
 	if (ret < 0) {
 		sparse_file_destroy(s);
 		return NULL;
@@ -0,0 +1,540 @@
+/*
+ * Copyright (C) 2014 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <gtest/gtest.h>
+#include <sparse/sparse.h>
+#include <zlib.h>
+
+extern "C" {
+#include "../backed_block.h"
+#include "../sparse_crc32.h"
+}
+
+#define BENCH_BLOCK_SIZE 4096
+// Raw image scanned by the benchmarks, in blocks
+#define BENCH_BLOCKS (64 * 1024)
+#define BENCH_ROUNDS 4
+// Blocks queued in random order by the backed block benchmark
+#define BENCH_QUEUED_BLOCKS (256 * 1024)
+
+#if defined(__ANDROID__)
+#define BENCH_TMPDIR "/data/local/tmp"
+#else
+#define BENCH_TMPDIR "/tmp"
+#endif
+
+static uint64_t nsecs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// A raw image made like a freshly built filesystem: runs of up to 64
+// blocks, about half of them zeros, a tenth some other fill value and the
+// rest data.
+class RawImage {
+    char mPath[PATH_MAX];
+    int mFd;
+    int64_t mLen;
+    char *mContents;
+
+public:
+    RawImage() : mFd(-1), mLen(0), mContents(NULL) {
+        mPath[0] = '\0';
+    }
+
+    ~RawImage() {
+        if (mFd >= 0) {
+            close(mFd);
+        }
+        if (mPath[0]) {
+            unlink(mPath);
+        }
+        free(mContents);
+    }
+
+    bool create(unsigned blocks) {
+        snprintf(mPath, sizeof(mPath), "%s/libsparse-benchmark.XXXXXX",
+                BENCH_TMPDIR);
+        mFd = mkstemp(mPath);
+        if (mFd < 0) {
+            mPath[0] = '\0';
+            return false;
+        }
+
+        mLen = (int64_t) blocks * BENCH_BLOCK_SIZE;
+        mContents = (char *) calloc(1, mLen);
+        if (!mContents) {
+            return false;
+        }
+
+        uint32_t seed = 2463534242U;
+        unsigned block = 0;
+        while (block < blocks) {
+            seed ^= seed << 13; seed ^= seed >> 17; seed ^= seed << 5;
+            unsigned run = 1 + seed % 64;
+            unsigned kind = (seed >> 8) % 10;
+            if (run > blocks - block) {
+                run = blocks - block;
+            }
+            uint32_t *words = (uint32_t *) (mContents +
+                    (size_t) block * BENCH_BLOCK_SIZE);
+            size_t count = (size_t) run * BENCH_BLOCK_SIZE / sizeof(uint32_t);
+            for (size_t i = 0; i < count; i++) {
+                if (kind < 5) {
+                    words[i] = 0;
+                } else if (kind < 6) {
+                    words[i] = 0xffffffff;
+                } else {
+                    seed ^= seed << 13; seed ^= seed >> 17; seed ^= seed << 5;
+                    words[i] = seed;
+                }
+            }
+            block += run;
+        }
+
+        return write(mFd, mContents, mLen) == mLen;
+    }
+
+    int fd() const { return mFd; }
+    int64_t len() const { return mLen; }
+    const char *contents() const { return mContents; }
+};
+
+// The per block read and scan that sparse_file_read_raw() replaced
+static int read_legacy(struct sparse_file *s, int fd, int64_t len) {
+    uint32_t buf[BENCH_BLOCK_SIZE / sizeof(uint32_t)];
+    unsigned block = 0;
+    int64_t offset = 0;
+
+    lseek(fd, 0, SEEK_SET);
+    while (offset < len) {
+        unsigned to_read = len - offset < BENCH_BLOCK_SIZE ?
+                len - offset : BENCH_BLOCK_SIZE;
+        if (read(fd, buf, to_read) != (ssize_t) to_read) {
+            return -1;
+        }
+        bool fill = to_read == BENCH_BLOCK_SIZE;
+        for (unsigned i = 1; fill && i < BENCH_BLOCK_SIZE / sizeof(uint32_t); i++) {
+            fill = buf[0] == buf[i];
+        }
+        if (fill) {
+            sparse_file_add_fill(s, buf[0], to_read, block);
+        } else {
+            sparse_file_add_fd(s, fd, offset, to_read, block);
+        }
+        offset += to_read;
+        block++;
+    }
+    return 0;
+}
+
+struct Expansion {
+    const char *expected;
+    int64_t offset;
+    bool matches;
+};
+
+static int check_expansion(void *priv, const void *data, int len) {
+    Expansion *e = (Expansion *) priv;
+    const char *expected = e->expected + e->offset;
+    for (int i = 0; e->matches && i < len; i++) {
+        e->matches = expected[i] == (data ? ((const char *) data)[i] : 0);
+    }
+    e->offset += len;
+    return 0;
+}
+
+static int count_bytes(void *priv, const void *data, int len) {
+    *(int64_t *) priv += len;
+    return 0;
+}
+
+static void check_read(const RawImage &image, bool skip_zero, int num_threads) {
+    struct sparse_file *s = sparse_file_new(BENCH_BLOCK_SIZE, image.len());
+    ASSERT_TRUE(s != NULL);
+    lseek(image.fd(), 0, SEEK_SET);
+    ASSERT_EQ(0, sparse_file_read_raw(s, image.fd(), skip_zero, num_threads));
+
+    Expansion e = { image.contents(), 0, true };
+    ASSERT_EQ(0, sparse_file_callback(s, false, false, check_expansion, &e));
+    EXPECT_EQ(image.len(), e.offset);
+    EXPECT_TRUE(e.matches);
+    sparse_file_destroy(s);
+}
+
+TEST(libsparse, read_raw) {
+    // spans several read batches
+    RawImage image;
+    ASSERT_TRUE(image.create(10000));
+
+    check_read(image, false, 1);
+    check_read(image, false, 4);
+    check_read(image, true, 1);
+    check_read(image, true, 4);
+}
+
+static void bench_read(const RawImage &image, const char *name,
+        bool legacy, bool skip_zero, int num_threads) {
+    uint64_t elapsed = 0;
+    int64_t sparse_len = 0;
+
+    for (int round = 0; round < BENCH_ROUNDS; round++) {
+        struct sparse_file *s = sparse_file_new(BENCH_BLOCK_SIZE, image.len());
+        ASSERT_TRUE(s != NULL);
+        lseek(image.fd(), 0, SEEK_SET);
+
+        uint64_t start = nsecs();
+        if (legacy) {
+            ASSERT_EQ(0, read_legacy(s, image.fd(), image.len()));
+        } else {
+            ASSERT_EQ(0, sparse_file_read_raw(s, image.fd(), skip_zero,
+                    num_threads));
+        }
+        elapsed += nsecs() - start;
+
+        if (round == 0) {
+            ASSERT_EQ(0, sparse_file_callback(s, true, false, count_bytes,
+                    &sparse_len));
+        }
+        sparse_file_destroy(s);
+    }
+
+    elapsed /= BENCH_ROUNDS;
+    fprintf(stderr, "%s: %llu us per read, %llu MB/s, %lld bytes sparse\n",
+            name, (unsigned long long) (elapsed / 1000),
+            (unsigned long long) (image.len() * 1000ULL / (elapsed ?: 1)),
+            (long long) sparse_len);
+}
+
+TEST(libsparse, benchmark_read_raw) {
+    RawImage image;
+    ASSERT_TRUE(image.create(BENCH_BLOCKS));
+
+    bench_read(image, "per block", true, false, 1);
+    bench_read(image, "1 thread", false, false, 1);
+    bench_read(image, "2 threads", false, false, 2);
+    bench_read(image, "4 threads", false, false, 4);
+    bench_read(image, "cpu threads", false, false, 0);
+    bench_read(image, "cpu threads, zeros skipped", false, true, 0);
+}
+
+// A scratch file for sparse output
+class OutputFile {
+    char mPath[PATH_MAX];
+    int mFd;
+
+public:
+    OutputFile() : mFd(-1) {
+        snprintf(mPath, sizeof(mPath), "%s/libsparse-benchmark.XXXXXX",
+                BENCH_TMPDIR);
+        mFd = mkstemp(mPath);
+    }
+
+    ~OutputFile() {
+        if (mFd >= 0) {
+            close(mFd);
+            unlink(mPath);
+        }
+    }
+
+    int fd() const { return mFd; }
+
+    // reopen, to get a fresh fd of our own after gzclose() closed the last
+    int reopen() {
+        close(mFd);
+        mFd = open(mPath, O_RDWR);
+        return mFd;
+    }
+
+    void truncate() {
+        ftruncate(mFd, 0);
+        lseek(mFd, 0, SEEK_SET);
+    }
+};
+
+static int64_t file_size(int fd) {
+    return lseek(fd, 0, SEEK_END);
+}
+
+static void check_write(const RawImage &image, bool skip_zero) {
+    struct sparse_file *s = sparse_file_new(BENCH_BLOCK_SIZE, image.len());
+    ASSERT_TRUE(s != NULL);
+    lseek(image.fd(), 0, SEEK_SET);
+    ASSERT_EQ(0, sparse_file_read_raw(s, image.fd(), skip_zero, 0));
+
+    OutputFile plain;
+    OutputFile gz;
+    ASSERT_LE(0, plain.fd());
+    ASSERT_LE(0, gz.fd());
+    ASSERT_EQ(0, sparse_file_write(s, plain.fd(), false, true, true));
+    ASSERT_EQ(0, sparse_file_write(s, dup(gz.fd()), true, true, true));
+    sparse_file_destroy(s);
+
+    // the crc chunk must match what the chunks expand to
+    lseek(plain.fd(), 0, SEEK_SET);
+    s = sparse_file_import(plain.fd(), true, true);
+    ASSERT_TRUE(s != NULL);
+    Expansion e = { image.contents(), 0, true };
+    ASSERT_EQ(0, sparse_file_callback(s, false, false, check_expansion, &e));
+    EXPECT_EQ(image.len(), e.offset);
+    EXPECT_TRUE(e.matches);
+    sparse_file_destroy(s);
+
+    // and gzip must compress the same bytes
+    int64_t len = file_size(plain.fd());
+    char *expected = (char *) malloc(len);
+    char *actual = (char *) malloc(len + 1);
+    ASSERT_TRUE(expected != NULL && actual != NULL);
+    ASSERT_EQ(len, pread(plain.fd(), expected, len, 0));
+    ASSERT_LE(0, gz.reopen());
+    gzFile gz_fd = gzdopen(dup(gz.fd()), "rb");
+    ASSERT_TRUE(gz_fd != NULL);
+    EXPECT_EQ(len, gzread(gz_fd, actual, len + 1));
+    gzclose(gz_fd);
+    EXPECT_EQ(0, memcmp(expected, actual, len));
+    free(expected);
+    free(actual);
+}
+
+TEST(libsparse, write_crc) {
+    RawImage image;
+    ASSERT_TRUE(image.create(10000));
+
+    check_write(image, false);
+    check_write(image, true);
+}
+
+// A small image fits in the pipeline's buffers, so that nothing fails
+// until the output is closed; that must still fail the write.
+TEST(libsparse, write_error) {
+    RawImage image;
+    ASSERT_TRUE(image.create(100));
+
+    struct sparse_file *s = sparse_file_new(BENCH_BLOCK_SIZE, image.len());
+    ASSERT_TRUE(s != NULL);
+    lseek(image.fd(), 0, SEEK_SET);
+    ASSERT_EQ(0, sparse_file_read_raw(s, image.fd(), false, 0));
+
+    int full = open("/dev/full", O_WRONLY);
+    ASSERT_LE(0, full);
+    EXPECT_GT(0, sparse_file_write(s, full, false, true, true));
+    EXPECT_GT(0, sparse_file_write(s, dup(full), true, true, true));
+    close(full);
+    sparse_file_destroy(s);
+}
+
+TEST(libsparse, benchmark_crc32) {
+    size_t len = 64 * 1024 * 1024;
+    char *buf = (char *) malloc(len);
+    ASSERT_TRUE(buf != NULL);
+    for (size_t i = 0; i < len; i++) {
+        buf[i] = i * 7 + (i >> 12);
+    }
+
+    // the same polynomial as zlib's, so it must agree: short lengths that
+    // never reach the wide loops, others that leave it a tail, at aligned
+    // and unaligned starts, and chained from a running crc
+    static const size_t lengths[] = { 0, 1, 3, 7, 8, 9, 15, 31, 63, 64, 65,
+                                      4096, 1000003 };
+    for (size_t i = 0; i < sizeof(lengths) / sizeof(lengths[0]); i++) {
+        for (size_t at = 0; at < 8; at += 3) {
+            EXPECT_EQ(crc32(0, (const Bytef *) buf + at, lengths[i]),
+                    sparse_crc32(0, buf + at, lengths[i]))
+                    << lengths[i] << " bytes at +" << at;
+        }
+    }
+    EXPECT_EQ(crc32(crc32(0, (const Bytef *) buf, 5), (const Bytef *) buf + 5, 1000),
+            sparse_crc32(sparse_crc32(0, buf, 5), buf + 5, 1000));
+
+    uint64_t start = nsecs();
+    uint32_t crc = 0;
+    for (int round = 0; round < BENCH_ROUNDS; round++) {
+        crc = sparse_crc32(crc, buf, len);
+    }
+    uint64_t elapsed = (nsecs() - start) / BENCH_ROUNDS;
+    free(buf);
+
+    fprintf(stderr, "sparse_crc32: %llu MB/s\n",
+            (unsigned long long) (len * 1000ULL / (elapsed ?: 1)));
+}
+
+static void bench_write(const RawImage &image, const char *name, bool gz,
+        bool crc) {
+    struct sparse_file *s = sparse_file_new(BENCH_BLOCK_SIZE, image.len());
+    ASSERT_TRUE(s != NULL);
+    lseek(image.fd(), 0, SEEK_SET);
+    ASSERT_EQ(0, sparse_file_read_raw(s, image.fd(), false, 0));
+
+    OutputFile out;
+    ASSERT_LE(0, out.fd());
+    // gzip at level 9 is slow enough to time once
+    int rounds = gz ? 1 : BENCH_ROUNDS;
+    uint64_t elapsed = 0;
+    for (int round = 0; round < rounds; round++) {
+        out.truncate();
+        uint64_t start = nsecs();
+        ASSERT_EQ(0, sparse_file_write(s, gz ? dup(out.fd()) : out.fd(), gz,
+                true, crc));
+        elapsed += nsecs() - start;
+    }
+    sparse_file_destroy(s);
+
+    elapsed /= rounds;
+    fprintf(stderr, "%s: %llu us per write, %lld bytes\n", name,
+            (unsigned long long) (elapsed / 1000),
+            (long long) file_size(out.fd()));
+}
+
+TEST(libsparse, benchmark_write) {
+    RawImage image;
+    ASSERT_TRUE(image.create(BENCH_BLOCKS));
+
+    bench_write(image, "plain", false, false);
+    bench_write(image, "crc", false, true);
+    bench_write(image, "gzip", true, false);
+    bench_write(image, "gzip and crc", true, true);
+}
+
+static uint32_t next_random(uint32_t *seed) {
+    *seed ^= *seed << 13;
+    *seed ^= *seed >> 17;
+    *seed ^= *seed << 5;
+    return *seed;
+}
+
+// the numbers 0 to count - 1 in random order
+static unsigned *shuffled(unsigned count, uint32_t seed) {
+    unsigned *order = (unsigned *) malloc(count * sizeof(unsigned));
+    for (unsigned i = 0; i < count; i++) {
+        order[i] = i;
+    }
+    for (unsigned i = count - 1; i > 0; i--) {
+        unsigned j = next_random(&seed) % (i + 1);
+        unsigned t = order[i];
+        order[i] = order[j];
+        order[j] = t;
+    }
+    return order;
+}
+
+TEST(libsparse, backed_block_random_order) {
+    const unsigned count = 20000;
+    uint32_t seed = 88172645U;
+
+    // runs of up to 8 blocks with the same fill value, which must come out
+    // merged into one backed block each whatever the order they went in
+    uint32_t *fill = (uint32_t *) malloc(count * sizeof(uint32_t));
+    unsigned runs = 0;
+    for (unsigned i = 0; i < count; runs++) {
+        unsigned run = 1 + next_random(&seed) % 8;
+        for (unsigned j = 0; j < run && i < count; j++) {
+            fill[i++] = runs;
+        }
+    }
+
+    struct backed_block_list *bbl = backed_block_list_new(BENCH_BLOCK_SIZE);
+    unsigned *order = shuffled(count, seed);
+    for (unsigned i = 0; i < count; i++) {
+        ASSERT_EQ(0, backed_block_add_fill(bbl, fill[order[i]],
+                BENCH_BLOCK_SIZE, order[i]));
+    }
+
+    unsigned found = 0;
+    unsigned next_block = 0;
+    for (struct backed_block *bb = backed_block_iter_new(bbl); bb;
+            bb = backed_block_iter_next(bb)) {
+        ASSERT_EQ(next_block, backed_block_block(bb));
+        ASSERT_EQ(fill[next_block], backed_block_fill_val(bb));
+        next_block += backed_block_len(bb) / BENCH_BLOCK_SIZE;
+        if (next_block < count) {
+            ASSERT_NE(fill[next_block - 1], fill[next_block]);
+        }
+        found++;
+    }
+    EXPECT_EQ(count, next_block);
+    EXPECT_EQ(runs, found);
+
+    // split every block in two and move every other one to another list
+    struct backed_block_list *other = backed_block_list_new(BENCH_BLOCK_SIZE);
+    for (struct backed_block *bb = backed_block_iter_new(bbl); bb;
+            bb = backed_block_iter_next(bb)) {
+        if (backed_block_len(bb) > BENCH_BLOCK_SIZE) {
+            ASSERT_EQ(0, backed_block_split(bbl, bb, BENCH_BLOCK_SIZE));
+            bb = backed_block_iter_next(bb);
+        }
+    }
+    bool move = false;
+    for (struct backed_block *bb = backed_block_iter_new(bbl), *next; bb;
+            bb = next) {
+        next = backed_block_iter_next(bb);
+        if (move) {
+            backed_block_list_move(bbl, other, bb, bb);
+        }
+        move = !move;
+    }
+    backed_block_list_move(other, bbl, NULL, NULL);
+    EXPECT_TRUE(backed_block_iter_new(other) == NULL);
+
+    next_block = 0;
+    for (struct backed_block *bb = backed_block_iter_new(bbl); bb;
+            bb = backed_block_iter_next(bb)) {
+        ASSERT_EQ(next_block, backed_block_block(bb));
+        ASSERT_EQ(fill[next_block], backed_block_fill_val(bb));
+        next_block += backed_block_len(bb) / BENCH_BLOCK_SIZE;
+    }
+    EXPECT_EQ(count, next_block);
+
+    backed_block_list_destroy(other);
+    backed_block_list_destroy(bbl);
+    free(order);
+    free(fill);
+}
+
+static void bench_queue(const char *name, bool random) {
+    unsigned *order = shuffled(BENCH_QUEUED_BLOCKS, 2463534242U);
+    struct backed_block_list *bbl = backed_block_list_new(BENCH_BLOCK_SIZE);
+
+    // every other block, so that none of them merge
+    uint64_t start = nsecs();
+    for (unsigned i = 0; i < BENCH_QUEUED_BLOCKS; i++) {
+        unsigned block = (random ? order[i] : i) * 2;
+        ASSERT_EQ(0, backed_block_add_fd(bbl, 0, (int64_t) block *
+                BENCH_BLOCK_SIZE, BENCH_BLOCK_SIZE, block));
+    }
+    uint64_t elapsed = nsecs() - start;
+
+    backed_block_list_destroy(bbl);
+    free(order);
+
+    fprintf(stderr, "%s: %llu ns per block queued\n", name,
+            (unsigned long long) (elapsed / BENCH_QUEUED_BLOCKS));
+}
+
+TEST(libsparse, benchmark_backed_block_queue) {
+    bench_queue("in order", false);
+    bench_queue("random order", true);
+}
@@ -224,6 +224,52 @@ int SocketClient::sendDataLockedv(struct iovec *iov, int iovcnt) {
     return ret;
 }
 
+int SocketClient::sendDatamv(struct mmsghdr *msgs, unsigned int vlen) {
+    pthread_mutex_lock(&mWriteMutex);
+
+    if (mSocket < 0) {
+        pthread_mutex_unlock(&mWriteMutex);
+        errno = EHOSTUNREACH;
+        return -1;
+    }
+
+    int ret = 0;
+    int e = 0; // SLOGW and sigaction are not inert regarding errno
+    unsigned int current = 0;
+
+    struct sigaction new_action, old_action;
+    memset(&new_action, 0, sizeof(new_action));
+    new_action.sa_handler = SIG_IGN;
+    sigaction(SIGPIPE, &new_action, &old_action);
+
+    // packets are sent whole or not at all, only the count can be short
+    while (current < vlen) {
+        int rc = TEMP_FAILURE_RETRY(
+            sendmmsg(mSocket, msgs + current, vlen - current, 0));
+
+        if (rc > 0) {
+            current += rc;
+            continue;
+        }
+
+        if (rc == 0) {
+            e = EIO;
+            SLOGW("0 length write :(");
+        } else {
+            e = errno;
+            SLOGW("write error (%s)", strerror(e));
+        }
+        ret = -1;
+        break;
+    }
+
+    sigaction(SIGPIPE, &old_action, &new_action);
+    pthread_mutex_unlock(&mWriteMutex);
+
+    errno = e;
+    return ret;
+}
+
 void SocketClient::incRef() {
     pthread_mutex_lock(&mRefCountMutex);
     mRefCount++;
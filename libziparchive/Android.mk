@@ -56,6 +56,7 @@ LOCAL_CFLAGS += \
     -DGTEST_HAS_STD_STRING \
     -Werror
 LOCAL_SRC_FILES := zip_archive_test.cc
+LOCAL_C_INCLUDES += ${includes}
 LOCAL_SHARED_LIBRARIES := liblog
 LOCAL_STATIC_LIBRARIES := libziparchive libz libgtest libgtest_main libutils
 include $(BUILD_NATIVE_TEST)
@@ -68,6 +69,7 @@ LOCAL_CFLAGS += \
     -DGTEST_HAS_STD_STRING \
     -Werror
 LOCAL_SRC_FILES := zip_archive_test.cc
+LOCAL_C_INCLUDES += ${includes}
 LOCAL_STATIC_LIBRARIES := libziparchive-host \
 	libz \
 	libgtest_host \
@@ -26,11 +26,17 @@
 #include <log/log.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
 #include <unistd.h>
 #include <utils/Compat.h>
 #include <utils/FileMap.h>
+#include <utils/Timers.h>
 #include <zlib.h>
 
+#ifdef HAVE_PTHREADS
+#include <pthread.h>
+#endif
+
 #include <JNIHelp.h>  // TEMP_FAILURE_RETRY may or may not be in unistd
 
 #include "ziparchive/zip_archive.h"
@@ -215,7 +221,9 @@ static const char* kErrorMessages[] = {
   "Inconsistent information",
   "Invalid entry name",
   "I/O Error",
-  "File mapping failed"
+  "File mapping failed",
+  "Aborted by callback",
+  "Entry is not stored"
 };
 
 static const int32_t kErrorMessageUpperBound = 0;
@@ -262,10 +270,20 @@ static const int32_t kIoError = -11;
 // We were not able to mmap the central directory or entry contents.
 static const int32_t kMmapFailed = -12;
 
-static const int32_t kErrorMessageLowerBound = -13;
+// A ProcessZipEntryFunction asked to stop.
+static const int32_t kCallbackAborted = -13;
+
+// MapStoredEntry was asked to map an entry that is compressed.
+static const int32_t kEntryNotStored = -14;
+
+static const int32_t kErrorMessageLowerBound = -15;
 
 static const char kTempMappingFileName[] = "zip: ExtractFileToFile";
 
+// The most threads ExtractEntriesToFiles picks by itself. Past a handful,
+// extraction is bound by the storage rather than by inflate.
+static const uint32_t kMaxDefaultExtractThreads = 8;
+
 /*
  * A Read-only Zip archive.
  *
@@ -305,13 +323,22 @@ struct ZipArchive {
   uint32_t hash_table_size;
   ZipEntryName* hash_table;
 
+  /*
+   * The used slots of the hash table, sorted by name, so that iterating
+   * over a prefix is a range scan. Built on the first such iteration, or
+   * loaded along with the hash table from an index file, and never changed
+   * after; the first thread to build it installs it.
+   */
+  const ZipEntryName** sorted_names;
+
   ZipArchive(const int fd) :
       fd(fd),
       directory_offset(0),
       directory_map(NULL),
       num_entries(0),
       hash_table_size(0),
-      hash_table(NULL) {}
+      hash_table(NULL),
+      sorted_names(NULL) {}
 
   ~ZipArchive() {
     if (fd >= 0) {
@@ -322,6 +349,7 @@ struct ZipArchive {
       directory_map->release();
     }
     free(hash_table);
+    free(sorted_names);
   }
 };
 
@@ -339,9 +367,32 @@ static android::FileMap* MapFileSegment(const int fd, const off64_t start,
   return file_map;
 }
 
-static int32_t CopyFileToFile(int fd, uint8_t* begin, const uint32_t length, uint64_t *crc_out) {
+// Attempts to read |len| bytes into |buf| at offset |off|.
+//
+// This method uses pread64 on platforms that support it and
+// lseek64 + read on platforms that don't. This implies that
+// callers should not rely on the |fd| offset being incremented
+// as a side effect of this call.
+static inline ssize_t ReadAtOffset(int fd, uint8_t* buf, size_t len,
+                                   off64_t off) {
+#ifdef HAVE_PREAD
+  return TEMP_FAILURE_RETRY(pread64(fd, buf, len, off));
+#else
+  // The only supported platform that doesn't support pread at the moment
+  // is Windows. Only recent versions of windows support unix like forks,
+  // and even there the semantics are quite different.
+  if (lseek64(fd, off, SEEK_SET) != off) {
+    ALOGW("Zip: failed seek to offset %" PRId64, off);
+    return kIoError;
+  }
+
+  return TEMP_FAILURE_RETRY(read(fd, buf, len));
+#endif  // HAVE_PREAD
+}
+
+static int32_t CopyFileToFile(int fd, uint8_t* begin, const uint32_t length,
+                              off64_t offset, uint64_t *crc_out) {
   static const uint32_t kBufSize = 32768;
-  uint8_t buf[kBufSize];
 
   uint32_t count = 0;
   uint64_t crc = 0;
@@ -351,16 +402,16 @@ static int32_t CopyFileToFile(int fd, uint8_t* begin, const uint32_t length, uin
     // Safe conversion because kBufSize is narrow enough for a 32 bit signed
     // value.
     ssize_t get_size = (remaining > kBufSize) ? kBufSize : remaining;
-    ssize_t actual = TEMP_FAILURE_RETRY(read(fd, buf, get_size));
+    ssize_t actual = ReadAtOffset(fd, begin + count, get_size, offset);
 
     if (actual != get_size) {
       ALOGW("CopyFileToFile: copy read failed (" ZD " vs " ZD ")", actual, get_size);
       return kIoError;
     }
 
-    memcpy(begin + count, buf, get_size);
-    crc = crc32(crc, buf, get_size);
+    crc = crc32(crc, begin + count, get_size);
     count += get_size;
+    offset += get_size;
   }
 
   *crc_out = crc;
@@ -385,14 +436,36 @@ static uint32_t RoundUpPower2(uint32_t val) {
   return val;
 }
 
-static uint32_t ComputeHash(const char* str, uint16_t len) {
-  uint32_t hash = 0;
+static inline uint64_t RotateLeft(uint64_t value, int shift) {
+  return (value << shift) | (value >> (64 - shift));
+}
 
-  while (len--) {
-    hash = hash * 31 + *str++;
+/*
+ * Hash eight bytes at a time with a rotate, xor and multiply per word, then
+ * fold the high bits of one last multiply into the result, since only the
+ * low bits index the table. Names in an archive share long prefixes
+ * ("res/drawable-xxhdpi-v4/"), which this mixes in far faster and better
+ * than a byte at a time.
+ */
+static uint32_t ComputeHash(const char* str, uint16_t len) {
+  static const uint64_t kMultiplier = 0x9e3779b97f4a7c15ULL;
+  uint64_t hash = len;
+
+  while (len >= sizeof(uint64_t)) {
+    uint64_t word;
+    memcpy(&word, str, sizeof(word));
+    hash = (RotateLeft(hash, 5) ^ word) * kMultiplier;
+    str += sizeof(word);
+    len -= sizeof(word);
+  }
+  if (len > 0) {
+    uint64_t word = 0;
+    memcpy(&word, str, len);
+    hash = (RotateLeft(hash, 5) ^ word) * kMultiplier;
   }
 
-  return hash;
+  hash = (hash ^ (hash >> 29)) * kMultiplier;
+  return hash >> 32;
 }
 
 /*
@@ -670,17 +743,267 @@ bail:
   return result;
 }
 
+/*
+ * Orders entry names as memcmp does, a name before any longer one it is a
+ * prefix of.
+ */
+static int CompareNames(const char* name, uint16_t length,
+                        const char* other, uint16_t other_length) {
+  const int result = memcmp(name, other, length < other_length ? length : other_length);
+  if (result != 0) {
+    return result;
+  }
+  return (int) length - (int) other_length;
+}
+
+static int CompareSortedNames(const void* lhs, const void* rhs) {
+  const ZipEntryName* name = *reinterpret_cast<const ZipEntryName* const*>(lhs);
+  const ZipEntryName* other = *reinterpret_cast<const ZipEntryName* const*>(rhs);
+  return CompareNames(name->name, name->name_length,
+                      other->name, other->name_length);
+}
+
+/*
+ * Returns the sorted names of the archive, building them if need be, or
+ * NULL if out of memory.
+ */
+static const ZipEntryName** GetSortedNames(ZipArchive* archive) {
+  const ZipEntryName** sorted = archive->sorted_names;
+  if (sorted != NULL) {
+    return sorted;
+  }
+
+  sorted = reinterpret_cast<const ZipEntryName**>(
+      malloc(archive->num_entries * sizeof(ZipEntryName*)));
+  if (sorted == NULL) {
+    return NULL;
+  }
+  uint32_t count = 0;
+  for (uint32_t i = 0; i < archive->hash_table_size; i++) {
+    if (archive->hash_table[i].name != NULL) {
+      sorted[count++] = &archive->hash_table[i];
+    }
+  }
+  qsort(sorted, count, sizeof(sorted[0]), CompareSortedNames);
+
+  // Lost a race with another thread building the same thing.
+  if (!__sync_bool_compare_and_swap(&archive->sorted_names, NULL, sorted)) {
+    free(sorted);
+  }
+  return archive->sorted_names;
+}
+
+/*
+ * An index file caches the hash table and sorted names of one archive, so
+ * that opening it again neither parses nor even touches the pages of the
+ * central directory. It is only used while the archive has the size,
+ * modification time and inode it was written for, and the hash of
+ * kIndexHashProbe catches any change to ComputeHash, or a file from a
+ * machine of the other endianness.
+ */
+struct IndexHeader {
+  static const uint32_t kMagic = 0x5844495a;  // "ZIDX"
+  static const uint32_t kVersion = 1;
+
+  uint32_t magic;
+  uint32_t version;
+  uint32_t hash_probe;
+  uint32_t num_entries;
+  uint64_t archive_size;
+  uint64_t archive_mtime;
+  uint64_t archive_inode;
+  uint32_t directory_offset;
+  uint32_t directory_size;
+  uint32_t hash_table_size;
+  // Followed by, for each slot of the hash table, the offset of its name
+  // in the central directory plus one, or 0 if the slot is empty; then the
+  // length of each of those names as a uint16_t; then, padded to four
+  // bytes, the slot of each entry in sorted order.
+} __attribute__((packed));
+
+static const char kIndexHashProbe[] = "zip index";
+
+static size_t IndexSize(uint32_t hash_table_size, uint32_t num_entries) {
+  const size_t names_size = hash_table_size * (sizeof(uint32_t) + sizeof(uint16_t));
+  return sizeof(IndexHeader) + ((names_size + 3) & ~3) + num_entries * sizeof(uint32_t);
+}
+
+static bool InitIndexHeader(const ZipArchive* archive, IndexHeader* header) {
+  struct stat archive_stat;
+  if (fstat(archive->fd, &archive_stat) != 0) {
+    return false;
+  }
+  memset(header, 0, sizeof(*header));
+  header->magic = IndexHeader::kMagic;
+  header->version = IndexHeader::kVersion;
+  header->hash_probe = ComputeHash(kIndexHashProbe, sizeof(kIndexHashProbe) - 1);
+  header->num_entries = archive->num_entries;
+  header->archive_size = archive_stat.st_size;
+  header->archive_mtime = archive_stat.st_mtime;
+  header->archive_inode = archive_stat.st_ino;
+  header->directory_offset = archive->directory_offset;
+  header->directory_size = archive->directory_map->getDataLength();
+  header->hash_table_size = RoundUpPower2(1 + (archive->num_entries * 4) / 3);
+  return true;
+}
+
+/*
+ * Set up the hash table and sorted names from |index_file_name|. Returns
+ * true if it held an index of this archive as it is.
+ */
+static bool LoadIndex(ZipArchive* archive, const char* index_file_name) {
+  IndexHeader expected;
+  if (!InitIndexHeader(archive, &expected)) {
+    return false;
+  }
+  const int fd = open(index_file_name, O_RDONLY | O_BINARY);
+  if (fd < 0) {
+    return false;
+  }
+
+  bool loaded = false;
+  const size_t index_size = IndexSize(expected.hash_table_size, expected.num_entries);
+  uint8_t* index = reinterpret_cast<uint8_t*>(malloc(index_size));
+  const char* cd_ptr = (const char*) archive->directory_map->getDataPtr();
+  const uint32_t cd_length = expected.directory_size;
+  const uint32_t* name_offsets;
+  const uint16_t* name_lengths;
+  const uint32_t* sorted_slots;
+  if (index == NULL ||
+      TEMP_FAILURE_RETRY(read(fd, index, index_size)) != static_cast<ssize_t>(index_size) ||
+      memcmp(index, &expected, sizeof(expected)) != 0) {
+    goto bail;
+  }
+
+  archive->hash_table_size = expected.hash_table_size;
+  archive->hash_table = (ZipEntryName*) calloc(archive->hash_table_size,
+      sizeof(ZipEntryName));
+  archive->sorted_names = reinterpret_cast<const ZipEntryName**>(
+      malloc(archive->num_entries * sizeof(ZipEntryName*)));
+  if (archive->hash_table == NULL || archive->sorted_names == NULL) {
+    goto bail;
+  }
+
+  // Nothing here reads the central directory, so a corrupt index can
+  // make for wrong answers but not for reads outside of it.
+  name_offsets = reinterpret_cast<const uint32_t*>(index + sizeof(IndexHeader));
+  name_lengths = reinterpret_cast<const uint16_t*>(name_offsets + expected.hash_table_size);
+  sorted_slots = reinterpret_cast<const uint32_t*>(
+      index + index_size - expected.num_entries * sizeof(uint32_t));
+  for (uint32_t i = 0; i < expected.hash_table_size; i++) {
+    if (name_offsets[i] == 0) {
+      continue;
+    }
+    const uint32_t name_offset = name_offsets[i] - 1;
+    if (name_offset < sizeof(CentralDirectoryRecord) ||
+        name_offset > cd_length || name_lengths[i] > cd_length - name_offset) {
+      goto bail;
+    }
+    archive->hash_table[i].name = cd_ptr + name_offset;
+    archive->hash_table[i].name_length = name_lengths[i];
+  }
+  for (uint32_t i = 0; i < expected.num_entries; i++) {
+    const uint32_t slot = sorted_slots[i];
+    if (slot >= expected.hash_table_size || archive->hash_table[slot].name == NULL) {
+      goto bail;
+    }
+    archive->sorted_names[i] = &archive->hash_table[slot];
+  }
+  loaded = true;
+
+bail:
+  if (!loaded) {
+    free(archive->hash_table);
+    archive->hash_table = NULL;
+    archive->hash_table_size = 0;
+    free(archive->sorted_names);
+    archive->sorted_names = NULL;
+  }
+  free(index);
+  close(fd);
+  return loaded;
+}
+
+/*
+ * Write the index of a freshly parsed archive to |index_file_name|, by way
+ * of a temporary file so that readers never see half of one. Failure only
+ * means the next open parses again.
+ */
+static void SaveIndex(ZipArchive* archive, const char* index_file_name) {
+  IndexHeader header;
+  if (!InitIndexHeader(archive, &header)) {
+    return;
+  }
+  const ZipEntryName** sorted = GetSortedNames(archive);
+  if (sorted == NULL) {
+    return;
+  }
+
+  const size_t index_size = IndexSize(header.hash_table_size, header.num_entries);
+  uint8_t* index = reinterpret_cast<uint8_t*>(calloc(1, index_size));
+  if (index == NULL) {
+    return;
+  }
+  memcpy(index, &header, sizeof(header));
+  const char* cd_ptr = (const char*) archive->directory_map->getDataPtr();
+  uint32_t* name_offsets = reinterpret_cast<uint32_t*>(index + sizeof(IndexHeader));
+  uint16_t* name_lengths = reinterpret_cast<uint16_t*>(name_offsets + header.hash_table_size);
+  uint32_t* sorted_slots = reinterpret_cast<uint32_t*>(
+      index + index_size - header.num_entries * sizeof(uint32_t));
+  for (uint32_t i = 0; i < header.hash_table_size; i++) {
+    const char* name = archive->hash_table[i].name;
+    if (name != NULL) {
+      name_offsets[i] = (name - cd_ptr) + 1;
+      name_lengths[i] = archive->hash_table[i].name_length;
+    }
+  }
+  for (uint32_t i = 0; i < header.num_entries; i++) {
+    sorted_slots[i] = sorted[i] - archive->hash_table;
+  }
+
+  const size_t temp_length = strlen(index_file_name) + sizeof(".tmp");
+  char* temp_file_name = reinterpret_cast<char*>(malloc(temp_length));
+  if (temp_file_name == NULL) {
+    free(index);
+    return;
+  }
+  snprintf(temp_file_name, temp_length, "%s.tmp", index_file_name);
+
+  const int fd = open(temp_file_name, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0644);
+  if (fd < 0) {
+    ALOGV("Zip: unable to create index %s: %s", temp_file_name, strerror(errno));
+  } else {
+    const bool written = TEMP_FAILURE_RETRY(write(fd, index, index_size)) ==
+        static_cast<ssize_t>(index_size);
+    close(fd);
+    if (!written || rename(temp_file_name, index_file_name) != 0) {
+      ALOGW("Zip: unable to write index %s: %s", index_file_name, strerror(errno));
+      unlink(temp_file_name);
+    }
+  }
+  free(temp_file_name);
+  free(index);
+}
+
 static int32_t OpenArchiveInternal(ZipArchive* archive,
-                                   const char* debug_file_name) {
+                                   const char* debug_file_name,
+                                   const char* index_file_name) {
   int32_t result = -1;
   if ((result = MapCentralDirectory(archive->fd, debug_file_name, archive))) {
     return result;
   }
 
+  if (index_file_name != NULL && LoadIndex(archive, index_file_name)) {
+    return 0;
+  }
+
   if ((result = ParseZipArchive(archive))) {
     return result;
   }
 
+  if (index_file_name != NULL) {
+    SaveIndex(archive, index_file_name);
+  }
   return 0;
 }
 
@@ -688,10 +1011,15 @@ int32_t OpenArchiveFd(int fd, const char* debug_file_name,
                       ZipArchiveHandle* handle) {
   ZipArchive* archive = new ZipArchive(fd);
   *handle = archive;
-  return OpenArchiveInternal(archive, debug_file_name);
+  return OpenArchiveInternal(archive, debug_file_name, NULL);
 }
 
 int32_t OpenArchive(const char* fileName, ZipArchiveHandle* handle) {
+  return OpenArchiveWithIndex(fileName, NULL, handle);
+}
+
+int32_t OpenArchiveWithIndex(const char* fileName, const char* indexFileName,
+                             ZipArchiveHandle* handle) {
   const int fd = open(fileName, O_RDONLY | O_BINARY, 0);
   ZipArchive* archive = new ZipArchive(fd);
   *handle = archive;
@@ -700,7 +1028,7 @@ int32_t OpenArchive(const char* fileName, ZipArchiveHandle* handle) {
     ALOGW("Unable to open '%s': %s", fileName, strerror(errno));
     return kIoError;
   }
-  return OpenArchiveInternal(archive, fileName);
+  return OpenArchiveInternal(archive, fileName, indexFileName);
 }
 
 /*
@@ -712,10 +1040,10 @@ void CloseArchive(ZipArchiveHandle handle) {
   delete archive;
 }
 
-static int32_t UpdateEntryFromDataDescriptor(int fd,
+static int32_t UpdateEntryFromDataDescriptor(int fd, off64_t dd_offset,
                                              ZipEntry *entry) {
   uint8_t ddBuf[sizeof(DataDescriptor) + sizeof(DataDescriptor::kOptSignature)];
-  ssize_t actual = TEMP_FAILURE_RETRY(read(fd, ddBuf, sizeof(ddBuf)));
+  ssize_t actual = ReadAtOffset(fd, ddBuf, sizeof(ddBuf), dd_offset);
   if (actual != sizeof(ddBuf)) {
     return kIoError;
   }
@@ -731,29 +1059,6 @@ static int32_t UpdateEntryFromDataDescriptor(int fd,
   return 0;
 }
 
-// Attempts to read |len| bytes into |buf| at offset |off|.
-//
-// This method uses pread64 on platforms that support it and
-// lseek64 + read on platforms that don't. This implies that
-// callers should not rely on the |fd| offset being incremented
-// as a side effect of this call.
-static inline ssize_t ReadAtOffset(int fd, uint8_t* buf, size_t len,
-                                   off64_t off) {
-#ifdef HAVE_PREAD
-  return TEMP_FAILURE_RETRY(pread64(fd, buf, len, off));
-#else
-  // The only supported platform that doesn't support pread at the moment
-  // is Windows. Only recent versions of windows support unix like forks,
-  // and even there the semantics are quite different.
-  if (lseek64(fd, off, SEEK_SET) != off) {
-    ALOGW("Zip: failed seek to offset %" PRId64, off);
-    return kIoError;
-  }
-
-  return TEMP_FAILURE_RETRY(read(fd, buf, len));
-#endif  // HAVE_PREAD
-}
-
 static int32_t FindEntry(const ZipArchive* archive, const int ent,
                          ZipEntry* data) {
   const uint16_t nameLen = archive->hash_table[ent].name_length;
@@ -889,7 +1194,11 @@ static int32_t FindEntry(const ZipArchive* archive, const int ent,
 }
 
 struct IterationHandle {
+  // Without a prefix, the next slot of the hash table to look at. With
+  // one, the next index into the sorted names, starting from |start|.
   uint32_t position;
+  uint32_t start;
+  const ZipEntryName** sorted_names;
   const char* prefix;
   uint16_t prefix_len;
   ZipArchive* archive;
@@ -905,10 +1214,31 @@ int32_t StartIteration(ZipArchiveHandle handle, void** cookie_ptr, const char* p
 
   IterationHandle* cookie = (IterationHandle*) malloc(sizeof(IterationHandle));
   cookie->position = 0;
+  cookie->start = 0;
+  cookie->sorted_names = NULL;
   cookie->prefix = prefix;
   cookie->archive = archive;
   if (prefix != NULL) {
     cookie->prefix_len = strlen(prefix);
+
+    // Start at the first name not before the prefix. Without the memory
+    // for the sorted names, fall back to a scan of the hash table.
+    const ZipEntryName** sorted = GetSortedNames(archive);
+    if (sorted != NULL) {
+      uint32_t low = 0;
+      uint32_t high = archive->num_entries;
+      while (low < high) {
+        const uint32_t mid = low + (high - low) / 2;
+        if (CompareNames(sorted[mid]->name, sorted[mid]->name_length,
+                         prefix, cookie->prefix_len) < 0) {
+          low = mid + 1;
+        } else {
+          high = mid;
+        }
+      }
+      cookie->sorted_names = sorted;
+      cookie->start = cookie->position = low;
+    }
   }
 
   *cookie_ptr = cookie ;
@@ -951,10 +1281,30 @@ int32_t Next(void* cookie, ZipEntry* data, ZipEntryName* name) {
   const uint32_t hash_table_length = archive->hash_table_size;
   const ZipEntryName *hash_table = archive->hash_table;
 
+  if (handle->sorted_names != NULL) {
+    // The names with the prefix follow each other from |start|.
+    if (currentOffset < archive->num_entries) {
+      const ZipEntryName* entry_name = handle->sorted_names[currentOffset];
+      if (entry_name->name_length >= handle->prefix_len &&
+          memcmp(handle->prefix, entry_name->name, handle->prefix_len) == 0) {
+        handle->position = currentOffset + 1;
+        const int error = FindEntry(archive, entry_name - hash_table, data);
+        if (!error) {
+          name->name = entry_name->name;
+          name->name_length = entry_name->name_length;
+        }
+        return error;
+      }
+    }
+    handle->position = handle->start;
+    return kIterationEnd;
+  }
+
   for (uint32_t i = currentOffset; i < hash_table_length; ++i) {
     if (hash_table[i].name != NULL &&
         (handle->prefix == NULL ||
-         (memcmp(handle->prefix, hash_table[i].name, handle->prefix_len) == 0))) {
+         (hash_table[i].name_length >= handle->prefix_len &&
+          memcmp(handle->prefix, hash_table[i].name, handle->prefix_len) == 0))) {
       handle->position = (i + 1);
       const int error = FindEntry(archive, i, data);
       if (!error) {
@@ -970,9 +1320,11 @@ int32_t Next(void* cookie, ZipEntry* data, ZipEntryName* name) {
   return kIterationEnd;
 }
 
-static int32_t InflateToFile(int fd, const ZipEntry* entry,
-                             uint8_t* begin, uint32_t length,
-                             uint64_t* crc_out) {
+// Inflates |entry|, handing the data to |func| in chunks as it goes. If
+// |crc_out| is not NULL, it is set to the crc32 of all the data.
+static int32_t InflateEntry(int fd, const ZipEntry* entry,
+                            ProcessZipEntryFunction func, void* cookie,
+                            uint64_t* crc_out) {
   int32_t result = -1;
   const uint32_t kBufSize = 32768;
   uint8_t read_buf[kBufSize];
@@ -1012,12 +1364,13 @@ static int32_t InflateToFile(int fd, const ZipEntry* entry,
   const uint32_t uncompressed_length = entry->uncompressed_length;
 
   uint32_t compressed_length = entry->compressed_length;
-  uint32_t write_count = 0;
+  off64_t read_offset = entry->offset;
+  uLong crc = crc32(0L, Z_NULL, 0);
   do {
     /* read as much as we can */
     if (zstream.avail_in == 0) {
       const ZD_TYPE getSize = (compressed_length > kBufSize) ? kBufSize : compressed_length;
-      const ZD_TYPE actual = TEMP_FAILURE_RETRY(read(fd, read_buf, getSize));
+      const ZD_TYPE actual = ReadAtOffset(fd, read_buf, getSize, read_offset);
       if (actual != getSize) {
         ALOGW("Zip: inflate read failed (" ZD " vs " ZD ")", actual, getSize);
         result = kIoError;
@@ -1025,6 +1378,7 @@ static int32_t InflateToFile(int fd, const ZipEntry* entry,
       }
 
       compressed_length -= getSize;
+      read_offset += getSize;
 
       zstream.next_in = read_buf;
       zstream.avail_in = getSize;
@@ -1044,12 +1398,13 @@ static int32_t InflateToFile(int fd, const ZipEntry* entry,
     if (zstream.avail_out == 0 ||
       (zerr == Z_STREAM_END && zstream.avail_out != kBufSize)) {
       const size_t write_size = zstream.next_out - write_buf;
-      // The file might have declared a bogus length.
-      if (write_size + write_count > length) {
+      if (!func(write_buf, write_size, cookie)) {
+        result = kCallbackAborted;
         goto z_bail;
       }
-      memcpy(begin + write_count, write_buf, write_size);
-      write_count += write_size;
+      if (crc_out != NULL) {
+        crc = crc32(crc, write_buf, write_size);
+      }
 
       zstream.next_out = write_buf;
       zstream.avail_out = kBufSize;
@@ -1058,8 +1413,9 @@ static int32_t InflateToFile(int fd, const ZipEntry* entry,
 
   assert(zerr == Z_STREAM_END);     /* other errors should've been caught */
 
-  // stream.adler holds the crc32 value for such streams.
-  *crc_out = zstream.adler;
+  if (crc_out != NULL) {
+    *crc_out = crc;
+  }
 
   if (zstream.total_out != uncompressed_length || compressed_length != 0) {
     ALOGW("Zip: size mismatch on inflated file (%lu vs %" PRIu32 ")",
@@ -1076,28 +1432,55 @@ z_bail:
   return result;
 }
 
+// Where ExtractToMemory has InflateEntry put the data.
+struct MemoryWriter {
+  uint8_t* begin;
+  uint32_t size;
+  uint32_t count;
+};
+
+static bool WriteToMemory(const uint8_t* buf, size_t buf_size, void* cookie) {
+  MemoryWriter* writer = reinterpret_cast<MemoryWriter*>(cookie);
+  // The file might have declared a bogus length.
+  if (buf_size > writer->size - writer->count) {
+    return false;
+  }
+  memcpy(writer->begin + writer->count, buf, buf_size);
+  writer->count += buf_size;
+  return true;
+}
+
 int32_t ExtractToMemory(ZipArchiveHandle handle,
                         ZipEntry* entry, uint8_t* begin, uint32_t size) {
   ZipArchive* archive = (ZipArchive*) handle;
   const uint16_t method = entry->method;
   off64_t data_offset = entry->offset;
 
-  if (lseek64(archive->fd, data_offset, SEEK_SET) != data_offset) {
-    ALOGW("Zip: lseek to data at %" PRId64 " failed", (int64_t)data_offset);
-    return kIoError;
-  }
-
+  // All reads go through ReadAtOffset rather than the file offset of the
+  // archive, so that entries can be extracted on several threads at once.
+  //
   // this should default to kUnknownCompressionMethod.
   int32_t return_value = -1;
   uint64_t crc = 0;
+  off64_t data_end = data_offset;
   if (method == kCompressStored) {
-    return_value = CopyFileToFile(archive->fd, begin, size, &crc);
+    return_value = CopyFileToFile(archive->fd, begin, size, data_offset, &crc);
+    data_end += size;
   } else if (method == kCompressDeflated) {
-    return_value = InflateToFile(archive->fd, entry, begin, size, &crc);
+    MemoryWriter writer;
+    writer.begin = begin;
+    writer.size = size;
+    writer.count = 0;
+    return_value = InflateEntry(archive->fd, entry, WriteToMemory, &writer, NULL);
+    if (return_value == kCallbackAborted) {
+      ALOGW("Zip: inflated data longer than %" PRIu32, size);
+      return_value = kInconsistentInformation;
+    }
+    data_end += entry->compressed_length;
   }
 
   if (!return_value && entry->has_data_descriptor) {
-    return_value = UpdateEntryFromDataDescriptor(archive->fd, entry);
+    return_value = UpdateEntryFromDataDescriptor(archive->fd, data_end, entry);
     if (return_value) {
       return return_value;
     }
@@ -1151,6 +1534,317 @@ int32_t ExtractEntryToFile(ZipArchiveHandle handle,
   return error;
 }
 
+int32_t MapStoredEntry(ZipArchiveHandle handle, const ZipEntry* entry,
+                       ZipEntryMapping* mapping) {
+  const ZipArchive* archive = (ZipArchive*) handle;
+  mapping->data = NULL;
+  mapping->length = 0;
+  mapping->map = NULL;
+
+  if (entry->method != kCompressStored) {
+    return kEntryNotStored;
+  }
+  // Should FindEntry have been given a stale or doctored entry, make sure
+  // it cannot reach into the central directory or past it.
+  if (entry->compressed_length != entry->uncompressed_length ||
+      entry->offset < 0 ||
+      entry->offset + static_cast<off64_t>(entry->uncompressed_length) >
+          archive->directory_offset) {
+    ALOGW("Zip: bad stored entry (%" PRId64 " + %" PRIu32 " > %" PRId64 ")",
+          static_cast<int64_t>(entry->offset), entry->uncompressed_length,
+          static_cast<int64_t>(archive->directory_offset));
+    return kInvalidOffset;
+  }
+
+  // FileMap cannot map a region of length 0.
+  if (entry->uncompressed_length == 0) {
+    return 0;
+  }
+
+  android::FileMap* map = MapFileSegment(archive->fd, entry->offset,
+                                         entry->uncompressed_length,
+                                         true /* read only */, kTempMappingFileName);
+  if (map == NULL) {
+    return kMmapFailed;
+  }
+  mapping->data = reinterpret_cast<const uint8_t*>(map->getDataPtr());
+  mapping->length = map->getDataLength();
+  mapping->map = map;
+  return 0;
+}
+
+void UnmapStoredEntry(ZipEntryMapping* mapping) {
+  if (mapping->map != NULL) {
+    reinterpret_cast<android::FileMap*>(mapping->map)->release();
+  }
+  mapping->data = NULL;
+  mapping->length = 0;
+  mapping->map = NULL;
+}
+
+// Hands the data of a stored entry to |func| in chunks, as InflateEntry does.
+static int32_t CopyEntry(int fd, const ZipEntry* entry,
+                         ProcessZipEntryFunction func, void* cookie,
+                         uint64_t* crc_out) {
+  static const uint32_t kBufSize = 32768;
+  uint8_t buf[kBufSize];
+
+  const uint32_t length = entry->uncompressed_length;
+  uint32_t count = 0;
+  uLong crc = crc32(0L, Z_NULL, 0);
+  while (count < length) {
+    const uint32_t remaining = length - count;
+    const ssize_t get_size = (remaining > kBufSize) ? kBufSize : remaining;
+    const ssize_t actual = ReadAtOffset(fd, buf, get_size, entry->offset + count);
+    if (actual != get_size) {
+      ALOGW("Zip: copy read failed (" ZD " vs " ZD ")", actual, get_size);
+      return kIoError;
+    }
+    if (!func(buf, get_size, cookie)) {
+      return kCallbackAborted;
+    }
+    crc = crc32(crc, buf, get_size);
+    count += get_size;
+  }
+
+  *crc_out = crc;
+  return 0;
+}
+
+int32_t ProcessZipEntryContents(ZipArchiveHandle handle, ZipEntry* entry,
+                                ProcessZipEntryFunction func, void* cookie) {
+  ZipArchive* archive = (ZipArchive*) handle;
+  int32_t return_value = -1;
+  uint64_t crc = 0;
+  off64_t data_end = entry->offset;
+  if (entry->method == kCompressStored) {
+    return_value = CopyEntry(archive->fd, entry, func, cookie, &crc);
+    data_end += entry->uncompressed_length;
+  } else if (entry->method == kCompressDeflated) {
+    return_value = InflateEntry(archive->fd, entry, func, cookie, &crc);
+    data_end += entry->compressed_length;
+  }
+  if (return_value) {
+    return return_value;
+  }
+
+  if (entry->has_data_descriptor) {
+    return_value = UpdateEntryFromDataDescriptor(archive->fd, data_end, entry);
+    if (return_value) {
+      return return_value;
+    }
+  }
+
+  // Unlike ExtractToMemory, the caller has no copy of the data to check
+  // afterwards, so check it here.
+  if (entry->crc32 != crc) {
+    ALOGW("Zip: crc mismatch: expected %" PRIu32 ", was %" PRIu64, entry->crc32, crc);
+    return kInconsistentInformation;
+  }
+  return 0;
+}
+
+/*
+ * The requests of one ExtractEntriesToFiles call, claimed one at a time by
+ * each of its threads until none are left.
+ */
+struct ExtractJob {
+  ZipArchiveHandle handle;
+  ZipExtractRequest* requests;
+  uint32_t count;
+  volatile uint32_t next;
+};
+
+static void RunExtractJob(ExtractJob* job) {
+  while (true) {
+    const uint32_t i = __sync_fetch_and_add(&job->next, 1);
+    if (i >= job->count) {
+      return;
+    }
+    ZipExtractRequest* request = &job->requests[i];
+    request->result = ExtractEntryToFile(job->handle, &request->entry,
+                                         request->fd);
+  }
+}
+
+#if defined(HAVE_PTHREADS) && defined(HAVE_PREAD)
+static void* ExtractThread(void* arg) {
+  RunExtractJob(reinterpret_cast<ExtractJob*>(arg));
+  return NULL;
+}
+#endif
+
+static uint32_t DefaultExtractThreads() {
+#if defined(HAVE_PTHREADS) && defined(HAVE_PREAD) && defined(_SC_NPROCESSORS_ONLN)
+  const long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  if (cpus > static_cast<long>(kMaxDefaultExtractThreads)) {
+    return kMaxDefaultExtractThreads;
+  }
+  if (cpus > 1) {
+    return cpus;
+  }
+#endif
+  return 1;
+}
+
+int32_t ExtractEntriesToFiles(ZipArchiveHandle handle,
+                              ZipExtractRequest* requests, uint32_t count,
+                              uint32_t num_threads, ZipExtractStats* stats) {
+  const ZipArchive* archive = (ZipArchive*) handle;
+  if (archive == NULL || archive->hash_table == NULL) {
+    ALOGW("Zip: Invalid ZipArchiveHandle");
+    return kInvalidHandle;
+  }
+
+  const nsecs_t start = systemTime(SYSTEM_TIME_MONOTONIC);
+  if (num_threads == 0) {
+    num_threads = DefaultExtractThreads();
+  }
+  if (num_threads > count) {
+    num_threads = count;
+  }
+
+  ExtractJob job;
+  job.handle = handle;
+  job.requests = requests;
+  job.count = count;
+  job.next = 0;
+
+  // Without pread, every read moves the shared file offset, so extract on
+  // the calling thread alone.
+  uint32_t started = 0;
+#if defined(HAVE_PTHREADS) && defined(HAVE_PREAD)
+  pthread_t* threads = NULL;
+  if (num_threads > 1) {
+    threads = reinterpret_cast<pthread_t*>(malloc((num_threads - 1) * sizeof(pthread_t)));
+  }
+  if (threads != NULL) {
+    for (; started < num_threads - 1; started++) {
+      if (pthread_create(&threads[started], NULL, ExtractThread, &job)) {
+        ALOGW("Zip: unable to start extract thread: %s", strerror(errno));
+        break;
+      }
+    }
+  }
+#endif
+
+  RunExtractJob(&job);
+
+#if defined(HAVE_PTHREADS) && defined(HAVE_PREAD)
+  for (uint32_t i = 0; i < started; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  free(threads);
+#endif
+
+  int32_t result = 0;
+  ZipExtractStats totals;
+  memset(&totals, 0, sizeof(totals));
+  for (uint32_t i = 0; i < count; i++) {
+    if (requests[i].result) {
+      if (!result) {
+        result = requests[i].result;
+      }
+      totals.failed++;
+    } else {
+      totals.extracted++;
+      totals.compressed_bytes += requests[i].entry.compressed_length;
+      totals.uncompressed_bytes += requests[i].entry.uncompressed_length;
+    }
+  }
+  totals.elapsed_ns = systemTime(SYSTEM_TIME_MONOTONIC) - start;
+  totals.num_threads = started + 1;
+
+  if (stats != NULL) {
+    *stats = totals;
+  }
+  return result;
+}
+
+int32_t ExtractPrefixToFiles(ZipArchiveHandle handle, const char* prefix,
+                             ZipExtractOpenCallback open_callback,
+                             ZipExtractDoneCallback done_callback,
+                             void* cookie, uint32_t num_threads,
+                             ZipExtractStats* stats) {
+  void* iteration_cookie;
+  int32_t result = StartIteration(handle, &iteration_cookie, prefix);
+  if (result) {
+    return result;
+  }
+
+  ZipExtractRequest* requests = NULL;
+  ZipEntryName* names = NULL;
+  uint32_t count = 0;
+  uint32_t capacity = 0;
+  uint32_t bad_entries = 0;
+  int32_t error;
+  ZipEntry entry;
+  ZipEntryName name;
+  while ((error = Next(iteration_cookie, &entry, &name)) != kIterationEnd) {
+    if (error) {
+      // Next moves on past a bad entry, so carry on with the rest
+      if (!result) {
+        result = error;
+      }
+      bad_entries++;
+      continue;
+    }
+
+    if (count == capacity) {
+      capacity = capacity ? capacity * 2 : 16;
+      ZipExtractRequest* new_requests = reinterpret_cast<ZipExtractRequest*>(
+          realloc(requests, capacity * sizeof(ZipExtractRequest)));
+      if (new_requests != NULL) {
+        requests = new_requests;
+      }
+      ZipEntryName* new_names = reinterpret_cast<ZipEntryName*>(
+          realloc(names, capacity * sizeof(ZipEntryName)));
+      if (new_names != NULL) {
+        names = new_names;
+      }
+      if (new_requests == NULL || new_names == NULL) {
+        ALOGW("Zip: unable to allocate %" PRIu32 " extract requests", capacity);
+        result = kIoError;
+        break;
+      }
+    }
+
+    const int fd = open_callback(&name, &entry, cookie);
+    if (fd < 0) {
+      continue;
+    }
+    requests[count].entry = entry;
+    requests[count].fd = fd;
+    requests[count].result = 0;
+    names[count] = name;
+    count++;
+  }
+  free(iteration_cookie);
+
+  // The requests opened so far are still extracted and handed back, even if
+  // collecting the rest failed.
+  ZipExtractStats totals;
+  const int32_t extract_result = ExtractEntriesToFiles(handle, requests, count,
+                                                       num_threads, &totals);
+  if (!result) {
+    result = extract_result;
+  }
+  totals.failed += bad_entries;
+
+  if (done_callback != NULL) {
+    for (uint32_t i = 0; i < count; i++) {
+      done_callback(&names[i], requests[i].fd, requests[i].result, cookie);
+    }
+  }
+  free(requests);
+  free(names);
+
+  if (stats != NULL) {
+    *stats = totals;
+  }
+  return result;
+}
+
 const char* ErrorCodeString(int32_t error_code) {
   if (error_code > kErrorMessageLowerBound && error_code < kErrorMessageUpperBound) {
     return kErrorMessages[error_code * -1];
@@ -17,10 +17,14 @@
 #include "ziparchive/zip_archive.h"
 
 #include <errno.h>
+#include <fcntl.h>
 #include <getopt.h>
+#include <inttypes.h>
 #include <stdio.h>
+#include <time.h>
 #include <unistd.h>
 #include <vector>
+#include <zlib.h>
 
 #include <gtest/gtest.h>
 
@@ -77,27 +81,53 @@ TEST(ziparchive, Iteration) {
   ZipEntry data;
   ZipEntryName name;
 
-  // b/c.txt
+  // b/
   ASSERT_EQ(0, Next(iteration_cookie, &data, &name));
-  AssertNameEquals("b/c.txt", name);
+  AssertNameEquals("b/", name);
 
   // b/d.txt
   ASSERT_EQ(0, Next(iteration_cookie, &data, &name));
   AssertNameEquals("b/d.txt", name);
 
+  // b.txt
+  ASSERT_EQ(0, Next(iteration_cookie, &data, &name));
+  AssertNameEquals("b.txt", name);
+
+  // b/c.txt
+  ASSERT_EQ(0, Next(iteration_cookie, &data, &name));
+  AssertNameEquals("b/c.txt", name);
+
   // a.txt
   ASSERT_EQ(0, Next(iteration_cookie, &data, &name));
   AssertNameEquals("a.txt", name);
 
-  // b.txt
-  ASSERT_EQ(0, Next(iteration_cookie, &data, &name));
-  AssertNameEquals("b.txt", name);
+  // End of iteration.
+  ASSERT_EQ(-1, Next(iteration_cookie, &data, &name));
 
-  // b/
+  CloseArchive(handle);
+}
+
+TEST(ziparchive, IterationWithPrefix) {
+  ZipArchiveHandle handle;
+  ASSERT_EQ(0, OpenArchiveWrapper(kValidZip, &handle));
+
+  void* iteration_cookie;
+  ASSERT_EQ(0, StartIteration(handle, &iteration_cookie, "b/"));
+
+  ZipEntry data;
+  ZipEntryName name;
+
+  // In order of their names.
   ASSERT_EQ(0, Next(iteration_cookie, &data, &name));
   AssertNameEquals("b/", name);
+  ASSERT_EQ(0, Next(iteration_cookie, &data, &name));
+  AssertNameEquals("b/c.txt", name);
+  ASSERT_EQ(0, Next(iteration_cookie, &data, &name));
+  AssertNameEquals("b/d.txt", name);
+  ASSERT_EQ(-1, Next(iteration_cookie, &data, &name));
 
-  // End of iteration.
+  // Nothing has this one.
+  ASSERT_EQ(0, StartIteration(handle, &iteration_cookie, "c"));
   ASSERT_EQ(-1, Next(iteration_cookie, &data, &name));
 
   CloseArchive(handle);
@@ -149,6 +179,65 @@ TEST(ziparchive, ExtractToMemory) {
   CloseArchive(handle);
 }
 
+TEST(ziparchive, MapStoredEntry) {
+  ZipArchiveHandle handle;
+  ASSERT_EQ(0, OpenArchiveWrapper(kValidZip, &handle));
+
+  ZipEntry data;
+  ZipEntryMapping mapping;
+  ASSERT_EQ(0, FindEntry(handle, "b.txt", &data));
+  ASSERT_EQ(0, MapStoredEntry(handle, &data, &mapping));
+  ASSERT_EQ(sizeof(kBTxtContents), mapping.length);
+  ASSERT_EQ(0, memcmp(mapping.data, kBTxtContents, sizeof(kBTxtContents)));
+
+  // The mapping outlives the archive.
+  CloseArchive(handle);
+  ASSERT_EQ(0, memcmp(mapping.data, kBTxtContents, sizeof(kBTxtContents)));
+  UnmapStoredEntry(&mapping);
+  ASSERT_EQ(NULL, mapping.data);
+
+  // a.txt is deflated, so there is nothing to map.
+  ASSERT_EQ(0, OpenArchiveWrapper(kValidZip, &handle));
+  ASSERT_EQ(0, FindEntry(handle, "a.txt", &data));
+  ASSERT_GT(0, MapStoredEntry(handle, &data, &mapping));
+  CloseArchive(handle);
+}
+
+static bool AppendToVector(const uint8_t* buf, size_t buf_size, void* cookie) {
+  std::vector<uint8_t>* output = reinterpret_cast<std::vector<uint8_t>*>(cookie);
+  output->insert(output->end(), buf, buf + buf_size);
+  return true;
+}
+
+static bool StopAtFirstChunk(const uint8_t*, size_t, void*) {
+  return false;
+}
+
+TEST(ziparchive, ProcessZipEntryContents) {
+  ZipArchiveHandle handle;
+  ASSERT_EQ(0, OpenArchiveWrapper(kValidZip, &handle));
+
+  // An entry that's deflated.
+  ZipEntry data;
+  std::vector<uint8_t> output;
+  ASSERT_EQ(0, FindEntry(handle, "a.txt", &data));
+  ASSERT_EQ(0, ProcessZipEntryContents(handle, &data, AppendToVector, &output));
+  ASSERT_EQ(sizeof(kATxtContents), output.size());
+  ASSERT_EQ(0, memcmp(&output[0], kATxtContents, sizeof(kATxtContents)));
+
+  // An entry that's stored.
+  output.clear();
+  ASSERT_EQ(0, FindEntry(handle, "b.txt", &data));
+  ASSERT_EQ(0, ProcessZipEntryContents(handle, &data, AppendToVector, &output));
+  ASSERT_EQ(sizeof(kBTxtContents), output.size());
+  ASSERT_EQ(0, memcmp(&output[0], kBTxtContents, sizeof(kBTxtContents)));
+
+  // The callback can stop early, which is reported as an error.
+  ASSERT_GT(0, ProcessZipEntryContents(handle, &data, StopAtFirstChunk, NULL));
+
+  CloseArchive(handle);
+}
+
 static const uint32_t kEmptyEntriesZip[] = {
       0x04034b50, 0x0000000a, 0x63600000, 0x00004438, 0x00000000, 0x00000000,
       0x00090000, 0x6d65001c, 0x2e797470, 0x55747874, 0x03000954, 0x52e25c13,
@@ -158,7 +247,9 @@ static const uint32_t kEmptyEntriesZip[] = {
       0x54557478, 0x13030005, 0x7552e25c, 0x01000b78, 0x00428904, 0x13880400,
       0x4b500000, 0x00000605, 0x00010000, 0x004f0001, 0x00430000, 0x00000000 };
 
-static int make_temporary_file(const char* file_name_pattern) {
+// With |anonymous|, the file is unlinked right away and goes when closed.
+static int make_temporary_file(const char* file_name_pattern,
+                               bool anonymous = false) {
   char full_path[1024];
   // Account for differences between the host and the target.
   //
@@ -170,6 +261,9 @@ static int make_temporary_file(const char* file_name_pattern) {
     fd = mkstemp(full_path);
   }
 
+  if (fd != -1 && anonymous) {
+    unlink(full_path);
+  }
   return fd;
 }
 
@@ -256,6 +350,494 @@ TEST(ziparchive, ExtractToFile) {
   close(fd);
 }
 
+TEST(ziparchive, ExtractEntriesToFiles) {
+  ZipArchiveHandle handle;
+  ASSERT_EQ(0, OpenArchiveWrapper(kValidZip, &handle));
+
+  // a.txt is deflated, b.txt stored.
+  ZipExtractRequest requests[2];
+  ASSERT_EQ(0, FindEntry(handle, "a.txt", &requests[0].entry));
+  ASSERT_EQ(0, FindEntry(handle, "b.txt", &requests[1].entry));
+  char output_file_pattern[] = "extract_entries_output_XXXXXX";
+  for (size_t i = 0; i < 2; i++) {
+    requests[i].fd = make_temporary_file(output_file_pattern, true);
+    ASSERT_NE(-1, requests[i].fd);
+    requests[i].result = 1;
+  }
+
+  ZipExtractStats stats;
+  ASSERT_EQ(0, ExtractEntriesToFiles(handle, requests, 2, 2, &stats));
+  ASSERT_EQ(0, requests[0].result);
+  ASSERT_EQ(0, requests[1].result);
+  ASSERT_EQ(static_cast<uint32_t>(2), stats.extracted);
+  ASSERT_EQ(static_cast<uint32_t>(0), stats.failed);
+  ASSERT_EQ(sizeof(kATxtContents) + sizeof(kBTxtContents), stats.uncompressed_bytes);
+
+  uint8_t buffer[sizeof(kATxtContents)];
+  ASSERT_EQ(static_cast<ssize_t>(sizeof(kATxtContents)),
+            TEMP_FAILURE_RETRY(pread(requests[0].fd, buffer, sizeof(buffer), 0)));
+  ASSERT_EQ(0, memcmp(buffer, kATxtContents, sizeof(kATxtContents)));
+  ASSERT_EQ(static_cast<ssize_t>(sizeof(kBTxtContents)),
+            TEMP_FAILURE_RETRY(pread(requests[1].fd, buffer, sizeof(buffer), 0)));
+  ASSERT_EQ(0, memcmp(buffer, kBTxtContents, sizeof(kBTxtContents)));
+
+  close(requests[0].fd);
+  close(requests[1].fd);
+  CloseArchive(handle);
+}
+
+struct PrefixExtraction {
+  std::vector<std::string> opened;
+  std::vector<std::string> done;
+};
+
+static int OpenPrefixOutput(const ZipEntryName* name, const ZipEntry*,
+                            void* cookie) {
+  PrefixExtraction* extraction = reinterpret_cast<PrefixExtraction*>(cookie);
+  const std::string entry_name(name->name, name->name_length);
+  // Directories are entries too, skip them.
+  if (entry_name[entry_name.size() - 1] == '/') {
+    return -1;
+  }
+  extraction->opened.push_back(entry_name);
+  char output_file_pattern[] = "extract_prefix_output_XXXXXX";
+  return make_temporary_file(output_file_pattern, true);
+}
+
+static void ClosePrefixOutput(const ZipEntryName* name, int fd, int32_t result,
+                              void* cookie) {
+  PrefixExtraction* extraction = reinterpret_cast<PrefixExtraction*>(cookie);
+  if (result == 0) {
+    extraction->done.push_back(std::string(name->name, name->name_length));
+  }
+  close(fd);
+}
+
+TEST(ziparchive, ExtractPrefixToFiles) {
+  ZipArchiveHandle handle;
+  ASSERT_EQ(0, OpenArchiveWrapper(kValidZip, &handle));
+
+  PrefixExtraction extraction;
+  ZipExtractStats stats;
+  ASSERT_EQ(0, ExtractPrefixToFiles(handle, "b/", OpenPrefixOutput,
+                                    ClosePrefixOutput, &extraction, 0, &stats));
+  ASSERT_EQ(static_cast<size_t>(2), extraction.opened.size());
+  ASSERT_EQ(extraction.opened, extraction.done);
+  ASSERT_EQ(static_cast<uint32_t>(2), stats.extracted);
+  ASSERT_EQ(static_cast<uint32_t>(0), stats.failed);
+
+  CloseArchive(handle);
+}
+
+// A synthetic archive standing in for a large APK: kBenchEntries entries of
+// kBenchEntrySize bytes each, every fourth one stored and the rest deflated.
+static const uint32_t kBenchEntries = 64;
+static const uint32_t kBenchEntrySize = 1024 * 1024;
+
+static void PutLE16(std::vector<uint8_t>* out, uint16_t value) {
+  out->push_back(value & 0xff);
+  out->push_back(value >> 8);
+}
+
+static void PutLE32(std::vector<uint8_t>* out, uint32_t value) {
+  PutLE16(out, value & 0xffff);
+  PutLE16(out, value >> 16);
+}
+
+// Writes an archive of |num_entries| entries of |entry_size| bytes each,
+// named by |make_name|. Every fourth is stored and the rest deflated, unless
+// they are too small to be worth it.
+static bool WriteBenchArchive(int fd, uint32_t num_entries, uint32_t entry_size,
+                              void (*make_name)(uint32_t, char*, size_t)) {
+  std::vector<uint8_t> archive;
+  std::vector<uint8_t> directory;
+  std::vector<uint8_t> content(entry_size);
+  std::vector<uint8_t> deflated(compressBound(entry_size));
+  uint32_t seed = 1;
+
+  for (uint32_t i = 0; i < num_entries; i++) {
+    char name[128];
+    make_name(i, name, sizeof(name));
+    const uint16_t name_length = strlen(name);
+    // Text-like content that deflates to about half.
+    for (uint32_t j = 0; j < entry_size; j++) {
+      seed = seed * 1103515245 + 12345;
+      content[j] = 'a' + ((seed >> 16) & 0x0f);
+    }
+    const uint32_t crc = crc32(0, &content[0], entry_size);
+
+    const uint16_t method = (i % 4 == 0 || entry_size < 1024) ?
+        kCompressStored : kCompressDeflated;
+    const uint8_t* data = &content[0];
+    uint32_t data_size = entry_size;
+    if (method == kCompressDeflated) {
+      z_stream zstream;
+      memset(&zstream, 0, sizeof(zstream));
+      deflateInit2(&zstream, Z_BEST_SPEED, Z_DEFLATED, -MAX_WBITS, 8,
+                   Z_DEFAULT_STRATEGY);
+      zstream.next_in = &content[0];
+      zstream.avail_in = entry_size;
+      zstream.next_out = &deflated[0];
+      zstream.avail_out = deflated.size();
+      if (deflate(&zstream, Z_FINISH) != Z_STREAM_END) {
+        deflateEnd(&zstream);
+        return false;
+      }
+      data = &deflated[0];
+      data_size = zstream.total_out;
+      deflateEnd(&zstream);
+    }
+
+    const uint32_t local_header_offset = archive.size();
+    PutLE32(&archive, 0x04034b50);
+    PutLE16(&archive, 20);  // version needed
+    PutLE16(&archive, 0);  // flags
+    PutLE16(&archive, method);
+    PutLE32(&archive, 0);  // time, date
+    PutLE32(&archive, crc);
+    PutLE32(&archive, data_size);
+    PutLE32(&archive, entry_size);
+    PutLE16(&archive, name_length);
+    PutLE16(&archive, 0);  // extra
+    archive.insert(archive.end(), name, name + name_length);
+    archive.insert(archive.end(), data, data + data_size);
+
+    PutLE32(&directory, 0x02014b50);
+    PutLE16(&directory, 20);  // version made by
+    PutLE16(&directory, 20);  // version needed
+    PutLE16(&directory, 0);  // flags
+    PutLE16(&directory, method);
+    PutLE32(&directory, 0);  // time, date
+    PutLE32(&directory, crc);
+    PutLE32(&directory, data_size);
+    PutLE32(&directory, entry_size);
+    PutLE16(&directory, name_length);
+    PutLE16(&directory, 0);  // extra
+    PutLE16(&directory, 0);  // comment
+    PutLE16(&directory, 0);  // disk
+    PutLE16(&directory, 0);  // internal attributes
+    PutLE32(&directory, 0);  // external attributes
+    PutLE32(&directory, local_header_offset);
+    directory.insert(directory.end(), name, name + name_length);
+  }
+
+  const uint32_t directory_offset = archive.size();
+  archive.insert(archive.end(), directory.begin(), directory.end());
+  PutLE32(&archive, 0x06054b50);
+  PutLE16(&archive, 0);  // disk
+  PutLE16(&archive, 0);  // directory disk
+  PutLE16(&archive, num_entries);
+  PutLE16(&archive, num_entries);
+  PutLE32(&archive, directory.size());
+  PutLE32(&archive, directory_offset);
+  PutLE16(&archive, 0);  // comment
+
+  const ssize_t size = archive.size();
+  return TEMP_FAILURE_RETRY(write(fd, &archive[0], size)) == size;
+}
+
+static void MakeLibraryName(uint32_t i, char* name, size_t size) {
+  snprintf(name, size, "lib/bench/lib%03u.so", i);
+}
+
+static int MakeBenchArchive() {
+  char temp_file_pattern[] = "extract_bench_XXXXXX";
+  const int fd = make_temporary_file(temp_file_pattern, true);
+  if (fd == -1) {
+    return -1;
+  }
+  if (!WriteBenchArchive(fd, kBenchEntries, kBenchEntrySize, MakeLibraryName)) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+static uint64_t NanoTime() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return static_cast<uint64_t>(now.tv_sec) * 1000000000ULL + now.tv_nsec;
+}
+
+// Not a test as such: extracts the synthetic archive one entry at a time,
+// then on a pool of threads, checking the output and reporting throughput.
+TEST(ziparchive, BenchmarkExtractEntriesToFiles) {
+  const int fd = MakeBenchArchive();
+  ASSERT_NE(-1, fd);
+  ZipArchiveHandle handle;
+  ASSERT_EQ(0, OpenArchiveFd(fd, "ExtractBenchmark", &handle));
+
+  std::vector<ZipExtractRequest> requests(kBenchEntries);
+  void* iteration_cookie;
+  ASSERT_EQ(0, StartIteration(handle, &iteration_cookie, "lib/bench/"));
+  ZipEntryName name;
+  for (uint32_t i = 0; i < kBenchEntries; i++) {
+    ASSERT_EQ(0, Next(iteration_cookie, &requests[i].entry, &name));
+  }
+  ASSERT_EQ(-1, Next(iteration_cookie, &requests[0].entry, &name));
+
+  // 0 picks one thread per CPU
+  const uint32_t thread_counts[] = { 1, 2, 4, 0 };
+  for (size_t run = 0; run < sizeof(thread_counts) / sizeof(thread_counts[0]); run++) {
+    char output_file_pattern[] = "extract_bench_output_XXXXXX";
+    for (uint32_t i = 0; i < kBenchEntries; i++) {
+      requests[i].fd = make_temporary_file(output_file_pattern, true);
+      ASSERT_NE(-1, requests[i].fd);
+    }
+
+    uint64_t elapsed;
+    uint32_t num_threads = 1;
+    if (thread_counts[run] == 1) {
+      // The existing API, one after the other.
+      const uint64_t start = NanoTime();
+      for (uint32_t i = 0; i < kBenchEntries; i++) {
+        requests[i].result = ExtractEntryToFile(handle, &requests[i].entry,
+                                                requests[i].fd);
+      }
+      elapsed = NanoTime() - start;
+    } else {
+      ZipExtractStats stats;
+      ASSERT_EQ(0, ExtractEntriesToFiles(handle, &requests[0], kBenchEntries,
+                                         thread_counts[run], &stats));
+      ASSERT_EQ(kBenchEntries, stats.extracted);
+      ASSERT_EQ(static_cast<uint64_t>(kBenchEntries) * kBenchEntrySize,
+                stats.uncompressed_bytes);
+      elapsed = stats.elapsed_ns;
+      num_threads = stats.num_threads;
+    }
+
+    std::vector<uint8_t> output(kBenchEntrySize);
+    for (uint32_t i = 0; i < kBenchEntries; i++) {
+      ASSERT_EQ(0, requests[i].result);
+      ASSERT_EQ(static_cast<ssize_t>(kBenchEntrySize),
+                TEMP_FAILURE_RETRY(pread(requests[i].fd, &output[0], kBenchEntrySize, 0)));
+      ASSERT_EQ(requests[i].entry.crc32, crc32(0, &output[0], kBenchEntrySize));
+      close(requests[i].fd);
+    }
+
+    // bytes per ns, scaled to MB/s
+    printf("%u entries, %u threads: %" PRIu64 " us, %" PRIu64 " MB/s\n",
+           kBenchEntries, num_threads, elapsed / 1000,
+           static_cast<uint64_t>(kBenchEntries) * kBenchEntrySize * 1000 / (elapsed + 1));
+  }
+
+  CloseArchive(handle);
+}
+
+static bool SumBytes(const uint8_t* buf, size_t buf_size, void* cookie) {
+  uint64_t* sum = reinterpret_cast<uint64_t*>(cookie);
+  for (size_t i = 0; i < buf_size; i++) {
+    *sum += buf[i];
+  }
+  return true;
+}
+
+// Not a test as such: reads every entry of the synthetic archive into a
+// buffer of its full size, then streams each through a callback, then
+// maps the stored ones in place, reporting the time each takes.
+TEST(ziparchive, BenchmarkEntryAccess) {
+  const int fd = MakeBenchArchive();
+  ASSERT_NE(-1, fd);
+  ZipArchiveHandle handle;
+  ASSERT_EQ(0, OpenArchiveFd(fd, "AccessBenchmark", &handle));
+
+  std::vector<ZipEntry> entries(kBenchEntries);
+  void* iteration_cookie;
+  ZipEntryName name;
+  ASSERT_EQ(0, StartIteration(handle, &iteration_cookie, "lib/bench/"));
+  for (uint32_t i = 0; i < kBenchEntries; i++) {
+    ASSERT_EQ(0, Next(iteration_cookie, &entries[i], &name));
+  }
+
+  uint64_t extract_sum = 0;
+  uint64_t start = NanoTime();
+  for (uint32_t i = 0; i < kBenchEntries; i++) {
+    std::vector<uint8_t> buffer(entries[i].uncompressed_length);
+    ASSERT_EQ(0, ExtractToMemory(handle, &entries[i], &buffer[0], buffer.size()));
+    SumBytes(&buffer[0], buffer.size(), &extract_sum);
+  }
+  const uint64_t extract_elapsed = NanoTime() - start;
+
+  uint64_t process_sum = 0;
+  start = NanoTime();
+  for (uint32_t i = 0; i < kBenchEntries; i++) {
+    ASSERT_EQ(0, ProcessZipEntryContents(handle, &entries[i], SumBytes, &process_sum));
+  }
+  const uint64_t process_elapsed = NanoTime() - start;
+  ASSERT_EQ(extract_sum, process_sum);
+
+  // The stored entries, copied out and then mapped.
+  uint64_t copy_sum = 0;
+  uint32_t stored = 0;
+  start = NanoTime();
+  for (uint32_t i = 0; i < kBenchEntries; i++) {
+    if (entries[i].method == kCompressStored) {
+      std::vector<uint8_t> buffer(entries[i].uncompressed_length);
+      ASSERT_EQ(0, ExtractToMemory(handle, &entries[i], &buffer[0], buffer.size()));
+      SumBytes(&buffer[0], buffer.size(), &copy_sum);
+      stored++;
+    }
+  }
+  const uint64_t copy_elapsed = NanoTime() - start;
+
+  uint64_t map_sum = 0;
+  start = NanoTime();
+  for (uint32_t i = 0; i < kBenchEntries; i++) {
+    if (entries[i].method == kCompressStored) {
+      ZipEntryMapping mapping;
+      ASSERT_EQ(0, MapStoredEntry(handle, &entries[i], &mapping));
+      SumBytes(mapping.data, mapping.length, &map_sum);
+      UnmapStoredEntry(&mapping);
+    }
+  }
+  const uint64_t map_elapsed = NanoTime() - start;
+  ASSERT_EQ(copy_sum, map_sum);
+
+  printf("%u entries: ExtractToMemory %" PRIu64 " us, ProcessZipEntryContents %" PRIu64 " us\n",
+         kBenchEntries, extract_elapsed / 1000, process_elapsed / 1000);
+  printf("%u stored entries: ExtractToMemory %" PRIu64 " us, MapStoredEntry %" PRIu64 " us\n",
+         stored, copy_elapsed / 1000, map_elapsed / 1000);
+
+  CloseArchive(handle);
+}
+
+// The directory layout of a large APK, for the index benchmark.
+static const uint32_t kIndexBenchEntries = 20000;
+
+static void MakeResourceName(uint32_t i, char* name, size_t size) {
+  switch (i % 8) {
+    case 0: case 1: case 2: case 3:
+      snprintf(name, size, "res/drawable-xxhdpi-v4/ic_bench_%05u.png", i);
+      break;
+    case 4: case 5:
+      snprintf(name, size, "res/layout/bench_layout_%05u.xml", i);
+      break;
+    case 6:
+      snprintf(name, size, "assets/bench/data_%05u.bin", i);
+      break;
+    default:
+      snprintf(name, size, "lib/arm64-v8a/libbench_%05u.so", i);
+      break;
+  }
+}
+
+// Not a test as such: times opening an archive with many small entries,
+// with and without an index file, finding each entry, and iterating over
+// the entries under a prefix.
+TEST(ziparchive, BenchmarkIndex) {
+  const char* temp_dir = access("/data/local/tmp", W_OK) == 0 ? "/data/local/tmp" : "/tmp";
+  char archive_path[1024];
+  char index_path[1024];
+  snprintf(archive_path, sizeof(archive_path), "%s/index_bench_%d.zip", temp_dir, getpid());
+  snprintf(index_path, sizeof(index_path), "%s/index_bench_%d.idx", temp_dir, getpid());
+  unlink(index_path);
+
+  const int fd = open(archive_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  ASSERT_NE(-1, fd);
+  ASSERT_TRUE(WriteBenchArchive(fd, kIndexBenchEntries, 16, MakeResourceName));
+  close(fd);
+
+  static const int kOpens = 20;
+  ZipArchiveHandle handle;
+  uint64_t start = NanoTime();
+  for (int i = 0; i < kOpens; i++) {
+    ASSERT_EQ(0, OpenArchive(archive_path, &handle));
+    CloseArchive(handle);
+  }
+  const uint64_t open_elapsed = (NanoTime() - start) / kOpens;
+
+  // The first open writes the index, the rest load it.
+  ASSERT_EQ(0, OpenArchiveWithIndex(archive_path, index_path, &handle));
+  CloseArchive(handle);
+  ASSERT_EQ(0, access(index_path, R_OK));
+  start = NanoTime();
+  for (int i = 0; i < kOpens; i++) {
+    ASSERT_EQ(0, OpenArchiveWithIndex(archive_path, index_path, &handle));
+    CloseArchive(handle);
+  }
+  const uint64_t index_elapsed = (NanoTime() - start) / kOpens;
+
+  // An archive opened from its index finds and iterates the same.
+  ASSERT_EQ(0, OpenArchiveWithIndex(archive_path, index_path, &handle));
+  ZipEntry entry;
+  char name[128];
+  start = NanoTime();
+  for (uint32_t i = 0; i < kIndexBenchEntries; i++) {
+    MakeResourceName(i, name, sizeof(name));
+    ASSERT_EQ(0, FindEntry(handle, name, &entry));
+  }
+  const uint64_t find_elapsed = (NanoTime() - start) / kIndexBenchEntries;
+
+  static const int kIterations = 20;
+  void* iteration_cookie;
+  ZipEntryName entry_name;
+  uint32_t count = 0;
+  start = NanoTime();
+  for (int i = 0; i < kIterations; i++) {
+    ASSERT_EQ(0, StartIteration(handle, &iteration_cookie, "lib/"));
+    while (Next(iteration_cookie, &entry, &entry_name) == 0) {
+      count++;
+    }
+    free(iteration_cookie);
+  }
+  const uint64_t iterate_elapsed = (NanoTime() - start) / kIterations;
+  ASSERT_EQ(kIndexBenchEntries / 8 * kIterations, count);
+  CloseArchive(handle);
+
+  unlink(index_path);
+  unlink(archive_path);
+
+  printf("%u entries: open %" PRIu64 " us, open with index %" PRIu64 " us, "
+         "find %" PRIu64 " ns, iterate lib/ %" PRIu64 " us\n",
+         kIndexBenchEntries, open_elapsed / 1000, index_elapsed / 1000,
+         find_elapsed, iterate_elapsed / 1000);
+}
+
+TEST(ziparchive, OpenArchiveWithIndex) {
+  const std::string archive_path = test_data_dir + "/" + kValidZip;
+  const char* temp_dir = access("/data/local/tmp", W_OK) == 0 ? "/data/local/tmp" : "/tmp";
+  char index_path[1024];
+  snprintf(index_path, sizeof(index_path), "%s/valid_index_%d.idx", temp_dir, getpid());
+  unlink(index_path);
+
+  // Written by the first open, read by the second.
+  for (int i = 0; i < 2; i++) {
+    ZipArchiveHandle handle;
+    ASSERT_EQ(0, OpenArchiveWithIndex(archive_path.c_str(), index_path, &handle));
+    ASSERT_EQ(0, access(index_path, R_OK));
+
+    ZipEntry data;
+    ASSERT_EQ(0, FindEntry(handle, "a.txt", &data));
+    ASSERT_EQ(static_cast<uint32_t>(17), data.uncompressed_length);
+    ASSERT_LT(FindEntry(handle, "nonexistent.txt", &data), 0);
+
+    void* iteration_cookie;
+    ZipEntryName name;
+    ASSERT_EQ(0, StartIteration(handle, &iteration_cookie, "b/"));
+    ASSERT_EQ(0, Next(iteration_cookie, &data, &name));
+    AssertNameEquals("b/", name);
+    free(iteration_cookie);
+    CloseArchive(handle);
+  }
+
+  // An index of some other archive is ignored.
+  ZipArchiveHandle handle;
+  char temp_file_pattern[] = "index_other_XXXXXX";
+  const int fd = make_temporary_file(temp_file_pattern, true);
+  ASSERT_NE(-1, fd);
+  ASSERT_TRUE(WriteBenchArchive(fd, 4, 16, MakeLibraryName));
+  char fd_path[64];
+  snprintf(fd_path, sizeof(fd_path), "/proc/self/fd/%d", fd);
+  ASSERT_EQ(0, OpenArchiveWithIndex(fd_path, index_path, &handle));
+  ZipEntry data;
+  ASSERT_EQ(0, FindEntry(handle, "lib/bench/lib002.so", &data));
+  ASSERT_LT(FindEntry(handle, "a.txt", &data), 0);
+  CloseArchive(handle);
+  close(fd);
+
+  unlink(index_path);
+}
+
 int main(int argc, char** argv) {
   ::testing::InitGoogleTest(&argc, argv);
 
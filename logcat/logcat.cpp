@@ -119,6 +119,35 @@ void printBinary(struct log_msg *buf)
     TEMP_FAILURE_RETRY(write(g_outFD, buf, size));
 }
 
+/*
+ * Read back a record written by -B. Returns its length, 0 at the end of
+ * the file, or a negative errno as android_logger_list_read() does.
+ */
+static int readReplay(int fd, struct log_msg *buf)
+{
+    size_t hdrLen = sizeof(buf->entry.len) + sizeof(buf->entry.hdr_size);
+    ssize_t ret;
+
+    ret = TEMP_FAILURE_RETRY(read(fd, buf->buf, hdrLen));
+    if (ret <= 0) {
+        return ret ? -errno : 0;
+    }
+    if (((size_t)ret != hdrLen)
+            || (buf->entry.hdr_size < sizeof(buf->entry_v2))
+            || (buf->len() > LOGGER_ENTRY_MAX_LEN)) {
+        return -EINVAL;
+    }
+
+    size_t len = buf->len() - hdrLen;
+    ret = TEMP_FAILURE_RETRY(read(fd, buf->buf + hdrLen, len));
+    if ((ret < 0) || ((size_t)ret != len)) {
+        return -EIO;
+    }
+    buf->buf[buf->len()] = '\0';
+
+    return buf->len();
+}
+
 static void processBuffer(log_device_t* dev, struct log_msg *buf)
 {
     int bytesWritten = 0;
@@ -234,6 +263,8 @@ static void show_help(const char *cmd)
                     "                  allowed and results are interleaved. The default is\n"
                     "                  -b main -b system -b crash.\n"
                     "  -B              output the log in binary.\n"
+                    "  -i <filename>   replay a log saved with -B instead of reading the\n"
+                    "                  log, implies -d. For measuring filters and formats.\n"
                     "  -S              output statistics.\n"
                     "  -G <size>       set size of log ring buffer, may suffix with K or M.\n"
                     "  -p              print prune white and ~black list. Service is specified as\n"
@@ -326,6 +357,8 @@ int main(int argc, char **argv)
     struct logger_list *logger_list;
     unsigned int tail_lines = 0;
     log_time tail_time(log_time::EPOCH);
+    const char *replayFileName = NULL;
+    int replayFd = -1;
 
     signal(SIGPIPE, exit);
 
@@ -339,7 +372,7 @@ int main(int argc, char **argv)
     for (;;) {
         int ret;
 
-        ret = getopt(argc, argv, "cdt:T:gG:sQf:r:n:v:b:BSpP:");
+        ret = getopt(argc, argv, "cdt:T:gG:sQf:r:n:v:b:BSpP:i:");
 
         if (ret < 0) {
             break;
@@ -504,6 +537,10 @@ int main(int argc, char **argv)
                 android::g_printBinary = 1;
             break;
 
+            case 'i':
+                replayFileName = optarg;
+            break;
+
             case 'f':
                 // redirect output to a file
 
@@ -646,6 +683,13 @@ int main(int argc, char **argv)
         exit(-1);
     }
 
+    if (replayFileName && (clearLog || getLogSize || setLogSize
+            || setPruneList || getPruneList || printStatistics)) {
+        fprintf(stderr,"-i does not read the log, -c -g -G -p -P -S can not be used\n");
+        android::show_help(argv[0]);
+        exit(-1);
+    }
+
     android::setupOutput();
 
     if (hasSetLogFormat == 0) {
@@ -694,11 +738,24 @@ int main(int argc, char **argv)
         }
     }
 
-    dev = devices;
-    if (tail_time != log_time::EPOCH) {
-        logger_list = android_logger_list_alloc_time(mode, tail_time, 0);
-    } else {
-        logger_list = android_logger_list_alloc(mode, tail_lines, 0);
+    if (replayFileName) {
+        replayFd = open(replayFileName, O_RDONLY);
+        if (replayFd < 0) {
+            perror("couldn't open replay file");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    // a replay never opens the log, -b only filters what is read back
+    logger_list = NULL;
+    dev = NULL;
+    if (replayFd < 0) {
+        if (tail_time != log_time::EPOCH) {
+            logger_list = android_logger_list_alloc_time(mode, tail_time, 0);
+        } else {
+            logger_list = android_logger_list_alloc(mode, tail_lines, 0);
+        }
+        dev = devices;
     }
     while (dev) {
         dev->logger_list = logger_list;
@@ -837,7 +894,16 @@ int main(int argc, char **argv)
 
     while (1) {
         struct log_msg log_msg;
-        int ret = android_logger_list_read(logger_list, &log_msg);
+        int ret;
+
+        if (replayFd >= 0) {
+            ret = android::readReplay(replayFd, &log_msg);
+            if (ret == 0) {
+                break;
+            }
+        } else {
+            ret = android_logger_list_read(logger_list, &log_msg);
+        }
 
         if (ret == 0) {
             fprintf(stderr, "read: Unexpected EOF!\n");
@@ -867,6 +933,9 @@ int main(int argc, char **argv)
             }
         }
         if (!dev) {
+            if (replayFd >= 0) {
+                continue; // not one of the -b buffers
+            }
             fprintf(stderr, "read: Unexpected log ID!\n");
             exit(EXIT_FAILURE);
         }
@@ -879,6 +948,9 @@ int main(int argc, char **argv)
         }
     }
 
+    if (replayFd >= 0) {
+        close(replayFd);
+    }
     android_logger_list_free(logger_list);
 
     return 0;
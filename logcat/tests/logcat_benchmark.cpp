@@ -17,6 +17,8 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <time.h>
 
 #include <gtest/gtest.h>
 
@@ -126,3 +128,65 @@ TEST(logcat, sorted_order) {
     // sample statistically too small
     EXPECT_LT(100, count);
 }
+
+static double now_seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * Replay a capture of the logs through the filters and formatter, without
+ * logd in the way. Set LOGCAT_REPLAY to replay a capture of your own, made
+ * with logcat -b all -B -d.
+ */
+TEST(logcat, benchmark_replay) {
+    const char *replay = getenv("LOGCAT_REPLAY");
+
+    if (!replay) {
+        replay = "/data/local/tmp/logcat-replay.bin";
+        ASSERT_EQ(0, system("logcat -b all -B -d > /data/local/tmp/logcat-replay.bin"));
+    }
+
+    struct stat st;
+    ASSERT_EQ(0, stat(replay, &st));
+    ASSERT_LT(0, st.st_size);
+
+    // Busy filter specs are where the time used to go
+    char filters[4096] = "";
+    for (int i = 0; i < 128; ++i) {
+        snprintf(filters + strlen(filters), sizeof(filters) - strlen(filters),
+                 " NoSuchTag%d:v", i);
+    }
+    strcat(filters, " ActivityManager:i PackageManager:w dalvikvm:d '*:i'");
+
+    static const char *formats[] = { "brief", "threadtime", "long" };
+    static const int iterations = 10;
+
+    for (size_t f = 0; f < sizeof(formats) / sizeof(formats[0]); ++f) {
+        char command[sizeof(filters) + 256];
+        snprintf(command, sizeof(command),
+                 "logcat -b all -i %s -v %s%s > /dev/null",
+                 replay, formats[f], filters);
+
+        double start = now_seconds();
+        for (int i = 0; i < iterations; ++i) {
+            ASSERT_EQ(0, system(command));
+        }
+        double elapsed = now_seconds() - start;
+
+        fprintf(stderr, "%-10s %8.2f MB/s of binary log replayed\n",
+                formats[f], st.st_size * iterations / elapsed / 1e6);
+    }
+
+    // and the replay has to print what logcat -d would
+    char command[256];
+    snprintf(command, sizeof(command),
+             "logcat -b all -i %s -v threadtime '*:v' | grep -c .", replay);
+    FILE *fp;
+    ASSERT_TRUE(NULL != (fp = popen(command, "r")));
+    int lines = 0;
+    EXPECT_EQ(1, fscanf(fp, "%d", &lines));
+    pclose(fp);
+    EXPECT_LT(0, lines);
+}
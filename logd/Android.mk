@@ -9,10 +9,13 @@ LOCAL_SRC_FILES := \
     LogCommand.cpp \
     CommandListener.cpp \
     LogListener.cpp \
+    LogQueue.cpp \
     LogReader.cpp \
     FlushCommand.cpp \
     LogBuffer.cpp \
     LogBufferElement.cpp \
+    LogBufferChunk.cpp \
+    LogBufferCold.cpp \
     LogTimes.cpp \
     LogStatistics.cpp \
     LogWhiteBlackList.cpp \
@@ -24,7 +27,8 @@ LOCAL_SHARED_LIBRARIES := \
     libsysutils \
     liblog \
     libcutils \
-    libutils
+    libutils \
+    libz
 
 LOCAL_CFLAGS := -Werror $(shell sed -n 's/^\([0-9]*\)[ \t]*auditd[ \t].*/-DAUDITD_LOG_TAG=\1/p' $(LOCAL_PATH)/event.logtags)
 
@@ -18,6 +18,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/socket.h>
 #include <sys/user.h>
 #include <time.h>
 #include <unistd.h>
@@ -35,6 +36,11 @@
 #define log_buffer_size(id) mMaxSize[id]
 #define LOG_BUFFER_MIN_SIZE (64 * 1024UL)
 #define LOG_BUFFER_MAX_SIZE (256 * 1024 * 1024UL)
+// Chunks are 1/16th of the buffer, so pruning is never too coarse
+#define LOG_BUFFER_CHUNK_MIN_SIZE (8 * 1024UL)
+#define LOG_BUFFER_CHUNK_MAX_SIZE (256 * 1024UL)
+// Entries sent to a reader per drop of the lock
+#define LOG_FLUSH_BATCH 64U
 
 static bool valid_size(unsigned long value) {
     if ((value < LOG_BUFFER_MIN_SIZE) || (LOG_BUFFER_MAX_SIZE < value)) {
@@ -62,6 +68,17 @@ static bool valid_size(unsigned long value) {
     return value <= maximum;
 }
 
+static size_t chunk_size(unsigned long size) {
+    size /= 16;
+    if (size < LOG_BUFFER_CHUNK_MIN_SIZE) {
+        return LOG_BUFFER_CHUNK_MIN_SIZE;
+    }
+    if (size > LOG_BUFFER_CHUNK_MAX_SIZE) {
+        return LOG_BUFFER_CHUNK_MAX_SIZE;
+    }
+    return size;
+}
+
 static unsigned long property_get_size(const char *key) {
     char property[PROPERTY_VALUE_MAX];
     property_get(key, property, "");
@@ -93,7 +110,11 @@ static unsigned long property_get_size(const char *key) {
 }
 
 LogBuffer::LogBuffer(LastLogTimes *times)
-        : mTimes(*times) {
+        : mLastMonotonic(log_time::EPOCH)
+        , mDgramHistory(NULL)
+        , mDgramHistorySize(0)
+        , mDgramHistoryCount(0)
+        , mTimes(*times) {
     pthread_mutex_init(&mLogElementsLock, NULL);
     dgram_qlen_statistics = false;
 
@@ -105,6 +126,10 @@ LogBuffer::LogBuffer(LastLogTimes *times)
         default_size = property_get_size(global_default);
     }
 
+    static const char compressed_tuneable[] = "persist.logd.compressed_size";
+    unsigned long default_compressed_size =
+        property_get_size(compressed_tuneable);
+
     log_id_for_each(i) {
         char key[PROP_NAME_MAX];
 
@@ -129,86 +154,91 @@ LogBuffer::LogBuffer(LastLogTimes *times)
         if (setSize(i, property_size)) {
             setSize(i, LOG_BUFFER_MIN_SIZE);
         }
-    }
-}
 
-void LogBuffer::log(log_id_t log_id, log_time realtime,
-                    uid_t uid, pid_t pid, pid_t tid,
-                    const char *msg, unsigned short len) {
-    if ((log_id >= LOG_ID_MAX) || (log_id < 0)) {
-        return;
+        // optional compressed tier, off unless given a budget
+        snprintf(key, sizeof(key), "%s.%s",
+                 compressed_tuneable, android_log_id_to_name(i));
+        property_size = property_get_size(key);
+        if (!property_size) {
+            property_size = default_compressed_size;
+        }
+        mCold[i].setBudget(property_size);
     }
-    LogBufferElement *elem = new LogBufferElement(log_id, realtime,
-                                                  uid, pid, tid, msg, len);
+}
 
+void LogBuffer::enableDgramQlenStatistics() {
     pthread_mutex_lock(&mLogElementsLock);
+    if (!mDgramHistory) {
+        unsigned short n, size = 0;
+        for (unsigned short i = 0; (n = stats.dgram_qlen(i)); ++i) {
+            size = n;
+        }
+        mDgramHistory = new log_time[size];
+        mDgramHistorySize = size;
+    }
+    stats.enableDgramQlenStatistics();
+    dgram_qlen_statistics = true;
+    pthread_mutex_unlock(&mLogElementsLock);
+}
 
-    // Insert elements in time sorted order if possible
-    //  NB: if end is region locked, place element at end of list
-    LogBufferElementCollection::iterator it = mLogElements.end();
-    LogBufferElementCollection::iterator last = it;
-    while (--it != mLogElements.begin()) {
-        if ((*it)->getRealTime() <= realtime) {
-            // halves the peak performance, use with caution
-            if (dgram_qlen_statistics) {
-                LogBufferElementCollection::iterator ib = it;
-                unsigned short buckets, num = 1;
-                for (unsigned short i = 0; (buckets = stats.dgram_qlen(i)); ++i) {
-                    buckets -= num;
-                    num += buckets;
-                    while (buckets && (--ib != mLogElements.begin())) {
-                        --buckets;
-                    }
-                    if (buckets) {
-                        break;
-                    }
-                    stats.recordDiff(
-                        elem->getRealTime() - (*ib)->getRealTime(), i);
-                }
-            }
+// Minimum time spanned by each dgram_qlen of consecutive arrivals.
+//
+// mLogElementsLock must be held when this function is called.
+void LogBuffer::recordDgramQlen(log_time realtime) {
+    unsigned short n;
+    for (unsigned short i = 0; (n = stats.dgram_qlen(i)); ++i) {
+        if (n > mDgramHistoryCount) {
             break;
         }
-        last = it;
+        log_time &then = mDgramHistory[
+            (mDgramHistoryCount - n) % mDgramHistorySize];
+        if (realtime > then) {
+            stats.recordDiff(realtime - then, i);
+        }
     }
+    mDgramHistory[mDgramHistoryCount++ % mDgramHistorySize] = realtime;
+}
 
-    if (last == mLogElements.end()) {
-        mLogElements.push_back(elem);
-    } else {
-        log_time end = log_time::EPOCH;
-        bool end_set = false;
-        bool end_always = false;
+void LogBuffer::log(log_id_t log_id, log_time realtime,
+                    uid_t uid, pid_t pid, pid_t tid,
+                    const char *msg, unsigned short len) {
+    pthread_mutex_lock(&mLogElementsLock);
+    log_Locked(log_id, realtime, uid, pid, tid, msg, len);
+    pthread_mutex_unlock(&mLogElementsLock);
+}
 
-        LogTimeEntry::lock();
+// mLogElementsLock must be held when this function is called.
+void LogBuffer::log_Locked(log_id_t log_id, log_time realtime,
+                           uid_t uid, pid_t pid, pid_t tid,
+                           const char *msg, unsigned short len) {
+    if ((log_id >= LOG_ID_MAX) || (log_id < 0)) {
+        return;
+    }
 
-        LastLogTimes::iterator t = mTimes.begin();
-        while(t != mTimes.end()) {
-            LogTimeEntry *entry = (*t);
-            if (entry->owned_Locked()) {
-                if (!entry->mNonBlock) {
-                    end_always = true;
-                    break;
-                }
-                if (!end_set || (end <= entry->mEnd)) {
-                    end = entry->mEnd;
-                    end_set = true;
-                }
-            }
-            t++;
+    // Entries are appended in arrival order, the monotonic time is the
+    // merge key between log ids and the resume point of readers, so it
+    // must be unique and increasing.
+    log_time monotonic(CLOCK_MONOTONIC);
+    if (monotonic <= mLastMonotonic) {
+        monotonic = mLastMonotonic;
+        if (++monotonic.tv_nsec >= NS_PER_SEC) {
+            monotonic.tv_nsec = 0;
+            ++monotonic.tv_sec;
         }
+    }
+    mLastMonotonic = monotonic;
 
-        if (end_always
-                || (end_set && (end >= (*last)->getMonotonicTime()))) {
-            mLogElements.push_back(elem);
-        } else {
-            mLogElements.insert(last,elem);
-        }
+    LogBufferElement *elem = mChunks[log_id].append(
+        chunk_size(log_buffer_size(log_id)), log_id,
+        monotonic, realtime, uid, pid, tid, msg, len);
 
-        LogTimeEntry::unlock();
+    // halves the peak performance, use with caution
+    if (dgram_qlen_statistics) {
+        recordDgramQlen(realtime);
     }
 
-    stats.add(len, log_id, uid, pid);
+    stats.add(elem);
     maybePrune(log_id);
-    pthread_mutex_unlock(&mLogElementsLock);
 }
 
 // If we're using more than 256K of memory for log entries, prune
@@ -216,6 +246,10 @@ void LogBuffer::log(log_id_t log_id, log_time realtime,
 //
 // mLogElementsLock must be held when this function is called.
 void LogBuffer::maybePrune(log_id_t id) {
+    if (mCold[id].enabled() && (stats.sizes(id) > log_buffer_size(id))) {
+        age(id);
+    }
+
     size_t sizes = stats.sizes(id);
     if (sizes > log_buffer_size(id)) {
         size_t sizeOver90Percent = sizes - ((log_buffer_size(id) * 9) / 10);
@@ -226,14 +260,68 @@ void LogBuffer::maybePrune(log_id_t id) {
             pruneRows = elements;
         }
         prune(id, pruneRows);
+    } else if (mChunks[id].getAllocated() > (2 * log_buffer_size(id))) {
+        prune(id, 0);
     }
 }
 
+// Move whole chunks from the head into the compressed tier until the
+// hot entries are back under 90% of budget. Readers need no protection,
+// flushTo() finds entries they have yet to see in either tier.
+//
+// mLogElementsLock must be held when this function is called.
+void LogBuffer::age(log_id_t id) {
+    LogBufferChunkList &list = mChunks[id];
+    size_t target = (log_buffer_size(id) * 9) / 10;
+
+    LogBufferChunk *head;
+    while ((stats.sizes(id) > target)
+            && (head = list.head()) && (head != list.tail())) {
+        size_t raw = 0;
+        size_t compressed = 0;
+
+        log_time begin(CLOCK_MONOTONIC);
+        bool aged = mCold[id].age(list, head, &raw, &compressed);
+        log_time end(CLOCK_MONOTONIC);
+        if (!aged) {
+            break;
+        }
+        stats.addCompressed(id, raw, compressed, (end - begin).nsec());
+
+        LogBufferCursor it(list);
+        while (it.get() && (it.chunk() == head)) {
+            erase(it);
+        }
+        if (list.head() == head) {
+            list.release(head);
+        }
+    }
+
+    stats.setCold(id, mCold[id].getCompressed(), mCold[id].getElements());
+}
+
+// Drop the element under the cursor and advance it.
+//
+// mLogElementsLock must be held when this function is called.
+void LogBuffer::erase(LogBufferCursor &it) {
+    stats.subtract(it.get());
+    it.erase();
+}
+
+// Drop an element found through its uid statistics.
+//
+// mLogElementsLock must be held when this function is called.
+void LogBuffer::erase(LogBufferElement *e) {
+    stats.subtract(e);
+    mChunks[e->getLogId()].erase(e);
+}
+
 // prune "pruneRows" of type "id" from the buffer.
 //
 // mLogElementsLock must be held when this function is called.
 void LogBuffer::prune(log_id_t id, unsigned long pruneRows, uid_t caller_uid) {
     LogTimeEntry *oldest = NULL;
+    LogBufferChunkList &list = mChunks[id];
 
     LogTimeEntry::lock();
 
@@ -248,158 +336,146 @@ void LogBuffer::prune(log_id_t id, unsigned long pruneRows, uid_t caller_uid) {
         t++;
     }
 
-    LogBufferElementCollection::iterator it;
+    LogBufferElement *e;
+    LidStatistics &l = stats.id(id);
 
     if (caller_uid != AID_ROOT) {
-        for(it = mLogElements.begin(); it != mLogElements.end();) {
-            LogBufferElement *e = *it;
-
+        UidStatistics *u = l.uid(caller_uid);
+        e = u ? u->oldest() : NULL;
+        while ((pruneRows > 0) && e) {
             if (oldest && (oldest->mStart <= e->getMonotonicTime())) {
                 break;
             }
+            LogBufferElement *next = e->getUidNext();
+            erase(e);
+            pruneRows--;
+            e = next;
+        }
+        LogTimeEntry::unlock();
+        return;
+    }
 
-            if (e->getLogId() != id) {
-                ++it;
-                continue;
+    // prune BlackListed entries first, only walking uids a rule can match
+    if ((pruneRows > 0) && (id != LOG_ID_CRASH)) {
+        UidStatisticsCollection naughty;
+        UidStatisticsCollection::iterator iu;
+        for (iu = l.begin(); iu != l.end(); ++iu) {
+            if (mPrune.naughtyUid((*iu)->getUid())) {
+                naughty.push_back(*iu);
             }
-
-            uid_t uid = e->getUid();
-
-            if (uid == caller_uid) {
-                it = mLogElements.erase(it);
-                unsigned short len = e->getMsgLen();
-                stats.subtract(len, id, uid, e->getPid());
-                delete e;
-                pruneRows--;
-                if (pruneRows == 0) {
+        }
+        for (iu = naughty.begin(); (pruneRows > 0) && (iu != naughty.end()); ++iu) {
+            e = (*iu)->oldest();
+            while ((pruneRows > 0) && e) {
+                if (oldest && (oldest->mStart <= e->getMonotonicTime())) {
                     break;
                 }
-            } else {
-                ++it;
+                LogBufferElement *next = e->getUidNext();
+                if (mPrune.naughty(e)) {
+                    erase(e);
+                    pruneRows--;
+                }
+                e = next;
             }
         }
-        LogTimeEntry::unlock();
-        return;
     }
 
-    // prune by worst offender by uid
-    while (pruneRows > 0) {
+    // prune by worst offender by uid, Uids are kept ordered by size and
+    // each uid threads its entries oldest first.
+    while ((pruneRows > 0) && (id != LOG_ID_CRASH)
+            && mPrune.worstUidEnabled()) {
         // recalculate the worst offender on every batched pass
-        uid_t worst = (uid_t) -1;
-        size_t worst_sizes = 0;
+        UidStatisticsCollection::iterator iu = l.begin();
+        if (iu == l.end()) {
+            break;
+        }
+        UidStatistics *worst = *iu;
+        size_t worst_sizes = worst->sizes();
         size_t second_worst_sizes = 0;
-
-        if ((id != LOG_ID_CRASH) && mPrune.worstUidEnabled()) {
-            LidStatistics &l = stats.id(id);
-            l.sort();
-            UidStatisticsCollection::iterator iu = l.begin();
-            if (iu != l.end()) {
-                UidStatistics *u = *iu;
-                worst = u->getUid();
-                worst_sizes = u->sizes();
-                if (++iu != l.end()) {
-                    second_worst_sizes = (*iu)->sizes();
-                }
-            }
+        if (++iu != l.end()) {
+            second_worst_sizes = (*iu)->sizes();
         }
 
         bool kick = false;
-        for(it = mLogElements.begin(); it != mLogElements.end();) {
-            LogBufferElement *e = *it;
-
+        e = worst->oldest();
+        while (e) {
             if (oldest && (oldest->mStart <= e->getMonotonicTime())) {
                 break;
             }
 
-            if (e->getLogId() != id) {
-                ++it;
-                continue;
+            LogBufferElement *next = e->getUidNext();
+            unsigned short len = e->getMsgLen();
+            erase(e);
+            kick = true;
+            pruneRows--;
+            if ((pruneRows == 0) || (worst_sizes < second_worst_sizes)) {
+                break;
             }
+            worst_sizes -= len;
+            e = next;
+        }
 
-            uid_t uid = e->getUid();
+        if (!kick) {
+            break; // the following loop will ask bad clients to skip/drop
+        }
+    }
 
-            if (uid == worst) {
-                it = mLogElements.erase(it);
-                unsigned short len = e->getMsgLen();
-                stats.subtract(len, id, worst, e->getPid());
-                delete e;
-                kick = true;
-                pruneRows--;
-                if ((pruneRows == 0) || (worst_sizes < second_worst_sizes)) {
-                    break;
-                }
-                worst_sizes -= len;
-            } else if (mPrune.naughty(e)) { // BlackListed
-                it = mLogElements.erase(it);
-                stats.subtract(e->getMsgLen(), id, uid, e->getPid());
-                delete e;
-                pruneRows--;
-                if (pruneRows == 0) {
-                    break;
+    bool whitelist = false;
+    LogBufferCursor it(list);
+    while ((pruneRows > 0) && (e = it.get())) {
+        if (oldest && (oldest->mStart <= e->getMonotonicTime())) {
+            if (!whitelist) {
+                if (stats.sizes(id) > (2 * log_buffer_size(id))) {
+                    // kick a misbehaving log reader client off the island
+                    oldest->release_Locked();
+                } else {
+                    oldest->triggerSkip_Locked(pruneRows);
                 }
-            } else {
-                ++it;
             }
+            break;
         }
 
-        if (!kick || !mPrune.worstUidEnabled()) {
-            break; // the following loop will ask bad clients to skip/drop
+        if (mPrune.nice(e)) { // WhiteListed
+            whitelist = true;
+            it.next();
+            continue;
         }
+
+        erase(it);
+        pruneRows--;
     }
 
-    bool whitelist = false;
-    it = mLogElements.begin();
-    while((pruneRows > 0) && (it != mLogElements.end())) {
-        LogBufferElement *e = *it;
-        if (e->getLogId() == id) {
+    if (whitelist && (pruneRows > 0)) {
+        LogBufferCursor it(list);
+        while ((pruneRows > 0) && (e = it.get())) {
             if (oldest && (oldest->mStart <= e->getMonotonicTime())) {
-                if (!whitelist) {
-                    if (stats.sizes(id) > (2 * log_buffer_size(id))) {
-                        // kick a misbehaving log reader client off the island
-                        oldest->release_Locked();
-                    } else {
-                        oldest->triggerSkip_Locked(pruneRows);
-                    }
+                if (stats.sizes(id) > (2 * log_buffer_size(id))) {
+                    // kick a misbehaving log reader client off the island
+                    oldest->release_Locked();
+                } else {
+                    oldest->triggerSkip_Locked(pruneRows);
                 }
                 break;
             }
-
-            if (mPrune.nice(e)) { // WhiteListed
-                whitelist = true;
-                it++;
-                continue;
-            }
-
-            it = mLogElements.erase(it);
-            stats.subtract(e->getMsgLen(), id, e->getUid(), e->getPid());
-            delete e;
+            erase(it);
             pruneRows--;
-        } else {
-            it++;
         }
     }
 
-    if (whitelist && (pruneRows > 0)) {
-        it = mLogElements.begin();
-        while((it != mLogElements.end()) && (pruneRows > 0)) {
-            LogBufferElement *e = *it;
-            if (e->getLogId() == id) {
-                if (oldest && (oldest->mStart <= e->getMonotonicTime())) {
-                    if (stats.sizes(id) > (2 * log_buffer_size(id))) {
-                        // kick a misbehaving log reader client off the island
-                        oldest->release_Locked();
-                    } else {
-                        oldest->triggerSkip_Locked(pruneRows);
-                    }
-                    break;
-                }
-                it = mLogElements.erase(it);
-                stats.subtract(e->getMsgLen(), id, e->getUid(), e->getPid());
-                delete e;
-                pruneRows--;
-            } else {
-                it++;
-            }
+    // Entries pruned out of the middle of a chunk are only reclaimed with
+    // their chunk, bound that overhead by retiring whole chunks from the head.
+    LogBufferChunk *head;
+    while ((list.getAllocated() > (2 * log_buffer_size(id)))
+            && (head = list.head()) && (head != list.tail())) {
+        if (oldest && (oldest->mStart <= head->getLastTime())) {
+            break;
+        }
+        LogBufferCursor it(list);
+        while ((e = it.get()) && (it.chunk() == head)) {
+            erase(it);
+        }
+        if (list.head() == head) {
+            list.release(head);
         }
     }
 
@@ -410,6 +486,11 @@ void LogBuffer::prune(log_id_t id, unsigned long pruneRows, uid_t caller_uid) {
 void LogBuffer::clear(log_id_t id, uid_t uid) {
     pthread_mutex_lock(&mLogElementsLock);
     prune(id, ULONG_MAX, uid);
+    // the compressed tier can only be dropped as a whole
+    if (uid == AID_ROOT) {
+        mCold[id].clear();
+        stats.setCold(id, 0, 0);
+    }
     pthread_mutex_unlock(&mLogElementsLock);
 }
 
@@ -444,56 +525,326 @@ unsigned long LogBuffer::getSize(log_id_t id) {
 log_time LogBuffer::flushTo(
         SocketClient *reader, const log_time start, bool privileged,
         bool (*filter)(const LogBufferElement *element, void *arg), void *arg) {
-    LogBufferElementCollection::iterator it;
+    LogColdCursor cold[LOG_ID_MAX];
+    LogBufferCursor it[LOG_ID_MAX];
     log_time max = start;
     uid_t uid = reader->getUid();
 
+    struct logger_entry_v3 entries[LOG_FLUSH_BATCH];
+    struct iovec iovecs[LOG_FLUSH_BATCH][2];
+    struct mmsghdr msgs[LOG_FLUSH_BATCH];
+    LogBufferChunk *pinned[LOG_FLUSH_BATCH];
+
+    memset(msgs, 0, sizeof(msgs));
+    for (unsigned int i = 0; i < LOG_FLUSH_BATCH; ++i) {
+        msgs[i].msg_hdr.msg_iov = iovecs[i];
+        msgs[i].msg_hdr.msg_iovlen = 2;
+    }
+
     pthread_mutex_lock(&mLogElementsLock);
-    for (it = mLogElements.begin(); it != mLogElements.end(); ++it) {
-        LogBufferElement *element = *it;
+    log_id_for_each(i) {
+        cold[i].seek(mCold[i], start);
+        it[i].seek(mChunks[i], start);
+    }
 
-        if (!privileged && (element->getUid() != uid)) {
-            continue;
-        }
+    for (;;) {
+        unsigned int count = 0;
+        log_time last;
+
+        while (count < LOG_FLUSH_BATCH) {
+            // merge the log ids back into arrival order, each id's
+            // compressed entries all precede its hot ones
+            LogBufferElement *element = NULL;
+            log_id_t id = LOG_ID_MAIN;
+            bool fromCold = false;
+            bool blocked = false;
+            log_id_for_each(i) {
+                bool isCold = true;
+                LogBufferElement *e = cold[i].get(!count, &blocked);
+                if (blocked) {
+                    break;
+                }
+                if (!e) {
+                    isCold = false;
+                    e = it[i].get();
+                }
+                if (e && (!element
+                        || (e->getMonotonicTime() < element->getMonotonicTime()))) {
+                    element = e;
+                    id = i;
+                    fromCold = isCold;
+                }
+            }
+            // send what we have before decompressing over it
+            if (blocked || !element) {
+                break;
+            }
+            if (fromCold) {
+                cold[id].next();
+            } else {
+                it[id].next();
+            }
 
-        if (element->getMonotonicTime() <= start) {
-            continue;
+            if (!privileged && (element->getUid() != uid)) {
+                continue;
+            }
+
+            // NB: calling out to another object with mLogElementsLock held (safe)
+            if (filter && !(*filter)(element, arg)) {
+                continue;
+            }
+
+            element->flushTo(&entries[count], iovecs[count]);
+            // the cold cursor holds its own copy
+            pinned[count] = fromCold ? NULL : element->getChunk();
+            if (pinned[count]) {
+                pinned[count]->pin();
+            }
+            last = element->getMonotonicTime();
+            ++count;
         }
 
-        // NB: calling out to another object with mLogElementsLock held (safe)
-        if (filter && !(*filter)(element, arg)) {
-            continue;
+        if (!count) {
+            break;
         }
 
         pthread_mutex_unlock(&mLogElementsLock);
 
-        // range locking in LastLogTimes looks after us
-        max = element->flushTo(reader);
+        // range locking in LastLogTimes looks after the entries that
+        // follow, the pins after those already in the batch
+        int ret = reader->sendDatamv(msgs, count);
+
+        pthread_mutex_lock(&mLogElementsLock);
 
-        if (max == element->FLUSH_ERROR) {
-            return max;
+        for (unsigned int i = 0; i < count; ++i) {
+            if (pinned[i]) {
+                pinned[i]->unpin();
+            }
         }
 
-        pthread_mutex_lock(&mLogElementsLock);
+        if (ret) {
+            max = LogBufferElement::FLUSH_ERROR;
+            break;
+        }
+        max = last;
+
+        // chunks may have been released or aged while we were unlocked
+        log_id_for_each(i) {
+            cold[i].revalidate(last);
+            it[i].revalidate(last);
+        }
     }
     pthread_mutex_unlock(&mLogElementsLock);
 
     return max;
 }
 
+// what a reader with these parameters would be sent
+static bool reader_match(const LogBufferElement *e, pid_t pid,
+                         uid_t uid, bool privileged) {
+    return (!pid || (pid == e->getPid()))
+        && (privileged || (uid == e->getUid()));
+}
+
+// The earliest entry over all log ids, in the order flushTo() sends
+// them, with a realtime at or after start that the reader would get
+class LogBufferFindStart {
+    const log_time mStart;
+    const pid_t mPid;
+    const uid_t mUid;
+    const bool mPrivileged;
+
+public:
+    bool found;
+    log_time monotonic;
+    log_time realtime;
+
+    LogBufferFindStart(log_time start, pid_t pid, uid_t uid, bool privileged)
+            : mStart(start)
+            , mPid(pid)
+            , mUid(uid)
+            , mPrivileged(privileged)
+            , found(false)
+    { }
+
+    // true once the log id of e needs searching no further
+    bool check(const LogBufferElement *e) {
+        if (found && (e->getMonotonicTime() > monotonic)) {
+            return true;
+        }
+        if ((e->getRealTime() >= mStart)
+                && reader_match(e, mPid, mUid, mPrivileged)) {
+            found = true;
+            monotonic = e->getMonotonicTime();
+            realtime = e->getRealTime();
+            return true;
+        }
+        return false;
+    }
+};
+
+bool LogBuffer::findStart(log_time &start, unsigned int logMask, pid_t pid,
+                          uid_t uid, bool privileged) {
+    LogBufferFindStart find(start, pid, uid, privileged);
+
+    pthread_mutex_lock(&mLogElementsLock);
+    log_id_for_each(i) {
+        if (!(logMask & (1 << i))) {
+            continue;
+        }
+
+        // the compressed tier holds the oldest entries of the log id
+        LogColdCursor cold;
+        cold.seekRealTime(mCold[i], start);
+
+        bool done = false;
+        bool blocked = false;
+        LogBufferElement *e;
+        while (!done && (e = cold.get(true, &blocked))) {
+            done = find.check(e);
+            cold.next();
+        }
+
+        LogBufferCursor it;
+        it.seekRealTime(mChunks[i], start);
+
+        while (!done && (e = it.get())) {
+            done = find.check(e);
+            it.next();
+        }
+    }
+
+    if (find.found) {
+        // an exact match is where the reader left off, resume after it,
+        // otherwise back off so flushTo() includes it
+        bool exact = (find.realtime == start);
+        start = find.monotonic;
+        if (!exact) {
+            start -= log_time(0, 1);
+        }
+    }
+    pthread_mutex_unlock(&mLogElementsLock);
+
+    return find.found;
+}
+
+static int log_time_newest_first(const void *a, const void *b) {
+    const log_time &l = *reinterpret_cast<const log_time *>(a);
+    const log_time &r = *reinterpret_cast<const log_time *>(b);
+    return (l > r) ? -1 : (l < r);
+}
+
+// append t to the growing array *times, false if out of memory
+static bool add_time(log_time **times, unsigned long *size,
+                     unsigned long *found, log_time t) {
+    if (*found >= *size) {
+        unsigned long grow = *size ? (*size * 2) : 256;
+        log_time *grown = (log_time *)realloc(*times, grow * sizeof(log_time));
+        if (!grown) {
+            return false;
+        }
+        *times = grown;
+        *size = grow;
+    }
+    (*times)[(*found)++] = t;
+    return true;
+}
+
+unsigned long LogBuffer::findTail(log_time &start, unsigned long count,
+                                  unsigned int logMask, pid_t pid,
+                                  uid_t uid, bool privileged) {
+    log_time *times = NULL;
+    unsigned long size = 0;
+    unsigned long found = 0;
+    bool ok = true;
+
+    pthread_mutex_lock(&mLogElementsLock);
+
+    // Each log id can contribute at most count entries, walk back from
+    // the tail a chunk at a time until it has or we run out, then on
+    // through the compressed tier, which holds the older entries.
+    log_id_for_each(i) {
+        if (!ok || !(logMask & (1 << i))) {
+            continue;
+        }
+
+        unsigned long matched = 0;
+        LogBufferChunk *chunk = mChunks[i].tail();
+        for (; ok && chunk && (matched < count); chunk = chunk->getPrev()) {
+            if (chunk->getLastTime() <= start) {
+                break;
+            }
+
+            LogBufferCursor it(mChunks[i], chunk);
+            LogBufferElement *e;
+            while (ok && (e = it.get()) && (it.chunk() == chunk)) {
+                if ((e->getMonotonicTime() > start)
+                        && reader_match(e, pid, uid, privileged)) {
+                    ok = add_time(&times, &size, &found,
+                                  e->getMonotonicTime());
+                    ++matched;
+                }
+                it.next();
+            }
+        }
+        if (chunk && (matched < count)) {
+            // stopped at a chunk older than start, nothing colder is newer
+            continue;
+        }
+
+        // one pass over the tier, newest block first
+        LogColdCursor cold;
+        cold.seekTail(mCold[i]);
+        bool older = false;
+        while (ok && !older && (matched < count) && cold.loadPrev()) {
+            bool blocked = false;
+            LogBufferElement *e;
+            while (ok && (e = cold.get(false, &blocked))) {
+                if (e->getMonotonicTime() <= start) {
+                    older = true;
+                } else if (reader_match(e, pid, uid, privileged)) {
+                    ok = add_time(&times, &size, &found,
+                                  e->getMonotonicTime());
+                    ++matched;
+                }
+                cold.next();
+            }
+        }
+    }
+
+    pthread_mutex_unlock(&mLogElementsLock);
+
+    if (!ok) {
+        // leave start alone, the reader gets everything
+        found = count;
+    } else if (found > count) {
+        qsort(times, found, sizeof(log_time), log_time_newest_first);
+        start = times[count - 1] - log_time(0, 1);
+        found = count;
+    }
+    free(times);
+
+    return found;
+}
+
 void LogBuffer::formatStatistics(char **strp, uid_t uid, unsigned int logMask) {
     log_time oldest(CLOCK_MONOTONIC);
 
     pthread_mutex_lock(&mLogElementsLock);
 
     // Find oldest element in the log(s)
-    LogBufferElementCollection::iterator it;
-    for (it = mLogElements.begin(); it != mLogElements.end(); ++it) {
-        LogBufferElement *element = *it;
-
-        if ((logMask & (1 << element->getLogId()))) {
+    log_id_for_each(i) {
+        if (!(logMask & (1 << i))) {
+            continue;
+        }
+        log_time first;
+        if (mCold[i].getFirstTime(first) && (oldest > first)) {
+            oldest = first;
+        }
+        LogBufferCursor it(mChunks[i]);
+        LogBufferElement *element = it.get();
+        if (element && (oldest > element->getMonotonicTime())) {
             oldest = element->getMonotonicTime();
-            break;
         }
     }
 
@@ -21,24 +21,32 @@
 
 #include <log/log.h>
 #include <sysutils/SocketClient.h>
-#include <utils/List.h>
 
 #include <private/android_filesystem_config.h>
 
+#include "LogBufferChunk.h"
+#include "LogBufferCold.h"
 #include "LogBufferElement.h"
 #include "LogTimes.h"
 #include "LogStatistics.h"
 #include "LogWhiteBlackList.h"
 
-typedef android::List<LogBufferElement *> LogBufferElementCollection;
-
 class LogBuffer {
-    LogBufferElementCollection mLogElements;
+    LogBufferChunkList mChunks[LOG_ID_MAX];
+    // chunks aged out of mChunks, compressed
+    LogColdList mCold[LOG_ID_MAX];
     pthread_mutex_t mLogElementsLock;
 
+    // unique merge key and reader position across all log ids
+    log_time mLastMonotonic;
+
     LogStatistics stats;
 
     bool dgram_qlen_statistics;
+    // realtime of the most recent arrivals, oldest overwritten first
+    log_time *mDgramHistory;
+    unsigned short mDgramHistorySize;
+    unsigned long mDgramHistoryCount;
 
     PruneList mPrune;
 
@@ -52,10 +60,31 @@ public:
     void log(log_id_t log_id, log_time realtime,
              uid_t uid, pid_t pid, pid_t tid,
              const char *msg, unsigned short len);
+
+    // Batched insertion, hold lock() across several log_Locked() calls
+    void lock() { pthread_mutex_lock(&mLogElementsLock); }
+    void unlock() { pthread_mutex_unlock(&mLogElementsLock); }
+    void log_Locked(log_id_t log_id, log_time realtime,
+                    uid_t uid, pid_t pid, pid_t tid,
+                    const char *msg, unsigned short len);
+    // messages LogQueue could not stage, for statistics
+    void dropped_Locked(log_id_t log_id, size_t count) {
+        stats.addDropped(log_id, count);
+    }
     log_time flushTo(SocketClient *writer, const log_time start,
                      bool privileged,
                      bool (*filter)(const LogBufferElement *element, void *arg) = NULL,
                      void *arg = NULL);
+    // Reader start positioning through the chunk time index rather than a
+    // pass over the whole buffer. findStart() converts a realtime start to
+    // the monotonic time to flush after, false if nothing is that new.
+    // findTail() moves start up so flushTo() sends at most the last count
+    // matching entries, returning how many will be sent.
+    bool findStart(log_time &start, unsigned int logMask, pid_t pid,
+                   uid_t uid, bool privileged);
+    unsigned long findTail(log_time &start, unsigned long count,
+                           unsigned int logMask, pid_t pid,
+                           uid_t uid, bool privileged);
 
     void clear(log_id_t id, uid_t uid = AID_ROOT);
     unsigned long getSize(log_id_t id);
@@ -64,10 +93,7 @@ public:
     // *strp uses malloc, use free to release.
     void formatStatistics(char **strp, uid_t uid, unsigned int logMask);
 
-    void enableDgramQlenStatistics() {
-        stats.enableDgramQlenStatistics();
-        dgram_qlen_statistics = true;
-    }
+    void enableDgramQlenStatistics();
 
     int initPrune(char *cp) { return mPrune.init(cp); }
     // *strp uses malloc, use free to release.
@@ -79,7 +105,11 @@ public:
 
 private:
     void maybePrune(log_id_t id);
+    void age(log_id_t id);
     void prune(log_id_t id, unsigned long pruneRows, uid_t uid = AID_ROOT);
+    void erase(LogBufferCursor &it);
+    void erase(LogBufferElement *e);
+    void recordDgramQlen(log_time realtime);
 
 };
 
@@ -0,0 +1,269 @@
+/*
+ * Copyright (C) 2014 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <new>
+
+#include "LogBufferChunk.h"
+
+LogBufferChunk::LogBufferChunk(size_t capacity)
+        : mPrev(NULL)
+        , mNext(NULL)
+        , mCapacity(capacity)
+        , mUsed(0)
+        , mElements(0)
+        , mAppended(0)
+        , mLast(NULL)
+        , mIndexCount(0)
+        , mPins(0)
+        , mReleased(false) {
+    mData = new char[capacity];
+    mIndex = new uint32_t[capacity / (LogBufferElement::storageSize(0) * STRIDE)
+                          + 1];
+}
+
+LogBufferChunk::~LogBufferChunk() {
+    delete [] mIndex;
+    delete [] mData;
+}
+
+LogBufferElement *LogBufferChunk::append(log_id_t log_id,
+                                         log_time monotonic, log_time realtime,
+                                         uid_t uid, pid_t pid, pid_t tid,
+                                         const char *msg, unsigned short len) {
+    LogBufferElement *e = new (mData + mUsed)
+        LogBufferElement(log_id, monotonic, realtime, uid, pid, tid, msg, len);
+    e->mChunk = this;
+    if (!(mAppended++ % STRIDE)) {
+        mIndex[mIndexCount++] = mUsed;
+    }
+    mUsed += e->getStorageSize();
+    ++mElements;
+    mLast = e;
+    if ((mAppended == 1) || (mMaxRealTime < realtime)) {
+        mMaxRealTime = realtime;
+    }
+    return e;
+}
+
+size_t LogBufferChunk::search(log_time start) const {
+    size_t lo = 0;
+    size_t hi = mIndexCount;
+
+    // first indexed element past the boundary
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        LogBufferElement *e = at(mIndex[mid]);
+        if (e->getMonotonicTime() <= start) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo ? mIndex[lo - 1] : 0;
+}
+
+size_t LogBufferChunk::find(log_time start) const {
+    if (getLastTime() <= start) {
+        return mUsed;
+    }
+    size_t offset = search(start);
+    while (offset < mUsed) {
+        LogBufferElement *e = at(offset);
+        if (e->getMonotonicTime() > start) {
+            break;
+        }
+        offset += e->getStorageSize();
+    }
+    return offset;
+}
+
+size_t LogBufferChunk::findRealTime(log_time start) const {
+    if (getMaxRealTime() < start) {
+        return mUsed;
+    }
+    size_t offset = 0;
+    while (offset < mUsed) {
+        LogBufferElement *e = at(offset);
+        if (e->getRealTime() >= start) {
+            break;
+        }
+        offset += e->getStorageSize();
+    }
+    return offset;
+}
+
+LogBufferChunkList::LogBufferChunkList()
+        : mHead(NULL)
+        , mTail(NULL)
+        , mAllocated(0)
+        , mGeneration(0)
+{ }
+
+LogBufferChunkList::~LogBufferChunkList() {
+    while (mHead) {
+        release(mHead);
+    }
+}
+
+LogBufferElement *LogBufferChunkList::append(size_t chunkSize,
+                                             log_id_t log_id,
+                                             log_time monotonic,
+                                             log_time realtime,
+                                             uid_t uid, pid_t pid, pid_t tid,
+                                             const char *msg,
+                                             unsigned short len) {
+    LogBufferChunk *chunk = mTail;
+    if (!chunk || !chunk->hasRoom(len)) {
+        // A full tail whose entries were all pruned has nothing left to say
+        if (chunk && !chunk->mElements) {
+            release(chunk);
+        }
+
+        size_t size = LogBufferElement::storageSize(len);
+        if (size < chunkSize) {
+            size = chunkSize;
+        }
+        chunk = new LogBufferChunk(size);
+        chunk->mPrev = mTail;
+        if (mTail) {
+            mTail->mNext = chunk;
+        } else {
+            mHead = chunk;
+        }
+        mTail = chunk;
+        mAllocated += size;
+    }
+    return chunk->append(log_id, monotonic, realtime, uid, pid, tid, msg, len);
+}
+
+void LogBufferChunkList::erase(LogBufferElement *e) {
+    LogBufferChunk *chunk = e->getChunk();
+
+    e->setDropped();
+    if (!--chunk->mElements && (chunk != mTail)) {
+        release(chunk);
+    }
+}
+
+void LogBufferChunkList::release(LogBufferChunk *chunk) {
+    if (chunk->mPrev) {
+        chunk->mPrev->mNext = chunk->mNext;
+    } else {
+        mHead = chunk->mNext;
+    }
+    if (chunk->mNext) {
+        chunk->mNext->mPrev = chunk->mPrev;
+    } else {
+        mTail = chunk->mPrev;
+    }
+    mAllocated -= chunk->mCapacity;
+    ++mGeneration;
+    if (chunk->mPins) {
+        chunk->mReleased = true;
+    } else {
+        delete chunk;
+    }
+}
+
+LogBufferCursor::LogBufferCursor()
+        : mList(NULL)
+        , mChunk(NULL)
+        , mOffset(0)
+        , mGeneration(0)
+{ }
+
+LogBufferCursor::LogBufferCursor(LogBufferChunkList &list)
+        : mList(&list)
+        , mChunk(list.mHead)
+        , mOffset(0)
+        , mGeneration(list.mGeneration)
+{ }
+
+LogBufferCursor::LogBufferCursor(LogBufferChunkList &list,
+                                 LogBufferChunk *chunk)
+        : mList(&list)
+        , mChunk(chunk)
+        , mOffset(0)
+        , mGeneration(list.mGeneration)
+{ }
+
+void LogBufferCursor::seek(LogBufferChunkList &list, log_time start) {
+    mList = &list;
+    mGeneration = list.mGeneration;
+
+    // readers mostly resume near the end, walk backwards from the tail
+    mChunk = list.mTail;
+    while (mChunk && mChunk->mPrev && (mChunk->getFirstTime() > start)) {
+        mChunk = mChunk->mPrev;
+    }
+    mOffset = mChunk ? mChunk->find(start) : 0;
+}
+
+void LogBufferCursor::seekRealTime(LogBufferChunkList &list, log_time start) {
+    mList = &list;
+    mGeneration = list.mGeneration;
+
+    // the first chunk that can hold it, an exact answer unlike a search
+    // of the unordered realtimes; past the tail if none
+    mChunk = list.mHead;
+    while (mChunk && mChunk->mNext && (mChunk->getMaxRealTime() < start)) {
+        mChunk = mChunk->mNext;
+    }
+    mOffset = mChunk ? mChunk->findRealTime(start) : 0;
+}
+
+LogBufferElement *LogBufferCursor::get() {
+    if (!mChunk) {
+        // list was empty when we were positioned, all that follows is new
+        if (!mList || !mList->mHead) {
+            return NULL;
+        }
+        mChunk = mList->mHead;
+        mOffset = 0;
+    }
+    for (;;) {
+        while (mOffset < mChunk->mUsed) {
+            LogBufferElement *e = mChunk->at(mOffset);
+            if (!e->isDropped()) {
+                return e;
+            }
+            mOffset += e->getStorageSize();
+        }
+        if (!mChunk->mNext) {
+            return NULL;
+        }
+        mChunk = mChunk->mNext;
+        mOffset = 0;
+    }
+}
+
+void LogBufferCursor::next() {
+    mOffset += mChunk->at(mOffset)->getStorageSize();
+}
+
+void LogBufferCursor::erase() {
+    LogBufferChunk *chunk = mChunk;
+    LogBufferElement *e = chunk->at(mOffset);
+
+    next();
+    if ((chunk->mElements == 1) && (chunk != mList->mTail)) {
+        // last live entry, step off the chunk before it is released
+        mChunk = chunk->mNext;
+        mOffset = 0;
+    }
+    mList->erase(e);
+    mGeneration = mList->mGeneration;
+}
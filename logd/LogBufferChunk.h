@@ -0,0 +1,174 @@
+/*
+ * Copyright (C) 2014 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _LOGD_LOG_BUFFER_CHUNK_H__
+#define _LOGD_LOG_BUFFER_CHUNK_H__
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <log/log.h>
+#include <log/log_read.h>
+
+#include "LogBufferElement.h"
+
+// A contiguous, size-bounded block of LogBufferElements for one log id.
+// Entries are appended in increasing monotonic time order and never move;
+// pruning a single entry only marks it dropped, the memory is reclaimed
+// when the whole chunk is released.
+class LogBufferChunk {
+    friend class LogBufferChunkList;
+    friend class LogBufferCursor;
+
+    LogBufferChunk *mPrev; // older
+    LogBufferChunk *mNext; // newer
+    const size_t mCapacity;
+    size_t mUsed;
+    size_t mElements; // not dropped
+    size_t mAppended;
+    LogBufferElement *mLast;
+    // realtime comes from the client and may go backwards, the newest
+    // seen lets a realtime search skip the chunk exactly
+    log_time mMaxRealTime;
+    char *mData;
+
+    // Sparse time index, the offset of every STRIDE'th element appended
+    static const size_t STRIDE = 16;
+    uint32_t *mIndex;
+    size_t mIndexCount;
+
+    // readers sending straight out of mData while unlocked
+    unsigned int mPins;
+    bool mReleased; // unlinked while pinned, last unpin deletes
+
+public:
+    LogBufferChunk(size_t capacity);
+    ~LogBufferChunk();
+
+    size_t getCapacity() const { return mCapacity; }
+    size_t getElements() const { return mElements; }
+
+    bool hasRoom(unsigned short len) const {
+        return (mUsed + LogBufferElement::storageSize(len)) <= mCapacity;
+    }
+
+    LogBufferElement *append(log_id_t log_id,
+                             log_time monotonic, log_time realtime,
+                             uid_t uid, pid_t pid, pid_t tid,
+                             const char *msg, unsigned short len);
+
+    // chunks are never empty, both are valid once linked into a list
+    log_time getFirstTime() const { return at(0)->getMonotonicTime(); }
+    log_time getLastTime() const { return mLast->getMonotonicTime(); }
+    log_time getMaxRealTime() const { return mMaxRealTime; }
+
+    LogBufferChunk *getNext() const { return mNext; }
+    LogBufferChunk *getPrev() const { return mPrev; }
+
+    // Keep the memory valid across a drop of the LogBuffer lock, both
+    // are called with the lock held. unpin() may delete the chunk.
+    void pin() { ++mPins; }
+    void unpin() {
+        if (!--mPins && mReleased) {
+            delete this;
+        }
+    }
+
+private:
+    LogBufferElement *at(size_t offset) const {
+        return reinterpret_cast<LogBufferElement *>(mData + offset);
+    }
+    // offset of the last indexed element at or before start, or 0,
+    // a forward scan takes it from there
+    size_t search(log_time start) const;
+    // offset of the first element newer than start, mUsed if none
+    size_t find(log_time start) const;
+    // offset of the first element with a realtime at or after start,
+    // mUsed if none; realtime is unordered so this scans the chunk
+    size_t findRealTime(log_time start) const;
+};
+
+// The chunks holding one log id, oldest at the head.
+class LogBufferChunkList {
+    friend class LogBufferCursor;
+
+    LogBufferChunk *mHead;
+    LogBufferChunk *mTail;
+    size_t mAllocated;
+    // bumped whenever a chunk is released, invalidates LogBufferCursors
+    unsigned long mGeneration;
+
+public:
+    LogBufferChunkList();
+    ~LogBufferChunkList();
+
+    LogBufferChunk *head() const { return mHead; }
+    LogBufferChunk *tail() const { return mTail; }
+
+    size_t getAllocated() const { return mAllocated; }
+    unsigned long getGeneration() const { return mGeneration; }
+
+    // chunkSize is the capacity used for a new tail, an oversized entry
+    // gets a chunk of its own.
+    LogBufferElement *append(size_t chunkSize, log_id_t log_id,
+                             log_time monotonic, log_time realtime,
+                             uid_t uid, pid_t pid, pid_t tid,
+                             const char *msg, unsigned short len);
+
+    // Drop an element, releasing its chunk once it runs out of live
+    // entries unless it is still being filled.
+    void erase(LogBufferElement *e);
+
+    // Unlink, the chunk is deleted once no reader has it pinned
+    void release(LogBufferChunk *chunk);
+};
+
+// Position within a LogBufferChunkList. get() skips dropped entries and
+// follows chunk boundaries, so a cursor parked at the end picks up entries
+// appended afterwards. A cursor held across a drop of the lock must be
+// revalidate()d before use, as its chunk may have been released.
+class LogBufferCursor {
+    LogBufferChunkList *mList;
+    LogBufferChunk *mChunk;
+    size_t mOffset;
+    unsigned long mGeneration;
+
+public:
+    LogBufferCursor();
+    LogBufferCursor(LogBufferChunkList &list); // at the head
+    LogBufferCursor(LogBufferChunkList &list, LogBufferChunk *chunk);
+
+    // position at the first element newer than start
+    void seek(LogBufferChunkList &list, log_time start);
+    // position at the first element with a realtime at or after start
+    void seekRealTime(LogBufferChunkList &list, log_time start);
+
+    // reposition after last if the list released chunks under us
+    void revalidate(log_time last) {
+        if (mList && (mGeneration != mList->mGeneration)) {
+            seek(*mList, last);
+        }
+    }
+
+    LogBufferElement *get();
+    LogBufferChunk *chunk() const { return mChunk; }
+    void next(); // only valid after get() returned an element
+
+    // LogBufferChunkList::erase() the current element and move to the next
+    void erase();
+};
+
+#endif // _LOGD_LOG_BUFFER_CHUNK_H__
@@ -0,0 +1,351 @@
+/*
+ * Copyright (C) 2014 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <zlib.h>
+
+#include "LogBufferCold.h"
+
+// Raw deflate at its fastest. A chunk is at most 256K, an 8K window
+// finds most of the repetition in log text at a fraction of the memory.
+#define LOG_COLD_LEVEL Z_BEST_SPEED
+#define LOG_COLD_WINDOW_BITS 13
+#define LOG_COLD_MEM_LEVEL 5
+
+// Shared by all log ids, serialized by the LogBuffer lock
+static z_stream deflater;
+static bool deflaterReady;
+
+static bool deflater_reset() {
+    if (deflaterReady) {
+        return deflateReset(&deflater) == Z_OK;
+    }
+    memset(&deflater, 0, sizeof(deflater));
+    deflaterReady = deflateInit2(&deflater, LOG_COLD_LEVEL, Z_DEFLATED,
+                                 -LOG_COLD_WINDOW_BITS, LOG_COLD_MEM_LEVEL,
+                                 Z_DEFAULT_STRATEGY) == Z_OK;
+    return deflaterReady;
+}
+
+LogColdBlock::LogColdBlock()
+        : mPrev(NULL)
+        , mNext(NULL)
+        , mElements(0)
+        , mRawSize(0)
+        , mCompressedSize(0)
+        , mData(NULL)
+{ }
+
+LogColdBlock::~LogColdBlock() {
+    free(mData);
+}
+
+LogColdList::LogColdList()
+        : mHead(NULL)
+        , mTail(NULL)
+        , mCompressed(0)
+        , mElements(0)
+        , mBudget(0)
+        , mGeneration(0)
+        , mStage(NULL)
+        , mStageSize(0)
+{ }
+
+LogColdList::~LogColdList() {
+    clear();
+    free(mStage);
+}
+
+void LogColdList::setBudget(size_t budget) {
+    mBudget = budget;
+    while (mHead && (mCompressed > mBudget)) {
+        release(mHead);
+    }
+    if (!mBudget) {
+        free(mStage);
+        mStage = NULL;
+        mStageSize = 0;
+    }
+}
+
+bool LogColdList::getFirstTime(log_time &first) const {
+    if (!mHead) {
+        return false;
+    }
+    first = mHead->mFirst;
+    return true;
+}
+
+bool LogColdList::age(LogBufferChunkList &list, LogBufferChunk *chunk,
+                      size_t *raw, size_t *compressed) {
+    if (!mBudget) {
+        return false;
+    }
+
+    if (mStageSize < chunk->getCapacity()) {
+        char *stage = (char *)realloc(mStage, chunk->getCapacity());
+        if (!stage) {
+            return false;
+        }
+        mStage = stage;
+        mStageSize = chunk->getCapacity();
+    }
+
+    LogColdBlock *block = new LogColdBlock();
+    size_t used = 0;
+
+    LogBufferCursor it(list, chunk);
+    LogBufferElement *e;
+    while ((e = it.get()) && (it.chunk() == chunk)) {
+        size_t size = e->getStorageSize();
+        memcpy(mStage + used, e, size);
+        if (!block->mElements++) {
+            block->mFirst = e->getMonotonicTime();
+            block->mMaxRealTime = e->getRealTime();
+        } else if (block->mMaxRealTime < e->getRealTime()) {
+            block->mMaxRealTime = e->getRealTime();
+        }
+        block->mLast = e->getMonotonicTime();
+        used += size;
+        it.next();
+    }
+
+    if (!used || !deflater_reset()) {
+        delete block;
+        return false;
+    }
+
+    uLong bound = deflateBound(&deflater, used);
+    block->mData = (char *)malloc(bound);
+    if (!block->mData) {
+        delete block;
+        return false;
+    }
+
+    deflater.next_in = reinterpret_cast<Bytef *>(mStage);
+    deflater.avail_in = used;
+    deflater.next_out = reinterpret_cast<Bytef *>(block->mData);
+    deflater.avail_out = bound;
+    if (deflate(&deflater, Z_FINISH) != Z_STREAM_END) {
+        delete block;
+        return false;
+    }
+
+    block->mRawSize = used;
+    block->mCompressedSize = bound - deflater.avail_out;
+    char *data = (char *)realloc(block->mData, block->mCompressedSize);
+    if (data) {
+        block->mData = data;
+    }
+
+    block->mPrev = mTail;
+    if (mTail) {
+        mTail->mNext = block;
+    } else {
+        mHead = block;
+    }
+    mTail = block;
+    mCompressed += block->mCompressedSize;
+    mElements += block->mElements;
+    ++mGeneration;
+
+    *raw = block->mRawSize;
+    *compressed = block->mCompressedSize;
+
+    while (mHead && (mCompressed > mBudget)) {
+        release(mHead);
+    }
+    return true;
+}
+
+void LogColdList::release(LogColdBlock *block) {
+    if (block->mPrev) {
+        block->mPrev->mNext = block->mNext;
+    } else {
+        mHead = block->mNext;
+    }
+    if (block->mNext) {
+        block->mNext->mPrev = block->mPrev;
+    } else {
+        mTail = block->mPrev;
+    }
+    mCompressed -= block->mCompressedSize;
+    mElements -= block->mElements;
+    ++mGeneration;
+    delete block;
+}
+
+void LogColdList::clear() {
+    while (mHead) {
+        release(mHead);
+    }
+}
+
+LogColdCursor::LogColdCursor()
+        : mList(NULL)
+        , mGeneration(0)
+        , mNext(NULL)
+        , mPrev(NULL)
+        , mStart(log_time::EPOCH)
+        , mLoaded(log_time::EPOCH)
+        , mData(NULL)
+        , mCapacity(0)
+        , mSize(0)
+        , mOffset(0)
+{ }
+
+LogColdCursor::~LogColdCursor() {
+    free(mData);
+}
+
+void LogColdCursor::seek(LogColdList &list, log_time start) {
+    mList = &list;
+    mGeneration = list.mGeneration;
+    mStart = start;
+    mSize = 0;
+    mOffset = 0;
+
+    // readers mostly resume near the end, walk backwards from the tail
+    mNext = list.mTail;
+    if (mNext && (mNext->mLast <= start)) {
+        mNext = NULL;
+    }
+    while (mNext && mNext->mPrev && (mNext->mPrev->mLast > start)) {
+        mNext = mNext->mPrev;
+    }
+}
+
+void LogColdCursor::seekRealTime(LogColdList &list, log_time start) {
+    mList = &list;
+    mGeneration = list.mGeneration;
+    mStart = log_time::EPOCH;
+    mSize = 0;
+    mOffset = 0;
+
+    mNext = list.mHead;
+    while (mNext && (mNext->mMaxRealTime < start)) {
+        mNext = mNext->mNext;
+    }
+}
+
+void LogColdCursor::seekTail(LogColdList &list) {
+    mList = &list;
+    mGeneration = list.mGeneration;
+    mStart = log_time::EPOCH;
+    mSize = 0;
+    mOffset = 0;
+    mNext = NULL;
+    mPrev = list.mTail;
+}
+
+bool LogColdCursor::loadPrev() {
+    LogColdBlock *block = mPrev;
+    if (!block) {
+        return false;
+    }
+    mPrev = block->mPrev;
+    if (!load(block)) {
+        // out of memory, the block is lost to this walk
+        mSize = 0;
+        mOffset = 0;
+    }
+    return true;
+}
+
+void LogColdCursor::revalidate(log_time last) {
+    if (!mList || (mGeneration == mList->mGeneration)) {
+        return;
+    }
+    mGeneration = mList->mGeneration;
+
+    // What is left of the loaded block is our own copy and still good,
+    // pick up after it with the first block holding anything newer.
+    log_time after = last;
+    if ((mOffset < mSize) && (mLoaded > after)) {
+        after = mLoaded;
+    }
+    mStart = last;
+
+    mNext = mList->mTail;
+    if (mNext && (mNext->mLast <= after)) {
+        mNext = NULL;
+    }
+    while (mNext && mNext->mPrev && (mNext->mPrev->mLast > after)) {
+        mNext = mNext->mPrev;
+    }
+}
+
+bool LogColdCursor::load(LogColdBlock *block) {
+    if (mCapacity < block->mRawSize) {
+        char *data = (char *)realloc(mData, block->mRawSize);
+        if (!data) {
+            return false;
+        }
+        mData = data;
+        mCapacity = block->mRawSize;
+    }
+
+    z_stream inflater;
+    memset(&inflater, 0, sizeof(inflater));
+    if (inflateInit2(&inflater, -LOG_COLD_WINDOW_BITS) != Z_OK) {
+        return false;
+    }
+    inflater.next_in = reinterpret_cast<Bytef *>(block->mData);
+    inflater.avail_in = block->mCompressedSize;
+    inflater.next_out = reinterpret_cast<Bytef *>(mData);
+    inflater.avail_out = block->mRawSize;
+    int ret = inflate(&inflater, Z_FINISH);
+    inflateEnd(&inflater);
+    if (ret != Z_STREAM_END) {
+        return false;
+    }
+
+    mSize = block->mRawSize;
+    mOffset = 0;
+    mLoaded = block->mLast;
+
+    // skip what the reader has already seen
+    while ((mOffset < mSize) && (at(mOffset)->getMonotonicTime() <= mStart)) {
+        mOffset += at(mOffset)->getStorageSize();
+    }
+    return true;
+}
+
+LogBufferElement *LogColdCursor::get(bool mayLoad, bool *blocked) {
+    while (mOffset >= mSize) {
+        if (!mNext) {
+            return NULL;
+        }
+        if (!mayLoad) {
+            *blocked = true;
+            return NULL;
+        }
+        LogColdBlock *block = mNext;
+        mNext = block->mNext;
+        if (!load(block)) {
+            // out of memory, the block is lost to this reader
+            mSize = 0;
+            mOffset = 0;
+        }
+    }
+    return at(mOffset);
+}
+
+void LogColdCursor::next() {
+    mOffset += at(mOffset)->getStorageSize();
+}
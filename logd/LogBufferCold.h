@@ -0,0 +1,141 @@
+/*
+ * Copyright (C) 2014 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _LOGD_LOG_BUFFER_COLD_H__
+#define _LOGD_LOG_BUFFER_COLD_H__
+
+#include <sys/types.h>
+
+#include <log/log.h>
+#include <log/log_read.h>
+
+#include "LogBufferChunk.h"
+#include "LogBufferElement.h"
+
+// The compressed tier of one log id. Whole chunks aged out of the hot
+// LogBufferChunkList have their live entries packed back to back and
+// deflated into a LogColdBlock. Blocks are dropped oldest first to stay
+// within their own budget, and decompressed on demand by LogColdCursor.
+//
+// Everything here is called with the LogBuffer lock held.
+class LogColdBlock {
+    friend class LogColdList;
+    friend class LogColdCursor;
+
+    LogColdBlock *mPrev; // older
+    LogColdBlock *mNext; // newer
+    log_time mFirst; // monotonic
+    log_time mLast;
+    log_time mMaxRealTime; // newest realtime, they are unordered
+    size_t mElements;
+    size_t mRawSize;
+    size_t mCompressedSize;
+    char *mData;
+
+public:
+    LogColdBlock();
+    ~LogColdBlock();
+};
+
+class LogColdList {
+    friend class LogColdCursor;
+
+    LogColdBlock *mHead;
+    LogColdBlock *mTail;
+    size_t mCompressed;
+    size_t mElements;
+    size_t mBudget; // 0 disables the tier
+    // bumped whenever a block is added or dropped
+    unsigned long mGeneration;
+
+    // entries of the chunk being aged, packed back to back
+    char *mStage;
+    size_t mStageSize;
+
+    void release(LogColdBlock *block);
+
+public:
+    LogColdList();
+    ~LogColdList();
+
+    void setBudget(size_t budget);
+    size_t getBudget() const { return mBudget; }
+    bool enabled() const { return mBudget != 0; }
+
+    size_t getCompressed() const { return mCompressed; }
+    size_t getElements() const { return mElements; }
+    // monotonic time of the oldest entry held, false if empty
+    bool getFirstTime(log_time &first) const;
+
+    // Compress the live entries of chunk into a new block, then drop old
+    // blocks to stay within budget. The caller still owns and releases
+    // the chunk. Returns false, with nothing added, on failure; *raw and
+    // *compressed report the sizes of the block added.
+    bool age(LogBufferChunkList &list, LogBufferChunk *chunk,
+             size_t *raw, size_t *compressed);
+
+    void clear();
+};
+
+// Reads a LogColdList in order, one decompressed block at a time. The
+// entries handed out point into the cursor's own copy of the block, so
+// they stay valid after the lock is dropped until the next block loads.
+class LogColdCursor {
+    LogColdList *mList;
+    unsigned long mGeneration;
+    LogColdBlock *mNext; // to load next, NULL if none yet
+    LogColdBlock *mPrev; // for loadPrev(), NULL once past the head
+    log_time mStart; // entries loaded must be newer than this
+    log_time mLoaded; // last entry of the loaded block
+
+    char *mData;
+    size_t mCapacity;
+    size_t mSize;
+    size_t mOffset;
+
+    LogBufferElement *at(size_t offset) const {
+        return reinterpret_cast<LogBufferElement *>(mData + offset);
+    }
+    bool load(LogColdBlock *block);
+
+public:
+    LogColdCursor();
+    ~LogColdCursor();
+
+    // position at the first element newer than start
+    void seek(LogColdList &list, log_time start);
+    // position at the first block holding a realtime at or after start,
+    // the caller scans forward from there
+    void seekRealTime(LogColdList &list, log_time start);
+
+    // Walk the tier a block at a time from the newest, without dropping
+    // the lock: after seekTail(), each loadPrev() loads the block before
+    // the last one, and get() hands out its entries alone. loadPrev()
+    // returns false once past the oldest block.
+    void seekTail(LogColdList &list);
+    bool loadPrev();
+
+    // catch up after the list changed under a drop of the lock
+    void revalidate(log_time last);
+
+    // NULL at the end of the tier. Moving on to the next block replaces
+    // the data behind entries already handed out, so without mayLoad the
+    // cursor sets *blocked and returns NULL instead.
+    LogBufferElement *get(bool mayLoad, bool *blocked);
+    void next(); // only valid after get() returned an element
+};
+
+#endif // _LOGD_LOG_BUFFER_COLD_H__
@@ -26,43 +26,37 @@
 
 const log_time LogBufferElement::FLUSH_ERROR((uint32_t)0, (uint32_t)0);
 
-LogBufferElement::LogBufferElement(log_id_t log_id, log_time realtime,
+LogBufferElement::LogBufferElement(log_id_t log_id,
+                                   log_time monotonic, log_time realtime,
                                    uid_t uid, pid_t pid, pid_t tid,
                                    const char *msg, unsigned short len)
-        : mLogId(log_id)
+        : mChunk(NULL)
+        , mUidPrev(NULL)
+        , mUidNext(NULL)
+        , mMonotonicTime(monotonic)
+        , mRealTime(realtime)
         , mUid(uid)
         , mPid(pid)
         , mTid(tid)
         , mMsgLen(len)
-        , mMonotonicTime(CLOCK_MONOTONIC)
-        , mRealTime(realtime) {
-    mMsg = new char[len];
-    memcpy(mMsg, msg, len);
+        , mLogId(log_id)
+        , mFlags(0) {
+    memcpy(this + 1, msg, len);
 }
 
-LogBufferElement::~LogBufferElement() {
-    delete [] mMsg;
-}
-
-log_time LogBufferElement::flushTo(SocketClient *reader) {
-    struct logger_entry_v3 entry;
-    memset(&entry, 0, sizeof(struct logger_entry_v3));
-    entry.hdr_size = sizeof(struct logger_entry_v3);
-    entry.len = mMsgLen;
-    entry.lid = mLogId;
-    entry.pid = mPid;
-    entry.tid = mTid;
-    entry.sec = mRealTime.tv_sec;
-    entry.nsec = mRealTime.tv_nsec;
-
-    struct iovec iovec[2];
-    iovec[0].iov_base = &entry;
+void LogBufferElement::flushTo(struct logger_entry_v3 *entry,
+                               struct iovec *iovec) const {
+    memset(entry, 0, sizeof(struct logger_entry_v3));
+    entry->hdr_size = sizeof(struct logger_entry_v3);
+    entry->len = mMsgLen;
+    entry->lid = mLogId;
+    entry->pid = mPid;
+    entry->tid = mTid;
+    entry->sec = mRealTime.tv_sec;
+    entry->nsec = mRealTime.tv_nsec;
+
+    iovec[0].iov_base = entry;
     iovec[0].iov_len = sizeof(struct logger_entry_v3);
-    iovec[1].iov_base = mMsg;
+    iovec[1].iov_base = const_cast<char *>(getMsg());
     iovec[1].iov_len = mMsgLen;
-    if (reader->sendDatav(iovec, 2)) {
-        return FLUSH_ERROR;
-    }
-
-    return mMonotonicTime;
 }
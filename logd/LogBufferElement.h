@@ -17,37 +17,77 @@
 #ifndef _LOGD_LOG_BUFFER_ELEMENT_H__
 #define _LOGD_LOG_BUFFER_ELEMENT_H__
 
+#include <stdint.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <sysutils/SocketClient.h>
 #include <log/log.h>
 #include <log/log_read.h>
 
+class LogBufferChunk;
+class UidStatistics;
+struct logger_entry_v3;
+
+// A LogBufferElement is a view of one entry stored inline in a
+// LogBufferChunk. The header below is immediately followed in the chunk
+// by mMsgLen bytes of payload. Elements are only ever constructed in
+// place by LogBufferChunk::append(), and never move once written.
+//
+// Live elements are also threaded onto the list of their UidStatistics
+// so pruning a uid does not have to scan the whole log id.
 class LogBufferElement {
-    const log_id_t mLogId;
-    const uid_t mUid;
-    const pid_t mPid;
-    const pid_t mTid;
-    char *mMsg;
-    const unsigned short mMsgLen;
-    const log_time mMonotonicTime;
-    const log_time mRealTime;
+    friend class LogBufferChunk;
+    friend class UidStatistics;
 
-public:
-    LogBufferElement(log_id_t log_id, log_time realtime,
+    LogBufferChunk *mChunk;
+    LogBufferElement *mUidPrev; // older
+    LogBufferElement *mUidNext; // newer
+    log_time mMonotonicTime;
+    log_time mRealTime;
+    uid_t mUid;
+    pid_t mPid;
+    pid_t mTid;
+    unsigned short mMsgLen;
+    unsigned char mLogId;
+    unsigned char mFlags;
+
+    static const unsigned char FLAG_DROPPED = 0x01;
+
+    LogBufferElement(log_id_t log_id, log_time monotonic, log_time realtime,
                      uid_t uid, pid_t pid, pid_t tid,
                      const char *msg, unsigned short len);
-    virtual ~LogBufferElement();
 
-    log_id_t getLogId() const { return mLogId; }
+public:
+    log_id_t getLogId() const { return (log_id_t) mLogId; }
     uid_t getUid(void) const { return mUid; }
     pid_t getPid(void) const { return mPid; }
     pid_t getTid(void) const { return mTid; }
     unsigned short getMsgLen() const { return mMsgLen; }
+    const char *getMsg() const {
+        return reinterpret_cast<const char *>(this + 1);
+    }
     log_time getMonotonicTime(void) const { return mMonotonicTime; }
     log_time getRealTime(void) const { return mRealTime; }
 
+    LogBufferChunk *getChunk() const { return mChunk; }
+    LogBufferElement *getUidNext() const { return mUidNext; }
+
+    // Pruned out of the middle of a chunk, storage reclaimed with the chunk
+    bool isDropped() const { return mFlags & FLAG_DROPPED; }
+    void setDropped() { mFlags |= FLAG_DROPPED; }
+
+    // space occupied in the chunk by an entry with a payload of len bytes
+    static size_t storageSize(unsigned short len) {
+        return (sizeof(LogBufferElement) + len
+                    + __alignof__(LogBufferElement) - 1)
+                   & ~(__alignof__(LogBufferElement) - 1);
+    }
+    size_t getStorageSize() const { return storageSize(mMsgLen); }
+
     static const log_time FLUSH_ERROR;
-    log_time flushTo(SocketClient *writer);
+    // Describe the entry as a logger_entry_v3 packet in two iovecs, the
+    // payload is referenced in place in the chunk.
+    void flushTo(struct logger_entry_v3 *entry, struct iovec *iovec) const;
 };
 
 #endif
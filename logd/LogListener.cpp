@@ -26,48 +26,141 @@
 
 #include "LogListener.h"
 
-LogListener::LogListener(LogBuffer *buf, LogReader *reader)
+// Largest datagram we accept, and its ancillary credentials
+#define LOG_DGRAM_SIZE (sizeof_log_id_t + sizeof(uint16_t) + sizeof(log_time) \
+                        + LOGGER_ENTRY_MAX_PAYLOAD)
+#define LOG_DGRAM_CONTROL_SIZE CMSG_SPACE(sizeof(struct ucred))
+// Upper limit on datagrams drained per wakeup, ~1MB of buffers
+#define LOG_DGRAM_BATCH_MAX 256U
+
+LogListener::LogListener(LogBuffer *buf, LogReader *reader, unsigned int batch,
+                         LogQueue *queue)
         : SocketListener(getLogSocket(), false)
         , logbuf(buf)
         , reader(reader)
-{  }
+        , mQueue(queue)
+        , mBatch(batch
+              ? ((batch < LOG_DGRAM_BATCH_MAX) ? batch : LOG_DGRAM_BATCH_MAX)
+              : 1)
+        , mMsgs(NULL)
+        , mIovs(NULL)
+        , mBuffers(NULL)
+        , mControls(NULL) {
+    if (mBatch <= 1) {
+        return;
+    }
+
+    // Only the listener thread touches these, allocate once up front
+    mMsgs = new struct mmsghdr[mBatch];
+    mIovs = new struct iovec[mBatch];
+    mBuffers = new char[mBatch * LOG_DGRAM_SIZE];
+    mControls = new char[mBatch * LOG_DGRAM_CONTROL_SIZE];
+}
+
+LogListener::~LogListener() {
+    delete [] mMsgs;
+    delete [] mIovs;
+    delete [] mBuffers;
+    delete [] mControls;
+}
 
 bool LogListener::onDataAvailable(SocketClient *cli) {
     prctl(PR_SET_NAME, "logd.writer");
 
-    char buffer[sizeof_log_id_t + sizeof(uint16_t) + sizeof(log_time)
-        + LOGGER_ENTRY_MAX_PAYLOAD];
-    struct iovec iov = { buffer, sizeof(buffer) };
-    memset(buffer, 0, sizeof(buffer));
-
-    char control[CMSG_SPACE(sizeof(struct ucred))];
-    struct msghdr hdr = {
-        NULL,
-        0,
-        &iov,
-        1,
-        control,
-        sizeof(control),
-        0,
-    };
-
     int socket = cli->getSocket();
 
-    ssize_t n = recvmsg(socket, &hdr, 0);
+    if (mBatch <= 1) {
+        char buffer[LOG_DGRAM_SIZE];
+        struct iovec iov = { buffer, sizeof(buffer) };
+        memset(buffer, 0, sizeof(buffer));
+
+        char control[LOG_DGRAM_CONTROL_SIZE];
+        struct msghdr hdr = {
+            NULL,
+            0,
+            &iov,
+            1,
+            control,
+            sizeof(control),
+            0,
+        };
+
+        ssize_t n = recvmsg(socket, &hdr, 0);
+
+        if (mQueue) {
+            return log(&hdr, n);
+        }
+
+        logbuf->lock();
+        bool logged = log(&hdr, n);
+        logbuf->unlock();
+
+        if (logged) {
+            reader->notifyNewLog();
+        }
+        return logged;
+    }
+
+    for (unsigned int i = 0; i < mBatch; ++i) {
+        mIovs[i].iov_base = mBuffers + i * LOG_DGRAM_SIZE;
+        mIovs[i].iov_len = LOG_DGRAM_SIZE;
+
+        struct msghdr &hdr = mMsgs[i].msg_hdr;
+        memset(&hdr, 0, sizeof(hdr));
+        hdr.msg_iov = &mIovs[i];
+        hdr.msg_iovlen = 1;
+        hdr.msg_control = mControls + i * LOG_DGRAM_CONTROL_SIZE;
+        hdr.msg_controllen = LOG_DGRAM_CONTROL_SIZE;
+        mMsgs[i].msg_len = 0;
+    }
+
+    // We were woken for at least one, take whatever else is queued
+    int count = recvmmsg(socket, mMsgs, mBatch, MSG_DONTWAIT, NULL);
+    if (count <= 0) {
+        return false;
+    }
+
+    unsigned int logged = 0;
+    if (!mQueue) {
+        logbuf->lock();
+    }
+    for (int i = 0; i < count; ++i) {
+        if (log(&mMsgs[i].msg_hdr, mMsgs[i].msg_len)) {
+            ++logged;
+        }
+    }
+    if (mQueue) {
+        // the merge thread wakes the readers
+        return logged != 0;
+    }
+    logbuf->unlock();
+
+    // one wakeup of the readers for the whole batch
+    if (logged) {
+        reader->notifyNewLog();
+    }
+
+    return logged != 0;
+}
+
+// Parse one datagram and stage it in the LogQueue, or without a queue
+// hand it to the LogBuffer with the caller holding the LogBuffer lock.
+// Returns false if the datagram was dropped.
+bool LogListener::log(struct msghdr *hdr, ssize_t n) {
     if (n <= (ssize_t)(sizeof_log_id_t + sizeof(uint16_t) + sizeof(log_time))) {
         return false;
     }
 
     struct ucred *cred = NULL;
 
-    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&hdr);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(hdr);
     while (cmsg != NULL) {
         if (cmsg->cmsg_level == SOL_SOCKET
                 && cmsg->cmsg_type  == SCM_CREDENTIALS) {
             cred = (struct ucred *)CMSG_DATA(cmsg);
             break;
         }
-        cmsg = CMSG_NXTHDR(&hdr, cmsg);
+        cmsg = CMSG_NXTHDR(hdr, cmsg);
     }
 
     if (cred == NULL) {
@@ -81,6 +174,8 @@ bool LogListener::onDataAvailable(SocketClient *cli) {
         return false;
     }
 
+    char *buffer = (char *)hdr->msg_iov[0].iov_base;
+
     // First log element is always log_id.
     log_id_t log_id = (log_id_t) *((typeof_log_id_t *) buffer);
     if (log_id < 0 || log_id >= LOG_ID_MAX) {
@@ -99,12 +194,16 @@ bool LogListener::onDataAvailable(SocketClient *cli) {
     msg += sizeof(log_time);
     n -= sizeof(log_time);
 
-    // NB: hdr.msg_flags & MSG_TRUNC is not tested, silently passing a
+    // NB: hdr->msg_flags & MSG_TRUNC is not tested, silently passing a
     // truncated message to the logs.
 
-    logbuf->log(log_id, realtime, cred->uid, cred->pid, tid, msg,
-        ((size_t) n <= USHRT_MAX) ? (unsigned short) n : USHRT_MAX);
-    reader->notifyNewLog();
+    unsigned short len = ((size_t) n <= USHRT_MAX) ? (unsigned short) n
+                                                   : USHRT_MAX;
+    if (mQueue) {
+        return mQueue->log(log_id, realtime, cred->uid, cred->pid, tid,
+                           msg, len);
+    }
+    logbuf->log_Locked(log_id, realtime, cred->uid, cred->pid, tid, msg, len);
 
     return true;
 }
@@ -18,20 +18,34 @@
 #define _LOGD_LOG_LISTENER_H__
 
 #include <sysutils/SocketListener.h>
+#include "LogQueue.h"
 #include "LogReader.h"
 
+#include <sys/socket.h>
+
 class LogListener : public SocketListener {
     LogBuffer *logbuf;
     LogReader *reader;
+    LogQueue *mQueue; // NULL inserts straight into logbuf
+
+    // datagrams drained per wakeup with recvmmsg(), 1 disables batching
+    const unsigned int mBatch;
+    struct mmsghdr *mMsgs;
+    struct iovec *mIovs;
+    char *mBuffers;
+    char *mControls;
 
 public:
-    LogListener(LogBuffer *buf, LogReader *reader);
+    LogListener(LogBuffer *buf, LogReader *reader, unsigned int batch = 1,
+                LogQueue *queue = NULL);
+    virtual ~LogListener();
 
 protected:
     virtual bool onDataAvailable(SocketClient *cli);
 
 private:
     static int getLogSocket();
+    bool log(struct msghdr *hdr, ssize_t n);
 };
 
 #endif
@@ -0,0 +1,202 @@
+/*
+ * Copyright (C) 2014 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <string.h>
+#include <sys/prctl.h>
+
+#include <cutils/atomic.h>
+
+#include "LogBuffer.h"
+#include "LogQueue.h"
+#include "LogReader.h"
+
+// Upper limit on slots, each one holds a maximum sized payload
+#define LOG_QUEUE_SLOTS_MAX 1024U
+// Entries merged per LogBuffer lock hold, lets readers in between
+#define LOG_QUEUE_MERGE_BATCH 64U
+
+// Positions and sequences are free running and compared by difference
+static inline int32_t seq_diff(int32_t a, int32_t b) {
+    return (int32_t) ((uint32_t) a - (uint32_t) b);
+}
+
+static inline int32_t seq_inc(int32_t a, uint32_t n) {
+    return (int32_t) ((uint32_t) a + n);
+}
+
+LogQueue::LogQueue(LogBuffer *buf, LogReader *reader, unsigned int slots)
+        : mLogbuf(buf)
+        , mReader(reader)
+        , mSlots(NULL)
+        , mMask(0)
+        , mEnqueuePos(0)
+        , mDequeuePos(0)
+        , mWaiting(0) {
+    uint32_t size = 2;
+    if (slots > LOG_QUEUE_SLOTS_MAX) {
+        slots = LOG_QUEUE_SLOTS_MAX;
+    }
+    while (size < slots) {
+        size <<= 1;
+    }
+    const_cast<uint32_t &>(mMask) = size - 1;
+
+    mSlots = new Slot[size];
+    for (uint32_t i = 0; i < size; ++i) {
+        mSlots[i].mSequence = i;
+    }
+
+    log_id_for_each(i) {
+        mDropped[i] = 0;
+    }
+
+    pthread_mutex_init(&mWaitLock, NULL);
+    pthread_cond_init(&mWaitCond, NULL);
+}
+
+// Only valid if startMerge() failed, the merge thread runs forever
+LogQueue::~LogQueue() {
+    pthread_cond_destroy(&mWaitCond);
+    pthread_mutex_destroy(&mWaitLock);
+    delete [] mSlots;
+}
+
+int LogQueue::startMerge() {
+    pthread_attr_t attr;
+    int ret = -1;
+
+    if (!pthread_attr_init(&attr)) {
+        if (!pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED)) {
+            ret = pthread_create(&mThread, &attr, LogQueue::threadStart, this);
+        }
+        pthread_attr_destroy(&attr);
+    }
+    return ret;
+}
+
+bool LogQueue::log(log_id_t log_id, log_time realtime,
+                   uid_t uid, pid_t pid, pid_t tid,
+                   const char *msg, unsigned short len) {
+    int32_t pos = android_atomic_acquire_load(&mEnqueuePos);
+    Slot *slot;
+
+    for (;;) {
+        slot = &mSlots[(uint32_t) pos & mMask];
+        int32_t diff = seq_diff(android_atomic_acquire_load(&slot->mSequence),
+                                pos);
+        if (diff == 0) {
+            // free slot, try to claim it
+            if (!android_atomic_release_cas(pos, seq_inc(pos, 1),
+                                            &mEnqueuePos)) {
+                break;
+            }
+        } else if (diff < 0) {
+            // still holds an entry from the previous lap, merge is behind
+            android_atomic_inc(&mDropped[log_id]);
+            return false;
+        }
+        // lost a race with another producer
+        pos = android_atomic_acquire_load(&mEnqueuePos);
+    }
+
+    if (len > sizeof(slot->mMsg)) {
+        len = sizeof(slot->mMsg);
+    }
+    slot->mLogId = log_id;
+    slot->mRealTime = realtime;
+    slot->mUid = uid;
+    slot->mPid = pid;
+    slot->mTid = tid;
+    slot->mMsgLen = len;
+    memcpy(slot->mMsg, msg, len);
+
+    // publish to the merge thread
+    android_atomic_release_store(seq_inc(pos, 1), &slot->mSequence);
+
+    // Pairs with the barrier in wait(), either we see the merge thread
+    // parked or it sees our slot, a release store alone does not order
+    // the store against the load that follows.
+    __sync_synchronize();
+    if (android_atomic_acquire_load(&mWaiting)) {
+        pthread_mutex_lock(&mWaitLock);
+        pthread_cond_signal(&mWaitCond);
+        pthread_mutex_unlock(&mWaitLock);
+    }
+    return true;
+}
+
+// Oldest published slot, or NULL if the ring is empty
+LogQueue::Slot *LogQueue::front() {
+    Slot *slot = &mSlots[(uint32_t) mDequeuePos & mMask];
+    int32_t diff = seq_diff(android_atomic_acquire_load(&slot->mSequence),
+                            seq_inc(mDequeuePos, 1));
+    return diff ? NULL : slot;
+}
+
+// Hand the slot back to the producers for the next lap
+void LogQueue::pop(Slot *slot) {
+    android_atomic_release_store(seq_inc(mDequeuePos, mMask + 1),
+                                 &slot->mSequence);
+    mDequeuePos = seq_inc(mDequeuePos, 1);
+}
+
+void LogQueue::wait() {
+    pthread_mutex_lock(&mWaitLock);
+    android_atomic_release_store(1, &mWaiting);
+    __sync_synchronize();
+    while (!front()) {
+        pthread_cond_wait(&mWaitCond, &mWaitLock);
+    }
+    android_atomic_release_store(0, &mWaiting);
+    pthread_mutex_unlock(&mWaitLock);
+}
+
+void LogQueue::merge() {
+    Slot *slot;
+    while ((slot = front())) {
+        mLogbuf->lock();
+        unsigned int count = 0;
+        do {
+            mLogbuf->log_Locked(slot->mLogId, slot->mRealTime,
+                                slot->mUid, slot->mPid, slot->mTid,
+                                slot->mMsg, slot->mMsgLen);
+            pop(slot);
+        } while ((++count < LOG_QUEUE_MERGE_BATCH) && (slot = front()));
+
+        log_id_for_each(i) {
+            int32_t dropped = android_atomic_and(0, &mDropped[i]);
+            if (dropped) {
+                mLogbuf->dropped_Locked(i, dropped);
+            }
+        }
+        mLogbuf->unlock();
+
+        // one wakeup of the readers per batch, so that they are not
+        // starved while the ring keeps refilling under sustained load
+        mReader->notifyNewLog();
+    }
+}
+
+void *LogQueue::threadStart(void *obj) {
+    prctl(PR_SET_NAME, "logd.merge");
+
+    LogQueue *me = reinterpret_cast<LogQueue *>(obj);
+    for (;;) {
+        me->wait();
+        me->merge();
+    }
+    return NULL;
+}
@@ -0,0 +1,92 @@
+/*
+ * Copyright (C) 2014 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _LOGD_LOG_QUEUE_H__
+#define _LOGD_LOG_QUEUE_H__
+
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <log/log.h>
+#include <log/log_read.h>
+#include <log/logger.h>
+
+class LogBuffer;
+class LogReader;
+
+// Bounded multi-producer, single-consumer staging ring between the
+// socket listeners and the LogBuffer. Producers claim a slot with a
+// compare and swap and never take the LogBuffer lock, so a reader or a
+// prune holding that lock no longer stalls draining of the logdw socket.
+// The merge thread moves everything staged into the LogBuffer under a
+// single lock hold, where pruning then also happens.
+//
+// When the ring is full the message is dropped and counted against its
+// log id; the merge thread folds the counts into LogStatistics.
+class LogQueue {
+    struct Slot {
+        volatile int32_t mSequence;
+        log_id_t mLogId;
+        log_time mRealTime;
+        uid_t mUid;
+        pid_t mPid;
+        pid_t mTid;
+        unsigned short mMsgLen;
+        char mMsg[LOGGER_ENTRY_MAX_PAYLOAD];
+    };
+
+    LogBuffer *mLogbuf;
+    LogReader *mReader;
+
+    Slot *mSlots;
+    const uint32_t mMask; // slot count - 1, slot count is a power of two
+
+    volatile int32_t mEnqueuePos;
+    int32_t mDequeuePos; // merge thread only
+
+    volatile int32_t mDropped[LOG_ID_MAX];
+
+    // merge thread parks here when the ring runs dry
+    volatile int32_t mWaiting;
+    pthread_mutex_t mWaitLock;
+    pthread_cond_t mWaitCond;
+
+    pthread_t mThread;
+
+    Slot *front();
+    void pop(Slot *slot);
+    void wait();
+    void merge();
+
+    static void *threadStart(void *me);
+
+public:
+    // slots is rounded up to a power of two
+    LogQueue(LogBuffer *buf, LogReader *reader, unsigned int slots);
+    ~LogQueue();
+
+    // Create the merge thread, 0 on success
+    int startMerge();
+
+    // Lock free, may be called from any thread. Returns false, and counts
+    // the message as dropped, if the merge thread is too far behind.
+    bool log(log_id_t log_id, log_time realtime,
+             uid_t uid, pid_t pid, pid_t tid,
+             const char *msg, unsigned short len);
+};
+
+#endif // _LOGD_LOG_QUEUE_H__
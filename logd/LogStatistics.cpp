@@ -114,7 +114,9 @@ char *PidStatistics::pidToName(pid_t pid) {
 UidStatistics::UidStatistics(uid_t uid)
         : uid(uid)
         , mSizes(0)
-        , mElements(0) {
+        , mElements(0)
+        , mOldest(NULL)
+        , mNewest(NULL) {
     Pids.clear();
 }
 
@@ -126,6 +128,35 @@ UidStatistics::~UidStatistics() {
     }
 }
 
+void UidStatistics::add(LogBufferElement *e) {
+    e->mUidPrev = mNewest;
+    e->mUidNext = NULL;
+    if (mNewest) {
+        mNewest->mUidNext = e;
+    } else {
+        mOldest = e;
+    }
+    mNewest = e;
+
+    add(e->getMsgLen(), e->getPid());
+}
+
+void UidStatistics::subtract(LogBufferElement *e) {
+    if (e->mUidPrev) {
+        e->mUidPrev->mUidNext = e->mUidNext;
+    } else {
+        mOldest = e->mUidNext;
+    }
+    if (e->mUidNext) {
+        e->mUidNext->mUidPrev = e->mUidPrev;
+    } else {
+        mNewest = e->mUidPrev;
+    }
+    e->mUidPrev = e->mUidNext = NULL;
+
+    subtract(e->getMsgLen(), e->getPid());
+}
+
 void UidStatistics::add(unsigned short size, pid_t pid) {
     mSizes += size;
     ++mElements;
@@ -272,43 +303,70 @@ LidStatistics::~LidStatistics() {
     }
 }
 
-void LidStatistics::add(unsigned short size, uid_t uid, pid_t pid) {
-    UidStatistics *u;
-    UidStatisticsCollection::iterator it;
-    UidStatisticsCollection::iterator last;
-
+UidStatisticsCollection::iterator LidStatistics::find(uid_t uid) {
     if (uid == (uid_t) -1) { // init
         uid = (uid_t) AID_ROOT;
     }
 
-    for (last = it = begin(); it != end(); last = it, ++it) {
-        u = *it;
-        if (uid == u->getUid()) {
-            u->add(size, pid);
-            if ((last != it) && ((*last)->sizesTotal() < u->sizesTotal())) {
-                Uids.erase(it);
-                Uids.insert(last, u);
-            }
-            return;
+    UidStatisticsCollection::iterator it;
+    for (it = begin(); it != end(); ++it) {
+        if (uid == (*it)->getUid()) {
+            break;
         }
     }
-    u = new UidStatistics(uid);
-    if ((last != it) && ((*last)->sizesTotal() < (size_t) size)) {
-        Uids.insert(last, u);
-    } else {
-        Uids.push_back(u);
+    return it;
+}
+
+UidStatistics *LidStatistics::uid(uid_t uid) {
+    UidStatisticsCollection::iterator it = find(uid);
+    return (it != end()) ? *it : NULL;
+}
+
+void LidStatistics::add(LogBufferElement *e) {
+    UidStatisticsCollection::iterator it = find(e->getUid());
+    if (it == end()) {
+        uid_t uid = e->getUid();
+        if (uid == (uid_t) -1) { // init
+            uid = (uid_t) AID_ROOT;
+        }
+        Uids.push_back(new UidStatistics(uid));
+        --it;
+    }
+
+    UidStatistics *u = *it;
+    u->add(e);
+
+    // bubble towards the front to keep Uids ordered
+    while (it != begin()) {
+        UidStatisticsCollection::iterator prev = it;
+        --prev;
+        if ((*prev)->sizes() >= u->sizes()) {
+            break;
+        }
+        *it = *prev;
+        *prev = u;
+        it = prev;
     }
-    u->add(size, pid);
 }
 
-void LidStatistics::subtract(unsigned short size, uid_t uid, pid_t pid) {
-    UidStatisticsCollection::iterator it;
-    for (it = begin(); it != end(); ++it) {
-        UidStatistics *u = *it;
-        if (uid == u->getUid()) {
-            u->subtract(size, pid);
-            return;
+void LidStatistics::subtract(LogBufferElement *e) {
+    UidStatisticsCollection::iterator it = find(e->getUid());
+    if (it == end()) {
+        return;
+    }
+
+    UidStatistics *u = *it;
+    u->subtract(e);
+
+    // bubble towards the back to keep Uids ordered
+    for (;;) {
+        UidStatisticsCollection::iterator next = it;
+        if ((++next == end()) || ((*next)->sizes() <= u->sizes())) {
+            break;
         }
+        *it = *next;
+        *next = u;
+        it = next;
     }
 }
 
@@ -388,6 +446,12 @@ LogStatistics::LogStatistics()
     log_id_for_each(i) {
         mSizes[i] = 0;
         mElements[i] = 0;
+        mDropped[i] = 0;
+        mColdSizes[i] = 0;
+        mColdElements[i] = 0;
+        mCompressedIn[i] = 0;
+        mCompressedOut[i] = 0;
+        mCompressedNsec[i] = 0;
     }
 
     dgram_qlen_statistics = false;
@@ -451,18 +515,18 @@ void LogStatistics::recordDiff(log_time diff, unsigned short bucket) {
     }
 }
 
-void LogStatistics::add(unsigned short size,
-                        log_id_t log_id, uid_t uid, pid_t pid) {
-    mSizes[log_id] += size;
+void LogStatistics::add(LogBufferElement *e) {
+    log_id_t log_id = e->getLogId();
+    mSizes[log_id] += e->getMsgLen();
     ++mElements[log_id];
-    id(log_id).add(size, uid, pid);
+    id(log_id).add(e);
 }
 
-void LogStatistics::subtract(unsigned short size,
-                             log_id_t log_id, uid_t uid, pid_t pid) {
-    mSizes[log_id] -= size;
+void LogStatistics::subtract(LogBufferElement *e) {
+    log_id_t log_id = e->getLogId();
+    mSizes[log_id] -= e->getMsgLen();
     --mElements[log_id];
-    id(log_id).subtract(size, uid, pid);
+    id(log_id).subtract(e);
 }
 
 size_t LogStatistics::sizes(log_id_t log_id, uid_t uid, pid_t pid) {
@@ -586,6 +650,81 @@ void LogStatistics::format(char **buf,
         spaces += spaces_total;
     }
 
+    // Messages the listener could not stage because merging fell behind
+    bool dropped = false;
+    log_id_for_each(i) {
+        if ((logMask & (1 << i)) && mDropped[i]) {
+            dropped = true;
+        }
+    }
+    if (dropped) {
+        spaces = 1;
+        string.appendFormat("\n%-25s", "Dropped (backpressure)");
+
+        log_id_for_each(i) {
+            if (!(logMask & (1 << i))) {
+                continue;
+            }
+
+            oldLength = string.length();
+            if (spaces < 0) {
+                spaces = 0;
+            }
+            string.appendFormat("%*s%zu", spaces, "", mDropped[i]);
+            spaces += spaces_total + oldLength - string.length();
+        }
+    }
+
+    // Compressed tier, what it holds now and how well aging has gone
+    bool compressed = false;
+    log_id_for_each(i) {
+        if ((logMask & (1 << i)) && mCompressedOut[i]) {
+            compressed = true;
+        }
+    }
+    if (compressed) {
+        spaces = 1;
+        string.appendFormat("\n%-25s", "Compressed");
+
+        log_id_for_each(i) {
+            if (!(logMask & (1 << i))) {
+                continue;
+            }
+
+            oldLength = string.length();
+            if (spaces < 0) {
+                spaces = 0;
+            }
+            string.appendFormat("%*s%zu/%zu", spaces, "",
+                                mColdSizes[i], mColdElements[i]);
+            spaces += spaces_total + oldLength - string.length();
+        }
+
+        spaces = 1;
+        string.appendFormat("\n%-25s", "Ratio/Time");
+
+        log_id_for_each(i) {
+            if (!(logMask & (1 << i))) {
+                continue;
+            }
+
+            oldLength = string.length();
+            if (spaces < 0) {
+                spaces = 0;
+            }
+            if (mCompressedOut[i]) {
+                unsigned long long ratio = mCompressedIn[i] * 100
+                                         / mCompressedOut[i];
+                string.appendFormat("%*s%llu.%02llux/%llums", spaces, "",
+                                    ratio / 100, ratio % 100,
+                                    mCompressedNsec[i] / 1000000);
+            } else {
+                string.appendFormat("%*s-", spaces, "");
+            }
+            spaces += spaces_total + oldLength - string.length();
+        }
+    }
+
     // Construct list of worst spammers by Pid
     static const unsigned char num_spammers = 10;
     bool header = false;
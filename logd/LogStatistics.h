@@ -23,6 +23,8 @@
 #include <log/log_read.h>
 #include <utils/List.h>
 
+#include "LogBufferElement.h"
+
 #define log_id_for_each(i) \
     for (log_id_t i = LOG_ID_MIN; i < LOG_ID_MAX; i = (log_id_t) (i + 1))
 
@@ -75,6 +77,13 @@ class UidStatistics {
     size_t mSizes;
     size_t mElements;
 
+    // live entries of this uid in this log id, oldest first
+    LogBufferElement *mOldest;
+    LogBufferElement *mNewest;
+
+    void add(unsigned short size, pid_t pid);
+    void subtract(unsigned short size, pid_t pid);
+
 public:
     UidStatistics(uid_t uid);
     ~UidStatistics();
@@ -84,10 +93,12 @@ public:
 
     uid_t getUid() { return uid; }
 
-    void add(unsigned short size, pid_t pid);
-    void subtract(unsigned short size, pid_t pid);
+    void add(LogBufferElement *e);
+    void subtract(LogBufferElement *e);
     void sort();
 
+    LogBufferElement *oldest() const { return mOldest; }
+
     static const pid_t pid_all = (pid_t) -1;
 
     // fast track current value
@@ -107,9 +118,13 @@ public:
 
 typedef android::List<UidStatistics *> UidStatisticsCollection;
 
+// Uids is kept ordered by current size, largest first, so the worst
+// offender is always at the front and heavy loggers are found quickly.
 class LidStatistics {
     UidStatisticsCollection Uids;
 
+    UidStatisticsCollection::iterator find(uid_t uid);
+
 public:
     LidStatistics();
     ~LidStatistics();
@@ -117,10 +132,12 @@ public:
     UidStatisticsCollection::iterator begin() { return Uids.begin(); }
     UidStatisticsCollection::iterator end() { return Uids.end(); }
 
-    void add(unsigned short size, uid_t uid, pid_t pid);
-    void subtract(unsigned short size, uid_t uid, pid_t pid);
+    void add(LogBufferElement *e);
+    void subtract(LogBufferElement *e);
     void sort();
 
+    UidStatistics *uid(uid_t uid); // NULL if none
+
     static const pid_t pid_all = (pid_t) -1;
     static const uid_t uid_all = (uid_t) -1;
 
@@ -137,6 +154,14 @@ class LogStatistics {
 
     size_t mSizes[LOG_ID_MAX];
     size_t mElements[LOG_ID_MAX];
+    size_t mDropped[LOG_ID_MAX]; // by backpressure, never stored
+
+    // compressed tier, currently held and totals ever aged into it
+    size_t mColdSizes[LOG_ID_MAX];
+    size_t mColdElements[LOG_ID_MAX];
+    unsigned long long mCompressedIn[LOG_ID_MAX];
+    unsigned long long mCompressedOut[LOG_ID_MAX];
+    unsigned long long mCompressedNsec[LOG_ID_MAX];
 
     bool dgram_qlen_statistics;
 
@@ -155,13 +180,24 @@ public:
     unsigned long long minimum(unsigned short bucket);
     void recordDiff(log_time diff, unsigned short bucket);
 
-    void add(unsigned short size, log_id_t log_id, uid_t uid, pid_t pid);
-    void subtract(unsigned short size, log_id_t log_id, uid_t uid, pid_t pid);
-    void sort();
+    void add(LogBufferElement *e);
+    void subtract(LogBufferElement *e);
+    void addDropped(log_id_t id, size_t count) { mDropped[id] += count; }
+    void addCompressed(log_id_t id, size_t in, size_t out,
+                       unsigned long long nsec) {
+        mCompressedIn[id] += in;
+        mCompressedOut[id] += out;
+        mCompressedNsec[id] += nsec;
+    }
+    void setCold(log_id_t id, size_t sizes, size_t elements) {
+        mColdSizes[id] = sizes;
+        mColdElements[id] = elements;
+    }
 
     // fast track current value by id only
     size_t sizes(log_id_t id) const { return mSizes[id]; }
     size_t elements(log_id_t id) const { return mElements[id]; }
+    size_t dropped(log_id_t id) const { return mDropped[id]; }
 
     // statistical track
     static const log_id_t log_id_all = (log_id_t) -1;
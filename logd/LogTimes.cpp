@@ -134,7 +134,14 @@ void *LogTimeEntry::threadStart(void *obj) {
         unlock();
 
         if (me->mTail) {
-            logbuf.flushTo(client, start, privileged, FilterFirstPass, me);
+            unsigned long count = logbuf.findTail(start, me->mTail,
+                                                  me->mLogMask, me->mPid,
+                                                  client->getUid(),
+                                                  privileged);
+            lock();
+            me->mCount = count;
+            me->mIndex = 0;
+            unlock();
         }
         start = logbuf.flushTo(client, start, privileged, FilterSecondPass, me);
 
@@ -158,27 +165,7 @@ void *LogTimeEntry::threadStart(void *obj) {
     return NULL;
 }
 
-// A first pass to count the number of elements
-bool LogTimeEntry::FilterFirstPass(const LogBufferElement *element, void *obj) {
-    LogTimeEntry *me = reinterpret_cast<LogTimeEntry *>(obj);
-
-    LogTimeEntry::lock();
-
-    if (me->mCount == 0) {
-        me->mStart = element->getMonotonicTime();
-    }
-
-    if ((!me->mPid || (me->mPid == element->getPid()))
-            && (me->mLogMask & (1 << element->getLogId()))) {
-        ++me->mCount;
-    }
-
-    LogTimeEntry::unlock();
-
-    return false;
-}
-
-// A second pass to send the selected elements
+// Pick the elements to send, a tail= start was positioned by findTail()
 bool LogTimeEntry::FilterSecondPass(const LogBufferElement *element, void *obj) {
     LogTimeEntry *me = reinterpret_cast<LogTimeEntry *>(obj);
 
@@ -100,8 +100,7 @@ public:
         delete this;
     }
 
-    // flushTo filter callbacks
-    static bool FilterFirstPass(const LogBufferElement *element, void *me);
+    // flushTo filter callback
     static bool FilterSecondPass(const LogBufferElement *element, void *me);
 };
 
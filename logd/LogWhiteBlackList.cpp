@@ -228,6 +228,17 @@ bool PruneList::naughty(LogBufferElement *element) {
     return false;
 }
 
+bool PruneList::naughtyUid(uid_t uid) {
+    PruneCollection::iterator it;
+    for (it = mNaughty.begin(); it != mNaughty.end(); ++it) {
+        uid_t u = (*it)->getUid();
+        if ((u == Prune::uid_all) || (u == uid)) {
+            return true;
+        }
+    }
+    return false;
+}
+
 bool PruneList::nice(LogBufferElement *element) {
     PruneCollection::iterator it;
     for (it = mNice.begin(); it != mNice.end(); ++it) {
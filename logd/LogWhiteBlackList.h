@@ -61,6 +61,7 @@ public:
     int init(char *str);
 
     bool naughty(LogBufferElement *element);
+    bool naughtyUid(uid_t uid); // could any blacklist entry match uid
     bool nice(LogBufferElement *element);
     bool worstUidEnabled() const { return mWorstUidEnabled; }
 
@@ -165,7 +165,23 @@ int main() {
     // initiated log messages. New log entries are added to LogBuffer
     // and LogReader is notified to send updates to connected clients.
 
-    LogListener *swl = new LogListener(logBuf, reader);
+    // LogQueue stages messages from the listener without taking the
+    // LogBuffer lock, a merge thread moves them into the LogBuffer.
+    // Off by default, as it drops messages when the merge falls behind.
+
+    LogQueue *queue = NULL;
+    int slots = property_get_int32("logd.listener.queue", 0);
+    if (slots > 0) {
+        queue = new LogQueue(logBuf, reader, slots);
+        if (queue->startMerge()) {
+            delete queue;
+            queue = NULL;
+        }
+    }
+
+    int batch = property_get_int32("logd.listener.batch", 1);
+    LogListener *swl = new LogListener(logBuf, reader,
+                                       (batch > 0) ? batch : 1, queue);
     // Backlog and /proc/sys/net/unix/max_dgram_qlen set to large value
     if (swl->startListener(300)) {
         exit(1);
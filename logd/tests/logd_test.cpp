@@ -19,12 +19,16 @@
 #include <signal.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 
 #include <gtest/gtest.h>
 
+#include "cutils/properties.h"
 #include "cutils/sockets.h"
 #include "log/log.h"
 #include "log/logger.h"
+#include "private/android_filesystem_config.h"
 
 #define __unused __attribute__((__unused__))
 
@@ -699,3 +703,280 @@ TEST(logd, benchmark) {
     // 50% threshold for SPAM filter (<20% typical, lots of engineering margin)
     ASSERT_GT(totalSize, nowSpamSize * 2);
 }
+
+// A blocking socket to logdw, so that no message is lost on our side
+static int logdw_open() {
+    int writer = socket(PF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (writer < 0) {
+        return -1;
+    }
+    struct sockaddr_un un;
+    memset(&un, 0, sizeof(un));
+    un.sun_family = AF_UNIX;
+    strcpy(un.sun_path, "/dev/socket/logdw");
+    if (connect(writer, (struct sockaddr *)&un, sizeof(un)) < 0) {
+        close(writer);
+        return -1;
+    }
+    return writer;
+}
+
+// Send one raw datagram to the main log, as liblog would
+static bool logdw_write(int writer, const char *tag, size_t taglen,
+                        const char *payload, size_t len) {
+    typeof_log_id_t log_id = LOG_ID_MAIN;
+    uint16_t tid = gettid();
+    unsigned char prio = ANDROID_LOG_INFO;
+    log_time realtime(CLOCK_REALTIME);
+    struct iovec vec[] = {
+        { &log_id, sizeof_log_id_t },
+        { &tid, sizeof(tid) },
+        { &realtime, sizeof(realtime) },
+        { &prio, sizeof(prio) },
+        { const_cast<char *>(tag), taglen },
+        { const_cast<char *>(payload), len },
+    };
+    return TEMP_FAILURE_RETRY(writev(writer, vec,
+                                     sizeof(vec) / sizeof(vec[0]))) >= 0;
+}
+
+// Send count raw datagrams to logdw, as liblog would, while following
+// them on logdr. Returns the end to end messages/sec, or 0 on failure.
+static unsigned long ingestion_rate(unsigned long count) {
+    int reader = socket_local_client("logdr",
+                                     ANDROID_SOCKET_NAMESPACE_RESERVED,
+                                     SOCK_SEQPACKET);
+    if (reader < 0) {
+        return 0;
+    }
+
+    char ask[80];
+    snprintf(ask, sizeof(ask), "stream lids=%d pid=%u", LOG_ID_MAIN, getpid());
+    if (write(reader, ask, strlen(ask) + 1) <= 0) {
+        close(reader);
+        return 0;
+    }
+
+    int writer = logdw_open();
+    if (writer < 0) {
+        close(reader);
+        return 0;
+    }
+
+    // unique to this run, so that other writers are never counted
+    char tag[32];
+    size_t taglen = snprintf(tag, sizeof(tag), "logd.ingestion.%u",
+                             getpid()) + 1;
+    char payload[32];
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    for (unsigned long i = 0; i < count; ++i) {
+        int len = snprintf(payload, sizeof(payload), "%lu", i) + 1;
+        if (!logdw_write(writer, tag, taglen, payload, len)) {
+            break;
+        }
+    }
+    close(writer);
+
+    unsigned long received = 0;
+    log_msg msg;
+    while (received < count) {
+        struct pollfd p = { .fd = reader, .events = POLLIN, .revents = 0 };
+        if ((poll(&p, 1, 1000) <= 0) || !(p.revents & POLLIN)) {
+            break;
+        }
+        if (recv(reader, msg.buf, sizeof(msg), 0) <= 0) {
+            break;
+        }
+        if ((msg.entry.len > taglen)
+                && !strcmp(msg.msg() + 1, tag)) {
+            ++received;
+        }
+    }
+    close(reader);
+
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    unsigned long long ns = (end.tv_sec - start.tv_sec) * NS_PER_SEC
+                          + end.tv_nsec - start.tv_nsec;
+    EXPECT_EQ(count, received);
+    return ns ? (received * NS_PER_SEC) / ns : 0;
+}
+
+static bool wait_for_logd() {
+    for (int retry = 50; retry; --retry) {
+        usleep(100000);
+        int sock = socket_local_client("logdr",
+                                       ANDROID_SOCKET_NAMESPACE_RESERVED,
+                                       SOCK_SEQPACKET);
+        if (sock >= 0) {
+            close(sock);
+            return true;
+        }
+    }
+    return false;
+}
+
+// Messages/sec accepted through logdw and delivered on logdr, with the
+// current logd.listener.batch setting. Comparing against the other
+// batching mode restarts logd, clearing the buffers and disturbing any
+// other test using it, so that is only done as root and when asked for
+// with LOGD_TEST_RESTART=1 in the environment.
+TEST(logd, ingestion) {
+    static const unsigned long count = 4000;
+
+    char batch[PROPERTY_VALUE_MAX];
+    property_get("logd.listener.batch", batch, "1");
+
+    unsigned long rate = ingestion_rate(count);
+    fprintf(stderr, "logd.listener.batch=%-4s %8lu messages/sec\n",
+            batch, rate);
+    EXPECT_NE(0UL, rate);
+
+    const char *restart = getenv("LOGD_TEST_RESTART");
+    if (!restart || strcmp(restart, "1")) {
+        fprintf(stderr, "NOTICE: set LOGD_TEST_RESTART=1 to compare"
+                        " batching modes, restarting logd\n");
+        return;
+    }
+    if (getuid() != AID_ROOT) {
+        fprintf(stderr, "WARNING: run as root to compare batching modes\n");
+        return;
+    }
+
+    const char *other = (atoi(batch) > 1) ? "1" : "32";
+    property_set("logd.listener.batch", other);
+    property_set("ctl.restart", "logd");
+    sleep(1);
+    ASSERT_TRUE(wait_for_logd());
+
+    unsigned long other_rate = ingestion_rate(count);
+    fprintf(stderr, "logd.listener.batch=%-4s %8lu messages/sec\n",
+            other, other_rate);
+    EXPECT_NE(0UL, other_rate);
+
+    property_set("logd.listener.batch", batch);
+    property_set("ctl.restart", "logd");
+    sleep(1);
+    EXPECT_TRUE(wait_for_logd());
+}
+
+// Size of the main log, as logcat -g reports it, 0 on failure
+static unsigned long main_log_size() {
+    int sock = socket_local_client("logd",
+                                   ANDROID_SOCKET_NAMESPACE_RESERVED,
+                                   SOCK_STREAM);
+    if (sock < 0) {
+        return 0;
+    }
+
+    unsigned long size = 0;
+    static const char ask[] = "getLogSize 0";
+    if (write(sock, ask, sizeof(ask)) == sizeof(ask)) {
+        char buf[32];
+        ssize_t ret = read(sock, buf, sizeof(buf) - 1);
+        if (ret > 0) {
+            buf[ret] = '\0';
+            size = strtoul(buf, NULL, 10);
+        }
+    }
+    close(sock);
+    return size;
+}
+
+// Dump the last tail entries of this process with tag, whose payloads
+// count up from 0. Returns how many came back, leaving the payload of
+// the last in *last, or -1 on error or if they were not consecutive.
+static long tail_dump(unsigned long tail, const char *tag, size_t taglen,
+                      unsigned long *last) {
+    int fd = socket_local_client("logdr",
+                                 ANDROID_SOCKET_NAMESPACE_RESERVED,
+                                 SOCK_SEQPACKET);
+    if (fd < 0) {
+        return -1;
+    }
+
+    char ask[80];
+    snprintf(ask, sizeof(ask), "dumpAndClose lids=%d tail=%lu pid=%u",
+             LOG_ID_MAIN, tail, getpid());
+    if (write(fd, ask, strlen(ask) + 1) <= 0) {
+        close(fd);
+        return -1;
+    }
+
+    long received = 0;
+    bool consecutive = true;
+    log_msg msg;
+    for (;;) {
+        struct pollfd p = { .fd = fd, .events = POLLIN, .revents = 0 };
+        if ((poll(&p, 1, 1000) <= 0) || !(p.revents & POLLIN)) {
+            break;
+        }
+        if (recv(fd, msg.buf, sizeof(msg), 0) <= 0) {
+            break;
+        }
+        if ((msg.entry.len <= taglen) || strcmp(msg.msg() + 1, tag)) {
+            continue;
+        }
+        unsigned long n = strtoul(msg.msg() + 1 + taglen, NULL, 10);
+        if (received && (n != (*last + 1))) {
+            consecutive = false;
+        }
+        *last = n;
+        ++received;
+    }
+    close(fd);
+
+    return consecutive ? received : -1;
+}
+
+// Fill the main log three times over, so that the oldest of our entries
+// are pruned, or aged into the compressed tier when
+// persist.logd.compressed_size is set, then ask for tails of them. What
+// comes back must be the newest entries and no more than asked for. The
+// larger tail is more than the hot tier can hold, with the compressed
+// tier on it has to reach into it and still end with our last entry.
+TEST(logd, tail) {
+    unsigned long size = main_log_size();
+    ASSERT_NE(0UL, size);
+
+    char tag[32];
+    size_t taglen = snprintf(tag, sizeof(tag), "logd.tail.%u",
+                             getpid()) + 1;
+    char payload[128];
+    unsigned long count = 3 * size / sizeof(payload);
+
+    int writer = logdw_open();
+    ASSERT_LE(0, writer);
+    for (unsigned long i = 0; i < count; ++i) {
+        // padded out to make up the size of the entry
+        int len = snprintf(payload, sizeof(payload), "%-100lu", i) + 1;
+        ASSERT_TRUE(logdw_write(writer, tag, taglen, payload, len));
+    }
+    close(writer);
+
+    // give logd a moment to drain logdw
+    static const unsigned long few = 10;
+    unsigned long last = 0;
+    long received = -1;
+    for (int retry = 50; retry; --retry) {
+        received = tail_dump(few, tag, taglen, &last);
+        if ((received == (long)few) && (last == (count - 1))) {
+            break;
+        }
+        usleep(100000);
+    }
+    EXPECT_EQ((long)few, received);
+    EXPECT_EQ(count - 1, last);
+
+    unsigned long many = 2 * size / sizeof(payload);
+    received = tail_dump(many, tag, taglen, &last);
+    fprintf(stderr, "tail=%lu returned %ld of %lu written\n",
+            many, received, count);
+    EXPECT_LT(0L, received);
+    EXPECT_GE((long)many, received);
+    EXPECT_EQ(count - 1, last);
+}
@@ -36,6 +36,7 @@
 #include <sys/uio.h>
 #include <unistd.h>
 
+#include <cutils/atomic.h>
 #include <cutils/fs.h>
 #include <cutils/hashmap.h>
 #include <cutils/log.h>
@@ -65,6 +66,16 @@
  * - if an op that returns a fuse_entry fails writing the reply to the
  * kernel, you must rollback the refcount to reflect the reference the
  * kernel did not actually acquire
+ * - the node tree is guarded by fuse->lock, a reader/writer lock.  Handlers
+ * that only walk the tree (path building, lookup of an existing child) take
+ * it shared, so requests on unrelated nodes run concurrently.  Anything that
+ * links, unlinks or frees a node takes it exclusive.  A node can gain a
+ * reference under the shared lock, but only loses one under the exclusive
+ * lock, so it cannot be freed while a shared holder is looking at it.
+ * - the kernel caches attributes and entries for the -a and -e timeouts, and
+ * knows to drop them when a change goes through the node itself, but not
+ * when it goes through an alias differing by case; the daemon notifies it
+ * of those, see queue_alias_invalidation_locked()
  *
  * This daemon can also derive custom filesystem permissions based on directory
  * structure when requested. These custom permissions support several features:
@@ -114,9 +125,26 @@
  * the largest possible data payload. */
 #define MAX_REQUEST_SIZE (sizeof(struct fuse_in_header) + sizeof(struct fuse_write_in) + MAX_WRITE)
 
-/* Default number of threads. */
+/* Size of the pipes of the splice data path, large enough for a whole request. */
+#define SPLICE_PIPE_SIZE (MAX_REQUEST_SIZE + PAGESIZE)
+
+/* Default number of seconds the kernel may cache attributes and entries. */
+#define DEFAULT_ATTR_TIMEOUT 10
+#define DEFAULT_ENTRY_TIMEOUT 10
+
+/* Invalidations a single request may queue for the kernel. */
+#define MAX_NOTIFY 8
+
+/* Minimum default number of threads, the default is one per online CPU. */
 #define DEFAULT_NUM_THREADS 2
 
+/* Number of children past which a directory node also hashes them by name. */
+#define CHILD_TABLE_THRESHOLD 32
+
+/* Number of entries past which a case-insensitive search of a directory in
+ * the underlying storage keeps what it read in a case_cache. */
+#define CASE_CACHE_THRESHOLD 64
+
 /* Pseudo-error constant used to indicate that no fuse status is needed
  * or that a reply has already been written. */
 #define NO_STATUS 1
@@ -158,14 +186,29 @@ typedef enum {
 
 struct handle {
     int fd;
+    struct node *node;          /* kept alive by the kernel while open */
 };
 
 struct dirhandle {
     DIR *d;
+    /* Read but did not fit in the last reply, still valid as d has not
+     * been read since. */
+    struct dirent *next;
+    /* The READDIR offset d is at: entries handed out since the rewind. */
+    __u64 pos;
+};
+
+/* Names in a directory of the underlying storage, keyed case-insensitively.
+ * Valid for as long as the directory's mtime is unchanged. */
+struct case_cache {
+    time_t mtime;
+    long mtime_nsec;
+    Hashmap* names;
 };
 
 struct node {
-    __u32 refcount;
+    /* Atomic, may be incremented under the shared lock. */
+    volatile int32_t refcount;
     __u64 nid;
     __u64 gen;
 
@@ -177,9 +220,25 @@ struct node {
     mode_t mode;
 
     struct node *next;          /* per-dir sibling list */
+    struct node *prev;
     struct node *child;         /* first contained file by this dir */
     struct node *parent;        /* containing directory */
 
+    /* Past CHILD_TABLE_THRESHOLD children, a directory also chains them
+     * into a hash table by case-folded name, sized to a power of two. */
+    struct node **child_table;
+    size_t child_table_size;
+    size_t child_count;
+    struct node *hash_next;     /* per-dir hash chain */
+    __u32 name_hash;            /* of name when added to the parent */
+
+    /* If non-null, cached listing of this directory in the underlying
+     * storage.  Guarded by fuse->case_lock. */
+    struct case_cache *case_cache;
+
+    /* If non-null, the result of get_node_path_locked(), see there. */
+    char *path;
+
     size_t namelen;
     char *name;
     /* If non-null, this is the real name of the file in the underlying storage.
@@ -199,6 +258,16 @@ static int str_hash(void *key) {
     return hashmapHash(key, strlen(key));
 }
 
+/** Hash of a string key ignoring case, agrees with str_icase_equals */
+static int str_icase_hash(void *key) {
+    const unsigned char* p = key;
+    int hash = 0;
+    while (*p) {
+        hash = hash * 31 + tolower(*p++);
+    }
+    return hash;
+}
+
 /** Test if two string keys are equal ignoring case */
 static bool str_icase_equals(void *keyA, void *keyB) {
     return strcasecmp(keyA, keyB) == 0;
@@ -214,10 +283,14 @@ static bool int_equals(void *keyA, void *keyB) {
 
 /* Global data structure shared by all fuse handlers. */
 struct fuse {
-    pthread_mutex_t lock;
+    pthread_rwlock_t lock;
+    pthread_mutex_t case_lock;
 
     __u64 next_generation;
     int fd;
+    bool splice;
+    int attr_timeout;
+    int entry_timeout;
     derive_t derive;
     bool split_perms;
     gid_t write_gid;
@@ -239,6 +312,25 @@ struct fuse_handler {
         __u8 request_buffer[MAX_REQUEST_SIZE];
         __u8 read_buffer[MAX_READ + PAGESIZE];
     };
+
+    /* When fuse->splice is set, requests are spliced from the FUSE device
+     * through request_pipe.  Only their headers are read from it; the data
+     * of a WRITE is left there, pipe_data bytes of it, for handle_write()
+     * to splice into the file.  READ replies are assembled in reply_pipe
+     * from a header and file data spliced into request_pipe.  The fds are
+     * -1 when this handler copies instead. */
+    int request_pipe[2];
+    int reply_pipe[2];
+    size_t pipe_data;
+
+    /* Invalidations to send once the reply to the request is out, as the
+     * kernel may hold locks they need until then. */
+    struct {
+        int code;               /* FUSE_NOTIFY_INVAL_INODE or _ENTRY */
+        __u64 nodeid;           /* the inode, or the parent of the entry */
+        char *name;             /* of the entry */
+    } notify[MAX_NOTIFY];
+    int notify_count;
 };
 
 static inline void *id_to_ptr(__u64 nid)
@@ -251,14 +343,17 @@ static inline __u64 ptr_to_id(void *ptr)
     return (__u64) (uintptr_t) ptr;
 }
 
+/* Requires fuse->lock held shared or exclusive. */
 static void acquire_node_locked(struct node* node)
 {
-    node->refcount++;
+    android_atomic_inc(&node->refcount);
     TRACE("ACQUIRE %p (%s) rc=%d\n", node, node->name, node->refcount);
 }
 
 static void remove_node_from_parent_locked(struct node* node);
+static void free_case_cache(struct case_cache* cache);
 
+/* Requires fuse->lock held exclusive. */
 static void release_node_locked(struct node* node)
 {
     TRACE("RELEASE %p (%s) rc=%d\n", node, node->name, node->refcount);
@@ -272,6 +367,11 @@ static void release_node_locked(struct node* node)
             memset(node->name, 0xef, node->namelen);
             free(node->name);
             free(node->actual_name);
+            free(node->child_table);
+            free(node->path);
+            if (node->case_cache) {
+                free_case_cache(node->case_cache);
+            }
             memset(node, 0xfc, sizeof(*node));
             free(node);
         }
@@ -280,28 +380,116 @@ static void release_node_locked(struct node* node)
     }
 }
 
+/* FNV-1a of the case-folded name.  Names are matched exactly, but folding
+ * puts the nodes differing only by case, aliases of the same underlying file,
+ * in the same bucket. */
+static __u32 hash_name(const char* name)
+{
+    __u32 hash = 2166136261u;
+    while (*name) {
+        hash ^= tolower((unsigned char) *name++);
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+static void child_table_insert(struct node* parent, struct node* node)
+{
+    struct node** bucket = &parent->child_table[
+            node->name_hash & (parent->child_table_size - 1)];
+    node->hash_next = *bucket;
+    *bucket = node;
+}
+
+static void child_table_remove(struct node* parent, struct node* node)
+{
+    struct node** bucket = &parent->child_table[
+            node->name_hash & (parent->child_table_size - 1)];
+    while (*bucket != node) {
+        bucket = &(*bucket)->hash_next;
+    }
+    *bucket = node->hash_next;
+    node->hash_next = NULL;
+}
+
+/* Rehashes all children of parent into a new table with room for twice as
+ * many.  Returns false, keeping the old table if any, if out of memory. */
+static bool child_table_rebuild(struct node* parent)
+{
+    size_t size = CHILD_TABLE_THRESHOLD * 2;
+    while (size < parent->child_count * 2) {
+        size *= 2;
+    }
+    struct node** table = calloc(size, sizeof(*table));
+    if (!table) {
+        return false;
+    }
+    free(parent->child_table);
+    parent->child_table = table;
+    parent->child_table_size = size;
+
+    struct node* child;
+    for (child = parent->child; child; child = child->next) {
+        child_table_insert(parent, child);
+    }
+    return true;
+}
+
+/* Requires fuse->lock held exclusive. */
 static void add_node_to_parent_locked(struct node *node, struct node *parent) {
     node->parent = parent;
+    node->prev = NULL;
     node->next = parent->child;
+    if (parent->child) {
+        parent->child->prev = node;
+    }
     parent->child = node;
+    parent->child_count++;
+
+    /* the name may have changed since it was last hashed, by a rename */
+    node->name_hash = hash_name(node->name);
+    if (parent->child_table && parent->child_count <= parent->child_table_size) {
+        child_table_insert(parent, node);
+    } else if (parent->child_count > CHILD_TABLE_THRESHOLD
+            && !child_table_rebuild(parent) && parent->child_table) {
+        child_table_insert(parent, node);
+    }
     acquire_node_locked(parent);
 }
 
+/* Requires fuse->lock held exclusive. */
 static void remove_node_from_parent_locked(struct node* node)
 {
     if (node->parent) {
-        if (node->parent->child == node) {
-            node->parent->child = node->parent->child->next;
+        if (node->parent->child_table) {
+            child_table_remove(node->parent, node);
+        }
+        if (node->prev) {
+            node->prev->next = node->next;
         } else {
-            struct node *node2;
-            node2 = node->parent->child;
-            while (node2->next != node)
-                node2 = node2->next;
-            node2->next = node->next;
+            node->parent->child = node->next;
+        }
+        if (node->next) {
+            node->next->prev = node->prev;
         }
+        node->parent->child_count--;
         release_node_locked(node->parent);
         node->parent = NULL;
         node->next = NULL;
+        node->prev = NULL;
+    }
+}
+
+/* Frees the cached paths of node and all below it, after it moved.
+ * Requires fuse->lock held exclusive. */
+static void forget_node_paths_locked(struct node* node)
+{
+    struct node* child;
+
+    free(node->path);
+    node->path = NULL;
+    for (child = node->child; child; child = child->next) {
+        forget_node_paths_locked(child);
     }
 }
 
@@ -309,8 +497,23 @@ static void remove_node_from_parent_locked(struct node* node)
  *
  * Populates 'buf' with the path and returns the length of the path on success,
  * or returns -1 if the path is too long for the provided buffer.
+ *
+ * The path is cached on the node, so it is only built up from the ancestors
+ * once.  Under the shared lock a cached path may be installed but is never
+ * changed or freed; that only happens under the exclusive lock, when the
+ * node or one of its ancestors is renamed, or the node is destroyed.
  */
 static ssize_t get_node_path_locked(struct node* node, char* buf, size_t bufsize) {
+    const char* cached = *(char* volatile*) &node->path;
+    if (cached) {
+        size_t len = strlen(cached);
+        if (bufsize < len + 1) {
+            return -1;
+        }
+        memcpy(buf, cached, len + 1);
+        return len;
+    }
+
     const char* name;
     size_t namelen;
     if (node->graft_path) {
@@ -338,7 +541,130 @@ static ssize_t get_node_path_locked(struct node* node, char* buf, size_t bufsize
     }
 
     memcpy(buf + pathlen, name, namelen + 1); /* include trailing \0 */
-    return pathlen + namelen;
+    pathlen += namelen;
+
+    char* path = malloc(pathlen + 1);
+    if (path) {
+        memcpy(path, buf, pathlen + 1);
+        /* lost a race with another thread caching the same path */
+        if (!__sync_bool_compare_and_swap(&node->path, NULL, path)) {
+            free(path);
+        }
+    }
+    return pathlen;
+}
+
+static bool free_case_cache_name(void *key, void *value, void *context) {
+    free(key);
+    return true;
+}
+
+static void free_case_cache(struct case_cache* cache)
+{
+    hashmapForEach(cache->names, free_case_cache_name, NULL);
+    hashmapFree(cache->names);
+    free(cache);
+}
+
+/* Reads dir, whose stat is s, from the start into a new case_cache.
+ * Returns NULL if out of memory. */
+static struct case_cache* build_case_cache(DIR* dir, const struct stat* s, size_t count)
+{
+    struct case_cache* cache = malloc(sizeof(struct case_cache));
+    if (!cache) {
+        return NULL;
+    }
+    cache->mtime = s->st_mtime;
+    cache->mtime_nsec = s->st_mtime_nsec;
+    cache->names = hashmapCreate(count, str_icase_hash, str_icase_equals);
+    if (!cache->names) {
+        free(cache);
+        return NULL;
+    }
+
+    struct dirent* entry;
+    rewinddir(dir);
+    while ((entry = readdir(dir))) {
+        /* like the search, the first of names differing only by case wins */
+        if (hashmapContainsKey(cache->names, entry->d_name)) {
+            continue;
+        }
+        char* name = strdup(entry->d_name);
+        errno = 0;
+        if (!name || (!hashmapPut(cache->names, name, name) && errno == ENOMEM)) {
+            free(name);
+            free_case_cache(cache);
+            return NULL;
+        }
+    }
+    return cache;
+}
+
+/* Replaces the name at 'actual' with the first name in the directory at path
+ * that matches it ignoring case, if any.
+ *
+ * Large directories keep what was read in parent->case_cache, so later misses
+ * cost a stat() rather than a full scan.  The cache is dropped when the mtime
+ * of the directory changes, and only built when the mtime is old enough that
+ * a change within the same timestamp granule cannot go unnoticed. */
+static void find_case_insensitive(struct fuse* fuse, struct node* parent,
+        const char* path, char* actual, size_t namelen)
+{
+    struct case_cache* cache;
+    struct stat s;
+    bool have_stat = !stat(path, &s);
+
+    pthread_mutex_lock(&fuse->case_lock);
+    cache = parent->case_cache;
+    if (cache) {
+        if (have_stat && s.st_mtime == cache->mtime
+                && (long) s.st_mtime_nsec == cache->mtime_nsec) {
+            const char* match = hashmapGet(cache->names, actual);
+            if (match) {
+                memcpy(actual, match, namelen);
+            }
+            pthread_mutex_unlock(&fuse->case_lock);
+            return;
+        }
+        parent->case_cache = NULL;
+        free_case_cache(cache);
+    }
+    pthread_mutex_unlock(&fuse->case_lock);
+
+    struct dirent* entry;
+    DIR* dir = opendir(path);
+    if (!dir) {
+        ERROR("opendir %s failed: %s\n", path, strerror(errno));
+        return;
+    }
+    size_t count = 0;
+    bool matched = false;
+    while ((entry = readdir(dir))) {
+        count++;
+        if (!matched && !strcasecmp(entry->d_name, actual)) {
+            /* we have a match - replace the name, don't need to copy the null again */
+            memcpy(actual, entry->d_name, namelen);
+            matched = true;
+        }
+    }
+
+    cache = NULL;
+    if (have_stat && count > CASE_CACHE_THRESHOLD && s.st_mtime + 1 < time(NULL)) {
+        cache = build_case_cache(dir, &s, count);
+    }
+    closedir(dir);
+
+    if (cache) {
+        pthread_mutex_lock(&fuse->case_lock);
+        if (!parent->case_cache) {
+            parent->case_cache = cache;
+            cache = NULL;
+        }
+        pthread_mutex_unlock(&fuse->case_lock);
+        if (cache) {
+            free_case_cache(cache);
+        }
+    }
 }
 
 /* Finds the absolute path of a file within a given directory.
@@ -349,8 +675,8 @@ static ssize_t get_node_path_locked(struct node* node, char* buf, size_t bufsize
  * Populates 'buf' with the path and returns the actual name (within 'buf') on success,
  * or returns NULL if the path is too long for the provided buffer.
  */
-static char* find_file_within(const char* path, const char* name,
-        char* buf, size_t bufsize, int search)
+static char* find_file_within(struct fuse* fuse, struct node* parent,
+        const char* path, const char* name, char* buf, size_t bufsize, int search)
 {
     size_t pathlen = strlen(path);
     size_t namelen = strlen(name);
@@ -367,20 +693,7 @@ static char* find_file_within(const char* path, const char* name,
     memcpy(actual, name, namelen + 1);
 
     if (search && access(buf, F_OK)) {
-        struct dirent* entry;
-        DIR* dir = opendir(path);
-        if (!dir) {
-            ERROR("opendir %s failed: %s\n", path, strerror(errno));
-            return actual;
-        }
-        while ((entry = readdir(dir))) {
-            if (!strcasecmp(entry->d_name, name)) {
-                /* we have a match - replace the name, don't need to copy the null again */
-                memcpy(actual, entry->d_name, namelen);
-                break;
-            }
-        }
-        closedir(dir);
+        find_case_insensitive(fuse, parent, path, actual, namelen);
     }
     return actual;
 }
@@ -569,6 +882,7 @@ static bool check_caller_access_to_node(struct fuse* fuse,
     return check_caller_access_to_name(fuse, hdr, node->parent, node->name, mode, has_rw);
 }
 
+/* Requires fuse->lock held exclusive. */
 struct node *create_node_locked(struct fuse* fuse,
         struct node *parent, const char *name, const char* actual_name)
 {
@@ -604,6 +918,7 @@ struct node *create_node_locked(struct fuse* fuse,
     return node;
 }
 
+/* Requires fuse->lock held exclusive. */
 static int rename_node_locked(struct node *node, const char *name,
         const char* actual_name)
 {
@@ -666,6 +981,16 @@ static struct node* lookup_node_and_path_by_id_locked(struct fuse* fuse, __u64 n
 
 static struct node *lookup_child_by_name_locked(struct node *node, const char *name)
 {
+    if (node->child_table) {
+        __u32 hash = hash_name(name);
+        for (node = node->child_table[hash & (node->child_table_size - 1)];
+                node; node = node->hash_next) {
+            if (node->name_hash == hash && !strcmp(name, node->name)) {
+                return node;
+            }
+        }
+        return 0;
+    }
     for (node = node->child; node; node = node->next) {
         /* use exact string comparison, nodes that differ by case
          * must be considered distinct even if they refer to the same
@@ -678,6 +1003,7 @@ static struct node *lookup_child_by_name_locked(struct node *node, const char *n
     return 0;
 }
 
+/* Requires fuse->lock held exclusive. */
 static struct node* acquire_or_create_child_locked(
         struct fuse* fuse, struct node* parent,
         const char* name, const char* actual_name)
@@ -693,9 +1019,13 @@ static struct node* acquire_or_create_child_locked(
 
 static void fuse_init(struct fuse *fuse, int fd, const char *source_path,
         gid_t write_gid, derive_t derive, bool split_perms) {
-    pthread_mutex_init(&fuse->lock, NULL);
+    pthread_rwlock_init(&fuse->lock, NULL);
+    pthread_mutex_init(&fuse->case_lock, NULL);
 
     fuse->fd = fd;
+    fuse->splice = false;
+    fuse->attr_timeout = DEFAULT_ATTR_TIMEOUT;
+    fuse->entry_timeout = DEFAULT_ENTRY_TIMEOUT;
     fuse->next_generation = 0;
     fuse->derive = derive;
     fuse->split_perms = split_perms;
@@ -752,7 +1082,8 @@ static void fuse_status(struct fuse *fuse, __u64 unique, int err)
     write(fuse->fd, &hdr, sizeof(hdr));
 }
 
-static void fuse_reply(struct fuse *fuse, __u64 unique, void *data, int len)
+/* Returns -1 if the reply could not be written. */
+static int fuse_reply(struct fuse *fuse, __u64 unique, void *data, int len)
 {
     struct fuse_out_header hdr;
     struct iovec vec[2];
@@ -770,38 +1101,218 @@ static void fuse_reply(struct fuse *fuse, __u64 unique, void *data, int len)
     res = writev(fuse->fd, vec, 2);
     if (res < 0) {
         ERROR("*** REPLY FAILED *** %d\n", errno);
+        return -1;
+    }
+    return 0;
+}
+
+/* Takes a reference on the child of parent called name, creating its node
+ * if needed, and fills out an entry for it with the attributes in s.
+ * Returns -ENOMEM on failure. */
+static int acquire_child_entry(struct fuse* fuse, struct node* parent,
+        const char* name, const char* actual_name, const struct stat* s,
+        struct fuse_entry_out* out)
+{
+    struct node* node;
+
+    /* Most lookups find the node already in the tree, only creating
+     * it needs the lock exclusive. */
+    pthread_rwlock_rdlock(&fuse->lock);
+    node = lookup_child_by_name_locked(parent, name);
+    if (node) {
+        acquire_node_locked(node);
+    } else {
+        pthread_rwlock_unlock(&fuse->lock);
+        pthread_rwlock_wrlock(&fuse->lock);
+        node = acquire_or_create_child_locked(fuse, parent, name, actual_name);
+        if (!node) {
+            pthread_rwlock_unlock(&fuse->lock);
+            return -ENOMEM;
+        }
     }
+    memset(out, 0, sizeof(*out));
+    attr_from_stat(&out->attr, s, node);
+    out->attr_valid = fuse->attr_timeout;
+    out->entry_valid = fuse->entry_timeout;
+    out->nodeid = node->nid;
+    out->generation = node->gen;
+    pthread_rwlock_unlock(&fuse->lock);
+    return 0;
 }
 
 static int fuse_reply_entry(struct fuse* fuse, __u64 unique,
         struct node* parent, const char* name, const char* actual_name,
         const char* path)
 {
-    struct node* node;
     struct fuse_entry_out out;
     struct stat s;
+    int res;
 
     if (lstat(path, &s) < 0) {
         return -errno;
     }
-
-    pthread_mutex_lock(&fuse->lock);
-    node = acquire_or_create_child_locked(fuse, parent, name, actual_name);
-    if (!node) {
-        pthread_mutex_unlock(&fuse->lock);
-        return -ENOMEM;
+    res = acquire_child_entry(fuse, parent, name, actual_name, &s, &out);
+    if (res < 0) {
+        return res;
     }
-    memset(&out, 0, sizeof(out));
-    attr_from_stat(&out.attr, &s, node);
-    out.attr_valid = 10;
-    out.entry_valid = 10;
-    out.nodeid = node->nid;
-    out.generation = node->gen;
-    pthread_mutex_unlock(&fuse->lock);
     fuse_reply(fuse, unique, &out, sizeof(out));
     return NO_STATUS;
 }
 
+static void close_splice_pipes(struct fuse_handler* handler)
+{
+    int i;
+    for (i = 0; i < 2; i++) {
+        if (handler->request_pipe[i] >= 0) {
+            close(handler->request_pipe[i]);
+            handler->request_pipe[i] = -1;
+        }
+        if (handler->reply_pipe[i] >= 0) {
+            close(handler->reply_pipe[i]);
+            handler->reply_pipe[i] = -1;
+        }
+    }
+    handler->pipe_data = 0;
+}
+
+/* Sets up the pipes of the splice data path.  Returns false, leaving the
+ * handler to copy, if they cannot be made large enough. */
+static bool open_splice_pipes(struct fuse_handler* handler)
+{
+    if (pipe(handler->request_pipe) < 0) {
+        handler->request_pipe[0] = handler->request_pipe[1] = -1;
+        return false;
+    }
+    if (pipe(handler->reply_pipe) < 0) {
+        handler->reply_pipe[0] = handler->reply_pipe[1] = -1;
+        close_splice_pipes(handler);
+        return false;
+    }
+    if (fcntl(handler->request_pipe[0], F_SETPIPE_SZ, SPLICE_PIPE_SIZE) < 0
+            || fcntl(handler->reply_pipe[0], F_SETPIPE_SZ, SPLICE_PIPE_SIZE) < 0) {
+        close_splice_pipes(handler);
+        return false;
+    }
+    return true;
+}
+
+/* Empties the pipes after an error left them holding an unknown amount. */
+static void reset_splice_pipes(struct fuse_handler* handler)
+{
+    close_splice_pipes(handler);
+    if (!open_splice_pipes(handler)) {
+        ERROR("[%d] cannot reopen splice pipes, copying instead: %s\n",
+                handler->token, strerror(errno));
+    }
+}
+
+/* Reads exactly len bytes of a spliced request out of the request pipe. */
+static bool read_request_pipe(struct fuse_handler* handler, void* buf, size_t len)
+{
+    while (len) {
+        ssize_t res = read(handler->request_pipe[0], buf, len);
+        if (res < 0 && errno == EINTR) {
+            continue;
+        }
+        if (res <= 0) {
+            return false;
+        }
+        buf = (char*) buf + res;
+        len -= res;
+    }
+    return true;
+}
+
+/* Replies to a READ with up to size bytes of fd at offset.  The data is
+ * spliced into the request pipe, then after a header into the reply pipe,
+ * and from there to the FUSE device, so it never passes through userspace.
+ * Returns false, having sent nothing, if fd cannot be spliced from and the
+ * caller should copy instead.  Otherwise sets *res to the status. */
+static bool splice_read_reply(struct fuse* fuse, struct fuse_handler* handler,
+        __u64 unique, int fd, __u32 size, __u64 offset, int* res)
+{
+    struct fuse_out_header hdr;
+    loff_t off = offset;
+    size_t len = 0;
+    size_t moved = 0;
+    ssize_t n = 0;
+
+    while (len < size) {
+        n = splice(fd, &off, handler->request_pipe[1], NULL, size - len, SPLICE_F_MOVE);
+        if (n <= 0) {
+            break;
+        }
+        len += n;
+    }
+    if (n < 0 && !len) {
+        if (errno == EINVAL) {
+            return false;
+        }
+        *res = -errno;
+        return true;
+    }
+
+    hdr.len = sizeof(hdr) + len;
+    hdr.error = 0;
+    hdr.unique = unique;
+    if (write(handler->reply_pipe[1], &hdr, sizeof(hdr)) != sizeof(hdr)) {
+        goto error;
+    }
+    while (moved < len) {
+        n = splice(handler->request_pipe[0], NULL, handler->reply_pipe[1], NULL,
+                len - moved, SPLICE_F_MOVE);
+        if (n <= 0) {
+            goto error;
+        }
+        moved += n;
+    }
+    /* the device takes a reply in a single splice, as it would a write */
+    n = splice(handler->reply_pipe[0], NULL, fuse->fd, NULL, hdr.len, SPLICE_F_MOVE);
+    if (n != (ssize_t) hdr.len) {
+        goto error;
+    }
+    *res = NO_STATUS;
+    return true;
+
+error:
+    ERROR("*** SPLICE REPLY FAILED *** %d\n", errno);
+    reset_splice_pipes(handler);
+    *res = -EIO;
+    return true;
+}
+
+/* Splices the data of a WRITE left in the request pipe into fd at offset.
+ * Returns the number of bytes written, or -1 with errno set.  If fd cannot
+ * be spliced to at all, the data is left in the pipe for the caller. */
+static ssize_t splice_write(struct fuse_handler* handler, int fd, __u64 offset)
+{
+    loff_t off = offset;
+    size_t done = 0;
+    ssize_t n = 0;
+
+    while (done < handler->pipe_data) {
+        n = splice(handler->request_pipe[0], NULL, fd, &off,
+                handler->pipe_data - done, SPLICE_F_MOVE);
+        if (n <= 0) {
+            break;
+        }
+        done += n;
+    }
+    if (done < handler->pipe_data) {
+        int saved_errno = (n < 0) ? errno : EIO;
+        if (!done && saved_errno == EINVAL) {
+            return -1;
+        }
+        reset_splice_pipes(handler);
+        if (!done) {
+            errno = saved_errno;
+            return -1;
+        }
+    }
+    handler->pipe_data = 0;
+    return done;
+}
+
 static int fuse_reply_attr(struct fuse* fuse, __u64 unique, const struct node* node,
         const char* path)
 {
@@ -813,11 +1324,98 @@ static int fuse_reply_attr(struct fuse* fuse, __u64 unique, const struct node* n
     }
     memset(&out, 0, sizeof(out));
     attr_from_stat(&out.attr, &s, node);
-    out.attr_valid = 10;
+    out.attr_valid = fuse->attr_timeout;
     fuse_reply(fuse, unique, &out, sizeof(out));
     return NO_STATUS;
 }
 
+/* The kernel caches nodes whose names differ only by case apart, although
+ * they are the same underlying file, and keeps their attributes, data and
+ * entries for up to attr_timeout and entry_timeout seconds.  When a request
+ * changes one of them, queues invalidation of the others under parent that
+ * are named like name: FUSE_NOTIFY_INVAL_INODE drops their attributes and
+ * cached data, FUSE_NOTIFY_INVAL_ENTRY their entries.  The node named
+ * exactly name is the one the kernel knows changed.
+ * Requires fuse->lock held. */
+static void queue_alias_invalidation_locked(struct fuse_handler* handler,
+        struct node* parent, const char* name, int code)
+{
+    __u32 hash = hash_name(name);
+    struct node* node;
+
+    if (parent->child_table) {
+        node = parent->child_table[hash & (parent->child_table_size - 1)];
+    } else {
+        node = parent->child;
+    }
+    for (; node; node = parent->child_table ? node->hash_next : node->next) {
+        if (strcasecmp(name, node->name) || !strcmp(name, node->name)) {
+            continue;
+        }
+        if (handler->notify_count == MAX_NOTIFY) {
+            /* absurdly many aliases, the rest time out as before */
+            return;
+        }
+        if (code == FUSE_NOTIFY_INVAL_ENTRY) {
+            char* entry = strdup(node->name);
+            if (!entry) {
+                return;
+            }
+            handler->notify[handler->notify_count].nodeid = parent->nid;
+            handler->notify[handler->notify_count].name = entry;
+        } else {
+            handler->notify[handler->notify_count].nodeid = node->nid;
+            handler->notify[handler->notify_count].name = NULL;
+        }
+        handler->notify[handler->notify_count].code = code;
+        handler->notify_count++;
+    }
+}
+
+/* Sends the invalidations queued by the last request. */
+static void send_notifications(struct fuse* fuse, struct fuse_handler* handler)
+{
+    int i;
+
+    for (i = 0; i < handler->notify_count; i++) {
+        struct fuse_out_header hdr;
+        struct fuse_notify_inval_inode_out inode;
+        struct fuse_notify_inval_entry_out entry;
+        struct iovec vec[3];
+        int count;
+
+        hdr.error = handler->notify[i].code;
+        hdr.unique = 0;
+        vec[0].iov_base = &hdr;
+        vec[0].iov_len = sizeof(hdr);
+        if (handler->notify[i].code == FUSE_NOTIFY_INVAL_ENTRY) {
+            memset(&entry, 0, sizeof(entry));
+            entry.parent = handler->notify[i].nodeid;
+            entry.namelen = strlen(handler->notify[i].name);
+            vec[1].iov_base = &entry;
+            vec[1].iov_len = sizeof(entry);
+            vec[2].iov_base = handler->notify[i].name;
+            vec[2].iov_len = entry.namelen + 1;
+            count = 3;
+        } else {
+            memset(&inode, 0, sizeof(inode));
+            inode.ino = handler->notify[i].nodeid;
+            vec[1].iov_base = &inode;
+            vec[1].iov_len = sizeof(inode);
+            count = 2;
+        }
+        hdr.len = vec[0].iov_len + vec[1].iov_len + (count > 2 ? vec[2].iov_len : 0);
+
+        /* fails harmlessly with ENOENT if the kernel no longer holds it */
+        if (writev(fuse->fd, vec, count) < 0 && errno != ENOENT) {
+            TRACE("[%d] notify %d failed: %s\n", handler->token,
+                    handler->notify[i].code, strerror(errno));
+        }
+        free(handler->notify[i].name);
+    }
+    handler->notify_count = 0;
+}
+
 static int handle_lookup(struct fuse* fuse, struct fuse_handler* handler,
         const struct fuse_in_header *hdr, const char* name)
 {
@@ -826,14 +1424,14 @@ static int handle_lookup(struct fuse* fuse, struct fuse_handler* handler,
     char child_path[PATH_MAX];
     const char* actual_name;
 
-    pthread_mutex_lock(&fuse->lock);
+    pthread_rwlock_rdlock(&fuse->lock);
     parent_node = lookup_node_and_path_by_id_locked(fuse, hdr->nodeid,
             parent_path, sizeof(parent_path));
     TRACE("[%d] LOOKUP %s @ %"PRIx64" (%s)\n", handler->token, name, hdr->nodeid,
         parent_node ? parent_node->name : "?");
-    pthread_mutex_unlock(&fuse->lock);
+    pthread_rwlock_unlock(&fuse->lock);
 
-    if (!parent_node || !(actual_name = find_file_within(parent_path, name,
+    if (!parent_node || !(actual_name = find_file_within(fuse, parent_node, parent_path, name,
             child_path, sizeof(child_path), 1))) {
         return -ENOENT;
     }
@@ -849,7 +1447,7 @@ static int handle_forget(struct fuse* fuse, struct fuse_handler* handler,
 {
     struct node* node;
 
-    pthread_mutex_lock(&fuse->lock);
+    pthread_rwlock_wrlock(&fuse->lock);
     node = lookup_node_by_id_locked(fuse, hdr->nodeid);
     TRACE("[%d] FORGET #%"PRIu64" @ %"PRIx64" (%s)\n", handler->token, req->nlookup,
             hdr->nodeid, node ? node->name : "?");
@@ -859,7 +1457,7 @@ static int handle_forget(struct fuse* fuse, struct fuse_handler* handler,
             release_node_locked(node);
         }
     }
-    pthread_mutex_unlock(&fuse->lock);
+    pthread_rwlock_unlock(&fuse->lock);
     return NO_STATUS; /* no reply */
 }
 
@@ -869,11 +1467,11 @@ static int handle_getattr(struct fuse* fuse, struct fuse_handler* handler,
     struct node* node;
     char path[PATH_MAX];
 
-    pthread_mutex_lock(&fuse->lock);
+    pthread_rwlock_rdlock(&fuse->lock);
     node = lookup_node_and_path_by_id_locked(fuse, hdr->nodeid, path, sizeof(path));
     TRACE("[%d] GETATTR flags=%x fh=%"PRIx64" @ %"PRIx64" (%s)\n", handler->token,
             req->getattr_flags, req->fh, hdr->nodeid, node ? node->name : "?");
-    pthread_mutex_unlock(&fuse->lock);
+    pthread_rwlock_unlock(&fuse->lock);
 
     if (!node) {
         return -ENOENT;
@@ -893,12 +1491,12 @@ static int handle_setattr(struct fuse* fuse, struct fuse_handler* handler,
     char path[PATH_MAX];
     struct timespec times[2];
 
-    pthread_mutex_lock(&fuse->lock);
+    pthread_rwlock_rdlock(&fuse->lock);
     has_rw = get_caller_has_rw_locked(fuse, hdr);
     node = lookup_node_and_path_by_id_locked(fuse, hdr->nodeid, path, sizeof(path));
     TRACE("[%d] SETATTR fh=%"PRIx64" valid=%x @ %"PRIx64" (%s)\n", handler->token,
             req->fh, req->valid, hdr->nodeid, node ? node->name : "?");
-    pthread_mutex_unlock(&fuse->lock);
+    pthread_rwlock_unlock(&fuse->lock);
 
     if (!node) {
         return -ENOENT;
@@ -945,6 +1543,13 @@ static int handle_setattr(struct fuse* fuse, struct fuse_handler* handler,
             return -errno;
         }
     }
+
+    pthread_rwlock_rdlock(&fuse->lock);
+    if (node->parent) {
+        queue_alias_invalidation_locked(handler, node->parent, node->name,
+                FUSE_NOTIFY_INVAL_INODE);
+    }
+    pthread_rwlock_unlock(&fuse->lock);
     return fuse_reply_attr(fuse, hdr->unique, node, path);
 }
 
@@ -957,15 +1562,15 @@ static int handle_mknod(struct fuse* fuse, struct fuse_handler* handler,
     char child_path[PATH_MAX];
     const char* actual_name;
 
-    pthread_mutex_lock(&fuse->lock);
+    pthread_rwlock_rdlock(&fuse->lock);
     has_rw = get_caller_has_rw_locked(fuse, hdr);
     parent_node = lookup_node_and_path_by_id_locked(fuse, hdr->nodeid,
             parent_path, sizeof(parent_path));
     TRACE("[%d] MKNOD %s 0%o @ %"PRIx64" (%s)\n", handler->token,
             name, req->mode, hdr->nodeid, parent_node ? parent_node->name : "?");
-    pthread_mutex_unlock(&fuse->lock);
+    pthread_rwlock_unlock(&fuse->lock);
 
-    if (!parent_node || !(actual_name = find_file_within(parent_path, name,
+    if (!parent_node || !(actual_name = find_file_within(fuse, parent_node, parent_path, name,
             child_path, sizeof(child_path), 1))) {
         return -ENOENT;
     }
@@ -988,15 +1593,15 @@ static int handle_mkdir(struct fuse* fuse, struct fuse_handler* handler,
     char child_path[PATH_MAX];
     const char* actual_name;
 
-    pthread_mutex_lock(&fuse->lock);
+    pthread_rwlock_rdlock(&fuse->lock);
     has_rw = get_caller_has_rw_locked(fuse, hdr);
     parent_node = lookup_node_and_path_by_id_locked(fuse, hdr->nodeid,
             parent_path, sizeof(parent_path));
     TRACE("[%d] MKDIR %s 0%o @ %"PRIx64" (%s)\n", handler->token,
             name, req->mode, hdr->nodeid, parent_node ? parent_node->name : "?");
-    pthread_mutex_unlock(&fuse->lock);
+    pthread_rwlock_unlock(&fuse->lock);
 
-    if (!parent_node || !(actual_name = find_file_within(parent_path, name,
+    if (!parent_node || !(actual_name = find_file_within(fuse, parent_node, parent_path, name,
             child_path, sizeof(child_path), 1))) {
         return -ENOENT;
     }
@@ -1037,15 +1642,15 @@ static int handle_unlink(struct fuse* fuse, struct fuse_handler* handler,
     char parent_path[PATH_MAX];
     char child_path[PATH_MAX];
 
-    pthread_mutex_lock(&fuse->lock);
+    pthread_rwlock_rdlock(&fuse->lock);
     has_rw = get_caller_has_rw_locked(fuse, hdr);
     parent_node = lookup_node_and_path_by_id_locked(fuse, hdr->nodeid,
             parent_path, sizeof(parent_path));
     TRACE("[%d] UNLINK %s @ %"PRIx64" (%s)\n", handler->token,
             name, hdr->nodeid, parent_node ? parent_node->name : "?");
-    pthread_mutex_unlock(&fuse->lock);
+    pthread_rwlock_unlock(&fuse->lock);
 
-    if (!parent_node || !find_file_within(parent_path, name,
+    if (!parent_node || !find_file_within(fuse, parent_node, parent_path, name,
             child_path, sizeof(child_path), 1)) {
         return -ENOENT;
     }
@@ -1055,6 +1660,10 @@ static int handle_unlink(struct fuse* fuse, struct fuse_handler* handler,
     if (unlink(child_path) < 0) {
         return -errno;
     }
+
+    pthread_rwlock_rdlock(&fuse->lock);
+    queue_alias_invalidation_locked(handler, parent_node, name, FUSE_NOTIFY_INVAL_ENTRY);
+    pthread_rwlock_unlock(&fuse->lock);
     return 0;
 }
 
@@ -1066,15 +1675,15 @@ static int handle_rmdir(struct fuse* fuse, struct fuse_handler* handler,
     char parent_path[PATH_MAX];
     char child_path[PATH_MAX];
 
-    pthread_mutex_lock(&fuse->lock);
+    pthread_rwlock_rdlock(&fuse->lock);
     has_rw = get_caller_has_rw_locked(fuse, hdr);
     parent_node = lookup_node_and_path_by_id_locked(fuse, hdr->nodeid,
             parent_path, sizeof(parent_path));
     TRACE("[%d] RMDIR %s @ %"PRIx64" (%s)\n", handler->token,
             name, hdr->nodeid, parent_node ? parent_node->name : "?");
-    pthread_mutex_unlock(&fuse->lock);
+    pthread_rwlock_unlock(&fuse->lock);
 
-    if (!parent_node || !find_file_within(parent_path, name,
+    if (!parent_node || !find_file_within(fuse, parent_node, parent_path, name,
             child_path, sizeof(child_path), 1)) {
         return -ENOENT;
     }
@@ -1084,6 +1693,10 @@ static int handle_rmdir(struct fuse* fuse, struct fuse_handler* handler,
     if (rmdir(child_path) < 0) {
         return -errno;
     }
+
+    pthread_rwlock_rdlock(&fuse->lock);
+    queue_alias_invalidation_locked(handler, parent_node, name, FUSE_NOTIFY_INVAL_ENTRY);
+    pthread_rwlock_unlock(&fuse->lock);
     return 0;
 }
 
@@ -1102,7 +1715,7 @@ static int handle_rename(struct fuse* fuse, struct fuse_handler* handler,
     const char* new_actual_name;
     int res;
 
-    pthread_mutex_lock(&fuse->lock);
+    pthread_rwlock_rdlock(&fuse->lock);
     has_rw = get_caller_has_rw_locked(fuse, hdr);
     old_parent_node = lookup_node_and_path_by_id_locked(fuse, hdr->nodeid,
             old_parent_path, sizeof(old_parent_path));
@@ -1131,7 +1744,7 @@ static int handle_rename(struct fuse* fuse, struct fuse_handler* handler,
         goto lookup_error;
     }
     acquire_node_locked(child_node);
-    pthread_mutex_unlock(&fuse->lock);
+    pthread_rwlock_unlock(&fuse->lock);
 
     /* Special case for renaming a file where destination is same path
      * differing only by case.  In this case we don't want to look for a case
@@ -1139,7 +1752,7 @@ static int handle_rename(struct fuse* fuse, struct fuse_handler* handler,
      */
     int search = old_parent_node != new_parent_node
             || strcasecmp(old_name, new_name);
-    if (!(new_actual_name = find_file_within(new_parent_path, new_name,
+    if (!(new_actual_name = find_file_within(fuse, new_parent_node, new_parent_path, new_name,
             new_child_path, sizeof(new_child_path), search))) {
         res = -ENOENT;
         goto io_error;
@@ -1152,20 +1765,25 @@ static int handle_rename(struct fuse* fuse, struct fuse_handler* handler,
         goto io_error;
     }
 
-    pthread_mutex_lock(&fuse->lock);
+    pthread_rwlock_wrlock(&fuse->lock);
     res = rename_node_locked(child_node, new_name, new_actual_name);
     if (!res) {
         remove_node_from_parent_locked(child_node);
         add_node_to_parent_locked(child_node, new_parent_node);
     }
+    forget_node_paths_locked(child_node);
+    queue_alias_invalidation_locked(handler, old_parent_node, old_name,
+            FUSE_NOTIFY_INVAL_ENTRY);
+    queue_alias_invalidation_locked(handler, new_parent_node, new_name,
+            FUSE_NOTIFY_INVAL_ENTRY);
     goto done;
 
 io_error:
-    pthread_mutex_lock(&fuse->lock);
+    pthread_rwlock_wrlock(&fuse->lock);
 done:
     release_node_locked(child_node);
 lookup_error:
-    pthread_mutex_unlock(&fuse->lock);
+    pthread_rwlock_unlock(&fuse->lock);
     return res;
 }
 
@@ -1189,12 +1807,12 @@ static int handle_open(struct fuse* fuse, struct fuse_handler* handler,
     struct fuse_open_out out;
     struct handle *h;
 
-    pthread_mutex_lock(&fuse->lock);
+    pthread_rwlock_rdlock(&fuse->lock);
     has_rw = get_caller_has_rw_locked(fuse, hdr);
     node = lookup_node_and_path_by_id_locked(fuse, hdr->nodeid, path, sizeof(path));
     TRACE("[%d] OPEN 0%o @ %"PRIx64" (%s)\n", handler->token,
             req->flags, hdr->nodeid, node ? node->name : "?");
-    pthread_mutex_unlock(&fuse->lock);
+    pthread_rwlock_unlock(&fuse->lock);
 
     if (!node) {
         return -ENOENT;
@@ -1208,6 +1826,7 @@ static int handle_open(struct fuse* fuse, struct fuse_handler* handler,
         return -ENOMEM;
     }
     TRACE("[%d] OPEN %s\n", handler->token, path);
+    h->node = node;
     h->fd = open(path, req->flags);
     if (h->fd < 0) {
         free(h);
@@ -1239,6 +1858,10 @@ static int handle_read(struct fuse* fuse, struct fuse_handler* handler,
     if (size > MAX_READ) {
         return -EINVAL;
     }
+    if (handler->reply_pipe[0] >= 0
+            && splice_read_reply(fuse, handler, unique, h->fd, size, offset, &res)) {
+        return res;
+    }
     res = pread64(h->fd, read_buffer, size, offset);
     if (res < 0) {
         return -errno;
@@ -1254,19 +1877,40 @@ static int handle_write(struct fuse* fuse, struct fuse_handler* handler,
     struct fuse_write_out out;
     struct handle *h = id_to_ptr(req->fh);
     int res;
+    bool copy = true;
     __u8 aligned_buffer[req->size] __attribute__((__aligned__(PAGESIZE)));
 
-    if (req->flags & O_DIRECT) {
-        memcpy(aligned_buffer, buffer, req->size);
-        buffer = (const __u8*) aligned_buffer;
+    TRACE("[%d] WRITE %p(%d) %u@%"PRIu64"%s\n", handler->token,
+            h, h->fd, req->size, req->offset, handler->pipe_data ? " spliced" : "");
+    if (handler->pipe_data) {
+        res = splice_write(handler, h->fd, req->offset);
+        copy = (res < 0) && handler->pipe_data;
+        if (copy) {
+            /* the file does not take splices, copy the data out after all */
+            if (!read_request_pipe(handler, (void*) buffer, handler->pipe_data)) {
+                reset_splice_pipes(handler);
+                return -EIO;
+            }
+            handler->pipe_data = 0;
+        }
+    }
+    if (copy) {
+        if (req->flags & O_DIRECT) {
+            memcpy(aligned_buffer, buffer, req->size);
+            buffer = (const __u8*) aligned_buffer;
+        }
+        res = pwrite64(h->fd, buffer, req->size, req->offset);
     }
-
-    TRACE("[%d] WRITE %p(%d) %u@%"PRIu64"\n", handler->token,
-            h, h->fd, req->size, req->offset);
-    res = pwrite64(h->fd, buffer, req->size, req->offset);
     if (res < 0) {
         return -errno;
     }
+
+    pthread_rwlock_rdlock(&fuse->lock);
+    if (h->node->parent) {
+        queue_alias_invalidation_locked(handler, h->node->parent, h->node->name,
+                FUSE_NOTIFY_INVAL_INODE);
+    }
+    pthread_rwlock_unlock(&fuse->lock);
     out.size = res;
     fuse_reply(fuse, hdr->unique, &out, sizeof(out));
     return NO_STATUS;
@@ -1280,10 +1924,10 @@ static int handle_statfs(struct fuse* fuse, struct fuse_handler* handler,
     struct fuse_statfs_out out;
     int res;
 
-    pthread_mutex_lock(&fuse->lock);
+    pthread_rwlock_rdlock(&fuse->lock);
     TRACE("[%d] STATFS\n", handler->token);
     res = get_node_path_locked(&fuse->root, path, sizeof(path));
-    pthread_mutex_unlock(&fuse->lock);
+    pthread_rwlock_unlock(&fuse->lock);
     if (res < 0) {
         return -ENOENT;
     }
@@ -1354,11 +1998,11 @@ static int handle_opendir(struct fuse* fuse, struct fuse_handler* handler,
     struct fuse_open_out out;
     struct dirhandle *h;
 
-    pthread_mutex_lock(&fuse->lock);
+    pthread_rwlock_rdlock(&fuse->lock);
     node = lookup_node_and_path_by_id_locked(fuse, hdr->nodeid, path, sizeof(path));
     TRACE("[%d] OPENDIR @ %"PRIx64" (%s)\n", handler->token,
             hdr->nodeid, node ? node->name : "?");
-    pthread_mutex_unlock(&fuse->lock);
+    pthread_rwlock_unlock(&fuse->lock);
 
     if (!node) {
         return -ENOENT;
@@ -1376,6 +2020,8 @@ static int handle_opendir(struct fuse* fuse, struct fuse_handler* handler,
         free(h);
         return -errno;
     }
+    h->next = NULL;
+    h->pos = 0;
     out.fh = ptr_to_id(h);
     out.open_flags = 0;
     out.padding = 0;
@@ -1383,32 +2029,130 @@ static int handle_opendir(struct fuse* fuse, struct fuse_handler* handler,
     return NO_STATUS;
 }
 
+#ifdef FUSE_DO_READDIRPLUS
+/* Fills out the entry of a READDIRPLUS reply, taking a reference on the node
+ * just like a LOOKUP would.  The entry is left zeroed, which the kernel takes
+ * as a name without attributes, for "." and ".." or if anything fails. */
+static void fill_direntplus_entry(struct fuse* fuse, const struct fuse_in_header* hdr,
+        struct node* parent, DIR* dir, const char* name, struct fuse_entry_out* out)
+{
+    struct stat s;
+
+    memset(out, 0, sizeof(*out));
+    if (!strcmp(name, ".") || !strcmp(name, "..")) {
+        return;
+    }
+    if (!check_caller_access_to_name(fuse, hdr, parent, name, R_OK, false)) {
+        return;
+    }
+    if (fstatat(dirfd(dir), name, &s, AT_SYMLINK_NOFOLLOW) < 0) {
+        return;
+    }
+    if (acquire_child_entry(fuse, parent, name, name, &s, out) < 0) {
+        memset(out, 0, sizeof(*out));
+    }
+}
+
+/* Drops the node references taken for the entries of a READDIRPLUS reply
+ * that never reached the kernel, which would otherwise FORGET them. */
+static void release_direntplus_entries(struct fuse* fuse, const char* buffer, size_t used)
+{
+    size_t pos = 0;
+
+    pthread_rwlock_wrlock(&fuse->lock);
+    while (pos < used) {
+        const struct fuse_direntplus *fdp = (const struct fuse_direntplus*) (buffer + pos);
+        if (fdp->entry_out.nodeid) {
+            release_node_locked(lookup_node_by_id_locked(fuse, fdp->entry_out.nodeid));
+        }
+        pos += FUSE_DIRENT_ALIGN(FUSE_NAME_OFFSET_DIRENTPLUS + fdp->dirent.namelen);
+    }
+    pthread_rwlock_unlock(&fuse->lock);
+}
+#endif
+
+/* Replies with as many entries as fit in the size asked for.  With 'plus',
+ * each also carries the attributes and a node reference, as for READDIRPLUS. */
 static int handle_readdir(struct fuse* fuse, struct fuse_handler* handler,
-        const struct fuse_in_header* hdr, const struct fuse_read_in* req)
+        const struct fuse_in_header* hdr, const struct fuse_read_in* req, bool plus)
 {
     char buffer[8192];
-    struct fuse_dirent *fde = (struct fuse_dirent*) buffer;
+    size_t size = req->size < sizeof(buffer) ? req->size : sizeof(buffer);
+    size_t used = 0;
+    __u64 offset = req->offset;
+    struct node* parent = NULL;
     struct dirent *de;
     struct dirhandle *h = id_to_ptr(req->fh);
 
-    TRACE("[%d] READDIR %p\n", handler->token, h);
-    if (req->offset == 0) {
-        /* rewinddir() might have been called above us, so rewind here too */
-        TRACE("[%d] calling rewinddir()\n", handler->token);
+    TRACE("[%d] READDIR%s %p\n", handler->token, plus ? "PLUS" : "", h);
+    if (offset == 0 || offset != h->pos) {
+        /* rewinddir() or seekdir() might have been called above us, or the
+         * kernel only used part of the last reply: rewind here too, then
+         * skip to the entry asked for */
+        TRACE("[%d] calling rewinddir(), skipping %"PRIu64"\n", handler->token, offset);
         rewinddir(h->d);
+        h->next = NULL;
+        h->pos = 0;
+        while (h->pos < offset && readdir(h->d)) {
+            h->pos++;
+        }
+    }
+    if (plus) {
+        pthread_rwlock_rdlock(&fuse->lock);
+        parent = lookup_node_by_id_locked(fuse, hdr->nodeid);
+        pthread_rwlock_unlock(&fuse->lock);
+        if (!parent) {
+            return -ENOENT;
+        }
     }
-    de = readdir(h->d);
-    if (!de) {
+
+    while ((de = h->next ? h->next : readdir(h->d))) {
+        struct fuse_dirent *fde;
+        size_t namelen = strlen(de->d_name);
+        size_t entlen;
+
+        entlen = FUSE_DIRENT_ALIGN(FUSE_NAME_OFFSET + namelen);
+#ifdef FUSE_DO_READDIRPLUS
+        if (plus) {
+            entlen = FUSE_DIRENT_ALIGN(FUSE_NAME_OFFSET_DIRENTPLUS + namelen);
+        }
+#endif
+        if (used + entlen > size) {
+            /* keep it for the next request */
+            h->next = de;
+            break;
+        }
+        h->next = NULL;
+
+        memset(buffer + used, 0, entlen);
+        fde = (struct fuse_dirent*) (buffer + used);
+#ifdef FUSE_DO_READDIRPLUS
+        if (plus) {
+            struct fuse_direntplus *fdp = (struct fuse_direntplus*) (buffer + used);
+            fill_direntplus_entry(fuse, hdr, parent, h->d, de->d_name, &fdp->entry_out);
+            fde = &fdp->dirent;
+        }
+#endif
+        fde->ino = FUSE_UNKNOWN_INO;
+        /* increment the offset so we can detect when rewinddir() seeks back to the beginning */
+        fde->off = ++offset;
+        fde->type = de->d_type;
+        fde->namelen = namelen;
+        memcpy(fde->name, de->d_name, namelen);
+        used += entlen;
+    }
+    /* a failed reply leaves the kernel asking for this offset again */
+    h->pos = offset;
+    if (!used) {
         return 0;
     }
-    fde->ino = FUSE_UNKNOWN_INO;
-    /* increment the offset so we can detect when rewinddir() seeks back to the beginning */
-    fde->off = req->offset + 1;
-    fde->type = de->d_type;
-    fde->namelen = strlen(de->d_name);
-    memcpy(fde->name, de->d_name, fde->namelen + 1);
-    fuse_reply(fuse, hdr->unique, fde,
-            FUSE_DIRENT_ALIGN(sizeof(struct fuse_dirent) + fde->namelen));
+    if (fuse_reply(fuse, hdr->unique, buffer, used) < 0) {
+#ifdef FUSE_DO_READDIRPLUS
+        if (plus) {
+            release_direntplus_entries(fuse, buffer, used);
+        }
+#endif
+    }
     return NO_STATUS;
 }
 
@@ -1434,6 +2178,10 @@ static int handle_init(struct fuse* fuse, struct fuse_handler* handler,
     out.minor = FUSE_KERNEL_MINOR_VERSION;
     out.max_readahead = req->max_readahead;
     out.flags = FUSE_ATOMIC_O_TRUNC | FUSE_BIG_WRITES;
+#ifdef FUSE_DO_READDIRPLUS
+    /* let the kernel choose between plain and plus readdir as it sees fit */
+    out.flags |= req->flags & (FUSE_DO_READDIRPLUS | FUSE_READDIRPLUS_AUTO);
+#endif
     out.max_background = 32;
     out.congestion_threshold = 32;
     out.max_write = MAX_WRITE;
@@ -1543,9 +2291,16 @@ static int handle_fuse_request(struct fuse *fuse, struct fuse_handler* handler,
 
     case FUSE_READDIR: {
         const struct fuse_read_in *req = data;
-        return handle_readdir(fuse, handler, hdr, req);
+        return handle_readdir(fuse, handler, hdr, req, false);
     }
 
+#ifdef FUSE_DO_READDIRPLUS
+    case FUSE_READDIRPLUS: {
+        const struct fuse_read_in *req = data;
+        return handle_readdir(fuse, handler, hdr, req, true);
+    }
+#endif
+
     case FUSE_RELEASEDIR: { /* release_in -> */
         const struct fuse_release_in *req = data;
         return handle_releasedir(fuse, handler, hdr, req);
@@ -1564,12 +2319,63 @@ static int handle_fuse_request(struct fuse *fuse, struct fuse_handler* handler,
     }
 }
 
+/* Reads the next request into the request buffer.  When splicing, the
+ * request goes through the request pipe, where the data of a buffered WRITE
+ * stays behind for handle_write().  Returns the length of the request. */
+static ssize_t read_request(struct fuse* fuse, struct fuse_handler* handler)
+{
+    const struct fuse_in_header* hdr = (void*) handler->request_buffer;
+    const struct fuse_write_in* req = (void*) (handler->request_buffer + sizeof(*hdr));
+    size_t head;
+    ssize_t len;
+
+    if (handler->request_pipe[0] < 0) {
+        return read(fuse->fd, handler->request_buffer, sizeof(handler->request_buffer));
+    }
+
+    len = splice(fuse->fd, NULL, handler->request_pipe[1], NULL,
+            sizeof(handler->request_buffer), 0);
+    if (len < 0) {
+        if (errno == EINVAL) {
+            ERROR("[%d] cannot splice from fuse device, copying instead\n", handler->token);
+            close_splice_pipes(handler);
+            return read(fuse->fd, handler->request_buffer, sizeof(handler->request_buffer));
+        }
+        return len;
+    }
+
+    head = sizeof(*hdr) + sizeof(*req);
+    if ((size_t) len < head) {
+        head = len;
+    }
+    if (!read_request_pipe(handler, handler->request_buffer, head)) {
+        goto error;
+    }
+    if ((size_t) len > head) {
+        if (hdr->opcode == FUSE_WRITE && !(req->flags & O_DIRECT)) {
+            handler->pipe_data = len - head;
+        } else if (!read_request_pipe(handler, handler->request_buffer + head, len - head)) {
+            goto error;
+        }
+    }
+    return len;
+
+error:
+    reset_splice_pipes(handler);
+    errno = EIO;
+    return -1;
+}
+
 static void handle_fuse_requests(struct fuse_handler* handler)
 {
     struct fuse* fuse = handler->fuse;
     for (;;) {
-        ssize_t len = read(fuse->fd,
-                handler->request_buffer, sizeof(handler->request_buffer));
+        if (handler->pipe_data) {
+            /* left over from a WRITE that never got to handle_write() */
+            reset_splice_pipes(handler);
+        }
+
+        ssize_t len = read_request(fuse, handler);
         if (len < 0) {
             if (errno != EINTR) {
                 ERROR("[%d] handle_fuse_requests: errno=%d\n", handler->token, errno);
@@ -1603,6 +2409,23 @@ static void handle_fuse_requests(struct fuse_handler* handler)
             }
             fuse_status(fuse, unique, res);
         }
+        if (handler->notify_count) {
+            send_notifications(fuse, handler);
+        }
+    }
+}
+
+static void init_handler(struct fuse* fuse, struct fuse_handler* handler, int token)
+{
+    handler->fuse = fuse;
+    handler->token = token;
+    handler->request_pipe[0] = handler->request_pipe[1] = -1;
+    handler->reply_pipe[0] = handler->reply_pipe[1] = -1;
+    handler->pipe_data = 0;
+    handler->notify_count = 0;
+    if (fuse->splice && !open_splice_pipes(handler)) {
+        ERROR("[%d] cannot set up splice pipes, copying instead: %s\n",
+                token, strerror(errno));
     }
 }
 
@@ -1627,7 +2450,7 @@ static bool remove_int_to_null(void *key, void *value, void *context) {
 }
 
 static int read_package_list(struct fuse *fuse) {
-    pthread_mutex_lock(&fuse->lock);
+    pthread_rwlock_wrlock(&fuse->lock);
 
     hashmapForEach(fuse->package_to_appid, remove_str_to_int, fuse->package_to_appid);
     hashmapForEach(fuse->appid_with_rw, remove_int_to_null, fuse->appid_with_rw);
@@ -1635,7 +2458,7 @@ static int read_package_list(struct fuse *fuse) {
     FILE* file = fopen(kPackagesListFile, "r");
     if (!file) {
         ERROR("failed to open package list: %s\n", strerror(errno));
-        pthread_mutex_unlock(&fuse->lock);
+        pthread_rwlock_unlock(&fuse->lock);
         return -1;
     }
 
@@ -1664,7 +2487,7 @@ static int read_package_list(struct fuse *fuse) {
             hashmapSize(fuse->package_to_appid),
             hashmapSize(fuse->appid_with_rw));
     fclose(file);
-    pthread_mutex_unlock(&fuse->lock);
+    pthread_rwlock_unlock(&fuse->lock);
     return 0;
 }
 
@@ -1742,8 +2565,7 @@ static int ignite_fuse(struct fuse* fuse, int num_threads)
     }
 
     for (i = 0; i < num_threads; i++) {
-        handlers[i].fuse = fuse;
-        handlers[i].token = i;
+        init_handler(fuse, &handlers[i], i);
     }
 
     /* When deriving permissions, this thread is used to process inotify events,
@@ -1772,23 +2594,37 @@ quit:
     exit(1);
 }
 
+/* One handler per online CPU, plus the inotify thread when deriving. */
+static int default_num_threads(derive_t derive)
+{
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int num_threads = (cpus > DEFAULT_NUM_THREADS) ? cpus : DEFAULT_NUM_THREADS;
+    if (derive != DERIVE_NONE) {
+        num_threads++;
+    }
+    return num_threads;
+}
+
 static int usage()
 {
     ERROR("usage: sdcard [OPTIONS] <source_path> <dest_path>\n"
             "    -u: specify UID to run as\n"
             "    -g: specify GID to run as\n"
             "    -w: specify GID required to write (default sdcard_rw, requires -d or -l)\n"
-            "    -t: specify number of threads to use (default %d)\n"
+            "    -t: specify number of threads to use (default one per CPU, at least %d)\n"
             "    -d: derive file permissions based on path\n"
             "    -l: derive file permissions based on legacy internal layout\n"
             "    -s: split derived permissions for pics, av\n"
-            "\n", DEFAULT_NUM_THREADS);
+            "    -z: splice file data to and from the fuse device instead of copying\n"
+            "    -a: specify seconds the kernel may cache attributes (default %d)\n"
+            "    -e: specify seconds the kernel may cache entries (default %d)\n"
+            "\n", DEFAULT_NUM_THREADS, DEFAULT_ATTR_TIMEOUT, DEFAULT_ENTRY_TIMEOUT);
     return 1;
 }
 
 static int run(const char* source_path, const char* dest_path, uid_t uid,
         gid_t gid, gid_t write_gid, int num_threads, derive_t derive,
-        bool split_perms) {
+        bool split_perms, bool splice, int attr_timeout, int entry_timeout) {
     int fd;
     char opts[256];
     int res;
@@ -1832,6 +2668,9 @@ static int run(const char* source_path, const char* dest_path, uid_t uid,
     }
 
     fuse_init(&fuse, fd, source_path, write_gid, derive, split_perms);
+    fuse.splice = splice;
+    fuse.attr_timeout = attr_timeout;
+    fuse.entry_timeout = entry_timeout;
 
     umask(0);
     res = ignite_fuse(&fuse, num_threads);
@@ -1852,15 +2691,18 @@ int main(int argc, char **argv)
     uid_t uid = 0;
     gid_t gid = 0;
     gid_t write_gid = AID_SDCARD_RW;
-    int num_threads = DEFAULT_NUM_THREADS;
+    int num_threads = 0;
     derive_t derive = DERIVE_NONE;
     bool split_perms = false;
+    bool splice = false;
+    int attr_timeout = DEFAULT_ATTR_TIMEOUT;
+    int entry_timeout = DEFAULT_ENTRY_TIMEOUT;
     int i;
     struct rlimit rlim;
     int fs_version;
 
     int opt;
-    while ((opt = getopt(argc, argv, "u:g:w:t:dls")) != -1) {
+    while ((opt = getopt(argc, argv, "u:g:w:t:dlsza:e:")) != -1) {
         switch (opt) {
             case 'u':
                 uid = strtoul(optarg, NULL, 10);
@@ -1883,6 +2725,15 @@ int main(int argc, char **argv)
             case 's':
                 split_perms = true;
                 break;
+            case 'z':
+                splice = true;
+                break;
+            case 'a':
+                attr_timeout = strtoul(optarg, NULL, 10);
+                break;
+            case 'e':
+                entry_timeout = strtoul(optarg, NULL, 10);
+                break;
             case '?':
             default:
                 return usage();
@@ -1917,10 +2768,17 @@ int main(int argc, char **argv)
         ERROR("uid and gid must be nonzero\n");
         return usage();
     }
+    if (!num_threads) {
+        num_threads = default_num_threads(derive);
+    }
     if (num_threads < 1) {
         ERROR("number of threads must be at least 1\n");
         return usage();
     }
+    if (attr_timeout < 0 || entry_timeout < 0) {
+        ERROR("cache timeouts must not be negative\n");
+        return usage();
+    }
     if (split_perms && derive == DERIVE_NONE) {
         ERROR("cannot split permissions without deriving\n");
         return usage();
@@ -1937,6 +2795,7 @@ int main(int argc, char **argv)
         sleep(1);
     }
 
-    res = run(source_path, dest_path, uid, gid, write_gid, num_threads, derive, split_perms);
+    res = run(source_path, dest_path, uid, gid, write_gid, num_threads, derive, split_perms, splice,
+            attr_timeout, entry_timeout);
     return res < 0 ? 1 : 0;
 }
@@ -0,0 +1,615 @@
+/*
+ * Copyright (C) 2014 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/fuse.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mount.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <gtest/gtest.h>
+
+#include "sdcard_harness.h"
+
+// Directories, and files in each, of the tree being served
+#define BENCH_DIRS 16
+#define BENCH_FILES 64
+// Files in the single directory of the large directory benchmarks
+#define BENCH_LARGE_FILES 4096
+// Requests kept in flight, enough to keep every handler busy
+#define BENCH_WINDOW 64
+#define BENCH_ROUNDS 2000
+// Full listings of the large directory
+#define BENCH_LISTINGS 20
+// Sequential transfers through a real mount, in requests of the largest size
+#define BENCH_IO_SIZE (128 * 1024)
+#define BENCH_IO_FILE_SIZE (64 * 1024 * 1024)
+// stat() calls through a real mount
+#define BENCH_STAT_COUNT 100000
+
+#define BENCH_TMPDIR "/data/local/tmp"
+
+static uint64_t nsecs() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+class SdcardBench {
+    char mRoot[PATH_MAX];
+    int mFd;
+    pid_t mPid;
+    uint64_t mUnique;
+    unsigned mDirCount;
+    unsigned mFileCount;
+    uint64_t mDirs[BENCH_DIRS];
+
+    void makeTree() {
+        // back date the directories, as if they had not changed for a while
+        struct timeval times[2];
+        gettimeofday(&times[0], NULL);
+        times[0].tv_sec -= 60;
+        times[1] = times[0];
+
+        for (unsigned d = 0; d < mDirCount; ++d) {
+            char path[PATH_MAX];
+            snprintf(path, sizeof(path), "%s/dir%u", mRoot, d);
+            mkdir(path, 0775);
+            for (unsigned f = 0; f < mFileCount; ++f) {
+                snprintf(path, sizeof(path), "%s/dir%u/file%u", mRoot, d, f);
+                int fd = open(path, O_CREAT | O_WRONLY, 0664);
+                if (fd >= 0) {
+                    close(fd);
+                }
+            }
+            snprintf(path, sizeof(path), "%s/dir%u", mRoot, d);
+            utimes(path, times);
+        }
+    }
+
+    void removeTree() {
+        for (unsigned d = 0; d < mDirCount; ++d) {
+            char path[PATH_MAX];
+            for (unsigned f = 0; f < mFileCount; ++f) {
+                snprintf(path, sizeof(path), "%s/dir%u/file%u", mRoot, d, f);
+                unlink(path);
+            }
+            snprintf(path, sizeof(path), "%s/dir%u", mRoot, d);
+            rmdir(path);
+        }
+        rmdir(mRoot);
+    }
+
+    void sendLookup(uint64_t parent, const char *name) {
+        char buf[sizeof(struct fuse_in_header) + NAME_MAX + 1];
+        struct fuse_in_header *hdr = reinterpret_cast<struct fuse_in_header *>(buf);
+        size_t namelen = strlen(name) + 1;
+
+        memset(hdr, 0, sizeof(*hdr));
+        hdr->len = sizeof(*hdr) + namelen;
+        hdr->opcode = FUSE_LOOKUP;
+        hdr->unique = ++mUnique;
+        hdr->nodeid = parent;
+        hdr->uid = getuid();
+        hdr->gid = getgid();
+        hdr->pid = getpid();
+        memcpy(buf + sizeof(*hdr), name, namelen);
+        write(mFd, buf, hdr->len);
+    }
+
+    void sendGetattr(uint64_t node) {
+        struct {
+            struct fuse_in_header hdr;
+            struct fuse_getattr_in req;
+        } msg;
+
+        memset(&msg, 0, sizeof(msg));
+        msg.hdr.len = sizeof(msg);
+        msg.hdr.opcode = FUSE_GETATTR;
+        msg.hdr.unique = ++mUnique;
+        msg.hdr.nodeid = node;
+        msg.hdr.uid = getuid();
+        msg.hdr.gid = getgid();
+        msg.hdr.pid = getpid();
+        write(mFd, &msg, sizeof(msg));
+    }
+
+    void sendRead(uint32_t opcode, uint64_t node, uint64_t fh, uint64_t offset, uint32_t size) {
+        struct {
+            struct fuse_in_header hdr;
+            struct fuse_read_in req;
+        } msg;
+
+        memset(&msg, 0, sizeof(msg));
+        msg.hdr.len = sizeof(msg);
+        msg.hdr.opcode = opcode;
+        msg.hdr.unique = ++mUnique;
+        msg.hdr.nodeid = node;
+        msg.hdr.uid = getuid();
+        msg.hdr.gid = getgid();
+        msg.hdr.pid = getpid();
+        msg.req.fh = fh;
+        msg.req.offset = offset;
+        msg.req.size = size;
+        write(mFd, &msg, sizeof(msg));
+    }
+
+    // Returns the length of the reply payload copied to buf, or the fuse error
+    ssize_t receiveData(char *buf, size_t size) {
+        char reply[sizeof(struct fuse_out_header) + 8192];
+        ssize_t len = read(mFd, reply, sizeof(reply));
+        if (len < (ssize_t) sizeof(struct fuse_out_header)) {
+            return -EIO;
+        }
+        struct fuse_out_header *hdr = reinterpret_cast<struct fuse_out_header *>(reply);
+        if (hdr->error) {
+            return hdr->error;
+        }
+        len -= sizeof(*hdr);
+        if ((size_t) len > size) {
+            len = size;
+        }
+        memcpy(buf, hdr + 1, len);
+        return len;
+    }
+
+    // Returns the fuse error of the reply, and the node id of an entry
+    int receive(uint64_t *nodeid) {
+        char buf[sizeof(struct fuse_out_header) + sizeof(struct fuse_entry_out)
+                 + sizeof(struct fuse_attr_out)];
+        ssize_t len = read(mFd, buf, sizeof(buf));
+        if (len < (ssize_t) sizeof(struct fuse_out_header)) {
+            return -EIO;
+        }
+        struct fuse_out_header *hdr = reinterpret_cast<struct fuse_out_header *>(buf);
+        if (nodeid && !hdr->error
+                && (len >= (ssize_t) (sizeof(*hdr) + sizeof(struct fuse_entry_out)))) {
+            *nodeid = reinterpret_cast<struct fuse_entry_out *>(hdr + 1)->nodeid;
+        }
+        return hdr->error;
+    }
+
+public:
+    SdcardBench(unsigned dirs = BENCH_DIRS, unsigned files = BENCH_FILES)
+            : mFd(-1), mPid(-1), mUnique(0), mDirCount(dirs), mFileCount(files) {
+        snprintf(mRoot, sizeof(mRoot), "%s/sdcard-benchmark.XXXXXX", BENCH_TMPDIR);
+        if (mkdtemp(mRoot)) {
+            makeTree();
+        } else {
+            mRoot[0] = '\0';
+        }
+    }
+
+    ~SdcardBench() {
+        stop();
+        if (mRoot[0]) {
+            removeTree();
+        }
+    }
+
+    // Fork a daemon serving the tree with num_threads handlers
+    bool start(int num_threads) {
+        int sv[2];
+
+        if (!mRoot[0] || socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv)) {
+            return false;
+        }
+        mPid = fork();
+        if (mPid == 0) {
+            close(sv[0]);
+            if (sdcard_harness_start(sv[1], mRoot, num_threads)) {
+                _exit(1);
+            }
+            for (;;) {
+                pause();
+            }
+        }
+        close(sv[1]);
+        mFd = sv[0];
+        if (mPid < 0) {
+            return false;
+        }
+
+        // Look the directories up once, the rounds then run on their ids
+        for (unsigned d = 0; d < mDirCount; ++d) {
+            char name[32];
+            snprintf(name, sizeof(name), "dir%u", d);
+            sendLookup(FUSE_ROOT_ID, name);
+            if (receive(&mDirs[d])) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    void stop() {
+        if (mPid > 0) {
+            kill(mPid, SIGKILL);
+            waitpid(mPid, NULL, 0);
+            mPid = -1;
+        }
+        if (mFd >= 0) {
+            close(mFd);
+            mFd = -1;
+        }
+    }
+
+    // Alternate lookups of files and getattrs of directories, spread over
+    // all directories. Returns the number of failed requests.
+    unsigned run(unsigned rounds) {
+        unsigned errors = 0;
+        unsigned n = 0;
+
+        for (unsigned r = 0; r < rounds; ++r) {
+            for (unsigned i = 0; i < BENCH_WINDOW; ++i, ++n) {
+                unsigned d = (n / 2) % mDirCount;
+                if (n & 1) {
+                    sendGetattr(mDirs[d]);
+                } else {
+                    char name[32];
+                    snprintf(name, sizeof(name), "file%u", (n / (2 * mDirCount)) % mFileCount);
+                    sendLookup(mDirs[d], name);
+                }
+            }
+            for (unsigned i = 0; i < BENCH_WINDOW; ++i) {
+                if (receive(NULL)) {
+                    ++errors;
+                }
+            }
+        }
+        return errors;
+    }
+
+    // Open, list and release the first directory with READDIR, or
+    // READDIRPLUS if plus is set. Returns the number of entries listed, or
+    // -1 on error, and the requests it took in *requests.
+    int list(bool plus, unsigned *requests) {
+        struct fuse_open_out open;
+        char buf[8192];
+        ssize_t len;
+
+        sendRead(FUSE_OPENDIR, mDirs[0], 0, 0, 0);
+        if (receiveData(reinterpret_cast<char *>(&open), sizeof(open))
+                != (ssize_t) sizeof(open)) {
+            return -1;
+        }
+
+        int entries = 0;
+        uint64_t offset = 0;
+        *requests = 0;
+        do {
+            sendRead(plus ? FUSE_READDIRPLUS : FUSE_READDIR, mDirs[0], open.fh, offset, 4096);
+            ++*requests;
+            len = receiveData(buf, sizeof(buf));
+            ssize_t pos = 0;
+            while (pos < len) {
+                struct fuse_dirent *fde;
+                if (plus) {
+                    struct fuse_direntplus *fdp =
+                            reinterpret_cast<struct fuse_direntplus *>(buf + pos);
+                    fde = &fdp->dirent;
+                    pos += FUSE_DIRENT_ALIGN(FUSE_NAME_OFFSET_DIRENTPLUS + fde->namelen);
+                } else {
+                    fde = reinterpret_cast<struct fuse_dirent *>(buf + pos);
+                    pos += FUSE_DIRENT_ALIGN(FUSE_NAME_OFFSET + fde->namelen);
+                }
+                offset = fde->off;
+                ++entries;
+            }
+        } while (len > 0);
+
+        sendRead(FUSE_RELEASEDIR, mDirs[0], open.fh, 0, 0);
+        if (receive(NULL) || (len < 0)) {
+            return -1;
+        }
+        return entries;
+    }
+
+    // Lookups of every file of the first directory in turn, by a name
+    // differing in case from the one on disk if fold is set. Returns the
+    // number of failed requests.
+    unsigned runLookups(unsigned rounds, bool fold) {
+        unsigned errors = 0;
+        unsigned n = 0;
+
+        for (unsigned r = 0; r < rounds; ++r) {
+            for (unsigned i = 0; i < BENCH_WINDOW; ++i, ++n) {
+                char name[32];
+                snprintf(name, sizeof(name), fold ? "FILE%u" : "file%u", n % mFileCount);
+                sendLookup(mDirs[0], name);
+            }
+            for (unsigned i = 0; i < BENCH_WINDOW; ++i) {
+                if (receive(NULL)) {
+                    ++errors;
+                }
+            }
+        }
+        return errors;
+    }
+};
+
+static void report(const char *what, int num_threads, uint64_t elapsed) {
+    uint64_t ops = (uint64_t) BENCH_ROUNDS * BENCH_WINDOW;
+    fprintf(stderr, "%s threads=%d: %llu requests in %llu us, %llu ns/request, %llu requests/s\n",
+            what, num_threads, (unsigned long long) ops,
+            (unsigned long long) (elapsed / 1000),
+            (unsigned long long) (elapsed / ops),
+            (unsigned long long) (ops * 1000000000ULL / elapsed));
+}
+
+static void bench_threads(int num_threads) {
+    SdcardBench bench;
+
+    ASSERT_TRUE(bench.start(num_threads));
+
+    bench.run(BENCH_ROUNDS / 10); // warm up the node cache
+    uint64_t start = nsecs();
+    unsigned errors = bench.run(BENCH_ROUNDS);
+    uint64_t elapsed = nsecs() - start;
+    bench.stop();
+
+    EXPECT_EQ(0U, errors);
+    report("lookup/getattr", num_threads, elapsed);
+}
+
+static void bench_large_dir(bool fold) {
+    SdcardBench bench(1, BENCH_LARGE_FILES);
+    int num_threads = 2;
+
+    ASSERT_TRUE(bench.start(num_threads));
+
+    // warm up with every file once, so all nodes already exist
+    bench.runLookups(BENCH_LARGE_FILES / BENCH_WINDOW, fold);
+    uint64_t start = nsecs();
+    unsigned errors = bench.runLookups(BENCH_ROUNDS, fold);
+    uint64_t elapsed = nsecs() - start;
+    bench.stop();
+
+    EXPECT_EQ(0U, errors);
+    report(fold ? "large dir case folded lookup" : "large dir lookup", num_threads, elapsed);
+}
+
+TEST(sdcard, benchmark_lookup_getattr_1_thread) {
+    bench_threads(1);
+}
+
+TEST(sdcard, benchmark_lookup_getattr_2_threads) {
+    bench_threads(2);
+}
+
+TEST(sdcard, benchmark_lookup_getattr_4_threads) {
+    bench_threads(4);
+}
+
+TEST(sdcard, benchmark_lookup_getattr_cpu_threads) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    bench_threads((cpus > 1) ? cpus : 1);
+}
+
+TEST(sdcard, benchmark_lookup_large_dir) {
+    bench_large_dir(false);
+}
+
+TEST(sdcard, benchmark_lookup_large_dir_case_folded) {
+    bench_large_dir(true);
+}
+
+static void bench_readdir(bool plus) {
+    SdcardBench bench(1, BENCH_LARGE_FILES);
+    unsigned requests = 0;
+
+    ASSERT_TRUE(bench.start(2));
+
+    uint64_t start = nsecs();
+    for (unsigned i = 0; i < BENCH_LISTINGS; ++i) {
+        // every file, plus "." and ".."
+        ASSERT_EQ(BENCH_LARGE_FILES + 2, bench.list(plus, &requests));
+    }
+    uint64_t elapsed = nsecs() - start;
+    bench.stop();
+
+    fprintf(stderr, "%s of %u entries: %u requests, %llu us per listing\n",
+            plus ? "READDIRPLUS" : "READDIR", BENCH_LARGE_FILES + 2, requests,
+            (unsigned long long) (elapsed / BENCH_LISTINGS / 1000));
+}
+
+TEST(sdcard, benchmark_readdir) {
+    bench_readdir(false);
+}
+
+TEST(sdcard, benchmark_readdirplus) {
+    bench_readdir(true);
+}
+
+// A real FUSE mount of an empty scratch directory, served by a forked child
+class SdcardMount {
+    char mSource[PATH_MAX];
+    char mDest[PATH_MAX];
+    pid_t mPid;
+
+public:
+    SdcardMount() : mPid(-1) {
+        snprintf(mSource, sizeof(mSource), "%s/sdcard-source.XXXXXX", BENCH_TMPDIR);
+        snprintf(mDest, sizeof(mDest), "%s/sdcard-dest.XXXXXX", BENCH_TMPDIR);
+        if (!mkdtemp(mSource)) {
+            mSource[0] = '\0';
+        }
+        if (!mkdtemp(mDest)) {
+            mDest[0] = '\0';
+        }
+    }
+
+    ~SdcardMount() {
+        stop();
+        if (mSource[0]) {
+            char path[PATH_MAX];
+            snprintf(path, sizeof(path), "%s/file", mSource);
+            unlink(path);
+            rmdir(mSource);
+        }
+        if (mDest[0]) {
+            rmdir(mDest);
+        }
+    }
+
+    const char *path() const { return mDest; }
+
+    // Returns 0, or the negative errno the mount failed with
+    int start(int num_threads, bool splice, int cache_timeout = 10) {
+        int status[2];
+        int res = -EIO;
+
+        if (!mSource[0] || !mDest[0] || pipe(status)) {
+            return res;
+        }
+        mPid = fork();
+        if (mPid == 0) {
+            close(status[0]);
+            res = sdcard_harness_mount(mSource, mDest, num_threads, splice,
+                    cache_timeout);
+            write(status[1], &res, sizeof(res));
+            if (res) {
+                _exit(1);
+            }
+            for (;;) {
+                pause();
+            }
+        }
+        close(status[1]);
+        if ((mPid < 0) || (read(status[0], &res, sizeof(res)) != sizeof(res))) {
+            res = -EIO;
+        }
+        close(status[0]);
+        return res;
+    }
+
+    void stop() {
+        if (mPid > 0) {
+            kill(mPid, SIGKILL);
+            waitpid(mPid, NULL, 0);
+            umount2(mDest, MNT_DETACH);
+            mPid = -1;
+        }
+    }
+};
+
+static void bench_io(bool splice) {
+    SdcardMount mount;
+    char path[PATH_MAX];
+    static char buf[BENCH_IO_SIZE];
+
+    int res = mount.start(2, splice);
+    if (res) {
+        fprintf(stderr, "cannot mount fuse (%s), skipped\n", strerror(-res));
+        return;
+    }
+    snprintf(path, sizeof(path), "%s/file", mount.path());
+    memset(buf, 'x', sizeof(buf));
+
+    int fd = open(path, O_CREAT | O_TRUNC | O_WRONLY, 0664);
+    ASSERT_LE(0, fd);
+    uint64_t start = nsecs();
+    for (size_t done = 0; done < BENCH_IO_FILE_SIZE; done += sizeof(buf)) {
+        ASSERT_EQ((ssize_t) sizeof(buf), write(fd, buf, sizeof(buf)));
+    }
+    uint64_t write_elapsed = nsecs() - start;
+    close(fd);
+
+    fd = open(path, O_RDONLY);
+    ASSERT_LE(0, fd);
+    // make every read go to the daemon rather than the page cache
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    size_t total = 0;
+    start = nsecs();
+    ssize_t len;
+    while ((len = read(fd, buf, sizeof(buf))) > 0) {
+        total += len;
+    }
+    uint64_t read_elapsed = nsecs() - start;
+    close(fd);
+    mount.stop();
+
+    EXPECT_EQ((size_t) BENCH_IO_FILE_SIZE, total);
+    EXPECT_EQ('x', buf[0]);
+
+    // bytes per ns, scaled to MB/s
+    fprintf(stderr, "%s: write %llu MB/s, read %llu MB/s\n",
+            splice ? "splice" : "copy",
+            (unsigned long long) (BENCH_IO_FILE_SIZE * 1000ULL / (write_elapsed + 1)),
+            (unsigned long long) (BENCH_IO_FILE_SIZE * 1000ULL / (read_elapsed + 1)));
+}
+
+TEST(sdcard, benchmark_io_copy) {
+    bench_io(false);
+}
+
+TEST(sdcard, benchmark_io_splice) {
+    bench_io(true);
+}
+
+static void bench_stat(int cache_timeout) {
+    SdcardMount mount;
+    char path[PATH_MAX];
+    char alias[PATH_MAX];
+    struct stat st;
+
+    int res = mount.start(2, false, cache_timeout);
+    if (res) {
+        fprintf(stderr, "cannot mount fuse (%s), skipped\n", strerror(-res));
+        return;
+    }
+    snprintf(path, sizeof(path), "%s/file", mount.path());
+    snprintf(alias, sizeof(alias), "%s/FILE", mount.path());
+
+    int fd = open(path, O_CREAT | O_TRUNC | O_WRONLY, 0664);
+    ASSERT_LE(0, fd);
+    ASSERT_EQ(0, stat(alias, &st));
+    EXPECT_EQ(0, st.st_size);
+
+    uint64_t start = nsecs();
+    for (int i = 0; i < BENCH_STAT_COUNT; i++) {
+        ASSERT_EQ(0, stat(path, &st));
+    }
+    uint64_t elapsed = nsecs() - start;
+
+    // a change through one name must show through its case alias at once
+    ASSERT_EQ(1, write(fd, "x", 1));
+    close(fd);
+    ASSERT_EQ(0, stat(alias, &st));
+    EXPECT_EQ(1, st.st_size);
+    mount.stop();
+
+    fprintf(stderr, "cache timeout %ds: %llu ns per stat\n", cache_timeout,
+            (unsigned long long) (elapsed / BENCH_STAT_COUNT));
+}
+
+TEST(sdcard, benchmark_stat_uncached) {
+    bench_stat(0);
+}
+
+TEST(sdcard, benchmark_stat_cached) {
+    bench_stat(10);
+}
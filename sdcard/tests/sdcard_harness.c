@@ -0,0 +1,83 @@
+/*
+ * Copyright (C) 2014 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* The daemon is built in whole, with its main() out of the way, so the
+ * benchmarks exercise exactly the request handlers that ship. */
+#define main sdcard_main
+#include "../sdcard.c"
+#undef main
+
+#include "sdcard_harness.h"
+
+static struct fuse harness_fuse;
+
+static int start_handlers(int num_threads)
+{
+    struct fuse_handler* handlers;
+    pthread_attr_t attr;
+    int i;
+
+    handlers = malloc(num_threads * sizeof(struct fuse_handler));
+    if (!handlers) {
+        return -ENOMEM;
+    }
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    for (i = 0; i < num_threads; i++) {
+        pthread_t thread;
+        init_handler(&harness_fuse, &handlers[i], i);
+        int res = pthread_create(&thread, &attr, start_handler, &handlers[i]);
+        if (res) {
+            pthread_attr_destroy(&attr);
+            return -res;
+        }
+    }
+    pthread_attr_destroy(&attr);
+    return 0;
+}
+
+int sdcard_harness_start(int fd, const char *source_path, int num_threads)
+{
+    fuse_init(&harness_fuse, fd, source_path, AID_SDCARD_RW, DERIVE_NONE, false);
+    return start_handlers(num_threads);
+}
+
+int sdcard_harness_mount(const char *source_path, const char *dest_path,
+        int num_threads, int splice, int cache_timeout)
+{
+    char opts[256];
+    int fd;
+
+    fd = open("/dev/fuse", O_RDWR);
+    if (fd < 0) {
+        return -errno;
+    }
+    snprintf(opts, sizeof(opts),
+            "fd=%i,rootmode=40000,default_permissions,allow_other,user_id=%d,group_id=%d",
+            fd, getuid(), getgid());
+    if (mount("/dev/fuse", dest_path, "fuse", MS_NOSUID | MS_NODEV, opts) < 0) {
+        int res = -errno;
+        close(fd);
+        return res;
+    }
+
+    fuse_init(&harness_fuse, fd, source_path, AID_SDCARD_RW, DERIVE_NONE, false);
+    harness_fuse.splice = splice;
+    harness_fuse.attr_timeout = cache_timeout;
+    harness_fuse.entry_timeout = cache_timeout;
+    return start_handlers(num_threads);
+}
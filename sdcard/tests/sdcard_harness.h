@@ -0,0 +1,47 @@
+/*
+ * Copyright (C) 2014 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _SDCARD_HARNESS_H
+#define _SDCARD_HARNESS_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Start num_threads sdcard request handlers serving source_path, reading
+ * requests from and writing replies to fd in place of /dev/fuse. fd must
+ * preserve message boundaries, e.g. one end of a SOCK_SEQPACKET socketpair.
+ * The handlers never return, so call this in a process of its own.
+ * Returns 0 on success, or a negative errno.
+ */
+int sdcard_harness_start(int fd, const char *source_path, int num_threads);
+
+/*
+ * Mount a real FUSE filesystem at dest_path serving source_path, with
+ * num_threads handlers, splicing file data if splice is nonzero, and
+ * letting the kernel cache attributes and entries for cache_timeout
+ * seconds. Needs root. As above, call this in a process of its own, and
+ * unmount dest_path before killing it.
+ */
+int sdcard_harness_mount(const char *source_path, const char *dest_path,
+        int num_threads, int splice, int cache_timeout);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif